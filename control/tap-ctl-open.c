@@ -44,7 +44,8 @@
 int
 tap_ctl_open(const int id, const int minor, const char *params, int flags,
 	     const int prt_minor, const char *secondary, int timeout,
-	     const char* logpath, uint8_t key_size, uint8_t *encryption_key)
+	     int mirror_lag, const char* logpath, uint8_t key_size,
+	     uint8_t *encryption_key)
 {
 	int err;
 	tapdisk_message_t message;
@@ -55,6 +56,7 @@ tap_ctl_open(const int id, const int minor, const char *params, int flags,
 	message.u.params.devnum = minor;
 	message.u.params.prt_devnum = prt_minor;
 	message.u.params.req_timeout = timeout;
+	message.u.params.mirror_lag = mirror_lag;
 	message.u.params.flags = flags;
 
 	err = snprintf(message.u.params.path,
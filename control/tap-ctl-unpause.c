@@ -44,7 +44,7 @@
 
 int
 tap_ctl_unpause(const int id, const int minor, const char *params, int flags,
-		char *secondary, const char *logpath)
+		char *secondary, int mirror_lag, const char *logpath)
 {
 	int err;
 	tapdisk_message_t message;
@@ -53,6 +53,7 @@ tap_ctl_unpause(const int id, const int minor, const char *params, int flags,
 	message.type = TAPDISK_MESSAGE_RESUME;
 	message.cookie = minor;
 	message.u.params.flags = flags;
+	message.u.params.mirror_lag = mirror_lag;
 
 	if (params)
 		safe_strncpy(message.u.params.path, params,
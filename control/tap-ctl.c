@@ -282,14 +282,20 @@ tap_cli_create_usage(FILE *stream)
 		"[-r turn on read caching into leaf node] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
+		"[-A mirror to the secondary asynchronously, with bounded lag] "
+		"[-L <MiB> bound the asynchronous mirror lag, implies -A] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
+		"[-Z elide zero writes to unallocated blocks] "
+		"[-J journal BAT updates to a sidecar log] "
+		"[-P copy hot parent blocks into the leaf on read] "
+		"[-W write back to shared storage in the background (llp)] "
 		"[-C <path/to/logfile> insert log layer to track changed blocks]\n");
 }
 
 static int
 tap_cli_create(int argc, char **argv)
 {
-	int c, err, flags, prt_minor, timeout;
+	int c, err, flags, prt_minor, timeout, mirror_lag;
 	char *args, *devname, *secondary;
 	char d_flag = 0;
 	char *logpath = NULL;
@@ -300,9 +306,10 @@ tap_cli_create(int argc, char **argv)
 	prt_minor = -1;
 	flags     = 0;
 	timeout   = 0;
+	mirror_lag = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:RDd:e:r2:st:C:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:RDZJPWAL:d:e:r2:st:C:h")) != -1) {
 		switch (c) {
 		case 'a':
 			args = optarg;
@@ -317,6 +324,25 @@ tap_cli_create(int argc, char **argv)
 		case 'D':
 			flags |= TAPDISK_MESSAGE_FLAG_NO_O_DIRECT;
 			break;
+		case 'Z':
+			flags |= TAPDISK_MESSAGE_FLAG_ELIDE_ZEROS;
+			break;
+		case 'J':
+			flags |= TAPDISK_MESSAGE_FLAG_BAT_LOG;
+			break;
+		case 'P':
+			flags |= TAPDISK_MESSAGE_FLAG_COR;
+			break;
+		case 'W':
+			flags |= TAPDISK_MESSAGE_FLAG_WRITEBACK;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC;
+			break;
+		case 'L':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC;
+			mirror_lag = atoi(optarg);
+			break;
 		case 'r':
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
 			break;
@@ -350,7 +376,7 @@ tap_cli_create(int argc, char **argv)
 		goto usage;
 
 	err = tap_ctl_create(args, &devname, flags, prt_minor, secondary,
-			timeout, logpath);
+			timeout, mirror_lag, logpath);
 	if (!err)
 		printf("%s\n", devname);
 
@@ -648,7 +674,8 @@ static void
 tap_cli_unpause_usage(FILE *stream)
 {
 	fprintf(stream, "usage: unpause <-p pid> <-m minor> [-a type:/path/to/file] "
-    "[-2 secondary] "
+    "[-2 secondary] [-A mirror to it asynchronously] "
+    "[-L <MiB> bound the asynchronous mirror lag, implies -A] "
     "[-c </path/to/logfile> insert log layer to track changed blocks]\n");
 }
 
@@ -657,17 +684,18 @@ tap_cli_unpause(int argc, char **argv)
 {
 	const char *args, *logpath;
 	char *secondary;
-	int c, pid, minor, flags;
+	int c, pid, minor, flags, mirror_lag;
 
 	pid        = -1;
 	minor = -1;
 	args  = NULL;
 	secondary  = NULL;
 	flags      = 0;
+	mirror_lag = 0;
 	logpath	   = NULL;	
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "p:m:a:2:c:h")) != -1) {
+	while ((c = getopt(argc, argv, "p:m:a:2:AL:c:h")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -682,6 +710,13 @@ tap_cli_unpause(int argc, char **argv)
 			flags |= TAPDISK_MESSAGE_FLAG_SECONDARY;
 			secondary = optarg;
 			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC;
+			break;
+		case 'L':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC;
+			mirror_lag = atoi(optarg);
+			break;
 		case 'c':
 			logpath = optarg;
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LOG;
@@ -697,7 +732,8 @@ tap_cli_unpause(int argc, char **argv)
 	if (pid == -1 || minor == -1)
 		goto usage;
 
-	return tap_ctl_unpause(pid, minor, args, flags, secondary, logpath);
+	return tap_ctl_unpause(pid, minor, args, flags, secondary, mirror_lag,
+			       logpath);
 
 usage:
 	tap_cli_unpause_usage(stderr);
@@ -760,7 +796,13 @@ tap_cli_open_usage(FILE *stream)
 		"[-r turn on read caching into leaf node] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
+		"[-A mirror to the secondary asynchronously, with bounded lag] "
+		"[-L <MiB> bound the asynchronous mirror lag, implies -A] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
+		"[-Z elide zero writes to unallocated blocks] "
+		"[-J journal BAT updates to a sidecar log] "
+		"[-P copy hot parent blocks into the leaf on read] "
+		"[-W write back to shared storage in the background (llp)] "
 		"[-C </path/to/logfile> insert log layer to track changed blocks] "
 		"[-E read encryption key from stdin]\n");
 }
@@ -769,7 +811,7 @@ static int
 tap_cli_open(int argc, char **argv)
 {
 	const char *args, *secondary, *logpath;
-	int c, pid, minor, flags, prt_minor, timeout;
+	int c, pid, minor, flags, prt_minor, timeout, mirror_lag;
 	uint8_t *encryption_key;
 	ssize_t key_size = 0;
 
@@ -778,13 +820,14 @@ tap_cli_open(int argc, char **argv)
 	minor      = -1;
 	prt_minor  = -1;
 	timeout    = 0;
+	mirror_lag = 0;
 	args       = NULL;
 	secondary  = NULL;
 	logpath    = NULL;
 	encryption_key = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:RDm:p:e:r2:st:C:Eh")) != -1) {
+	while ((c = getopt(argc, argv, "a:RDZJPWAL:m:p:e:r2:st:C:Eh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -801,6 +844,25 @@ tap_cli_open(int argc, char **argv)
 		case 'D':
 			flags |= TAPDISK_MESSAGE_FLAG_NO_O_DIRECT;
 			break;
+		case 'Z':
+			flags |= TAPDISK_MESSAGE_FLAG_ELIDE_ZEROS;
+			break;
+		case 'J':
+			flags |= TAPDISK_MESSAGE_FLAG_BAT_LOG;
+			break;
+		case 'P':
+			flags |= TAPDISK_MESSAGE_FLAG_COR;
+			break;
+		case 'W':
+			flags |= TAPDISK_MESSAGE_FLAG_WRITEBACK;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC;
+			break;
+		case 'L':
+			flags |= TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC;
+			mirror_lag = atoi(optarg);
+			break;
 		case 'r':
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
 			break;
@@ -856,7 +918,8 @@ tap_cli_open(int argc, char **argv)
 		goto usage;
 
 	return tap_ctl_open(pid, minor, args, flags, prt_minor, secondary,
-			    timeout, logpath, (uint8_t)key_size, encryption_key);
+			    timeout, mirror_lag, logpath, (uint8_t)key_size,
+			    encryption_key);
 
 usage:
 	tap_cli_open_usage(stderr);
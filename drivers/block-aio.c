@@ -41,6 +41,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
@@ -198,6 +199,32 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+/*
+ * Zero the range in the file rather than write zeroes to it: punched
+ * out when discarded, which still reads as zeroes. Returns 1 if done,
+ * 0 if the zeroes must be written after all.
+ */
+static int
+tdaio_zero_range(struct tdaio_state *prv, td_request_t treq,
+		 uint64_t offset, int size)
+{
+	int mode;
+
+	mode = treq.vreq->zeroes == TD_ZEROES_DISCARD ?
+		FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE;
+	if (prv->zero_modes_failed & mode)
+		return 0;
+
+	if (fallocate(prv->fd, mode | FALLOC_FL_KEEP_SIZE, offset, size)) {
+		if (errno == EOPNOTSUPP)
+			prv->zero_modes_failed |= mode;
+		return 0;
+	}
+
+	td_complete_request(treq, 0);
+	return 1;
+}
+
 void tdaio_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	int size;
@@ -209,6 +236,10 @@ void tdaio_queue_write(td_driver_t *driver, td_request_t treq)
 	size    = treq.secs * driver->info.sector_size;
 	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
 
+	if (treq.vreq && treq.vreq->zeroes &&
+	    tdaio_zero_range(prv, treq, offset, size))
+		return;
+
 	if (prv->aio_free_count == 0)
 		goto fail;
 
@@ -226,6 +257,29 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+void tdaio_queue_sync(td_driver_t *driver, td_request_t treq)
+{
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv = (struct tdaio_state *)driver->data;
+
+	if (prv->aio_free_count == 0)
+		goto fail;
+
+	aio        = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq  = treq;
+	aio->state = prv;
+
+	td_prep_sync(driver, &aio->tiocb, prv->fd, tdaio_complete, aio);
+	td_queue_tiocb(driver, &aio->tiocb);
+
+	return;
+
+fail:
+	td_complete_request(treq, -EBUSY);
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
@@ -267,6 +321,7 @@ struct tap_disk tapdisk_aio = {
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_sync      = tdaio_queue_sync,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
@@ -51,6 +51,8 @@ struct tdaio_state {
 	int                  aio_free_count;
 	struct aio_request   aio_requests[MAX_AIO_REQS];
 	struct aio_request  *aio_free_list[MAX_AIO_REQS];
+
+	int                  zero_modes_failed; /* FALLOC_FL_*, not retried */
 };
 
 void tdaio_complete(void *arg, struct tiocb *tiocb, int err);
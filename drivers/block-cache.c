@@ -41,9 +41,8 @@
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
-#include "tapdisk-server.h"
 #include "tapdisk-interface.h"
-#include "timeout-math.h"
+#include "tapdisk-pagecache.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -53,66 +52,80 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
-#define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
-#define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
 
-#define RADIX_TREE_NODE_SHIFT           9 /* 512B nodes */
-#define RADIX_TREE_NODE_SIZE            (1 << RADIX_TREE_NODE_SHIFT)
-#define RADIX_TREE_NODE_MASK            (RADIX_TREE_NODE_SIZE - 1)
 
-#define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
+#define BLOCK_CACHE_SECTOR_SHIFT        9
+#define BLOCK_CACHE_SECTOR_SIZE         (1 << BLOCK_CACHE_SECTOR_SHIFT)
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
+#define BLOCK_CACHE_PAGE_SHIFT          12 /* 4K pages */
+#define BLOCK_CACHE_PAGE_SIZE           (1 << BLOCK_CACHE_PAGE_SHIFT)
+#define BLOCK_CACHE_SECS_PER_PAGE       (1 << (BLOCK_CACHE_PAGE_SHIFT - BLOCK_CACHE_SECTOR_SHIFT))
+
+#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 10MB cache */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
 
-typedef struct radix_tree               radix_tree_t;
-typedef struct radix_tree_node          radix_tree_node_t;
-typedef struct radix_tree_link          radix_tree_link_t;
-typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
+/*
+ * Pages are replaced 2Q style: a page enters on a FIFO (A1in) sized
+ * to a quarter of the cache, and is only promoted to the LRU proper
+ * (Am) if it is read again after falling off A1in, while its number
+ * is still remembered on the ghost list (A1out). One-off scans thus
+ * never push out the working set.
+ */
+#define BLOCK_CACHE_KIN(_pages)         ((_pages) >> 2)
+#define BLOCK_CACHE_KOUT(_pages)        ((_pages) >> 1)
+
+#define BLOCK_CACHE_QUEUE_FREE          0
+#define BLOCK_CACHE_QUEUE_A1IN          1
+#define BLOCK_CACHE_QUEUE_AM            2
+#define BLOCK_CACHE_QUEUE_A1OUT         3
+
+/*
+ * Page contents are stored once per process, whichever image and
+ * offset they were read from: clones of one template read mostly the
+ * same data at different places in different chains. The store is
+ * keyed by a 128 bit fingerprint, and a match is confirmed by
+ * comparison before it is shared. Across processes, the host-wide
+ * tier behind it stores data by content the same way.
+ */
+#define BLOCK_CACHE_STORE_SHIFT         12 /* initial buckets */
 
 typedef struct block_cache              block_cache_t;
+typedef struct block_cache_data         block_cache_data_t;
+typedef struct block_cache_store        block_cache_store_t;
+typedef struct block_cache_page         block_cache_page_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
 
-struct radix_tree_page {
+struct block_cache_data {
+	block_cache_data_t             *hnext;
+	uint64_t                        fp[2];
+	int                             refcnt;
 	char                           *buf;
-	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
 };
 
-struct radix_tree_leaf {
-	radix_tree_page_t              *page;
-	char                           *buf;
-};
-
-struct radix_tree_link {
-	uint32_t                        time;
-	union {
-		radix_tree_node_t      *next;
-		radix_tree_leaf_t       leaf;
-	} u;
-};
+struct block_cache_store {
+	block_cache_data_t            **hash;
+	int                             hash_shift;
+	int                             users;
 
-struct radix_tree_node {
-	int                             height;
-	radix_tree_link_t               links[RADIX_TREE_NODE_SIZE];
+	uint64_t                        unique;
+	uint64_t                        refs;
 };
 
-struct radix_tree {
-	int                             height;
-	uint64_t                        size;
-	uint32_t                        nodes;
-	radix_tree_node_t              *root;
-
-	block_cache_t                  *cache;
+struct block_cache_page {
+	struct list_head                queue;
+	block_cache_page_t             *hnext;
+	uint64_t                        page;
+	int                             queue_id;
+	block_cache_data_t             *data;  /* NULL on A1out */
 };
 
 struct block_cache_request {
 	int                             err;
 	char                           *buf;
+	uint64_t                        buf_sec;
+	uint64_t                        buf_secs;
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
@@ -122,7 +135,9 @@ struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
-	uint64_t                        prunes;
+	uint64_t                        evictions;
+	uint64_t                        ghost_hits;
+	uint64_t                        dedup_hits;
 };
 
 struct block_cache {
@@ -135,377 +150,467 @@ struct block_cache {
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
 
-	event_id_t                      timeout_id;
+	/* page index and replacement queues */
+	uint32_t                        npages;
+	block_cache_page_t             *entries;
+	block_cache_page_t            **hash;
+	int                             hash_shift;
 
-	radix_tree_t                    tree;
+	struct list_head                free;
+	struct list_head                a1in;
+	struct list_head                am;
+	struct list_head                a1out;
+	uint32_t                        nr_a1in;
+	uint32_t                        nr_am;
+	uint32_t                        nr_a1out;
 
 	block_cache_stats_t             stats;
+
+	/* host-wide tier, behind the private cache */
+	td_pagecache_t                 *shared;
+	uint8_t                         id[TD_PAGECACHE_ID_SIZE];
+	td_pagecache_stats_t            shared_stats;
 };
 
-static inline uint64_t
-radix_tree_calculate_size(int height)
+static inline block_cache_page_t **
+block_cache_bucket(block_cache_t *cache, uint64_t page)
 {
-	return (uint64_t)RADIX_TREE_NODE_SIZE <<
-	  (height * RADIX_TREE_NODE_SHIFT);
+	return cache->hash +
+		((page * 0x9e3779b97f4a7c15ULL) >> (64 - cache->hash_shift));
 }
 
-static inline int
-radix_tree_calculate_height(uint64_t sectors)
+static block_cache_page_t *
+block_cache_find(block_cache_t *cache, uint64_t page)
 {
-	int height;
-	uint64_t tree_size;
+	block_cache_page_t *entry;
 
-	height = 1;  /* always allocate root node */
-	tree_size = radix_tree_calculate_size(height);
-	while (sectors > tree_size)
-		tree_size = radix_tree_calculate_size(++height);
+	for (entry = *block_cache_bucket(cache, page);
+	     entry; entry = entry->hnext)
+		if (entry->page == page)
+			return entry;
 
-	return height;
+	return NULL;
 }
 
-static inline int
-radix_tree_index(radix_tree_node_t *node, uint64_t sector)
+static void
+block_cache_hash_insert(block_cache_t *cache, block_cache_page_t *entry)
 {
-	return ((sector >> (node->height * RADIX_TREE_NODE_SHIFT)) &
-		RADIX_TREE_NODE_MASK);
-}
+	block_cache_page_t **bucket = block_cache_bucket(cache, entry->page);
 
-static inline int
-radix_tree_node_contains_leaves(radix_tree_t *tree, radix_tree_node_t *node)
-{
-	return (node->height == 0);
+	entry->hnext = *bucket;
+	*bucket      = entry;
 }
 
-static inline int
-radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
+static void
+block_cache_hash_remove(block_cache_t *cache, block_cache_page_t *entry)
 {
-	return (node->height == tree->height);
+	block_cache_page_t **pp;
+
+	for (pp = block_cache_bucket(cache, entry->page);
+	     *pp; pp = &(*pp)->hnext)
+		if (*pp == entry) {
+			*pp = entry->hnext;
+			break;
+		}
+
+	entry->hnext = NULL;
 }
 
+static block_cache_store_t block_cache_store;
+
 static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
+block_cache_rotl64(uint64_t x, int r)
 {
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
+	return (x << r) | (x >> (64 - r));
 }
 
-static inline void
-radix_tree_clear_link(radix_tree_link_t *link)
+static inline uint64_t
+block_cache_fmix64(uint64_t k)
 {
-	if (link)
-		memset(link, 0, sizeof(radix_tree_link_t));
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_node(radix_tree_t *tree, int height)
+/*
+ * MurmurHash3 x64/128 over one page.
+ */
+static void
+block_cache_hash(const char *buf, uint64_t fp[2])
 {
-	radix_tree_node_t *node;
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1, h2, k1, k2;
+	int i;
 
-	node = calloc(1, sizeof(radix_tree_node_t));
-	if (!node)
-		return NULL;
+	h1 = h2 = 0;
+
+	for (i = 0; i < BLOCK_CACHE_PAGE_SIZE; i += 2 * sizeof(uint64_t)) {
+		memcpy(&k1, buf + i, sizeof(k1));
+		memcpy(&k2, buf + i + sizeof(k1), sizeof(k2));
+
+		k1 *= c1;
+		k1  = block_cache_rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1  = block_cache_rotl64(h1, 27);
+		h1 += h2;
+		h1  = h1 * 5 + 0x52dce729;
+
+		k2 *= c2;
+		k2  = block_cache_rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2  = block_cache_rotl64(h2, 31);
+		h2 += h1;
+		h2  = h2 * 5 + 0x38495ab5;
+	}
 
-	node->height = height;
-	tree->nodes++;
+	h1 ^= BLOCK_CACHE_PAGE_SIZE;
+	h2 ^= BLOCK_CACHE_PAGE_SIZE;
+	h1 += h2;
+	h2 += h1;
+	h1  = block_cache_fmix64(h1);
+	h2  = block_cache_fmix64(h2);
+	h1 += h2;
+	h2 += h1;
 
-	return node;
+	fp[0] = h1;
+	fp[1] = h2;
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_child_node(radix_tree_t *tree, radix_tree_node_t *parent)
+static inline block_cache_data_t **
+block_cache_store_bucket(block_cache_store_t *store, const uint64_t fp[2])
 {
-	return radix_tree_allocate_node(tree, parent->height - 1);
+	return store->hash + (fp[0] >> (64 - store->hash_shift));
 }
 
-void
-radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
-{
-	if (!node)
-		return;
-
-	free(node);
-	tree->nodes--;
-}
-
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+static int
+block_cache_store_init(block_cache_store_t *store)
 {
-	radix_tree_page_t *page;
-
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
-		return NULL;
+	if (store->users++)
+		return 0;
 
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
+	store->hash_shift = BLOCK_CACHE_STORE_SHIFT;
+	store->hash = calloc(1 << store->hash_shift,
+			     sizeof(block_cache_data_t *));
+	if (!store->hash) {
+		store->users--;
+		return -ENOMEM;
+	}
 
-	return page;
+	return 0;
 }
 
-static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
+static void
+block_cache_store_exit(block_cache_store_t *store)
 {
-	int i;
-
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
+	if (--store->users)
+		return;
 
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	/* every page holds a reference, so nothing is left by now */
+	free(store->hash);
+	memset(store, 0, sizeof(*store));
 }
 
 /*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
+ * Keeps chains short by doubling the table whenever it holds twice
+ * as many pages as buckets. Best effort: a failed resize just leaves
+ * longer chains.
  */
 static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
+block_cache_store_grow(block_cache_store_t *store)
 {
-	int i;
+	block_cache_data_t **hash, **old, *data, *next;
+	int shift;
+	size_t i;
 
-	if (!page)
+	if (store->unique < (2ULL << store->hash_shift))
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
-
-	radix_tree_free_page(tree, page);
-}
-
-static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
-{
-	int i;
-
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
+	shift = store->hash_shift + 1;
+	hash  = calloc(1 << shift, sizeof(block_cache_data_t *));
+	if (!hash)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
-			continue;
+	old = store->hash;
+	store->hash = hash;
+	store->hash_shift = shift;
 
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
+	for (i = 0; i < (1UL << (shift - 1)); i++)
+		for (data = old[i]; data; data = next) {
+			block_cache_data_t **bucket;
 
-		break;
-	}
+			next        = data->hnext;
+			bucket      = block_cache_store_bucket(store, data->fp);
+			data->hnext = *bucket;
+			*bucket     = data;
+		}
+
+	free(old);
 }
 
-static char *
-radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
-{
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
+/*
+ * Returns a reference to stored content equal to @buf, adding it if
+ * it is new.
+ */
+static block_cache_data_t *
+block_cache_data_get(block_cache_t *cache, const char *buf)
+{
+	block_cache_store_t *store = &block_cache_store;
+	block_cache_data_t *data, **bucket;
+	uint64_t fp[2];
+	int err;
+
+	block_cache_hash(buf, fp);
+	bucket = block_cache_store_bucket(store, fp);
+
+	for (data = *bucket; data; data = data->hnext)
+		if (data->fp[0] == fp[0] && data->fp[1] == fp[1] &&
+		    !memcmp(data->buf, buf, BLOCK_CACHE_PAGE_SIZE)) {
+			data->refcnt++;
+			store->refs++;
+			cache->stats.dedup_hits++;
+			return data;
+		}
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	data = malloc(sizeof(*data));
+	if (!data)
+		return NULL;
 
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+	err = posix_memalign((void **)&data->buf, BLOCK_CACHE_PAGE_SIZE,
+			     BLOCK_CACHE_PAGE_SIZE);
+	if (err) {
+		free(data);
+		return NULL;
+	}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+	memcpy(data->buf, buf, BLOCK_CACHE_PAGE_SIZE);
+	data->fp[0]  = fp[0];
+	data->fp[1]  = fp[1];
+	data->refcnt = 1;
+	data->hnext  = *bucket;
+	*bucket      = data;
 
-		if (!link->u.next)
-			return NULL;
+	store->unique++;
+	store->refs++;
+	block_cache_store_grow(store);
 
-		node = link->u.next;
-	} while (1);
+	return data;
 }
 
-static char *
-radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
-{
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
-
-	node = tree->root;
-	gettimeofday(&now, NULL);
-
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
-
-		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
-		}
+static void
+block_cache_data_put(block_cache_data_t *data)
+{
+	block_cache_store_t *store = &block_cache_store;
+	block_cache_data_t **pp;
 
-		if (!link->u.next) {
-			link->u.next = radix_tree_allocate_child_node(tree,
-								      node);
-			if (!link->u.next)
-				return NULL;
+	store->refs--;
+	if (--data->refcnt)
+		return;
+
+	for (pp = block_cache_store_bucket(store, data->fp);
+	     *pp; pp = &(*pp)->hnext)
+		if (*pp == data) {
+			*pp = data->hnext;
+			break;
 		}
 
-		node = link->u.next;
-	} while (1);
+	store->unique--;
+	free(data->buf);
+	free(data);
 }
 
-static int
-radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
+static void
+block_cache_release_entry(block_cache_t *cache, block_cache_page_t *entry)
 {
-	int i;
-	radix_tree_page_t *page;
+	block_cache_hash_remove(cache, entry);
+	entry->queue_id = BLOCK_CACHE_QUEUE_FREE;
+	entry->data     = NULL;
+	list_move(&entry->queue, &cache->free);
+}
 
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
-		return -ENOMEM;
+/*
+ * Makes room for one more page, evicting from A1in while it is over
+ * its share of the cache and from Am otherwise. Pages evicted from
+ * A1in are remembered on A1out.
+ */
+static int
+block_cache_reclaim(block_cache_t *cache)
+{
+	block_cache_page_t *victim;
+
+	if (cache->nr_a1in + cache->nr_am < cache->npages)
+		return 0;
+
+	if (cache->nr_a1in > BLOCK_CACHE_KIN(cache->npages) || !cache->nr_am) {
+		if (!cache->nr_a1in)
+			return -ENOSPC;
+
+		victim = list_last_entry(&cache->a1in,
+					 block_cache_page_t, queue);
+		block_cache_data_put(victim->data);
+		victim->data     = NULL;
+		victim->queue_id = BLOCK_CACHE_QUEUE_A1OUT;
+		list_move(&victim->queue, &cache->a1out);
+		cache->nr_a1in--;
+		cache->nr_a1out++;
+
+		if (cache->nr_a1out > BLOCK_CACHE_KOUT(cache->npages)) {
+			victim = list_last_entry(&cache->a1out,
+						 block_cache_page_t, queue);
+			block_cache_release_entry(cache, victim);
+			cache->nr_a1out--;
+		}
+	} else {
+		victim = list_last_entry(&cache->am, block_cache_page_t, queue);
+		block_cache_data_put(victim->data);
+		block_cache_release_entry(cache, victim);
+		cache->nr_am--;
+	}
 
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, ((off_t)i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
+	DBG("%s: evicting page 0x%"PRIx64"\n", cache->name, victim->page);
+	cache->stats.evictions++;
 
 	return 0;
-
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
 }
 
-static void
-radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
+/*
+ * Returns the cached copy of @page, if any, and records the access.
+ */
+static char *
+block_cache_lookup(block_cache_t *cache, uint64_t page)
 {
-	int i;
-	radix_tree_link_t *link;
+	block_cache_page_t *entry;
 
-	if (!node)
-		return;
-
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
-
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+	entry = block_cache_find(cache, page);
+	if (!entry)
+		return NULL;
 
-		radix_tree_clear_link(link);
+	switch (entry->queue_id) {
+	case BLOCK_CACHE_QUEUE_AM:
+		list_move(&entry->queue, &cache->am);
+		return entry->data->buf;
+	case BLOCK_CACHE_QUEUE_A1IN:
+		return entry->data->buf;
+	default:
+		return NULL;
 	}
-
-	radix_tree_free_node(tree, node);
-}
-
-static inline void
-radix_tree_destroy(radix_tree_t *tree)
-{
-	radix_tree_delete_branch(tree, tree->root);
-	tree->root = NULL;
 }
 
 /*
- * returns 1 if @node is empty after pruning, 0 otherwise
+ * Adds @page with the data just read. Pages remembered on A1out go
+ * straight to Am, anything else starts on A1in.
  */
-static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+static void
+block_cache_admit(block_cache_t *cache, uint64_t page, const char *buf)
 {
-	int i, empty;
-	radix_tree_link_t *link;
-
-	empty = 1;
-	if (!node)
-		return empty;
+	block_cache_page_t *entry;
+	block_cache_data_t *data;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	entry = block_cache_find(cache, page);
+	if (entry) {
+		if (entry->queue_id != BLOCK_CACHE_QUEUE_A1OUT)
+			return;
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
-			}
-
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
-				empty = 0;
-
-			continue;
-		}
+		/* keep reclaim from dropping the ghost we are reviving */
+		list_del_init(&entry->queue);
+		cache->nr_a1out--;
+	}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+	data = NULL;
+	if (!block_cache_reclaim(cache))
+		data = block_cache_data_get(cache, buf);
 
-		radix_tree_clear_link(link);
+	if (!data) {
+		if (entry)
+			block_cache_release_entry(cache, entry);
+		return;
 	}
 
-	if (empty && !radix_tree_node_is_root(tree, node))
-		radix_tree_free_node(tree, node);
+	if (entry) {
+		cache->stats.ghost_hits++;
+		entry->data     = data;
+		entry->queue_id = BLOCK_CACHE_QUEUE_AM;
+		list_add(&entry->queue, &cache->am);
+		cache->nr_am++;
+		return;
+	}
 
-	return empty;
+	entry = list_first_entry(&cache->free, block_cache_page_t, queue);
+	entry->page     = page;
+	entry->data     = data;
+	entry->queue_id = BLOCK_CACHE_QUEUE_A1IN;
+	list_move(&entry->queue, &cache->a1in);
+	block_cache_hash_insert(cache, entry);
+	cache->nr_a1in++;
 }
 
-/*
- * walk tree and free any node that has been idle for too long
- */
 static void
-radix_tree_prune(radix_tree_t *tree)
+block_cache_free_pages(block_cache_t *cache)
 {
-	struct timeval now;
-
-	if (!tree->root)
-		return;
+	block_cache_page_t *entry;
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	if (cache->entries) {
+		list_for_each_entry(entry, &cache->a1in, queue)
+			block_cache_data_put(entry->data);
+		list_for_each_entry(entry, &cache->am, queue)
+			block_cache_data_put(entry->data);
+		block_cache_store_exit(&block_cache_store);
+	}
 
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
+	free(cache->entries);
+	free(cache->hash);
 
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	cache->entries = NULL;
+	cache->hash    = NULL;
 }
 
-static inline int
-radix_tree_initialize(radix_tree_t *tree, uint64_t sectors)
+static int
+block_cache_allocate_pages(block_cache_t *cache, size_t size)
 {
-	tree->height = radix_tree_calculate_height(sectors);
-	tree->root   = radix_tree_allocate_node(tree, tree->height);
-	if (!tree->root)
-		return -ENOMEM;
+	uint32_t i, nentries;
+	int err;
 
-	return 0;
-}
+	cache->npages = size >> BLOCK_CACHE_PAGE_SHIFT;
+	if (!cache->npages)
+		return -EINVAL;
 
-static inline void
-radix_tree_free(radix_tree_t *tree)
-{
-	radix_tree_destroy(tree);
-}
+	/* every page cached plus every page remembered on A1out */
+	nentries = cache->npages + BLOCK_CACHE_KOUT(cache->npages) + 1;
 
-static void
-block_cache_prune_event(event_id_t id, char mode, void *private)
-{
-	radix_tree_t *tree;
-	block_cache_t *cache;
+	for (cache->hash_shift = 1;
+	     (1U << cache->hash_shift) < nentries; cache->hash_shift++)
+		;
 
-	cache = (block_cache_t *)private;
-	tree  = &cache->tree;
+	err = block_cache_store_init(&block_cache_store);
+	if (err)
+		return err;
+
+	cache->entries = calloc(nentries, sizeof(block_cache_page_t));
+	cache->hash    = calloc(1 << cache->hash_shift,
+				sizeof(block_cache_page_t *));
+	if (!cache->entries || !cache->hash) {
+		free(cache->entries);
+		free(cache->hash);
+		cache->entries = NULL;
+		cache->hash    = NULL;
+		block_cache_store_exit(&block_cache_store);
+		return -ENOMEM;
+	}
 
-	radix_tree_prune(tree);
+	INIT_LIST_HEAD(&cache->free);
+	INIT_LIST_HEAD(&cache->a1in);
+	INIT_LIST_HEAD(&cache->am);
+	INIT_LIST_HEAD(&cache->a1out);
+
+	for (i = 0; i < nentries; i++)
+		list_add_tail(&cache->entries[i].queue, &cache->free);
+
+	return 0;
 }
 
 static inline block_cache_request_t *
@@ -524,18 +629,30 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+static void
+block_cache_attach_shared(block_cache_t *cache)
+{
+	if (td_pagecache_image_id(cache->name, cache->id))
+		return;
+
+	cache->shared = td_pagecache_get();
+	if (cache->shared)
+		DPRINTF("%s: using shared page cache\n", cache->name);
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name,
 		 struct td_vbd_encryption *encryption, td_flag_t flags)
 {
 	int i, err;
-	radix_tree_t *tree;
+	size_t size;
+	const char *env;
 	block_cache_t *cache;
 
 	if (!td_flag_test(flags, TD_OPEN_RDONLY))
 		return -EINVAL;
 
-	if (driver->info.sector_size != RADIX_TREE_NODE_SIZE)
+	if (driver->info.sector_size != BLOCK_CACHE_SECTOR_SIZE)
 		return -EINVAL;
 
 	cache = (block_cache_t *)driver->data;
@@ -545,27 +662,23 @@ block_cache_open(td_driver_t *driver, const char *name,
 
 	cache->sectors = driver->info.size;
 
-	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
+	size = BLOCK_CACHE_MAX_SIZE;
+	env  = getenv("TAPDISK3_BLOCK_CACHE_SIZE");
+	if (env)
+		size = strtoul(env, NULL, 10) << 20;
+
+	err = block_cache_allocate_pages(cache, size);
 	if (err)
 		goto fail;
 
-	tree->cache = cache;
 	cache->requests_free = BLOCK_CACHE_REQUESTS;
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
-	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-							  -1, /* dummy fd */
-							  TV_SECS(BLOCK_CACHE_PAGE_IDLETIME << 1),
-							  block_cache_prune_event,
-							  cache);
-	if (cache->timeout_id < 0)
-		goto fail;
+	block_cache_attach_shared(cache);
 
-	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
+	DPRINTF("opening cache for %s, sectors: %"PRIu64", pages: %u\n",
+		cache->name, cache->sectors, cache->npages);
 
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
@@ -574,171 +687,214 @@ block_cache_open(td_driver_t *driver, const char *name,
 
 fail:
 	free(cache->name);
-	radix_tree_free(&cache->tree);
 	return err;
 }
 
 static int
 block_cache_close(td_driver_t *driver)
 {
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	td_pagecache_put(cache->shared);
+	block_cache_free_pages(cache);
 	free(cache->name);
 
 	return 0;
 }
 
-static inline uint64_t
-block_cache_hash(block_cache_t *cache, char *buf)
-{
-	return 0;
-#if 0
-	int i, n;
-	uint64_t cksm, *data;
-
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
-
-	for (i = 0; i < n; i++)
-		cksm += data[i];
-
-	return ~cksm;
-#endif
-}
-
-static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
-{
-	int i;
-	off_t off;
-
-	cache->stats.hits += treq.secs;
-
-	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
-
-		off = (off_t)i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
-	}
-
-	td_complete_request(treq, 0);
-}
-
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
-	int i;
-	radix_tree_t *tree;
+	uint64_t i, page;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
 
 	breq        = (block_cache_request_t *)clone.cb_data;
 	cache       = breq->cache;
-	tree        = &cache->tree;
 	breq->secs -= clone.secs;
 	breq->err   = (breq->err ? breq->err : err);
 
 	if (breq->secs)
 		return;
 
-	if (breq->err) {
-		free(breq->buf);
+	if (breq->err)
 		goto out;
-	}
 
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = (off_t)i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
-	}
+	if (breq->buf != breq->treq.buf)
+		memcpy(breq->treq.buf,
+		       breq->buf + ((breq->treq.sec - breq->buf_sec) <<
+				    BLOCK_CACHE_SECTOR_SHIFT),
+		       (size_t)breq->treq.secs << BLOCK_CACHE_SECTOR_SHIFT);
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+	/* buf_sec is page aligned, a short tail page is not cached */
+	for (i = 0; i + BLOCK_CACHE_SECS_PER_PAGE <= breq->buf_secs;
+	     i += BLOCK_CACHE_SECS_PER_PAGE) {
+		char *data = breq->buf + (i << BLOCK_CACHE_SECTOR_SHIFT);
+
+		page = (breq->buf_sec + i) / BLOCK_CACHE_SECS_PER_PAGE;
+		DBG("%s: populating page 0x%"PRIx64"\n", cache->name, page);
+
+		block_cache_admit(cache, page, data);
+
+		if (cache->shared)
+			td_pagecache_insert(cache->shared, cache->id, page,
+					    data, &cache->shared_stats);
+	}
 
 out:
+	if (breq->buf != breq->treq.buf)
+		free(breq->buf);
 	td_complete_request(breq->treq, breq->err);
 	block_cache_put_request(cache, breq);
 }
 
+/*
+ * Forwards a run of missed sectors, widened to whole pages so they can
+ * be cached. Page aligned runs are read straight into the caller's
+ * buffer, others go through a bounce buffer.
+ */
 static void
 block_cache_miss(block_cache_t *cache, td_request_t treq)
 {
 	void *buf;
-	size_t size;
+	uint64_t start, end;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
-	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
-
-	clone = treq;
-	tree  = &cache->tree;
-	size  = (size_t)treq.secs << RADIX_TREE_NODE_SHIFT;
+	DBG("%s: block cache miss: sec 0x%08"PRIx64", secs: %d\n",
+	    cache->name, treq.sec, treq.secs);
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
+	start = treq.sec - treq.sec % BLOCK_CACHE_SECS_PER_PAGE;
+	end   = treq.sec + treq.secs;
+	end   = (end + BLOCK_CACHE_SECS_PER_PAGE - 1) &
+		~((uint64_t)BLOCK_CACHE_SECS_PER_PAGE - 1);
+	end   = MIN(end, cache->sectors);
 
 	breq = block_cache_get_request(cache);
 	if (!breq)
 		goto out;
 
-	if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
+	if (start == treq.sec && end == treq.sec + treq.secs)
+		buf = treq.buf;
+	else if (posix_memalign(&buf, BLOCK_CACHE_PAGE_SIZE,
+				(end - start) << BLOCK_CACHE_SECTOR_SHIFT)) {
 		block_cache_put_request(cache, breq);
 		goto out;
 	}
 
-	breq->treq    = treq;
-	breq->secs    = treq.secs;
-	breq->err     = 0;
-	breq->buf     = buf;
-	breq->cache   = cache;
-
+	breq->treq     = treq;
+	breq->secs     = end - start;
+	breq->err      = 0;
+	breq->buf      = buf;
+	breq->buf_sec  = start;
+	breq->buf_secs = end - start;
+	breq->cache    = cache;
+
+	clone         = treq;
+	clone.sec     = start;
+	clone.secs    = end - start;
 	clone.buf     = buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
-out:
 	td_forward_request(clone);
+	return;
+
+out:
+	td_forward_request(treq);
+}
+
+static char *
+block_cache_get_page(block_cache_t *cache, uint64_t page, char *tmp)
+{
+	char *buf;
+
+	buf = block_cache_lookup(cache, page);
+	if (buf)
+		return buf;
+
+	if (!cache->shared ||
+	    !td_pagecache_lookup(cache->shared, cache->id, page, tmp,
+				 &cache->shared_stats))
+		return NULL;
+
+	block_cache_admit(cache, page, tmp);
+	return tmp;
 }
 
+static void
+block_cache_complete_run(block_cache_t *cache, td_request_t run, int hit)
+{
+	if (!run.secs)
+		return;
+
+	if (!hit)
+		return block_cache_miss(cache, run);
+
+	cache->stats.hits += run.secs;
+	td_complete_request(run, 0);
+}
+
+/*
+ * Splits a read into runs of cached and uncached pages: the former
+ * are copied out right away, the latter forwarded.
+ */
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int i;
-	radix_tree_t *tree;
+	int hit;
+	char *buf;
+	uint64_t sec, end, page, secs, off;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	td_request_t run;
+	char tmp[BLOCK_CACHE_PAGE_SIZE];
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
-
 	cache->stats.reads += treq.secs;
 
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
-		return td_forward_request(treq);
+	run      = treq;
+	run.secs = 0;
+	hit      = 0;
+
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+
+	while (sec < end) {
+		page = sec / BLOCK_CACHE_SECS_PER_PAGE;
+		off  = sec % BLOCK_CACHE_SECS_PER_PAGE;
+		secs = MIN(end - sec, BLOCK_CACHE_SECS_PER_PAGE - off);
+		buf  = block_cache_get_page(cache, page, tmp);
+
+		/* copy before completing a miss run can evict the page */
+		if (buf) {
+			DBG("%s: block cache hit: page 0x%"PRIx64"\n",
+			    cache->name, page);
+			memcpy(treq.buf +
+			       ((sec - treq.sec) << BLOCK_CACHE_SECTOR_SHIFT),
+			       buf + (off << BLOCK_CACHE_SECTOR_SHIFT),
+			       secs << BLOCK_CACHE_SECTOR_SHIFT);
+		}
+
+		if (run.secs && !!buf != hit) {
+			block_cache_complete_run(cache, run, hit);
+			run.sec  = sec;
+			run.buf  = treq.buf +
+				((sec - treq.sec) << BLOCK_CACHE_SECTOR_SHIFT);
+			run.secs = 0;
+		}
 
-	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
-			return block_cache_miss(cache, treq);
+		hit       = !!buf;
+		run.secs += secs;
+		sec      += secs;
 	}
 
-	return block_cache_hit(cache, treq, iov);
+	block_cache_complete_run(cache, run, hit);
 }
 
 static void
@@ -777,8 +933,60 @@ block_cache_debug(td_driver_t *driver)
 
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", "
-	     "misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	     "misses: %"PRIu64", evictions: %"PRIu64", "
+	     "ghost hits: %"PRIu64"\n",
+	     stats->reads, stats->hits, stats->misses, stats->evictions,
+	     stats->ghost_hits);
+	WARN("pages: %u, a1in: %u, am: %u, a1out: %u\n",
+	     cache->npages, cache->nr_a1in, cache->nr_am, cache->nr_a1out);
+	WARN("dedup: hits: %"PRIu64", process: unique: %"PRIu64", "
+	     "refs: %"PRIu64"\n", stats->dedup_hits,
+	     block_cache_store.unique, block_cache_store.refs);
+
+	if (cache->shared)
+		WARN("shared: hits: %"PRIu64", misses: %"PRIu64", "
+		     "inserts: %"PRIu64", shared: %"PRIu64", "
+		     "evictions: %"PRIu64"\n",
+		     cache->shared_stats.hits, cache->shared_stats.misses,
+		     cache->shared_stats.inserts, cache->shared_stats.shared,
+		     cache->shared_stats.evictions);
+}
+
+static void
+block_cache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	block_cache_t *cache = (block_cache_t *)driver->data;
+	td_pagecache_stats_t *shared = &cache->shared_stats;
+	block_cache_store_t *store = &block_cache_store;
+
+	tapdisk_stats_field(st, "reads", "llu", cache->stats.reads);
+	tapdisk_stats_field(st, "hits", "llu", cache->stats.hits);
+	tapdisk_stats_field(st, "misses", "llu", cache->stats.misses);
+	tapdisk_stats_field(st, "evictions", "llu", cache->stats.evictions);
+	tapdisk_stats_field(st, "ghost_hits", "llu", cache->stats.ghost_hits);
+	tapdisk_stats_field(st, "pages", "u", cache->npages);
+
+	/* the store is per process, shared by all block caches in it */
+	tapdisk_stats_field(st, "dedup", "{");
+	tapdisk_stats_field(st, "hits", "llu", cache->stats.dedup_hits);
+	tapdisk_stats_field(st, "unique", "llu", store->unique);
+	tapdisk_stats_field(st, "refs", "llu", store->refs);
+	tapdisk_stats_field(st, "ratio", ".2f", store->unique ?
+			    (double)store->refs / store->unique : 1.0);
+	tapdisk_stats_field(st, "saved_bytes", "llu",
+			    (store->refs - store->unique) <<
+			    BLOCK_CACHE_PAGE_SHIFT);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "shared", "{");
+	tapdisk_stats_field(st, "size", "llu",
+			    (unsigned long long)td_pagecache_size(cache->shared));
+	tapdisk_stats_field(st, "hits", "llu", shared->hits);
+	tapdisk_stats_field(st, "misses", "llu", shared->misses);
+	tapdisk_stats_field(st, "inserts", "llu", shared->inserts);
+	tapdisk_stats_field(st, "shared", "llu", shared->shared);
+	tapdisk_stats_field(st, "evictions", "llu", shared->evictions);
+	tapdisk_stats_leave(st, '}');
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -792,4 +1000,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
@@ -37,11 +37,15 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "list.h"
 #include "libvhd.h"
 #include "tapdisk.h"
 #include "vhd-util.h"
+#include "block-crypto.h"
 
 #include "crypto/compat-crypto-openssl.h"
 #include "crypto/xts_aes.h"
@@ -416,23 +420,45 @@ vhd_close_crypto(vhd_context_t *vhd)
 	}
 }
 
-void
+/*
+ * Runs a whole request through @ctx. XTS-plain tweaks each sector with
+ * its own number, so the IV is reset per sector, but the cipher context
+ * and key schedule are set up once for the request.
+ */
+static int
+__vhd_crypto_run(EVP_CIPHER_CTX *ctx, uint64_t sector, int secs,
+		 uint8_t *dst, const uint8_t *src)
+{
+	uint8_t iv[16];
+	int sec, dstlen;
+
+	for (sec = 0; sec < secs; sec++) {
+		xts_aes_plain_iv_generate(iv, sizeof(iv), sector + sec);
+
+		if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+			return -1;
+		if (!EVP_CipherUpdate(ctx, dst + sec * VHD_SECTOR_SIZE, &dstlen,
+				      src + sec * VHD_SECTOR_SIZE,
+				      VHD_SECTOR_SIZE))
+			return -2;
+	}
+
+	return 0;
+}
+
+int
 vhd_crypto_decrypt(vhd_context_t *vhd, td_request_t *t)
 {
-	int sec, ret;
-
-	for (sec = 0; sec < t->secs; sec++) {
-		ret = xts_aes_plain_decrypt(vhd->xts_tfm, t->sec + sec,
-					    (uint8_t *)t->buf +
-					    sec * VHD_SECTOR_SIZE,
-					    (uint8_t *)t->buf +
-					    sec * VHD_SECTOR_SIZE,
-					    VHD_SECTOR_SIZE);
-		if (ret) {
-			DPRINTF("crypto decrypt failed: %d : TERMINATED\n", ret);
-			exit(1); /* XXX */
-		}
+	int ret;
+
+	ret = __vhd_crypto_run(vhd->xts_tfm->de_ctx, t->sec, t->secs,
+			       (uint8_t *)t->buf, (uint8_t *)t->buf);
+	if (ret) {
+		EPRINTF("crypto decrypt failed: %d\n", ret);
+		return -EIO;
 	}
+
+	return 0;
 }
 
 int
@@ -442,21 +468,256 @@ vhd_crypto_encrypt_block(vhd_context_t *vhd, sector_t sector, uint8_t *source,
 	return xts_aes_plain_encrypt(vhd->xts_tfm, sector, dst, source, block_size);
 }
 
-void
+int
 vhd_crypto_encrypt(vhd_context_t *vhd, td_request_t *t, char *orig_buf)
 {
-	int sec, ret;
-
-	for (sec = 0; sec < t->secs; sec++) {
-		ret = vhd_crypto_encrypt_block(
-			vhd, t->sec + sec,
-			(uint8_t *)orig_buf + sec * VHD_SECTOR_SIZE,
-			(uint8_t *)t->buf + sec * VHD_SECTOR_SIZE,
-			VHD_SECTOR_SIZE);
-		if (ret) {
-			DPRINTF("crypto encrypt failed: %d : TERMINATED\n", ret);
-			exit(1); /* XXX */
+	int ret;
+
+	ret = __vhd_crypto_run(vhd->xts_tfm->en_ctx, t->sec, t->secs,
+			       (uint8_t *)t->buf, (uint8_t *)orig_buf);
+	if (ret) {
+		EPRINTF("crypto encrypt failed: %d\n", ret);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * One engine per process, shared by every encrypted image. Once an image
+ * uses the engine its xts_tfm contexts are only ever read (copied into
+ * the worker's private context), never run directly.
+ */
+#define VHD_CRYPTO_THREADS_DEFAULT   4
+#define VHD_CRYPTO_THREADS_MAX       32
+
+struct vhd_crypto_engine {
+	int                       users;
+	int                       event_fd;
+	int                       stop;
+
+	int                       nr_workers;
+	pthread_t                 workers[VHD_CRYPTO_THREADS_MAX];
+
+	pthread_mutex_t           lock;
+	pthread_cond_t            cond;
+	struct list_head          queue;
+
+	pthread_mutex_t           done_lock;
+	struct list_head          done;
+};
+
+static struct vhd_crypto_engine *engine;
+
+static int
+vhd_crypto_engine_threads(void)
+{
+	const char *env;
+	long n;
+
+	env = getenv("TAPDISK3_CRYPTO_THREADS");
+	if (env)
+		n = strtol(env, NULL, 10);
+	else {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n > VHD_CRYPTO_THREADS_DEFAULT)
+			n = VHD_CRYPTO_THREADS_DEFAULT;
+	}
+
+	if (n < 0)
+		n = 0;
+	if (n > VHD_CRYPTO_THREADS_MAX)
+		n = VHD_CRYPTO_THREADS_MAX;
+
+	return n;
+}
+
+static void *
+vhd_crypto_worker(void *arg)
+{
+	struct vhd_crypto_engine *e = arg;
+	struct vhd_crypto_job *job;
+	EVP_CIPHER_CTX *ctx;
+	uint64_t one = 1;
+	ssize_t n;
+
+	ctx = NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&e->lock);
+		while (!e->stop && list_empty(&e->queue))
+			pthread_cond_wait(&e->cond, &e->lock);
+		if (list_empty(&e->queue)) {
+			pthread_mutex_unlock(&e->lock);
+			break;
 		}
+		job = list_entry(e->queue.next, struct vhd_crypto_job, next);
+		list_del_init(&job->next);
+		pthread_mutex_unlock(&e->lock);
+
+		/* failed allocations fail the job, the next one retries */
+		if (!ctx)
+			ctx = EVP_CIPHER_CTX_new();
+
+		if (!ctx ||
+		    !EVP_CIPHER_CTX_copy(ctx, job->encrypt ?
+					 job->vhd->xts_tfm->en_ctx :
+					 job->vhd->xts_tfm->de_ctx))
+			job->error = -ENOMEM;
+		else if (__vhd_crypto_run(ctx, job->sec, job->secs,
+					  job->dst, job->src))
+			job->error = -EIO;
+		else
+			job->error = 0;
+
+		pthread_mutex_lock(&e->done_lock);
+		list_add_tail(&job->next, &e->done);
+		pthread_mutex_unlock(&e->done_lock);
+
+		do {
+			n = write(e->event_fd, &one, sizeof(one));
+		} while (n < 0 && errno == EINTR);
 	}
+
+	if (ctx)
+		EVP_CIPHER_CTX_free(ctx);
+	return NULL;
 }
 
+static void
+vhd_crypto_engine_stop(struct vhd_crypto_engine *e)
+{
+	int i;
+
+	pthread_mutex_lock(&e->lock);
+	e->stop = 1;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+
+	for (i = 0; i < e->nr_workers; i++)
+		pthread_join(e->workers[i], NULL);
+
+	if (e->event_fd != -1)
+		close(e->event_fd);
+
+	pthread_mutex_destroy(&e->lock);
+	pthread_mutex_destroy(&e->done_lock);
+	pthread_cond_destroy(&e->cond);
+	free(e);
+}
+
+/*
+ * Takes a reference on the engine, starting it on first use. Returns the
+ * completion eventfd, or -EOPNOTSUPP if the engine is disabled
+ * (TAPDISK3_CRYPTO_THREADS=0), in which case the caller should stay on
+ * the synchronous vhd_crypto_encrypt/decrypt path.
+ */
+int
+vhd_crypto_engine_get(void)
+{
+	struct vhd_crypto_engine *e;
+	int i, err, threads;
+
+	if (engine) {
+		engine->users++;
+		return engine->event_fd;
+	}
+
+	threads = vhd_crypto_engine_threads();
+	if (!threads)
+		return -EOPNOTSUPP;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&e->queue);
+	INIT_LIST_HEAD(&e->done);
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_mutex_init(&e->done_lock, NULL);
+	pthread_cond_init(&e->cond, NULL);
+
+	e->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (e->event_fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	for (i = 0; i < threads; i++) {
+		err = pthread_create(&e->workers[i], NULL, vhd_crypto_worker, e);
+		if (err) {
+			err = -err;
+			goto fail;
+		}
+		e->nr_workers++;
+	}
+
+	DPRINTF("started crypto engine with %d workers\n", e->nr_workers);
+
+	e->users = 1;
+	engine   = e;
+	return e->event_fd;
+
+fail:
+	EPRINTF("failed to start crypto engine: %d\n", err);
+	vhd_crypto_engine_stop(e);
+	return err;
+}
+
+void
+vhd_crypto_engine_put(void)
+{
+	if (!engine)
+		return;
+
+	if (--engine->users)
+		return;
+
+	vhd_crypto_engine_stop(engine);
+	engine = NULL;
+}
+
+void
+vhd_crypto_engine_submit(struct vhd_crypto_job *job)
+{
+	struct vhd_crypto_engine *e = engine;
+
+	pthread_mutex_lock(&e->lock);
+	list_add_tail(&job->next, &e->queue);
+	pthread_cond_signal(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * Called from the event loop when the eventfd fires: runs the callbacks
+ * of all finished jobs.
+ */
+void
+vhd_crypto_engine_complete(void)
+{
+	struct vhd_crypto_engine *e = engine;
+	struct vhd_crypto_job *job, *tmp;
+	struct list_head done;
+	uint64_t count;
+
+	if (!e)
+		return;
+
+	if (read(e->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		EPRINTF("crypto engine: eventfd read failed: %d\n", -errno);
+
+	INIT_LIST_HEAD(&done);
+	pthread_mutex_lock(&e->done_lock);
+	list_splice_tail(&e->done, &done);
+	INIT_LIST_HEAD(&e->done);
+	pthread_mutex_unlock(&e->done_lock);
+
+	list_for_each_entry_safe(job, tmp, &done, next) {
+		list_del_init(&job->next);
+		if (job->error)
+			EPRINTF("crypto %s failed: %d\n",
+				job->encrypt ? "encrypt" : "decrypt",
+				job->error);
+		job->cb(job);
+	}
+}
@@ -31,7 +31,32 @@
  */
 
 
-int vhd_open_crypto(vhd_context_t *vhd, struct td_vbd_encryption *encryption, const char *name);
+int vhd_open_crypto(vhd_context_t *vhd, const uint8_t *key, size_t key_bytes, const char *name);
 void vhd_close_crypto(vhd_context_t *vhd);
-void vhd_crypto_encrypt(vhd_context_t *vhd, td_request_t *t, char *orig_buf);
-void vhd_crypto_decrypt(vhd_context_t *vhd, td_request_t *t);
+int vhd_crypto_encrypt(vhd_context_t *vhd, td_request_t *t, char *orig_buf);
+int vhd_crypto_decrypt(vhd_context_t *vhd, td_request_t *t);
+
+/*
+ * Asynchronous crypto engine: whole requests are handed to a small pool
+ * of worker threads, each with private cipher contexts, and completed
+ * back on the tapdisk event loop through an eventfd.
+ *
+ * The job is owned by the caller until its callback runs; no memory is
+ * allocated per request.
+ */
+struct vhd_crypto_job {
+	struct list_head          next;
+	vhd_context_t            *vhd;
+	int                       encrypt;
+	uint64_t                  sec;
+	int                       secs;
+	uint8_t                  *src;
+	uint8_t                  *dst;
+	int                       error;
+	void                    (*cb)(struct vhd_crypto_job *);
+};
+
+int vhd_crypto_engine_get(void);
+void vhd_crypto_engine_put(void);
+void vhd_crypto_engine_submit(struct vhd_crypto_job *job);
+void vhd_crypto_engine_complete(void);
@@ -43,6 +43,7 @@
 
 #include "vhd.h"
 #include "tapdisk.h"
+#include "tapdisk-vbd.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
@@ -69,9 +70,35 @@
 #define TD_LCACHE_BUFSZ                 (MAX_SEGMENTS_PER_REQ * \
 					 sysconf(_SC_PAGE_SIZE))
 
+/*
+ * What the cache holds persists in the leaf VHD itself: its block
+ * bitmaps say which sectors were filled, and the chain check at open
+ * ties it to the parent's UUID and timestamp. Reads only get here when
+ * the leaf misses them, so no index of our own is kept.
+ *
+ * Parent reads are stored in the leaf by fills, queued on the vbd
+ * as soon as the read completes, like the guest request would be.
+ * Never later: a guest write to the same sectors queued meanwhile
+ * would be overwritten with stale parent data.
+ *
+ * A read completing while the last fill still waits at the tail of
+ * the vbd queue, and ends where the read starts, is merged into it as
+ * one more segment: nothing was queued in between, so ordering is as
+ * if queued separately. The aio backend then issues one sequential
+ * write.
+ *
+ * Fills hold on to at most half the buffers, so guest reads always
+ * find one. Reads beyond that, or already covered by an outstanding
+ * fill, are not stored. Every fill holds a buffer, so there is a fill
+ * slot for each: none is dropped for want of one.
+ */
+#define TD_LCACHE_FILL_BUFS             (TD_LCACHE_MAX_REQ/2)
+#define TD_LCACHE_FILL_DEPTH            TD_LCACHE_FILL_BUFS
+#define TD_LCACHE_FILL_MAX_IOV          32
 
 typedef struct lcache                   td_lcache_t;
 typedef struct lcache_request           td_lcache_req_t;
+typedef struct lcache_fill              td_lcache_fill_t;
 
 struct lcache_request {
 	char                           *buf;
@@ -80,12 +107,30 @@ struct lcache_request {
 	td_request_t                    treq;
 	int                             secs;
 
+	td_lcache_t                    *cache;
+};
+
+struct lcache_fill {
 	td_vbd_request_t                vreq;
-	struct td_iovec                 iov;
+	struct td_iovec                 iov[TD_LCACHE_FILL_MAX_IOV];
+	td_lcache_req_t                *reqv[TD_LCACHE_FILL_MAX_IOV];
+	int                             n_reqs;
+
+	td_sector_t                     sec;
+	int                             secs;
 
 	td_lcache_t                    *cache;
 };
 
+struct lcache_fill_stats {
+	uint64_t                        fills;
+	uint64_t                        filled_secs;
+	uint64_t                        merged;
+	uint64_t                        skipped;
+	uint64_t                        dropped;
+	uint64_t                        errors;
+};
+
 struct lcache {
 	char                           *name;
 
@@ -98,6 +143,21 @@ struct lcache {
 
 	int                             wr_en;
 	struct timeval                  ts;
+
+	td_vbd_t                       *vbd;
+
+	td_lcache_fill_t                fillv[TD_LCACHE_FILL_DEPTH];
+	td_lcache_fill_t               *fill_free[TD_LCACHE_FILL_DEPTH];
+	int                             n_fill_free;
+	td_lcache_fill_t               *fill_last;
+	int                             fill_bufs;
+
+	struct timeval                  bw_ts;
+	uint64_t                        bw_secs;
+	uint64_t                        bw;     /* B/s */
+
+	struct lcache_fill_stats        st;
+
 };
 
 static td_lcache_req_t *
@@ -178,7 +238,15 @@ lcache_open(td_driver_t *driver, const char *name,
 	    struct td_vbd_encryption *encryption, td_flag_t flags)
 {
 	td_lcache_t *cache = driver->data;
-	int err;
+	int i, err;
+
+	cache->n_fill_free = 0;
+	for (i = 0; i < TD_LCACHE_FILL_DEPTH; i++) {
+		td_lcache_fill_t *fill = &cache->fillv[i];
+
+		fill->cache = cache;
+		cache->fill_free[cache->n_fill_free++] = fill;
+	}
 
 	err  = tapdisk_namedup(&cache->name, (char *)name);
 	if (err)
@@ -191,6 +259,8 @@ lcache_open(td_driver_t *driver, const char *name,
 	timerclear(&cache->ts);
 	cache->wr_en = 1;
 
+	gettimeofday(&cache->bw_ts, NULL);
+
 	return 0;
 
 fail:
@@ -253,44 +323,163 @@ lcache_wr_enabled(td_lcache_t *cache)
 }
 
 static void
-__lcache_write_cb(td_vbd_request_t *vreq, int error,
-		  void *token, int final)
+lcache_fill_account(td_lcache_t *cache, int secs)
 {
-	td_lcache_req_t *req = container_of(vreq, td_lcache_req_t, vreq);
+	struct timeval now, delta;
+	uint64_t usecs;
+
+	cache->bw_secs += secs;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &cache->bw_ts, &delta);
+	if (delta.tv_sec < 1)
+		return;
+
+	usecs = delta.tv_sec * 1000000ULL + delta.tv_usec;
+	cache->bw = (cache->bw_secs << SECTOR_SHIFT) * 1000000ULL / usecs;
+
+	cache->bw_secs = 0;
+	cache->bw_ts   = now;
+}
+
+static int
+lcache_fill_covered(td_lcache_t *cache, td_sector_t sec, int secs)
+{
+	int i;
+
+	for (i = 0; i < TD_LCACHE_FILL_DEPTH; i++) {
+		td_lcache_fill_t *fill = &cache->fillv[i];
+
+		if (fill->n_reqs &&
+		    fill->sec <= sec && sec + secs <= fill->sec + fill->secs)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+__lcache_fill_cb(td_vbd_request_t *vreq, int error,
+		 void *token, int final)
+{
+	td_lcache_fill_t *fill = container_of(vreq, td_lcache_fill_t, vreq);
 	td_lcache_t *cache = token;
+	int i;
 
 	if (error == -ENOSPC)
 		cache->wr_en = 0;
 
-	lcache_free_request(cache, req);
+	if (error)
+		cache->st.errors++;
+	else {
+		cache->st.fills++;
+		cache->st.filled_secs += fill->secs;
+		lcache_fill_account(cache, fill->secs);
+	}
+
+	for (i = 0; i < fill->n_reqs; i++)
+		lcache_free_request(cache, fill->reqv[i]);
+	cache->fill_bufs -= fill->n_reqs;
+	fill->n_reqs = 0;
+
+	if (cache->fill_last == fill)
+		cache->fill_last = NULL;
+	cache->fill_free[cache->n_fill_free++] = fill;
 }
 
 static void
-lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
+lcache_fill_add(td_lcache_t *cache, td_lcache_fill_t *fill,
+		td_lcache_req_t *req)
 {
+	struct td_iovec *iov = &fill->iov[fill->n_reqs];
+
+	iov->base = req->buf;
+	iov->secs = req->treq.secs;
+
+	fill->reqv[fill->n_reqs++] = req;
+	fill->secs += req->treq.secs;
+	fill->vreq.iovcnt = fill->n_reqs;
+
+	cache->fill_bufs++;
+}
+
+/*
+ * The last fill, if @req can still be merged into it.
+ */
+static td_lcache_fill_t *
+lcache_fill_tail(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	td_lcache_fill_t *fill = cache->fill_last;
+
+	if (!fill || fill->n_reqs >= TD_LCACHE_FILL_MAX_IOV)
+		return NULL;
+
+	if (cache->vbd->new_requests.prev != &fill->vreq.next)
+		return NULL;
+
+	if (fill->sec + fill->secs != req->treq.sec)
+		return NULL;
+
+	return fill;
+}
+
+static void
+lcache_fill_issue(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	td_lcache_fill_t *fill;
 	td_vbd_request_t *vreq;
-	struct td_iovec *iov;
-	td_vbd_t *vbd;
 	int err;
 
-	iov          = &req->iov;
-	iov->base    = req->buf;
-	iov->secs    = req->treq.secs;
+	fill = cache->fill_free[--cache->n_fill_free];
+
+	fill->sec    = req->treq.sec;
+	fill->secs   = 0;
+	fill->n_reqs = 0;
 
-	vreq         = &req->vreq;
+	vreq         = &fill->vreq;
+	memset(vreq, 0, sizeof(*vreq));
 	vreq->op     = TD_OP_WRITE;
-	vreq->sec    = req->treq.sec;
-	vreq->iov    = iov;
-	vreq->iovcnt = 1;
-	vreq->cb     = __lcache_write_cb;
+	vreq->sec    = fill->sec;
+	vreq->iov    = fill->iov;
+	vreq->cb     = __lcache_fill_cb;
 	vreq->token  = cache;
+	vreq->name   = "lcache";
 
-	vbd = req->treq.vreq->vbd;
+	lcache_fill_add(cache, fill, req);
+	cache->fill_last = fill;
 
-	err = tapdisk_vbd_queue_request(vbd, vreq);
+	err = tapdisk_vbd_queue_request(cache->vbd, vreq);
 	BUG_ON(err);
 }
 
+static void
+lcache_fill_queue(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	td_lcache_fill_t *fill;
+
+	if (lcache_fill_covered(cache, req->treq.sec, req->treq.secs)) {
+		cache->st.skipped++;
+		lcache_free_request(cache, req);
+		return;
+	}
+
+	if (cache->fill_bufs >= TD_LCACHE_FILL_BUFS) {
+		cache->st.dropped++;
+		lcache_free_request(cache, req);
+		return;
+	}
+
+	fill = lcache_fill_tail(cache, req);
+	if (fill) {
+		lcache_fill_add(cache, fill, req);
+		cache->st.merged++;
+		return;
+	}
+
+	BUG_ON(!cache->n_fill_free);
+	lcache_fill_issue(cache, req);
+}
+
 static void
 lcache_complete_read(td_lcache_t *cache, td_lcache_req_t *req)
 {
@@ -306,7 +495,7 @@ lcache_complete_read(td_lcache_t *cache, td_lcache_req_t *req)
 		return;
 	}
 
-	lcache_store_read(cache, req);
+	lcache_fill_queue(cache, req);
 }
 
 static void
@@ -342,6 +531,8 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	req->secs    = req->treq.secs;
 	req->err     = 0;
 
+	cache->vbd   = treq.vreq->vbd;
+
 	clone         = treq;
 	clone.buf     = req->buf;
 	clone.cb      = __lcache_read_cb;
@@ -380,6 +571,29 @@ lcache_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static void
+lcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_lcache_t *cache = driver->data;
+
+	lcache_fill_account(cache, 0);
+
+	tapdisk_stats_field(st, "wr_en", "d", cache->wr_en);
+
+	tapdisk_stats_field(st, "fill", "{");
+	tapdisk_stats_field(st, "bufs", "d", cache->fill_bufs);
+	tapdisk_stats_field(st, "inflight", "d",
+			    TD_LCACHE_FILL_DEPTH - cache->n_fill_free);
+	tapdisk_stats_field(st, "fills", "llu", cache->st.fills);
+	tapdisk_stats_field(st, "filled_secs", "llu", cache->st.filled_secs);
+	tapdisk_stats_field(st, "merged", "llu", cache->st.merged);
+	tapdisk_stats_field(st, "skipped", "llu", cache->st.skipped);
+	tapdisk_stats_field(st, "dropped", "llu", cache->st.dropped);
+	tapdisk_stats_field(st, "errors", "llu", cache->st.errors);
+	tapdisk_stats_field(st, "bytes_per_sec", "llu", cache->bw);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_lcache = {
 	.disk_type                  = "tapdisk_lcache",
 	.flags                      = 0,
@@ -389,4 +603,5 @@ struct tap_disk tapdisk_lcache = {
 	.td_queue_read              = lcache_queue_read,
 	.td_get_parent_id           = lcache_get_parent_id,
 	.td_validate_parent         = lcache_validate_parent,
+	.td_stats                   = lcache_stats,
 };
@@ -32,13 +32,20 @@
 #include "config.h"
 #endif
 
+#include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "tapdisk.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-driver.h"
+#include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
+#include "timeout-math.h"
 
 #define DBG(_f, _a...)  tlog_syslog(TLOG_DBG, _f, ##_a)
 #define INFO(_f, _a...) tlog_syslog(TLOG_INFO, _f, ##_a)
@@ -48,6 +55,8 @@
 #define BUG()           td_panic()
 #define BUG_ON(_cond)   if (unlikely(_cond)) { td_panic(); }
 #define WARN_ON(_p)     if (unlikely(_cond)) { WARN(_cond); }
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+#define ALIGN_UP(_x, _a) (((_x) + (_a) - 1) & ~((off_t)(_a) - 1))
 
 int ll_write_error(int curr, int error)
 {
@@ -115,19 +124,133 @@ enum {
 	 *
 	 * Failure to write SHARED is irrecoverable.
 	 */
+
+	LLP_WRITEBACK = 3,
+	/*
+	 * LLP_WRITEBACK:
+	 *
+	 * Writes are issued to LOCAL only, and complete once both
+	 * LOCAL and the dirty log have them. A destager copies dirty
+	 * extents from LOCAL to SHARED in the background, in log
+	 * order and at a bounded rate. Reads are issued to LOCAL.
+	 *
+	 * Failure to write LOCAL with ENOSPC is recoverable: the
+	 * write goes to SHARED instead. It can only have hit blocks
+	 * LOCAL does not hold, so LOCAL reads fall through to it.
+	 *
+	 * Failure to log a write is recoverable the same way, the
+	 * data being in LOCAL already.
+	 *
+	 * Close, and therefore pause ahead of migration, waits for
+	 * all dirty data to reach SHARED.
+	 */
 };
 
 typedef struct llpcache                 td_llpcache_t;
 typedef struct llpcache_request         td_llpcache_req_t;
+typedef struct llpcache_extent          td_llpcache_extent_t;
 #define TD_LLPCACHE_MAX_REQ             (MAX_REQUESTS*2)
 
+/*
+ * The dirty log sits next to LOCAL: a header sector, then one record
+ * per write acknowledged but not yet destaged, in seq order. Appends
+ * are group committed: records of writes completing while a log write
+ * is in flight all go out with the next one, rewriting the partial
+ * tail sector. Records up to header.clean are known to be in SHARED.
+ * The header is advanced lazily, and once everything is clean the log
+ * starts over behind it; stale records left past the end break the
+ * seq order and end replay.
+ */
+#define TD_LLPCACHE_LOG_SUFFIX          ".dirty"
+#define TD_LLPCACHE_LOG_COOKIE          "tdllpdty"
+#define TD_LLPCACHE_LOG_HDR_SIZE        512
+#define TD_LLPCACHE_LOG_TAIL_SIZE                                       \
+	(ALIGN_UP(TD_LLPCACHE_MAX_REQ *                                 \
+		  sizeof(struct llpcache_log_record), SECTOR_SIZE) +    \
+	 SECTOR_SIZE)
+
+#define TD_LLPCACHE_DESTAGE_DEPTH       4
+#define TD_LLPCACHE_DESTAGE_RATE        (16 << 10) /* KiB/s */
+#define TD_LLPCACHE_DESTAGE_INTERVAL    100000     /* usecs */
+
+struct llpcache_log_header {
+	char                    cookie[8];
+	uint64_t                clean;
+	uint32_t                checksum;
+} __attribute__((packed));
+
+struct llpcache_log_record {
+	uint64_t                seq;
+	uint64_t                sec;
+	uint32_t                secs;
+	uint32_t                checksum;
+} __attribute__((packed));
+
+struct llpcache_extent {
+	struct list_head        next;
+	td_llpcache_t          *s;
+
+	uint64_t                seq;
+	td_sector_t             sec;
+	int                     secs;
+
+	int                     destaging;
+	int                     pending;
+	int                     error;
+	char                   *buf;
+};
+
+struct llpcache_writeback {
+	int                     fd;
+	char                   *path;
+	off_t                   end;
+	uint64_t                seq;
+
+	/* log tail, from the sector holding tail_off on */
+	char                   *tail;
+	off_t                   tail_off;
+	off_t                   flush_end;
+	struct list_head        log_pending;   /* requests to commit */
+	struct list_head        log_inflight;  /* requests committing */
+	struct tiocb            log_tiocb;
+	int                     log_busy;
+
+	char                   *hdr;
+	uint64_t                clean;         /* last written to header */
+	struct tiocb            hdr_tiocb;
+	int                     hdr_busy;
+
+	struct list_head        dirty;
+	int                     n_dirty;
+	int                     inflight;
+
+	td_image_t             *shared;
+	event_id_t              timer;
+
+	uint64_t                rate;     /* bytes/s, 0: unlimited */
+	uint64_t                budget;
+	struct timeval          last;
+
+	int                     draining;
+	uint64_t                drain_errors;  /* errors when it started */
+
+	uint64_t                logged;
+	uint64_t                commits;
+	uint64_t                destaged;
+	uint64_t                destaged_secs;
+	uint64_t                errors;
+	uint64_t                fallbacks;
+};
+
 struct llpcache_vreq {
 	enum { LOCAL = 0, SHARED = 1 }  target;
 	td_vbd_request_t                vreq;
 };
 
 struct llpcache_request {
+	td_llpcache_t          *s;
 	td_request_t            treq;
+	struct list_head        next;
 
 	struct td_iovec         iov;
 	int                     error;
@@ -136,12 +259,16 @@ struct llpcache_request {
 
 	unsigned int            pending;
 	int                     mode;
+	int                     secs;
 };
 
 struct llpcache {
+	td_driver_t            *driver;
 	td_image_t             *local;
 	int                     mode;
 
+	struct llpcache_writeback wb;
+
 	td_llpcache_req_t       reqv[TD_LLPCACHE_MAX_REQ];
 	td_llpcache_req_t      *free[TD_LLPCACHE_MAX_REQ];
 	int                     n_free;
@@ -300,6 +427,708 @@ llpcache_forward_write(td_llpcache_t *s, td_request_t treq)
 	}
 }
 
+static uint32_t
+llpcache_log_checksum(const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint32_t sum = 0;
+
+	while (size--)
+		sum += *p++;
+
+	return ~sum;
+}
+
+static void
+llpcache_log_fill_header(td_llpcache_t *s, uint64_t clean)
+{
+	struct llpcache_log_header *hdr = (void *)s->wb.hdr;
+
+	memset(s->wb.hdr, 0, TD_LLPCACHE_LOG_HDR_SIZE);
+	memcpy(hdr->cookie, TD_LLPCACHE_LOG_COOKIE, sizeof(hdr->cookie));
+	hdr->clean    = clean;
+	hdr->checksum = llpcache_log_checksum(hdr, sizeof(*hdr));
+}
+
+/*
+ * Synchronous, for open and close only.
+ */
+static int
+llpcache_log_write_header(td_llpcache_t *s, uint64_t clean)
+{
+	struct llpcache_writeback *wb = &s->wb;
+
+	llpcache_log_fill_header(s, clean);
+
+	if (pwrite(wb->fd, wb->hdr, TD_LLPCACHE_LOG_HDR_SIZE, 0) !=
+	    TD_LLPCACHE_LOG_HDR_SIZE)
+		return errno ? -errno : -EIO;
+
+	wb->clean = clean;
+	return 0;
+}
+
+static void llpcache_log_commit(td_llpcache_t *s);
+static void llpcache_log_clean(td_llpcache_t *s);
+static void llpcache_wb_write_done(td_llpcache_req_t *req, int err);
+
+/*
+ * Adds a record for @req to the tail and queues @req to be completed
+ * once it is on disk.
+ */
+static int
+llpcache_log_append(td_llpcache_t *s, td_llpcache_req_t *req)
+{
+	struct llpcache_writeback *wb = &s->wb;
+	struct llpcache_log_record rec;
+	td_llpcache_extent_t *e;
+
+	BUG_ON(wb->end + sizeof(rec) - wb->tail_off >
+	       TD_LLPCACHE_LOG_TAIL_SIZE);
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return -ENOMEM;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.seq      = wb->seq + 1;
+	rec.sec      = req->treq.sec;
+	rec.secs     = req->treq.secs;
+	rec.checksum = llpcache_log_checksum(&rec, sizeof(rec));
+
+	memcpy(wb->tail + (wb->end - wb->tail_off), &rec, sizeof(rec));
+
+	e->s    = s;
+	e->seq  = rec.seq;
+	e->sec  = rec.sec;
+	e->secs = rec.secs;
+	list_add_tail(&e->next, &wb->dirty);
+
+	wb->seq  = rec.seq;
+	wb->end += sizeof(rec);
+	wb->n_dirty++;
+	wb->logged++;
+
+	list_add_tail(&req->next, &wb->log_pending);
+	llpcache_log_commit(s);
+
+	return 0;
+}
+
+static void
+__llpcache_log_commit_cb(void *arg, struct tiocb *tiocb, int err)
+{
+	td_llpcache_t *s = arg;
+	struct llpcache_writeback *wb = &s->wb;
+	td_llpcache_req_t *req, *next;
+	off_t off;
+
+	wb->log_busy = 0;
+
+	/* keep the partial sector, for the next commit to rewrite */
+	off = wb->flush_end & ~((off_t)SECTOR_SIZE - 1);
+	memmove(wb->tail, wb->tail + (off - wb->tail_off), wb->end - off);
+	memset(wb->tail + (wb->end - off), 0,
+	       TD_LLPCACHE_LOG_TAIL_SIZE - (wb->end - off));
+	wb->tail_off = off;
+
+	if (err)
+		WARN("logging writes: %s, writing through. ", strerror(-err));
+
+	list_for_each_entry_safe(req, next, &wb->log_inflight, next) {
+		list_del_init(&req->next);
+		llpcache_wb_write_done(req, err);
+	}
+
+	llpcache_log_commit(s);
+	llpcache_log_clean(s);
+}
+
+/*
+ * Writes out the tail, covering every record appended so far, unless
+ * a commit is in flight already: it will be followed by another.
+ */
+static void
+llpcache_log_commit(td_llpcache_t *s)
+{
+	struct llpcache_writeback *wb = &s->wb;
+	size_t size;
+
+	if (wb->log_busy || list_empty(&wb->log_pending))
+		return;
+
+	list_splice_tail(&wb->log_pending, &wb->log_inflight);
+	INIT_LIST_HEAD(&wb->log_pending);
+
+	wb->flush_end = wb->end;
+	size = ALIGN_UP(wb->end - wb->tail_off, SECTOR_SIZE);
+
+	td_prep_write(s->driver, &wb->log_tiocb, wb->fd, wb->tail, size,
+		      wb->tail_off, __llpcache_log_commit_cb, s);
+	td_queue_tiocb(s->driver, &wb->log_tiocb);
+
+	wb->log_busy = 1;
+	wb->commits++;
+}
+
+static void
+__llpcache_log_clean_cb(void *arg, struct tiocb *tiocb, int err)
+{
+	td_llpcache_t *s = arg;
+	struct llpcache_writeback *wb = &s->wb;
+	struct llpcache_log_header *hdr = (void *)wb->hdr;
+
+	wb->hdr_busy = 0;
+
+	if (err) {
+		WARN("%s: updating header: %s. ", wb->path, strerror(-err));
+		return;
+	}
+
+	wb->clean = hdr->clean;
+	llpcache_log_clean(s);
+}
+
+/*
+ * Advances the header past everything destaged, one write at a time.
+ * Replaying records already destaged is harmless, so this need not
+ * keep up. Once all records are clean on disk, and no commit is in
+ * flight, the log starts over.
+ */
+static void
+llpcache_log_clean(td_llpcache_t *s)
+{
+	struct llpcache_writeback *wb = &s->wb;
+	td_llpcache_extent_t *e;
+	uint64_t clean;
+
+	if (wb->hdr_busy)
+		return;
+
+	clean = wb->seq;
+	if (!list_empty(&wb->dirty)) {
+		e = list_first_entry(&wb->dirty, td_llpcache_extent_t, next);
+		clean = e->seq - 1;
+	}
+
+	if (clean == wb->clean) {
+		if (clean == wb->seq && !wb->log_busy &&
+		    wb->end > TD_LLPCACHE_LOG_HDR_SIZE) {
+			wb->end      = TD_LLPCACHE_LOG_HDR_SIZE;
+			wb->tail_off = TD_LLPCACHE_LOG_HDR_SIZE;
+			memset(wb->tail, 0, TD_LLPCACHE_LOG_TAIL_SIZE);
+		}
+		return;
+	}
+
+	llpcache_log_fill_header(s, clean);
+
+	td_prep_write(s->driver, &wb->hdr_tiocb, wb->fd, wb->hdr,
+		      TD_LLPCACHE_LOG_HDR_SIZE, 0, __llpcache_log_clean_cb, s);
+	td_queue_tiocb(s->driver, &wb->hdr_tiocb);
+
+	wb->hdr_busy = 1;
+}
+
+/*
+ * Reads back what a previous session left undestaged. LOCAL has the
+ * data for all of it, so reads can be served meanwhile.
+ */
+static int
+llpcache_log_replay(td_llpcache_t *s)
+{
+	struct llpcache_writeback *wb = &s->wb;
+	char buf[TD_LLPCACHE_LOG_HDR_SIZE];
+	struct llpcache_log_header *hdr = (void *)buf;
+	struct llpcache_log_record rec;
+	td_llpcache_extent_t *e;
+	uint64_t last = 0;
+	uint32_t checksum;
+	ssize_t n;
+
+	wb->end      = TD_LLPCACHE_LOG_HDR_SIZE;
+	wb->tail_off = TD_LLPCACHE_LOG_HDR_SIZE;
+
+	n = pread(wb->fd, buf, sizeof(buf), 0);
+	if (n == 0)
+		return llpcache_log_write_header(s, 0);
+	if (n != sizeof(buf))
+		return -EINVAL;
+
+	checksum      = hdr->checksum;
+	hdr->checksum = 0;
+	if (memcmp(hdr->cookie, TD_LLPCACHE_LOG_COOKIE, sizeof(hdr->cookie)) ||
+	    checksum != llpcache_log_checksum(hdr, sizeof(*hdr)))
+		return -EINVAL;
+
+	wb->seq   = hdr->clean;
+	wb->clean = hdr->clean;
+
+	while (pread(wb->fd, &rec, sizeof(rec), wb->end) == sizeof(rec)) {
+		checksum     = rec.checksum;
+		rec.checksum = 0;
+		if (checksum != llpcache_log_checksum(&rec, sizeof(rec)))
+			break;
+
+		/* stale records from before the log started over */
+		if (last && rec.seq != last + 1)
+			break;
+		last = rec.seq;
+
+		wb->end += sizeof(rec);
+
+		if (rec.seq <= hdr->clean)
+			continue;
+
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+
+		e->s    = s;
+		e->seq  = rec.seq;
+		e->sec  = rec.sec;
+		e->secs = rec.secs;
+		list_add_tail(&e->next, &wb->dirty);
+
+		wb->seq = rec.seq;
+		wb->n_dirty++;
+	}
+
+	if (wb->n_dirty)
+		INFO("%s: %d extents to destage from last session\n",
+		     wb->path, wb->n_dirty);
+
+	/* the next commit rewrites the sector the log ends in */
+	wb->tail_off = wb->end & ~((off_t)SECTOR_SIZE - 1);
+	n = pread(wb->fd, wb->tail, SECTOR_SIZE, wb->tail_off);
+	if (n < 0)
+		return -errno;
+	memset(wb->tail + (wb->end - wb->tail_off), 0,
+	       TD_LLPCACHE_LOG_TAIL_SIZE - (wb->end - wb->tail_off));
+
+	return 0;
+}
+
+static int
+llpcache_wb_budget(td_llpcache_t *s, int secs)
+{
+	struct llpcache_writeback *wb = &s->wb;
+	uint64_t bytes = (uint64_t)secs << SECTOR_SHIFT, usecs;
+	struct timeval now, delta;
+
+	if (!wb->rate)
+		return 1;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &wb->last, &delta);
+	wb->last = now;
+
+	usecs = delta.tv_sec * 1000000ULL + delta.tv_usec;
+	wb->budget += wb->rate * usecs / 1000000;
+	if (wb->budget > wb->rate)
+		wb->budget = wb->rate;
+
+	/* extents over a second's worth go once the bucket is full */
+	if (wb->budget < MIN(bytes, wb->rate))
+		return 0;
+
+	wb->budget -= MIN(bytes, wb->budget);
+	return 1;
+}
+
+static void llpcache_wb_kick(td_llpcache_t *s);
+
+static void
+llpcache_wb_destage_done(td_llpcache_extent_t *e)
+{
+	td_llpcache_t *s = e->s;
+	struct llpcache_writeback *wb = &s->wb;
+
+	free(e->buf);
+	e->buf       = NULL;
+	e->destaging = 0;
+	wb->inflight--;
+
+	if (e->error) {
+		/* stays dirty, the timer retries it */
+		WARN("destaging 0x%"PRIx64"+%d: %s. ",
+		     (uint64_t)e->sec, e->secs, strerror(-e->error));
+		e->error = 0;
+		wb->errors++;
+		return;
+	}
+
+	wb->destaged++;
+	wb->destaged_secs += e->secs;
+
+	list_del(&e->next);
+	wb->n_dirty--;
+	free(e);
+
+	llpcache_log_clean(s);
+	llpcache_wb_kick(s);
+}
+
+static void
+__llpcache_wb_shared_cb(td_request_t treq, int error)
+{
+	td_llpcache_extent_t *e = treq.cb_data;
+
+	e->error    = e->error ? : error;
+	e->pending -= treq.secs;
+	if (!e->pending)
+		llpcache_wb_destage_done(e);
+}
+
+static void
+__llpcache_wb_local_cb(td_request_t treq, int error)
+{
+	td_llpcache_extent_t *e = treq.cb_data;
+	td_llpcache_t *s = e->s;
+
+	e->error    = e->error ? : error;
+	e->pending -= treq.secs;
+	if (e->pending)
+		return;
+
+	if (e->error) {
+		llpcache_wb_destage_done(e);
+		return;
+	}
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_WRITE;
+	treq.sec     = e->sec;
+	treq.secs    = e->secs;
+	treq.buf     = e->buf;
+	treq.cb      = __llpcache_wb_shared_cb;
+	treq.cb_data = e;
+
+	e->pending = e->secs;
+	td_queue_write(s->wb.shared, treq);
+}
+
+/*
+ * Extents are logged only once LOCAL has them, so the read below is
+ * served by LOCAL itself and neither side needs a vbd request to
+ * forward on.
+ */
+static int
+llpcache_wb_destage(td_llpcache_t *s, td_llpcache_extent_t *e)
+{
+	td_request_t treq;
+	int err;
+
+	err = posix_memalign((void **)&e->buf, SECTOR_SIZE,
+			     (size_t)e->secs << SECTOR_SHIFT);
+	if (err) {
+		e->buf = NULL;
+		return -err;
+	}
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_READ;
+	treq.sec     = e->sec;
+	treq.secs    = e->secs;
+	treq.buf     = e->buf;
+	treq.cb      = __llpcache_wb_local_cb;
+	treq.cb_data = e;
+
+	e->destaging = 1;
+	e->pending   = e->secs;
+	s->wb.inflight++;
+
+	td_queue_read(s->local, treq);
+	return 0;
+}
+
+static int
+llpcache_wb_overlaps(td_llpcache_t *s, td_llpcache_extent_t *e)
+{
+	td_llpcache_extent_t *prev;
+
+	list_for_each_entry(prev, &s->wb.dirty, next) {
+		if (prev == e)
+			break;
+
+		if (prev->destaging &&
+		    prev->sec < e->sec + e->secs &&
+		    e->sec < prev->sec + prev->secs)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Starts destaging dirty extents oldest first. An extent overlapping
+ * an older one still in flight waits, and so does everything after
+ * it: SHARED must see overlapping writes in log order.
+ */
+static void
+llpcache_wb_kick(td_llpcache_t *s)
+{
+	struct llpcache_writeback *wb = &s->wb;
+	td_llpcache_extent_t *e;
+
+	if (!wb->shared)
+		return;
+
+	list_for_each_entry(e, &wb->dirty, next) {
+		if (wb->inflight >= TD_LLPCACHE_DESTAGE_DEPTH)
+			break;
+
+		if (e->destaging)
+			continue;
+
+		if (llpcache_wb_overlaps(s, e))
+			break;
+
+		if (!llpcache_wb_budget(s, e->secs))
+			break;
+
+		if (llpcache_wb_destage(s, e))
+			break;
+	}
+}
+
+static void
+llpcache_wb_timer(event_id_t id, char mode, void *private)
+{
+	llpcache_wb_kick(private);
+}
+
+/*
+ * Completes a write LOCAL has, once logged. Failing to log, like
+ * LOCAL running out of space, falls back to writing SHARED.
+ */
+static void
+llpcache_wb_write_done(td_llpcache_req_t *req, int err)
+{
+	td_llpcache_t *s = req->s;
+
+	if (!err)
+		goto done;
+
+	if (err != -ENOSPC)
+		WARN("logging write: %s, writing through. ", strerror(-err));
+
+	s->wb.fallbacks++;
+	req->error   = 0;
+	req->pending = 0;
+
+	err = llpcache_requeue_treq(s, req, SHARED);
+	if (!err)
+		return;
+
+done:
+	td_complete_request(req->treq, req->error);
+	llpcache_free_request(s, req);
+	llpcache_wb_kick(s);
+}
+
+static void
+__llpcache_wb_write_cb(td_request_t treq, int error)
+{
+	td_llpcache_req_t *req = treq.cb_data;
+	td_llpcache_t *s = req->s;
+	int err;
+
+	req->error = req->error ? : error;
+	req->secs -= treq.secs;
+	if (req->secs)
+		return;
+
+	if (req->error) {
+		err = req->error;
+		req->error = 0;
+		if (err == -ENOSPC)
+			llpcache_wb_write_done(req, err);
+		else {
+			td_complete_request(req->treq, err);
+			llpcache_free_request(s, req);
+		}
+		return;
+	}
+
+	err = llpcache_log_append(s, req);
+	if (err)
+		llpcache_wb_write_done(req, err);
+}
+
+static void
+llpcache_wb_write(td_llpcache_t *s, td_request_t treq)
+{
+	td_llpcache_req_t *req;
+	td_request_t clone;
+
+	req = llpcache_alloc_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	memset(req, 0, sizeof(td_llpcache_req_t));
+
+	req->s         = s;
+	req->treq      = treq;
+	req->mode      = LLP_WRITEBACK;
+	req->secs      = treq.secs;
+	req->iov.base  = treq.buf;
+	req->iov.secs  = treq.secs;
+
+	clone         = treq;
+	clone.cb      = __llpcache_wb_write_cb;
+	clone.cb_data = req;
+
+	td_queue_write(s->local, clone);
+}
+
+static int
+llpcache_wb_open(td_llpcache_t *s, const char *name, td_flag_t flags)
+{
+	struct llpcache_writeback *wb = &s->wb;
+	const char *env;
+	int err;
+
+	err = asprintf(&wb->path, "%s%s", name, TD_LLPCACHE_LOG_SUFFIX);
+	if (err == -1) {
+		wb->path = NULL;
+		return -ENOMEM;
+	}
+
+	/* a log left behind must be destaged even in mirror mode */
+	if (!td_flag_test(flags, TD_OPEN_WRITEBACK) && access(wb->path, F_OK))
+		return 0;
+
+	err = posix_memalign((void **)&wb->tail, SECTOR_SIZE,
+			     TD_LLPCACHE_LOG_TAIL_SIZE);
+	if (err) {
+		wb->tail = NULL;
+		return -err;
+	}
+	memset(wb->tail, 0, TD_LLPCACHE_LOG_TAIL_SIZE);
+
+	err = posix_memalign((void **)&wb->hdr, SECTOR_SIZE,
+			     TD_LLPCACHE_LOG_HDR_SIZE);
+	if (err) {
+		wb->hdr = NULL;
+		return -err;
+	}
+
+	wb->fd = open(wb->path, O_RDWR | O_CREAT | O_DSYNC, 0600);
+	if (wb->fd == -1)
+		return -errno;
+
+	err = llpcache_log_replay(s);
+	if (err) {
+		WARN("%s: bad dirty log: %s. ", wb->path, strerror(-err));
+		return err;
+	}
+
+	/* whole sectors from here on, keep commits off the page cache */
+	err = fcntl(wb->fd, F_GETFL);
+	if (err == -1 || fcntl(wb->fd, F_SETFL, err | O_DIRECT))
+		INFO("%s: no O_DIRECT: %s\n", wb->path, strerror(errno));
+
+	wb->rate = TD_LLPCACHE_DESTAGE_RATE;
+	env = getenv("TAPDISK3_LLP_DESTAGE_RATE");
+	if (env)
+		wb->rate = strtoull(env, NULL, 10);
+	wb->rate  <<= 10;
+	wb->budget  = wb->rate;
+	gettimeofday(&wb->last, NULL);
+
+	wb->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+						  TV_USECS(TD_LLPCACHE_DESTAGE_INTERVAL),
+						  llpcache_wb_timer, s);
+	if (wb->timer < 0)
+		return wb->timer;
+
+	if (td_flag_test(flags, TD_OPEN_WRITEBACK))
+		s->mode = LLP_WRITEBACK;
+
+	return 0;
+}
+
+/*
+ * Destages everything dirty to SHARED, unthrottled, ahead of close.
+ * Gives up on errors, or if the chain never gave us SHARED, and leaves
+ * the log to the next open. Returns -EAGAIN until nothing is in flight.
+ */
+static int
+llpcache_wb_drain(td_llpcache_t *s)
+{
+	struct llpcache_writeback *wb = &s->wb;
+
+	if (wb->fd < 0)
+		return 0;
+
+	if (!wb->draining) {
+		wb->draining     = 1;
+		wb->drain_errors = wb->errors;
+		wb->rate         = 0;
+	}
+
+	if (!list_empty(&wb->dirty) && wb->shared &&
+	    wb->errors == wb->drain_errors) {
+		llpcache_wb_kick(s);
+		return -EAGAIN;
+	}
+
+	if (wb->inflight || wb->log_busy || wb->hdr_busy)
+		return -EAGAIN;
+
+	return 0;
+}
+
+static void
+llpcache_wb_close(td_llpcache_t *s)
+{
+	struct llpcache_writeback *wb = &s->wb;
+	td_llpcache_extent_t *e, *next;
+
+	if (wb->fd >= 0) {
+		if (wb->n_dirty)
+			WARN("%s: %d extents left undestaged. ",
+			     wb->path, wb->n_dirty);
+
+		if (!wb->n_dirty)
+			unlink(wb->path);
+		else if (!list_empty(&wb->dirty)) {
+			e = list_first_entry(&wb->dirty,
+					     td_llpcache_extent_t, next);
+			llpcache_log_write_header(s, e->seq - 1);
+		}
+
+		close(wb->fd);
+		wb->fd = -1;
+	}
+
+	if (wb->shared) {
+		tapdisk_image_close(wb->shared);
+		wb->shared = NULL;
+	}
+
+	if (wb->timer >= 0) {
+		tapdisk_server_unregister_event(wb->timer);
+		wb->timer = -1;
+	}
+
+	list_for_each_entry_safe(e, next, &wb->dirty, next) {
+		list_del(&e->next);
+		free(e);
+	}
+	wb->n_dirty = 0;
+
+	free(wb->path);
+	wb->path = NULL;
+	free(wb->tail);
+	wb->tail = NULL;
+	free(wb->hdr);
+	wb->hdr = NULL;
+}
+
 static void
 llpcache_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -307,6 +1136,8 @@ llpcache_queue_write(td_driver_t *driver, td_request_t treq)
 
 	if (treq.vreq->token == s)
 		llpcache_forward_write(s, treq);
+	else if (s->mode == LLP_WRITEBACK)
+		llpcache_wb_write(s, treq);
 	else
 		llpcache_fork_write(s, treq);
 }
@@ -318,20 +1149,57 @@ llpcache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	switch (s->mode) {
 	case LLP_MIRROR:
+	case LLP_WRITEBACK:
 		td_queue_read(s->local, treq);
 		break;
 	case LLP_SHARED:
 		td_forward_request(treq);
+		break;
 	default:
 		BUG();
 	}
 }
 
+/*
+ * The log is written O_DSYNC, only the local leaf needs syncing.
+ */
+static void
+llpcache_queue_sync(td_driver_t *driver, td_request_t treq)
+{
+	td_llpcache_t *s = driver->data;
+
+	if (s->local)
+		td_queue_sync(s->local, treq);
+	else
+		td_complete_request(treq, 0);
+}
+
+static int
+llpcache_quiesce(td_driver_t *driver)
+{
+	td_llpcache_t *s = driver->data;
+	int err;
+
+	err = llpcache_wb_drain(s);
+	if (err)
+		return err;
+
+	if (s->wb.shared) {
+		err = td_quiesce(s->wb.shared);
+		if (err)
+			return err;
+	}
+
+	return s->local ? td_quiesce(s->local) : 0;
+}
+
 static int
 llpcache_close(td_driver_t *driver)
 {
 	td_llpcache_t *s = driver->data;
 
+	llpcache_wb_close(s);
+
 	if (s->local) {
 		tapdisk_image_close(s->local);
 		s->local = NULL;
@@ -347,7 +1215,13 @@ llpcache_open(td_driver_t *driver, const char *name,
 	td_llpcache_t *s = driver->data;
 	int i, err;
 
-	s->mode = LLP_MIRROR;
+	s->driver = driver;
+	s->mode   = LLP_MIRROR;
+	INIT_LIST_HEAD(&s->wb.dirty);
+	INIT_LIST_HEAD(&s->wb.log_pending);
+	INIT_LIST_HEAD(&s->wb.log_inflight);
+	s->wb.fd    = -1;
+	s->wb.timer = -1;
 
 	for (i = 0; i < TD_LLPCACHE_MAX_REQ; i++)
 		llpcache_free_request(s, &s->reqv[i]);
@@ -358,6 +1232,10 @@ llpcache_open(td_driver_t *driver, const char *name,
 
 	driver->info = s->local->driver->info;
 
+	err = llpcache_wb_open(s, name, flags);
+	if (err)
+		goto fail;
+
 	return 0;
 
 fail:
@@ -385,6 +1263,57 @@ llcache_validate_parent(td_driver_t *driver,
 	return -ENOSYS;
 }
 
+/*
+ * SHARED is our parent, open once the chain is. Destaging needs it
+ * before any write comes in, to work off a log left from last time,
+ * and until the end of our close, so hold our own reference.
+ */
+static int
+llpcache_validate_parent(td_driver_t *driver,
+			 td_driver_t *pdriver, td_flag_t flags)
+{
+	td_llpcache_t *s = driver->data;
+	td_image_t *shared;
+
+	if (s->wb.shared)
+		return 0;
+
+	shared = tapdisk_image_allocate(pdriver->name, pdriver->type, 0);
+	if (!shared)
+		return -ENOMEM;
+
+	shared->driver = pdriver;
+	shared->info   = pdriver->info;
+	pdriver->refcnt++;
+
+	s->wb.shared = shared;
+	if (s->wb.fd >= 0)
+		llpcache_wb_kick(s);
+
+	return 0;
+}
+
+static void
+llpcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_llpcache_t *s = driver->data;
+	struct llpcache_writeback *wb = &s->wb;
+
+	tapdisk_stats_field(st, "mode", "d", s->mode);
+
+	tapdisk_stats_field(st, "writeback", "{");
+	tapdisk_stats_field(st, "enabled", "d", s->mode == LLP_WRITEBACK);
+	tapdisk_stats_field(st, "dirty", "d", wb->n_dirty);
+	tapdisk_stats_field(st, "inflight", "d", wb->inflight);
+	tapdisk_stats_field(st, "logged", "llu", wb->logged);
+	tapdisk_stats_field(st, "commits", "llu", wb->commits);
+	tapdisk_stats_field(st, "destaged", "llu", wb->destaged);
+	tapdisk_stats_field(st, "destaged_secs", "llu", wb->destaged_secs);
+	tapdisk_stats_field(st, "errors", "llu", wb->errors);
+	tapdisk_stats_field(st, "fallbacks", "llu", wb->fallbacks);
+	tapdisk_stats_leave(st, '}');
+}
+
 
 struct tap_disk tapdisk_llpcache = {
 	.disk_type                  = "tapdisk_llpcache",
@@ -394,8 +1323,11 @@ struct tap_disk tapdisk_llpcache = {
 	.td_close                   = llpcache_close,
 	.td_queue_read              = llpcache_queue_read,
 	.td_queue_write             = llpcache_queue_write,
+	.td_queue_sync              = llpcache_queue_sync,
+	.td_quiesce                 = llpcache_quiesce,
 	.td_get_parent_id           = llcache_get_parent_id,
-	.td_validate_parent         = llcache_validate_parent,
+	.td_validate_parent         = llpcache_validate_parent,
+	.td_stats                   = llpcache_stats,
 };
 
 /*
@@ -480,6 +1412,20 @@ llecache_free_request(td_llecache_t *s, td_llecache_req_t *req)
 	s->free[s->n_free++] = req;
 }
 
+/*
+ * Local writes are not meant to persist, shared ones are.
+ */
+static void
+llecache_queue_sync(td_driver_t *driver, td_request_t treq)
+{
+	td_llecache_t *s = driver->data;
+
+	if (s->mode == LLE_SHARED)
+		td_queue_sync(s->shared, treq);
+	else
+		td_complete_request(treq, 0);
+}
+
 static int
 llecache_close(td_driver_t *driver)
 {
@@ -610,6 +1556,7 @@ struct tap_disk tapdisk_llecache = {
 	.td_close                   = llecache_close,
 	.td_queue_read              = llecache_queue_read,
 	.td_queue_write             = llecache_queue_write,
+	.td_queue_sync              = llecache_queue_sync,
 	.td_get_parent_id           = llcache_get_parent_id,
 	.td_validate_parent         = llcache_validate_parent,
 };
@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -68,7 +69,37 @@
 #define RECV_BUFFER_SIZE 256
 
 /*
- * We'll only ever have one nbdclient fd receiver per tapdisk process, so let's 
+ * Adjacent requests of the same type, queued before the command went
+ * out, are sent as a single NBD command of up to this many requests
+ * and bytes.
+ */
+#define NBD_MAX_MERGE_REQS 16
+#define NBD_MAX_MERGE_BYTES (1 << 20)
+
+/*
+ * Connections opened to a server advertising NBD_FLAG_CAN_MULTI_CONN,
+ * unless TAPDISK3_NBD_CONNECTIONS says otherwise.
+ */
+#define NBD_DEFAULT_CONNS 4
+#define NBD_MAX_CONNS 8
+
+/*
+ * A lost connection is retried every NBD_RECONNECT_INTERVAL seconds,
+ * for up to NBD_TIMEOUT seconds, its requests being resent once it is
+ * back. Only connections we opened ourselves can be reestablished.
+ *
+ * Reconnecting must not hold up the requests on the other connections:
+ * the socket is connected and negotiated without blocking, driven by
+ * its own event, and abandoned if not done within NBD_CONNECT_TIMEOUT
+ * seconds. The extra connections are opened the same way. The first
+ * one goes through the same steps, but td_open waits for it, up to
+ * NBD_CONNECT_TIMEOUT seconds in all, as it needs the export size.
+ */
+#define NBD_RECONNECT_INTERVAL 1
+#define NBD_CONNECT_TIMEOUT 5
+
+/*
+ * We'll only ever have one nbdclient fd receiver per tapdisk process, so let's
  * just store it here globally. We'll also keep track of the passed fds here
  * too.
  */
@@ -80,38 +111,110 @@ struct tdnbd_passed_fd {
 	int                     fd;
 } passed_fds[N_PASSED_FDS];
 
-struct nbd_queued_io {
-	char                   *buffer;
-	int                     len;
-	int                     so_far;
-};
+struct tdnbd_conn;
 
 struct td_nbd_request {
-	td_request_t            treq;
 	struct nbd_request      nreq;
-	int                     timeout_event;
-	int                     fake;
-	struct nbd_queued_io    header;
-	struct nbd_queued_io    body;     /* in or out, depending on whether
-					     type is read or write. */
+	td_request_t            treqs[NBD_MAX_MERGE_REQS];
+	int                     nr_treqs;
+	uint32_t                len;      /* payload, in bytes */
+
+	/* the header, followed by the request buffers */
+	struct iovec            iov[NBD_MAX_MERGE_REQS + 1];
+	size_t                  so_far;   /* sent so far */
+	int                     sent;
+	int                     error;    /* from structured reply chunks */
+
+	struct tdnbd_conn      *conn;
 	struct list_head        queue;
 };
 
-struct tdnbd_data
+enum {
+	NBD_RX_MAGIC = 0,
+	NBD_RX_HDR,
+	NBD_RX_CHUNK,
+	NBD_RX_DATA,
+	NBD_RX_SKIP,
+};
+
+enum {
+	NBD_HS_CONNECT = 0,  /* connect() in progress */
+	NBD_HS_MAGIC,        /* NBDMAGIC, then the protocol magic */
+	NBD_HS_OLD,          /* old style: size, flags and padding */
+	NBD_HS_GFLAGS,       /* new style: server handshake flags */
+	NBD_HS_OPT_REPLY,    /* reply to NBD_OPT_STRUCTURED_REPLY */
+	NBD_HS_OPT_DATA,     /* and its message, discarded */
+	NBD_HS_EXPORT,       /* export size and flags */
+};
+
+#define NBD_HS_BUF_SIZE 136
+#define NBD_HS_TX_SIZE 64
+
+struct tdnbd_conn
 {
+	struct tdnbd_data      *prv;
+	int                     socket;
 	int                     writer_event_id;
-	struct list_head        sent_reqs;
+	int                     reader_event_id;
 	struct list_head        pending_reqs;
+	struct list_head        sent_reqs;
+	int                     inflight;
+
+	/*
+	 * Reply being received: a simple or structured reply header, then
+	 * the fixed part of a structured chunk, then any payload, either
+	 * read straight into the request buffers or discarded.
+	 */
+	int                     rx_state;
+	union {
+		struct nbd_reply             simple;
+		struct nbd_structured_reply  structured;
+	} rx_hdr;
+	char                    rx_chunk[12];
+	size_t                  rx_off;
+	size_t                  rx_len;
+	uint16_t                rx_flags;
+	uint16_t                rx_type;
+	uint32_t                rx_length;
+	struct iovec            rx_iov[NBD_MAX_MERGE_REQS];
+	int                     rx_iovcnt;
+	struct td_nbd_request  *rx_req;
+
+	/*
+	 * Negotiation in progress, while socket is still down: the new
+	 * socket, the event driving it, what it waits for next, and what
+	 * is left to send and to receive of the current step.
+	 */
+	int                     hs_socket;
+	int                     hs_event_id;
+	char                    hs_event_mode;
+	char                    hs_want;
+	int                     hs_state;
+	struct timeval          hs_started;
+	char                    hs_buf[NBD_HS_BUF_SIZE];
+	size_t                  hs_off;
+	size_t                  hs_len;
+	uint32_t                hs_skip;
+	char                    hs_tx[NBD_HS_TX_SIZE];
+	size_t                  hs_tx_off;
+	size_t                  hs_tx_len;
+};
+
+struct tdnbd_data
+{
 	struct list_head        free_reqs;
 	struct td_nbd_request   requests[MAX_NBD_REQS];
 	int                     nr_free_count;
 
-	int                     reader_event_id;
-	struct nbd_reply        current_reply;
-	struct nbd_queued_io    cur_reply_qio;
-	struct td_nbd_request  *curr_reply_req;
+	struct tdnbd_conn       conns[NBD_MAX_CONNS];
+	int                     nr_conns;
+	struct tdnbd_conn      *last_conn;
+	uint16_t                tflags;
+
+	int                     reconnect_event_id;
+	struct timeval          down_since;
+	td_driver_t            *driver;
 
-	int                     socket;
 	/*
 	 * TODO tapdisk can talk to an Internet socket or a UNIX domain socket.
 	 * Try to group struct members accordingly e.g. in a union.
@@ -126,10 +229,8 @@ struct tdnbd_data
 	int                     closed;
 };
 
-int global_id = 0;
-
-static void disable_write_queue(struct tdnbd_data *prv);
-
+static void disable_write_queue(struct tdnbd_conn *conn);
+static void tdnbd_hs_abort(struct tdnbd_conn *conn);
 
 /* -- fdreceiver bits and pieces -- */
 
@@ -210,6 +311,35 @@ tdnbd_fdreceiver_stop()
 		td_fdreceiver_stop(fdreceiver);
 }
 
+
+/* -- requests and connections -- */
+
+static void
+tdnbd_put_request(struct tdnbd_data *prv, struct td_nbd_request *req)
+{
+	if (req->conn)
+		req->conn->inflight--;
+
+	req->conn = NULL;
+	req->nr_treqs = 0;
+	list_move(&req->queue, &prv->free_reqs);
+	prv->nr_free_count++;
+}
+
+static void
+tdnbd_complete(struct tdnbd_data *prv, struct td_nbd_request *req, int err)
+{
+	td_request_t treqs[NBD_MAX_MERGE_REQS];
+	int i, n = req->nr_treqs;
+
+	/* the slot may be reused as soon as the first completes */
+	memcpy(treqs, req->treqs, n * sizeof(td_request_t));
+	tdnbd_put_request(prv, req);
+
+	for (i = 0; i < n; i++)
+		td_complete_request(treqs[i], err);
+}
+
 static void
 __cancel_req(int i, struct td_nbd_request *pos, int e)
 {
@@ -217,623 +347,1299 @@ __cancel_req(int i, struct td_nbd_request *pos, int e)
 	memcpy(handle, pos->nreq.handle, 8);
 	handle[8] = 0;
 	INFO("Entry %d: handle='%s' type=%d, len=%d: %s",
-	     i, handle, ntohl(pos->nreq.type), ntohl(pos->nreq.len), strerror(e));
+	     i, handle, ntohl(pos->nreq.type), ntohl(pos->nreq.len),
+	     strerror(-e));
+}
 
-	if (pos->timeout_event >= 0) {
-		tapdisk_server_unregister_event(pos->timeout_event);
-		pos->timeout_event = -1;
-	}
+static void
+tdnbd_conn_stop(struct tdnbd_conn *conn)
+{
+	disable_write_queue(conn);
 
-	td_complete_request(pos->treq, e);
+	if (conn->reader_event_id >= 0) {
+		tapdisk_server_unregister_event(conn->reader_event_id);
+		conn->reader_event_id = -1;
+	}
 }
 
 static void
 tdnbd_disable(struct tdnbd_data *prv, int e)
 {
 	struct td_nbd_request *pos, *q;
-	int i = 0;
+	struct tdnbd_conn *conn;
+	int i = 0, n;
 
 	INFO("NBD client full-disable");
 
-	tapdisk_server_unregister_event(prv->writer_event_id);
-	tapdisk_server_unregister_event(prv->reader_event_id);
-
-	INFO("NBD client cancelling sent reqs");
-	list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue)
-		__cancel_req(i++, pos, e);
-
-	INFO("NBD client cancelling pending reqs");
-	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue)
-		__cancel_req(i++, pos, e);
-
 	INFO("Setting closed");
 	prv->closed = 3;
-}
-
-/* NBD writer queue */
-
-/* Return code: how much is left to write, or a negative error code */
-static int
-tdnbd_write_some(int fd, struct nbd_queued_io *data) 
-{
-	int left = data->len - data->so_far;
-	int rc;
-	char *code;
 
-	while (left > 0) {
-		rc = send(fd, data->buffer + data->so_far, left, 0);
+	if (prv->reconnect_event_id >= 0) {
+		tapdisk_server_unregister_event(prv->reconnect_event_id);
+		prv->reconnect_event_id = -1;
+	}
 
-		if (rc == -1) {
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-				return left;
+	for (n = 0; n < prv->nr_conns; n++) {
+		conn = &prv->conns[n];
+		tdnbd_conn_stop(conn);
+		tdnbd_hs_abort(conn);
 
-			code = strerror(errno);
-			ERROR("Bad return code %d from send (%s)", rc, 
-					(code == 0 ? "unknown" : code));
-			return rc;
+		INFO("NBD client cancelling sent reqs");
+		list_for_each_entry_safe(pos, q, &conn->sent_reqs, queue) {
+			__cancel_req(i++, pos, e);
+			tdnbd_complete(prv, pos, e);
 		}
 
-		if (rc == 0) {
-			ERROR("Server shutdown prematurely in write_some");
-			return -1;
+		INFO("NBD client cancelling pending reqs");
+		list_for_each_entry_safe(pos, q, &conn->pending_reqs, queue) {
+			__cancel_req(i++, pos, e);
+			tdnbd_complete(prv, pos, e);
 		}
 
-		left -= rc;
-		data->so_far += rc;
+		conn->rx_req = NULL;
 	}
+}
+
+/*
+ * Least loaded connection up, or the first one while none is (its
+ * requests go out once reconnected).
+ */
+static struct tdnbd_conn *
+tdnbd_pick_conn(struct tdnbd_data *prv)
+{
+	struct tdnbd_conn *conn, *best = NULL;
+	int i;
 
-	return left;
+	for (i = 0; i < prv->nr_conns; i++) {
+		conn = &prv->conns[i];
+		if (conn->socket < 0)
+			continue;
+		if (!best || conn->inflight < best->inflight)
+			best = conn;
+	}
+
+	return best ? : &prv->conns[0];
 }
 
+/* NBD writer queue */
+
+/*
+ * Send, or receive, what is left of the @len bytes described by @iov
+ * past *@off. Return code: how much is left, or a negative error code.
+ */
 static int
-tdnbd_read_some(int fd, struct nbd_queued_io *data)
+tdnbd_xfer(int fd, const struct iovec *iov, int iovcnt,
+	   size_t *off, size_t len, int write)
 {
-	int left = data->len - data->so_far;
-	int rc;
-	char *code;
+	struct iovec v[NBD_MAX_MERGE_REQS + 1];
+	struct msghdr msg;
+	size_t skip;
+	ssize_t rc;
+	int i, n;
+
+	while (*off < len) {
+		skip = *off;
+		for (i = 0; i < iovcnt && skip >= iov[i].iov_len; i++)
+			skip -= iov[i].iov_len;
+
+		for (n = 0; i < iovcnt; i++, n++) {
+			v[n].iov_base = (char *)iov[i].iov_base + skip;
+			v[n].iov_len = iov[i].iov_len - skip;
+			skip = 0;
+		}
 
-	while (left > 0) {
-		rc = recv(fd, data->buffer + data->so_far, left, 0);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = v;
+		msg.msg_iovlen = n;
 
-		if (rc == -1) {
+		if (write)
+			rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		else
+			rc = recvmsg(fd, &msg, 0);
 
+		if (rc == -1) {
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-				return left;
+				return len - *off;
+			if (errno == EINTR)
+				continue;
 
-			code = strerror(errno);
-			ERROR("Bad return code %d from send (%s)", rc,
-					(code == 0 ? "unknown" : code));
-			return rc;
+			ERROR("Bad return code from %s (%s)",
+			      write ? "send" : "recv", strerror(errno));
+			return -errno;
 		}
 
 		if (rc == 0) {
-			ERROR("Server shutdown prematurely in read_some");
-			return -1;
+			ERROR("Server shutdown prematurely in %s",
+			      write ? "write" : "read");
+			return -ECONNRESET;
 		}
 
-		data->so_far += rc;
-		left -= rc;
+		*off += rc;
 	}
 
-	return left;
+	return 0;
 }
 
+static void tdnbd_conn_lost(struct tdnbd_conn *conn, int err);
+
 static void
 tdnbd_writer_cb(event_id_t eb, char mode, void *data)
 {
 	struct td_nbd_request *pos, *q;
-	struct tdnbd_data *prv = data;
+	struct tdnbd_conn *conn = data;
+	int type, iovcnt, rc;
+	size_t len;
+
+	list_for_each_entry_safe(pos, q, &conn->pending_reqs, queue) {
+		type = ntohl(pos->nreq.type);
+
+		iovcnt = 1;
+		len = sizeof(pos->nreq);
+		if (type == TAPDISK_NBD_CMD_WRITE) {
+			iovcnt += pos->nr_treqs;
+			len += pos->len;
+		}
 
-	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue) {
-		if (tdnbd_write_some(prv->socket, &pos->header) > 0)
+		rc = tdnbd_xfer(conn->socket, pos->iov, iovcnt,
+				&pos->so_far, len, 1);
+		if (rc > 0)
+			return;
+		if (rc < 0) {
+			tdnbd_conn_lost(conn, rc);
 			return;
-
-		if (ntohl(pos->nreq.type) == TAPDISK_NBD_CMD_WRITE) {
-			if (tdnbd_write_some(prv->socket, &pos->body) > 0)
-				return;
 		}
 
-		if (ntohl(pos->nreq.type) == TAPDISK_NBD_CMD_DISC) {
+		if (type == TAPDISK_NBD_CMD_DISC) {
 			INFO("sent close request");
 			/*
 			 * We don't expect a response from a DISC, so move the
 			 * request back onto the free list
 			 */
-			list_move(&pos->queue, &prv->free_reqs);
-			prv->nr_free_count++;
-			prv->closed = 2;
+			tdnbd_put_request(conn->prv, pos);
 		} else {
-			list_move(&pos->queue, &prv->sent_reqs);
+			pos->sent = 1;
+			list_move_tail(&pos->queue, &conn->sent_reqs);
 		}
 	}
 
 	/* If we're here, we've written everything */
 
-	disable_write_queue(prv);
-
-	if (prv->closed == 2)
-		tdnbd_disable(prv, EIO);
-
-	return;
+	disable_write_queue(conn);
 }
 
 static int
-enable_write_queue(struct tdnbd_data *prv)
+enable_write_queue(struct tdnbd_conn *conn)
 {
-	if (prv->writer_event_id >= 0) 
+	if (conn->writer_event_id >= 0)
 		return 0;
 
-	prv->writer_event_id = 
+	conn->writer_event_id =
 		tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
-				prv->socket,
+				conn->socket,
 				TV_ZERO,
 				tdnbd_writer_cb,
-				prv);
+				conn);
 
-	return prv->writer_event_id;
+	return conn->writer_event_id;
 }
 
 static void
-disable_write_queue(struct tdnbd_data *prv)
+disable_write_queue(struct tdnbd_conn *conn)
 {
-	if (prv->writer_event_id < 0)
+	if (conn->writer_event_id < 0)
 		return;
 
-	tapdisk_server_unregister_event(prv->writer_event_id);
+	tapdisk_server_unregister_event(conn->writer_event_id);
 
-	prv->writer_event_id = -1;
+	conn->writer_event_id = -1;
 }
 
-static int
-tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
-		char *buffer, uint32_t length, td_request_t treq, int fake)
+static struct td_nbd_request *
+tdnbd_alloc_request(struct tdnbd_data *prv, struct tdnbd_conn *conn,
+		    int type, uint64_t offset)
 {
-	if (prv->nr_free_count == 0) 
-		return -EBUSY;
+	struct td_nbd_request *req;
+	int id;
 
-	if (prv->closed == 3) {
-		td_complete_request(treq, -ETIMEDOUT);
-		return -ETIMEDOUT;
-	}
-
-	struct td_nbd_request *req = list_entry(prv->free_reqs.next,
-			struct td_nbd_request, queue);
+	if (prv->nr_free_count == 0)
+		return NULL;
 
-	/* fill in the request */
+	req = list_entry(prv->free_reqs.next, struct td_nbd_request, queue);
 
-	req->treq = treq;
-	int id = global_id++;
-	snprintf(req->nreq.handle, 8, "td%05x", id % 0xffff);
-
-	/* Don't time the NBD requests out */
-	req->timeout_event = -1;
+	/* the handle names the slot, for replies to find it */
+	id = req - prv->requests;
+	snprintf(req->nreq.handle, 8, "td%05x", id);
 
 	req->nreq.magic = htonl(NBD_REQUEST_MAGIC);
 	req->nreq.type = htonl(type);
 	req->nreq.from = htonll(offset);
-	req->nreq.len = htonl(length);
-	req->header.buffer = (char *)&req->nreq;
-	req->header.len = sizeof(req->nreq);
-	req->header.so_far = 0;
-	req->body.buffer = buffer;
-	req->body.len = length;
-	req->body.so_far = 0;
-	req->fake = fake;
-
-	list_move_tail(&req->queue, &prv->pending_reqs);
+	req->nreq.len = 0;
+	req->iov[0].iov_base = &req->nreq;
+	req->iov[0].iov_len = sizeof(req->nreq);
+	req->nr_treqs = 0;
+	req->len = 0;
+	req->so_far = 0;
+	req->sent = 0;
+	req->error = 0;
+	req->conn = conn;
+
+	list_move_tail(&req->queue, &conn->pending_reqs);
 	prv->nr_free_count--;
+	conn->inflight++;
 
-	if (prv->writer_event_id < 0)
-		enable_write_queue(prv);
+	return req;
+}
 
-	return 0;
+static void
+tdnbd_add_treq(struct td_nbd_request *req, char *buffer, uint32_t length,
+	       td_request_t treq)
+{
+	req->treqs[req->nr_treqs] = treq;
+	req->nr_treqs++;
+	req->iov[req->nr_treqs].iov_base = buffer;
+	req->iov[req->nr_treqs].iov_len = length;
+	req->len += length;
+	req->nreq.len = htonl(req->len);
 }
 
-/* NBD Reader callback */
+/*
+ * The command last queued, if @treq can extend it: not started on the
+ * wire yet, same type, and ending where @treq begins.
+ */
+static struct td_nbd_request *
+tdnbd_merge_target(struct tdnbd_data *prv, int type, uint64_t offset,
+		   uint32_t length)
+{
+	struct tdnbd_conn *conn = prv->last_conn;
+	struct td_nbd_request *req;
+
+	if (!conn || list_empty(&conn->pending_reqs))
+		return NULL;
+
+	req = list_last_entry(&conn->pending_reqs, struct td_nbd_request,
+			      queue);
+
+	if (req->so_far || ntohl(req->nreq.type) != type ||
+	    !req->nr_treqs || req->nr_treqs == NBD_MAX_MERGE_REQS ||
+	    req->len + length > NBD_MAX_MERGE_BYTES ||
+	    ntohll(req->nreq.from) + req->len != offset)
+		return NULL;
+
+	return req;
+}
 
 static void
-tdnbd_reader_cb(event_id_t eb, char mode, void *data)
+tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
+		char *buffer, uint32_t length, td_request_t treq)
 {
-	char handle[9];
-	int do_disable = 0;
-
-	/* Check to see if we're in the middle of reading a response already */
-	struct tdnbd_data *prv = data;
-	int rc = tdnbd_read_some(prv->socket, &prv->cur_reply_qio);
+	struct tdnbd_conn *conn;
+	struct td_nbd_request *req;
 
-	if (rc < 0) {
-		ERROR("Error reading reply header: %d", rc);
-		tdnbd_disable(prv, EIO);
+	if (prv->closed == 3) {
+		td_complete_request(treq, -ETIMEDOUT);
 		return;
 	}
 
-	if (rc > 0)
-		return; /* need more data */
+	req = tdnbd_merge_target(prv, type, offset, length);
+	if (!req) {
+		conn = tdnbd_pick_conn(prv);
+		req = tdnbd_alloc_request(prv, conn, type, offset);
+		if (!req) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+		prv->last_conn = conn;
+	}
+
+	tdnbd_add_treq(req, buffer, length, treq);
+
+	if (req->conn->socket >= 0)
+		enable_write_queue(req->conn);
+}
+
+/* Move the requests of a connection that is down to those still up */
+static void
+tdnbd_requeue(struct tdnbd_data *prv, struct tdnbd_conn *conn)
+{
+	struct td_nbd_request *pos, *q;
+	struct tdnbd_conn *to;
 
-	/* Got a header. */
-	if (prv->current_reply.error != 0) {
-		ERROR("Error in reply: %d", prv->current_reply.error);
-		tdnbd_disable(prv, EIO);
+	to = tdnbd_pick_conn(prv);
+	if (to->socket < 0)
 		return;
+
+	list_for_each_entry_safe(pos, q, &conn->pending_reqs, queue) {
+		conn->inflight--;
+		to->inflight++;
+		pos->conn = to;
+		list_move_tail(&pos->queue, &to->pending_reqs);
 	}
 
-	/* Have we found the request yet? */
-	if (prv->curr_reply_req == NULL) {
-		struct td_nbd_request *pos, *q;
-		list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue) {
-			if (memcmp(pos->nreq.handle, prv->current_reply.handle,
-						8) == 0) {
-				prv->curr_reply_req = pos;
-				break;
-			}
-		}
+	if (prv->last_conn == conn)
+		prv->last_conn = NULL;
 
-		if (prv->curr_reply_req == NULL) {
-			memcpy(handle, prv->current_reply.handle, 8);
-			handle[8] = 0;
+	enable_write_queue(to);
+}
 
-			ERROR("Couldn't find request corresponding to reply "
-					"(reply handle='%s')", handle);
-			tdnbd_disable(prv, EIO);
-			return;
+static int
+tdnbd_conn_reopen(struct tdnbd_data *prv, struct tdnbd_conn *conn);
+
+static void
+tdnbd_reconnect_cb(event_id_t id, char mode, void *data)
+{
+	struct tdnbd_data *prv = data;
+	struct tdnbd_conn *conn;
+	struct timeval now;
+	int i, down = 0;
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < prv->nr_conns; i++) {
+		conn = &prv->conns[i];
+		if (conn->socket >= 0)
+			continue;
+
+		down++;
+
+		if (conn->hs_socket >= 0) {
+			if (now.tv_sec - conn->hs_started.tv_sec <
+			    NBD_CONNECT_TIMEOUT)
+				continue;
+
+			ERROR("Connection %d: no answer for %d seconds", i,
+			      NBD_CONNECT_TIMEOUT);
+			tdnbd_hs_abort(conn);
 		}
+
+		tdnbd_conn_reopen(prv, conn);
 	}
 
-	switch(ntohl(prv->curr_reply_req->nreq.type)) {
-	case TAPDISK_NBD_CMD_READ:
-		rc = tdnbd_read_some(prv->socket,
-				&prv->curr_reply_req->body);
+	for (i = 0; i < prv->nr_conns; i++)
+		if (prv->conns[i].socket < 0)
+			tdnbd_requeue(prv, &prv->conns[i]);
 
-		if (rc < 0) {
-			ERROR("Error reading body of request: %d", rc);
-			tdnbd_disable(prv, EIO);
-			return;
+	if (down == prv->nr_conns) {
+		if (now.tv_sec - prv->down_since.tv_sec >= NBD_TIMEOUT) {
+			ERROR("Could not reconnect for %d seconds, giving up",
+			      NBD_TIMEOUT);
+			tdnbd_disable(prv, -EIO);
 		}
+		return;
+	}
 
-		if (rc > 0)
-			return; /* need more data */
+	/* carry on without those still down, once the others are back */
+	if (!down || now.tv_sec - prv->down_since.tv_sec >= NBD_TIMEOUT) {
+		for (i = 0; i < prv->nr_conns; i++)
+			tdnbd_hs_abort(&prv->conns[i]);
 
-		td_complete_request(prv->curr_reply_req->treq, 0);
+		tapdisk_server_unregister_event(prv->reconnect_event_id);
+		prv->reconnect_event_id = -1;
+	}
+}
 
-		break;
-	case TAPDISK_NBD_CMD_WRITE:
-		td_complete_request(prv->curr_reply_req->treq, 0);
+/*
+ * Start the reconnect timer, minding the connections down from now on.
+ */
+static int
+tdnbd_watch_conns(struct tdnbd_data *prv)
+{
+	if (prv->reconnect_event_id >= 0)
+		return 0;
 
-		break;
-	default:
-		ERROR("Unhandled request response: %d",
-				ntohl(prv->curr_reply_req->nreq.type));
-		do_disable = 1;
-		return;
-	} 
+	gettimeofday(&prv->down_since, NULL);
+	prv->reconnect_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+				-1, TV_SECS(NBD_RECONNECT_INTERVAL),
+				tdnbd_reconnect_cb, prv);
 
-	/* remove the state */
-	list_move(&prv->curr_reply_req->queue, &prv->free_reqs);
-	prv->nr_free_count++;
+	return prv->reconnect_event_id < 0 ? -1 : 0;
+}
 
-	prv->cur_reply_qio.so_far = 0;
-	if (prv->curr_reply_req->timeout_event >= 0) {
-		tapdisk_server_unregister_event(
-				prv->curr_reply_req->timeout_event);
+static void
+tdnbd_conn_lost(struct tdnbd_conn *conn, int err)
+{
+	struct tdnbd_data *prv = conn->prv;
+	struct td_nbd_request *pos;
+
+	ERROR("Connection %d lost: %s", (int)(conn - prv->conns),
+	      strerror(-err));
+
+	if (prv->closed || prv->name) {
+		/* closing, or a passed fd we cannot open again */
+		tdnbd_disable(prv, -EIO);
+		return;
 	}
 
-	prv->curr_reply_req = NULL;
+	tdnbd_conn_stop(conn);
+	close(conn->socket);
+	conn->socket = -1;
+	conn->rx_req = NULL;
+
+	/* whatever was sent, or half sent, goes again, in order */
+	list_splice(&conn->sent_reqs, &conn->pending_reqs);
+	INIT_LIST_HEAD(&conn->sent_reqs);
+	list_for_each_entry(pos, &conn->pending_reqs, queue) {
+		pos->so_far = 0;
+		pos->sent = 0;
+		pos->error = 0;
+	}
 
-	/*
-	 * NB: do this here otherwise we cancel the request that has just been 
-	 * moved
-	 */
-	if (do_disable)
-		tdnbd_disable(prv, EIO);
+	tdnbd_requeue(prv, conn);
+
+	if (tdnbd_watch_conns(prv) < 0)
+		tdnbd_disable(prv, -EIO);
 }
 
-/* Wait a certain maximum amount of time for a socket to be readable and then
- * recv() some bytes from it if it is. Returns -ETIMEDOUT if the select times out,
- * otherwise -errno from whatever action failed.
- *
- * Otherwise, returns number of bytes read from the recv() (which could be 0)
+/* NBD Reader callback */
+
+static struct td_nbd_request *
+tdnbd_find_request(struct tdnbd_conn *conn, const char *handle)
+{
+	struct tdnbd_data *prv = conn->prv;
+	struct td_nbd_request *req;
+	char buf[9], *end;
+	long id;
+
+	memcpy(buf, handle, 8);
+	buf[8] = 0;
+
+	id = strtol(buf + 2, &end, 16);
+	if (strncmp(buf, "td", 2) || *end || id < 0 || id >= MAX_NBD_REQS)
+		goto fail;
+
+	req = &prv->requests[id];
+	if (req->conn != conn || !req->sent)
+		goto fail;
+
+	return req;
+
+fail:
+	ERROR("Couldn't find request corresponding to reply "
+	      "(reply handle='%s')", buf);
+	return NULL;
+}
+
+static void
+tdnbd_rx_reset(struct tdnbd_conn *conn)
+{
+	conn->rx_state = NBD_RX_MAGIC;
+	conn->rx_off = 0;
+	conn->rx_len = sizeof(uint32_t);
+	conn->rx_req = NULL;
+}
+
+/*
+ * Point rx_iov at @len bytes of the request buffers, @off bytes into
+ * the payload.
  */
 static int
-tdnbd_wait_recv(int fd, void *buffer, size_t len, int flags)
+tdnbd_rx_window(struct tdnbd_conn *conn, uint64_t off, uint32_t len)
 {
-	struct timeval select_tv;
-	fd_set socks;
-	int rc;
+	struct td_nbd_request *req = conn->rx_req;
+	struct iovec *iov;
+	size_t n;
+	int i;
+
+	if (off + len > req->len)
+		return -EPROTO;
+
+	conn->rx_iovcnt = 0;
+
+	for (i = 1; i <= req->nr_treqs && len; i++) {
+		iov = &req->iov[i];
+		if (off >= iov->iov_len) {
+			off -= iov->iov_len;
+			continue;
+		}
 
-	FD_ZERO(&socks);
-	FD_SET(fd, &socks);
-	select_tv.tv_sec = 10;
-	select_tv.tv_usec = 0;
-	rc = TEMP_FAILURE_RETRY(select(fd + 1, &socks, NULL, NULL, &select_tv));
-	if (rc < 0) return -errno;
-	if (rc == 0) return -ETIMEDOUT;
-
-	rc = TEMP_FAILURE_RETRY(recv(fd, buffer, len, flags));
-	if (rc < 0) return -errno;
-	return rc;
+		n = iov->iov_len - off;
+		if (n > len)
+			n = len;
+
+		conn->rx_iov[conn->rx_iovcnt].iov_base =
+			(char *)iov->iov_base + off;
+		conn->rx_iov[conn->rx_iovcnt].iov_len = n;
+		conn->rx_iovcnt++;
+
+		len -= n;
+		off = 0;
+	}
+
+	return 0;
 }
 
-int 
-negotiate_client_newstyle_options(int sock, td_driver_t *driver)
+static int
+tdnbd_rx_done(struct tdnbd_conn *conn)
 {
-	int rc;
-	struct nbd_new_option new_option;
-	char exportname[] = NBD_FIXED_SINGLE_EXPORT;
-	new_option.version = htobe64(NBD_OPT_MAGIC);
-	new_option.optlen = htobe32(sizeof(exportname));
-	new_option.option = htobe32( NBD_OPT_EXPORT_NAME);
+	struct td_nbd_request *req = conn->rx_req;
+	int done = conn->rx_flags & NBD_REPLY_FLAG_DONE;
 
-	struct nbd_export_name_option_reply handshake_finish;
-	static const size_t NO_ZERO_HANDSHAKE_FINISH_SIZE = 10;
+	tdnbd_rx_reset(conn);
 
-	/* Send EXPORTNAME_NAME option request */
-	rc = send_fully_or_fail(sock, &new_option, sizeof(new_option));
-	if (rc < 0)
-	{
-		ERROR("Failed to send options to sock");
-		goto errout;
-	}
-	/* Send exportname name */
-	rc = send_fully_or_fail(sock, exportname, sizeof(exportname));
-	if (rc < 0)
-	{
-		ERROR("Failed to send export name to sock");
-		goto errout;
+	if (done)
+		tdnbd_complete(conn->prv, req, req->error);
+
+	return 1;
+}
+
+static int
+tdnbd_rx_data(struct tdnbd_conn *conn, uint64_t from, uint32_t len)
+{
+	struct td_nbd_request *req = conn->rx_req;
+	uint64_t start = ntohll(req->nreq.from);
+
+	if (ntohl(req->nreq.type) != TAPDISK_NBD_CMD_READ || from < start ||
+	    tdnbd_rx_window(conn, from - start, len)) {
+		ERROR("Reply data outside of the request");
+		return -EPROTO;
 	}
 
-	/* Collect the results in the handshake finished */
-	rc = tdnbd_wait_recv(sock, &handshake_finish, NO_ZERO_HANDSHAKE_FINISH_SIZE, 0);
-	if (rc < 0)
-	{
-		ERROR("Failed to read handshake from sock: %s", strerror(-rc));
-		goto errout;
+	if (!len)
+		return tdnbd_rx_done(conn);
+
+	conn->rx_state = NBD_RX_DATA;
+	conn->rx_off = 0;
+	conn->rx_len = len;
+
+	return 1;
+}
+
+static int
+tdnbd_rx_skip(struct tdnbd_conn *conn, uint32_t len)
+{
+	conn->rx_state = NBD_RX_SKIP;
+	conn->rx_off = 0;
+	conn->rx_len = len;
+
+	return 1;
+}
+
+static int
+tdnbd_rx_magic(struct tdnbd_conn *conn)
+{
+	uint32_t magic = ntohl(conn->rx_hdr.simple.magic);
+
+	if (magic == NBD_REPLY_MAGIC)
+		conn->rx_len = sizeof(struct nbd_reply);
+	else if (magic == NBD_STRUCTURED_REPLY_MAGIC)
+		conn->rx_len = sizeof(struct nbd_structured_reply);
+	else {
+		ERROR("Bad reply magic 0x%x", magic);
+		return -EPROTO;
 	}
 
-	driver->info.size = be64toh(handshake_finish.exportsize) >> SECTOR_SHIFT;
-	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
-	driver->info.info = 0;
+	conn->rx_state = NBD_RX_HDR;
+	return 1;
+}
 
-	rc = fcntl(sock, F_SETFL, O_NONBLOCK);
-	if (rc != 0) {
-		ERROR("Could not set O_NONBLOCK flag");
-		goto errout;
+static int
+tdnbd_rx_header(struct tdnbd_conn *conn)
+{
+	struct nbd_structured_reply *reply = &conn->rx_hdr.structured;
+	struct td_nbd_request *req;
+	uint32_t error;
+
+	/* both reply formats carry the handle at the same offset */
+	req = tdnbd_find_request(conn, conn->rx_hdr.simple.handle);
+	if (!req)
+		return -EPROTO;
+
+	conn->rx_req = req;
+
+	if (conn->rx_len == sizeof(struct nbd_reply)) {
+		conn->rx_flags = NBD_REPLY_FLAG_DONE;
+
+		error = ntohl(conn->rx_hdr.simple.error);
+		if (error) {
+			ERROR("Error in reply: %d", error);
+			req->error = -error;
+			return tdnbd_rx_done(conn);
+		}
+
+		return tdnbd_rx_data(conn, ntohll(req->nreq.from),
+				     ntohl(req->nreq.type) ==
+				     TAPDISK_NBD_CMD_READ ? req->len : 0);
 	}
 
-	INFO("Successfully connected to New-style NBD server");
+	conn->rx_flags = be16toh(reply->flags);
+	conn->rx_type = be16toh(reply->type);
+	conn->rx_length = be32toh(reply->length);
+	conn->rx_off = 0;
+
+	switch (conn->rx_type) {
+	case NBD_REPLY_TYPE_NONE:
+		if (conn->rx_length)
+			return -EPROTO;
+		return tdnbd_rx_done(conn);
+
+	case NBD_REPLY_TYPE_OFFSET_DATA:
+		if (conn->rx_length < sizeof(uint64_t))
+			return -EPROTO;
+		conn->rx_len = sizeof(uint64_t);
+		break;
 
-	return 0;
+	case NBD_REPLY_TYPE_OFFSET_HOLE:
+		if (conn->rx_length != sizeof(uint64_t) + sizeof(uint32_t))
+			return -EPROTO;
+		conn->rx_len = conn->rx_length;
+		break;
 
-errout:
-	close(sock);
-	return -1;
-}
+	default:
+		if (!NBD_REPLY_TYPE_IS_ERR(conn->rx_type)) {
+			ERROR("Unhandled reply chunk type %d", conn->rx_type);
+			req->error = -EIO;
+			return tdnbd_rx_skip(conn, conn->rx_length);
+		}
+		if (conn->rx_length < sizeof(uint32_t))
+			return -EPROTO;
+		conn->rx_len = sizeof(uint32_t);
+		break;
+	}
 
+	conn->rx_state = NBD_RX_CHUNK;
+	return 1;
+}
 
 static int
-tdnbd_nbd_negotiate_old(struct tdnbd_data *prv, td_driver_t *driver)
+tdnbd_rx_chunk(struct tdnbd_conn *conn)
 {
-	int rc;
-	char buffer[RECV_BUFFER_SIZE];
-	uint64_t size;
-	uint32_t flags;
-	int padbytes = 124;
-	int sock = prv->socket;
+	struct td_nbd_request *req = conn->rx_req;
+	uint64_t from, start;
+	uint32_t len, error;
+	int i;
 
-	/*
-	 * NBD OLD-style negotiation protocol:
-	 *
-	 * Server sends 'NBDMAGIC'
-	 * then it sends 0x00420281861253L
-	 * then it sends a 64 bit bigendian size <-- YOU ARE HERE
-	 * then it sends a 32 bit bigendian flags
-	 * then it sends 124 bytes of nothing
-	 */
+	memcpy(&from, conn->rx_chunk, sizeof(from));
+	from = be64toh(from);
 
-	/*
-	 * We need to limit the time we spend in this function as we're still
-	 * using blocking IO at this point
-	 */
+	switch (conn->rx_type) {
+	case NBD_REPLY_TYPE_OFFSET_DATA:
+		return tdnbd_rx_data(conn, from,
+				     conn->rx_length - sizeof(from));
 
-	rc = tdnbd_wait_recv(sock, &size, sizeof(size), 0);
-	if (rc < 0) {
-		ERROR("Error in nbd_negotiate: %s", strerror(-rc));
-		goto errout;
+	case NBD_REPLY_TYPE_OFFSET_HOLE:
+		memcpy(&len, conn->rx_chunk + sizeof(from), sizeof(len));
+		len = be32toh(len);
+
+		start = ntohll(req->nreq.from);
+		if (from < start || tdnbd_rx_window(conn, from - start, len))
+			return -EPROTO;
+
+		for (i = 0; i < conn->rx_iovcnt; i++)
+			memset(conn->rx_iov[i].iov_base, 0,
+			       conn->rx_iov[i].iov_len);
+
+		return tdnbd_rx_done(conn);
+
+	default:
+		memcpy(&error, conn->rx_chunk, sizeof(error));
+		error = be32toh(error);
+		ERROR("Error chunk in reply: %d", error);
+		req->error = error ? -(int)error : -EIO;
+
+		return tdnbd_rx_skip(conn, conn->rx_length - sizeof(error));
 	}
-	if (rc < sizeof(size)) {
-		ERROR("Short read in OLD negotiation(3) (%d)\n", rc);
-		goto errout;
+}
+
+/*
+ * Receive the next piece of a reply. Returns 1 when it made progress,
+ * 0 when the socket has nothing more for now, or a negative error code.
+ */
+static int
+tdnbd_receive(struct tdnbd_conn *conn)
+{
+	char buf[RECV_BUFFER_SIZE];
+	struct iovec iov;
+	size_t len, off;
+	int rc;
+
+	switch (conn->rx_state) {
+	case NBD_RX_MAGIC:
+	case NBD_RX_HDR:
+		iov.iov_base = &conn->rx_hdr;
+		iov.iov_len = conn->rx_len;
+		rc = tdnbd_xfer(conn->socket, &iov, 1,
+				&conn->rx_off, conn->rx_len, 0);
+		if (rc)
+			return rc < 0 ? rc : 0;
+
+		if (conn->rx_state == NBD_RX_MAGIC)
+			return tdnbd_rx_magic(conn);
+		return tdnbd_rx_header(conn);
+
+	case NBD_RX_CHUNK:
+		iov.iov_base = conn->rx_chunk;
+		iov.iov_len = conn->rx_len;
+		rc = tdnbd_xfer(conn->socket, &iov, 1,
+				&conn->rx_off, conn->rx_len, 0);
+		if (rc)
+			return rc < 0 ? rc : 0;
+
+		return tdnbd_rx_chunk(conn);
+
+	case NBD_RX_DATA:
+		rc = tdnbd_xfer(conn->socket, conn->rx_iov, conn->rx_iovcnt,
+				&conn->rx_off, conn->rx_len, 0);
+		if (rc)
+			return rc < 0 ? rc : 0;
+
+		return tdnbd_rx_done(conn);
+
+	case NBD_RX_SKIP:
+		while (conn->rx_off < conn->rx_len) {
+			len = conn->rx_len - conn->rx_off;
+			if (len > sizeof(buf))
+				len = sizeof(buf);
+
+			off = 0;
+			iov.iov_base = buf;
+			iov.iov_len = len;
+			rc = tdnbd_xfer(conn->socket, &iov, 1, &off, len, 0);
+			conn->rx_off += off;
+			if (rc)
+				return rc < 0 ? rc : 0;
+		}
+
+		return tdnbd_rx_done(conn);
 	}
 
-	INFO("Got size: %"PRIu64"", ntohll(size));
+	return -EPROTO;
+}
+
+static void
+tdnbd_reader_cb(event_id_t eb, char mode, void *data)
+{
+	struct tdnbd_conn *conn = data;
+	int rc;
 
-	driver->info.size = ntohll(size) >> SECTOR_SHIFT;
-	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
-	driver->info.info = 0;
+	do {
+		rc = tdnbd_receive(conn);
+	} while (rc > 0);
 
-	rc = tdnbd_wait_recv(sock, &flags, sizeof(flags), 0);
-	if (rc < 0) {
-		ERROR("Error in nbd_negotiate: %s", strerror(-rc));
-		goto errout;
+	if (rc < 0)
+		tdnbd_conn_lost(conn, rc);
+}
+
+static int
+tdnbd_conn_start(struct tdnbd_conn *conn, int sock)
+{
+	conn->socket = sock;
+	tdnbd_rx_reset(conn);
+
+	conn->reader_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+				conn->socket, TV_ZERO,
+				tdnbd_reader_cb,
+				conn);
+	if (conn->reader_event_id < 0) {
+		ERROR("Could not register the reader: %d",
+		      conn->reader_event_id);
+		close(sock);
+		conn->socket = -1;
+		return conn->reader_event_id;
 	}
-	if (rc < sizeof(flags)) {
-		ERROR("Short read in OLD negotiation(4) (%d)\n", rc);
-		goto errout;
+
+	if (!list_empty(&conn->pending_reqs))
+		enable_write_queue(conn);
+
+	return 0;
+}
+
+/*
+ * Start connecting a non-blocking socket to the export, over TCP if we
+ * have an address for it, else over its UNIX domain socket. Returns
+ * the socket, with *pending set if the connection is still in
+ * progress, or -1.
+ */
+static int
+tdnbd_connect_start(struct tdnbd_data *prv, int *pending)
+{
+	struct sockaddr *addr;
+	socklen_t len;
+	int sock, opt = 1, rc;
+
+	if (prv->remote) {
+		addr = (struct sockaddr *)prv->remote;
+		len = sizeof(struct sockaddr_in);
+		sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	} else {
+		addr = (struct sockaddr *)&prv->remote_un;
+		len = strlen(prv->remote_un.sun_path)
+			+ sizeof(prv->remote_un.sun_family);
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
 	}
 
-	INFO("Got flags: %"PRIu32"", ntohl(flags));
+	if (sock < 0) {
+		ERROR("Could not create socket: %s\n", strerror(errno));
+		return -1;
+	}
 
-	while (padbytes > 0) {
-		rc = tdnbd_wait_recv(sock, buffer, padbytes, 0);
+	if (prv->remote) {
+		rc = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt,
+				sizeof(opt));
 		if (rc < 0) {
-			ERROR("Error in nbd_negotiate: %s", strerror(-rc));
-			goto errout;
+			ERROR("Could not set TCP_NODELAY: %s\n", strerror(errno));
+			goto fail;
 		}
-		padbytes -= rc;
 	}
 
 	rc = fcntl(sock, F_SETFL, O_NONBLOCK);
+	if (rc < 0)
+		goto fail;
 
-	if (rc != 0) {
-		ERROR("Could not set O_NONBLOCK flag");
-		goto errout;
+	rc = connect(sock, addr, len);
+	*pending = rc < 0 && errno == EINPROGRESS;
+	if (rc < 0 && !*pending) {
+		ERROR("Could not connect to peer: %s\n", strerror(errno));
+		goto fail;
 	}
-	INFO("Successfully connected to Old-style NBD server");
 
-	return 0;
+	return sock;
 
-errout:
+fail:
 	close(sock);
 	return -1;
 }
 
-static int
-tdnbd_nbd_negotiate_new(struct tdnbd_data *prv, td_driver_t *driver)
-{
-	int rc;
-	uint16_t gflags;
-	uint32_t cflags = htobe32(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
-	int sock = prv->socket;
+/* -- non-blocking negotiation -- */
 
-	/*
-	 * NBD NEW-style negotiation protocol:
-	 *
-	 * Server sends 'NBDMAGIC'
-	 * then it sends 'IHAVEOPT'
-	 * then it sends 16 bits of server handshake flags <-- YOU ARE HERE
-	 * then it expects 32 bits of client handshake flags
-	 * then we send additional options
-	 */
+static void tdnbd_hs_cb(event_id_t id, char mode, void *data);
 
-	/* Receive NBD flags */
-	rc = tdnbd_wait_recv(sock, &gflags, sizeof(gflags), 0);
-	if (rc < 0) {
-		ERROR("Error in nbd_negotiate: %s", strerror(-rc));
-		goto errout;
+static void
+tdnbd_hs_abort(struct tdnbd_conn *conn)
+{
+	if (conn->hs_event_id >= 0) {
+		tapdisk_server_unregister_event(conn->hs_event_id);
+		conn->hs_event_id = -1;
 	}
-	if (rc < sizeof(gflags)) {
-		ERROR("Short read in NEW negotiation(3) (%d)\n", rc);
-		goto errout;
+
+	if (conn->hs_socket >= 0) {
+		close(conn->hs_socket);
+		conn->hs_socket = -1;
 	}
+}
 
-	/* Send back flags*/
-	rc = send(sock, &cflags, sizeof(cflags), 0);
-	if (rc < sizeof(cflags)) {
-		ERROR("Failed to send client flags");
-		goto errout;
+/* wait for the socket to become readable, or writable */
+static int
+tdnbd_hs_wait(struct tdnbd_conn *conn, char mode)
+{
+	if (conn->hs_event_id >= 0) {
+		if (conn->hs_event_mode == mode)
+			return 0;
+
+		tapdisk_server_unregister_event(conn->hs_event_id);
 	}
 
-	return negotiate_client_newstyle_options(sock, driver);
+	conn->hs_event_id =
+		tapdisk_server_register_event(mode, conn->hs_socket, TV_ZERO,
+					      tdnbd_hs_cb, conn);
+	if (conn->hs_event_id < 0)
+		return conn->hs_event_id;
 
-errout:
-	close(sock);
-	return -1;
+	conn->hs_event_mode = mode;
+	return 0;
 }
 
+static void
+tdnbd_hs_expect(struct tdnbd_conn *conn, int state, size_t len)
+{
+	conn->hs_state = state;
+	conn->hs_off = 0;
+	conn->hs_len = len;
+}
+
+static void
+tdnbd_hs_send(struct tdnbd_conn *conn, const void *buf, size_t len)
+{
+	memcpy(conn->hs_tx + conn->hs_tx_len, buf, len);
+	conn->hs_tx_len += len;
+}
+
+static void
+tdnbd_hs_send_option(struct tdnbd_conn *conn, uint32_t opt,
+		     const void *data, uint32_t len)
+{
+	struct nbd_new_option option;
+
+	option.version = htobe64(NBD_OPT_MAGIC);
+	option.option = htobe32(opt);
+	option.optlen = htobe32(len);
+
+	tdnbd_hs_send(conn, &option, sizeof(option));
+	tdnbd_hs_send(conn, data, len);
+}
+
+static void
+tdnbd_hs_export_name(struct tdnbd_conn *conn)
+{
+	static const char exportname[] = NBD_FIXED_SINGLE_EXPORT;
+
+	tdnbd_hs_send_option(conn, NBD_OPT_EXPORT_NAME,
+			     exportname, sizeof(exportname));
+	/* NBD_FLAG_NO_ZEROES: size and flags only */
+	tdnbd_hs_expect(conn, NBD_HS_EXPORT, 10);
+}
+
+/*
+ * Act on a complete negotiation step. Returns 1 once the export is
+ * ready, 0 to carry on, or -errno.
+ */
 static int
-tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
+tdnbd_hs_step(struct tdnbd_conn *conn, uint64_t *size, uint16_t *flags)
 {
-	int rc;
+	struct nbd_fixed_new_option_reply *reply;
+	char *buf = conn->hs_buf;
+	uint32_t cflags;
 	uint64_t magic;
-	int sock = prv->socket;
+	uint16_t gflags;
 
-	/* Read the NBD opening magic number, which is the same for all protocol
-	 * versions */
-	rc = tdnbd_wait_recv(sock, &magic, sizeof(magic), 0);
-	if (rc < 0) {
-		ERROR("Error in nbd_negotiate: %s", strerror(-rc));
-		goto errout;
+	switch (conn->hs_state) {
+	case NBD_HS_MAGIC:
+		memcpy(&magic, buf, sizeof(magic));
+		if (be64toh(magic) != NBD_MAGIC)
+			return -EPROTO;
+
+		memcpy(&magic, buf + 8, sizeof(magic));
+		if (be64toh(magic) == NBD_OLD_VERSION)
+			tdnbd_hs_expect(conn, NBD_HS_OLD, 8 + 4 + 124);
+		else if (be64toh(magic) == NBD_OPT_MAGIC)
+			tdnbd_hs_expect(conn, NBD_HS_GFLAGS, sizeof(gflags));
+		else
+			return -EPROTO;
+		return 0;
+
+	case NBD_HS_OLD:
+		memcpy(size, buf, sizeof(*size));
+		*size = be64toh(*size);
+		memcpy(&cflags, buf + 8, sizeof(cflags));
+		*flags = be32toh(cflags) & 0xffff;
+		return 1;
+
+	case NBD_HS_GFLAGS:
+		memcpy(&gflags, buf, sizeof(gflags));
+
+		cflags = htobe32(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+		tdnbd_hs_send(conn, &cflags, sizeof(cflags));
+
+		/* a server without fixed newstyle hangs up on unknown options */
+		if (be16toh(gflags) & NBD_FLAG_FIXED_NEWSTYLE) {
+			tdnbd_hs_send_option(conn, NBD_OPT_STRUCTURED_REPLY,
+					     NULL, 0);
+			tdnbd_hs_expect(conn, NBD_HS_OPT_REPLY, sizeof(*reply));
+		} else
+			tdnbd_hs_export_name(conn);
+		return 0;
+
+	case NBD_HS_OPT_REPLY:
+		reply = (struct nbd_fixed_new_option_reply *)buf;
+		if (be64toh(reply->magic) != NBD_REP_MAGIC ||
+		    be32toh(reply->option) != NBD_OPT_STRUCTURED_REPLY)
+			return -EPROTO;
+
+		conn->hs_skip = be32toh(reply->replylen);
+		/* fall through */
+	case NBD_HS_OPT_DATA:
+		if (conn->hs_state == NBD_HS_OPT_DATA)
+			conn->hs_skip -= conn->hs_len;
+
+		if (conn->hs_skip)
+			tdnbd_hs_expect(conn, NBD_HS_OPT_DATA,
+					conn->hs_skip < NBD_HS_BUF_SIZE ?
+					conn->hs_skip : NBD_HS_BUF_SIZE);
+		else
+			tdnbd_hs_export_name(conn);
+		return 0;
+
+	case NBD_HS_EXPORT:
+		memcpy(size, buf, sizeof(*size));
+		*size = be64toh(*size);
+		memcpy(flags, buf + 8, sizeof(*flags));
+		*flags = be16toh(*flags);
+		return 1;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Move the negotiation on as far as the socket allows. Returns 1 once
+ * the export is ready, 0 when waiting for the socket to become
+ * conn->hs_want, or -errno.
+ */
+static int
+tdnbd_hs_run(struct tdnbd_conn *conn, uint64_t *size, uint16_t *flags)
+{
+	int sock = conn->hs_socket, err;
+	socklen_t len;
+	ssize_t n;
+
+	if (conn->hs_state == NBD_HS_CONNECT) {
+		len = sizeof(err);
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len))
+			return -errno;
+		if (err)
+			return -err;
+
+		tdnbd_hs_expect(conn, NBD_HS_MAGIC, 16);
 	}
-	if (rc < sizeof(magic)) {
-		ERROR("Short read in negotiation(1) (wanted %ld got %d)\n", sizeof(magic), rc);
-		goto errout;
+
+	for (;;) {
+		while (conn->hs_tx_off < conn->hs_tx_len) {
+			n = send(sock, conn->hs_tx + conn->hs_tx_off,
+				 conn->hs_tx_len - conn->hs_tx_off,
+				 MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					conn->hs_want = SCHEDULER_POLL_WRITE_FD;
+					return 0;
+				}
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			conn->hs_tx_off += n;
+		}
+		conn->hs_tx_off = conn->hs_tx_len = 0;
+
+		while (conn->hs_off < conn->hs_len) {
+			n = recv(sock, conn->hs_buf + conn->hs_off,
+				 conn->hs_len - conn->hs_off, MSG_DONTWAIT);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					conn->hs_want = SCHEDULER_POLL_READ_FD;
+					return 0;
+				}
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			if (!n)
+				return -ECONNRESET;
+			conn->hs_off += n;
+		}
+
+		err = tdnbd_hs_step(conn, size, flags);
+		if (err)
+			return err;
 	}
-	if (htonll(NBD_MAGIC) != magic) {
-		ERROR("Error in NBD negotiation: wanted '0x%" PRIx64 "' got '0x%" PRIx64 "'", htonll(NBD_MAGIC), magic);
-		goto errout;
+}
+
+static void
+tdnbd_hs_cb(event_id_t id, char mode, void *data)
+{
+	struct tdnbd_conn *conn = data;
+	struct tdnbd_data *prv = conn->prv;
+	int i = conn - prv->conns, sock, rc;
+	uint64_t size;
+	uint16_t flags;
+
+	rc = tdnbd_hs_run(conn, &size, &flags);
+	if (!rc) {
+		rc = tdnbd_hs_wait(conn, conn->hs_want);
+		if (!rc)
+			return;
 	}
 
-	/* Read the second magic number, which tells us which NBD protocol the
-	 * server is offering. */
-	rc = tdnbd_wait_recv(sock, &magic, sizeof(magic), 0);
 	if (rc < 0) {
-		ERROR("Error in nbd_negotiate: %s", strerror(-rc));
-		goto errout;
+		ERROR("Connection %d: negotiation failed: %s", i,
+		      strerror(-rc));
+		tdnbd_hs_abort(conn);
+		return;
 	}
-	if (rc < sizeof(magic)) {
-		ERROR("Short read in negotiation(2) (wanted %ld got %d)\n", sizeof(magic), rc);
-		goto errout;
+
+	if (size >> SECTOR_SHIFT != prv->driver->info.size) {
+		ERROR("Export size changed from %"PRIu64" to %"PRIu64" sectors",
+		      prv->driver->info.size, size >> SECTOR_SHIFT);
+		tdnbd_hs_abort(conn);
+		return;
 	}
 
-	if (htonll(NBD_OLD_VERSION) == magic)
-		return tdnbd_nbd_negotiate_old(prv, driver);
-	if (htonll(NBD_OPT_MAGIC) == magic)
-		return tdnbd_nbd_negotiate_new(prv, driver);
+	prv->tflags = flags;
 
-	ERROR("Unknown NBD MAGIC 2: Wanted '0x%" PRIx64 "' or '0x%" PRIx64 "', got '0x%" PRIx64 "'",
-			htonll(NBD_OLD_VERSION), htonll(NBD_OPT_MAGIC), magic);
+	sock = conn->hs_socket;
+	conn->hs_socket = -1;
+	tdnbd_hs_abort(conn);
 
-errout:
-	close(sock);
-	return -1;
+	if (tdnbd_conn_start(conn, sock) < 0)
+		return;
+
+	INFO("Connection %d up", i);
 }
 
+/*
+ * Start (re)establishing a connection that is down. The reconnect
+ * timer checks on it, and gives up on it after NBD_CONNECT_TIMEOUT
+ * seconds.
+ */
 static int
-tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
+tdnbd_conn_reopen(struct tdnbd_data *prv, struct tdnbd_conn *conn)
 {
-	int sock;
-	int opt = 1;
-	int rc;
+	int pending, err;
+
+	conn->hs_socket = tdnbd_connect_start(prv, &pending);
+	if (conn->hs_socket < 0)
+		return -1;
+
+	gettimeofday(&conn->hs_started, NULL);
+	conn->hs_state = NBD_HS_CONNECT;
+	conn->hs_tx_off = conn->hs_tx_len = 0;
+
+	err = tdnbd_hs_wait(conn, SCHEDULER_POLL_WRITE_FD);
+	if (err) {
+		ERROR("Could not register the reconnection: %d", err);
+		tdnbd_hs_abort(conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the first connection, on @sock if passed one, already connected,
+ * else on a new one. The same steps as tdnbd_conn_reopen, polled for
+ * here rather than driven by events: the export size is needed before
+ * td_open returns.
+ */
+static int
+tdnbd_conn_open_first(struct tdnbd_data *prv, int sock)
+{
+	struct tdnbd_conn *conn = &prv->conns[0];
+	struct timeval now;
+	struct pollfd pfd;
+	uint64_t size;
+	uint16_t flags;
+	int pending, ms, rc;
 
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (sock < 0) {
-		ERROR("Could not create socket: %s\n", strerror(errno));
+		sock = tdnbd_connect_start(prv, &pending);
+		if (sock < 0)
+			return -1;
+	} else if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK)) {
+		ERROR("Could not set O_NONBLOCK flag");
+		close(sock);
 		return -1;
 	}
 
-	rc = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt,
-			sizeof(opt));
+	conn->hs_socket = sock;
+	gettimeofday(&conn->hs_started, NULL);
+	conn->hs_state = NBD_HS_CONNECT;
+	conn->hs_tx_off = conn->hs_tx_len = 0;
+	conn->hs_want = SCHEDULER_POLL_WRITE_FD;
+
+	do {
+		gettimeofday(&now, NULL);
+		ms = NBD_CONNECT_TIMEOUT * 1000 -
+			(now.tv_sec - conn->hs_started.tv_sec) * 1000 -
+			(now.tv_usec - conn->hs_started.tv_usec) / 1000;
+		if (ms <= 0) {
+			rc = -ETIMEDOUT;
+			break;
+		}
+
+		pfd.fd = sock;
+		pfd.events = conn->hs_want == SCHEDULER_POLL_WRITE_FD ?
+			POLLOUT : POLLIN;
+		rc = poll(&pfd, 1, ms);
+		if (rc < 0 && errno != EINTR) {
+			rc = -errno;
+			break;
+		}
+
+		rc = rc > 0 ? tdnbd_hs_run(conn, &size, &flags) : 0;
+	} while (!rc);
+
 	if (rc < 0) {
-		ERROR("Could not set TCP_NODELAY: %s\n", strerror(errno));
-		close(sock);
+		ERROR("Could not negotiate with the NBD server: %s",
+		      strerror(-rc));
+		tdnbd_hs_abort(conn);
 		return -1;
 	}
 
+	INFO("Negotiated: size %"PRIu64", flags 0x%x", size, flags);
+
+	prv->driver->info.size = size >> SECTOR_SHIFT;
+	prv->driver->info.sector_size = DEFAULT_SECTOR_SIZE;
+	prv->driver->info.info = 0;
+	prv->tflags = flags;
+
+	conn->hs_socket = -1;
+	return tdnbd_conn_start(conn, sock);
+}
+
+static int
+tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
+{
+	int rc;
+
 	prv->remote = (struct sockaddr_in *)malloc(
 			sizeof(struct sockaddr_in));
 	if (!prv->remote) {
 		ERROR("struct sockaddr_in malloc failure\n");
-		close(sock);
 		return -1;
 	}
+	memset(prv->remote, 0, sizeof(struct sockaddr_in));
 	prv->remote->sin_family = AF_INET;
 	rc = inet_pton(AF_INET, prv->peer_ip, &(prv->remote->sin_addr.s_addr));
 	if (rc < 0) {
 		ERROR("Could not create inaddr: %s\n", strerror(errno));
 		free(prv->remote);
 		prv->remote = NULL;
-		close(sock);
 		return -1;
 	}
 	else if (rc == 0) {
 		ERROR("inet_pton parse error\n");
 		free(prv->remote);
 		prv->remote = NULL;
-		close(sock);
 		return -1;
 	}
 	prv->remote->sin_port = htons(prv->port);
 
-	if (connect(sock, (struct sockaddr *)prv->remote,
-				sizeof(struct sockaddr)) < 0) {
-		ERROR("Could not connect to peer: %s\n", strerror(errno));
+	if (tdnbd_conn_open_first(prv, -1) < 0) {
 		free(prv->remote);
-		close(sock);
+		prv->remote = NULL;
 		return -1;
 	}
 
-	prv->socket = sock;
+	return 0;
+}
+
+/*
+ * More connections, when the server says writes acknowledged on one
+ * are visible on all of them. They come up in the background, as if
+ * reconnecting, and the requests go to the first one meanwhile.
+ */
+static void
+tdnbd_open_extra_conns(struct tdnbd_data *prv)
+{
+	int i, n = NBD_DEFAULT_CONNS;
+	char *env;
+
+	if (prv->name || !(prv->tflags & NBD_FLAG_CAN_MULTI_CONN))
+		return;
+
+	env = getenv("TAPDISK3_NBD_CONNECTIONS");
+	if (env)
+		n = atoi(env);
 
-	return tdnbd_nbd_negotiate(prv, driver);
+	if (n > NBD_MAX_CONNS)
+		n = NBD_MAX_CONNS;
+
+	while (prv->nr_conns < n) {
+		if (tdnbd_conn_reopen(prv, &prv->conns[prv->nr_conns]) < 0) {
+			ERROR("Could not open connection %d, carrying on "
+			      "with %d", prv->nr_conns, prv->nr_conns);
+			break;
+		}
+		prv->nr_conns++;
+	}
+
+	if (prv->nr_conns > 1 && tdnbd_watch_conns(prv) < 0) {
+		ERROR("Could not watch the connections, carrying on with 1");
+		for (i = 1; i < prv->nr_conns; i++)
+			tdnbd_hs_abort(&prv->conns[i]);
+		prv->nr_conns = 1;
+	}
+
+	INFO("Opening %d connections", prv->nr_conns);
 }
 
 /* -- interface -- */
@@ -845,6 +1651,7 @@ tdnbd_open(td_driver_t* driver, const char* name,
 	   struct td_vbd_encryption *encryption, td_flag_t flags)
 {
 	struct tdnbd_data *prv;
+	struct tdnbd_conn *conn;
 	char peer_ip[256];
 	int port;
 	int rc;
@@ -859,40 +1666,36 @@ tdnbd_open(td_driver_t* driver, const char* name,
 
 	INFO("Opening nbd export to %s (flags=%x)\n", name, flags);
 
-	prv->writer_event_id = -1;
-	INIT_LIST_HEAD(&prv->sent_reqs);
-	INIT_LIST_HEAD(&prv->pending_reqs);
 	INIT_LIST_HEAD(&prv->free_reqs);
 	for (i = 0; i < MAX_NBD_REQS; i++) {
 		INIT_LIST_HEAD(&prv->requests[i].queue);
-		prv->requests[i].timeout_event = -1;
 		list_add(&prv->requests[i].queue, &prv->free_reqs);
 	}
 	prv->nr_free_count = MAX_NBD_REQS;
-	prv->cur_reply_qio.buffer = (char *)&prv->current_reply;
-	prv->cur_reply_qio.len = sizeof(struct nbd_reply);
+
+	for (i = 0; i < NBD_MAX_CONNS; i++) {
+		conn = &prv->conns[i];
+		conn->prv = prv;
+		conn->socket = -1;
+		conn->writer_event_id = -1;
+		conn->reader_event_id = -1;
+		conn->hs_socket = -1;
+		conn->hs_event_id = -1;
+		INIT_LIST_HEAD(&conn->pending_reqs);
+		INIT_LIST_HEAD(&conn->sent_reqs);
+	}
+	prv->nr_conns = 1;
+	prv->reconnect_event_id = -1;
+	prv->driver = driver;
 
 	bzero(&buf, sizeof(buf));
 	rc = stat(name, &buf);
 	if (!rc && S_ISSOCK(buf.st_mode)) {
-		int len = 0;
-		if ((prv->socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-			ERROR("failed to create UNIX domain socket: %s\n",
-					strerror(errno));
-			return -1;
-		}
 		prv->remote_un.sun_family = AF_UNIX;
 		safe_strncpy(prv->remote_un.sun_path, name, sizeof(prv->remote_un.sun_path));
-		len = strlen(prv->remote_un.sun_path)
-			+ sizeof(prv->remote_un.sun_family);
-		if ((rc = connect(prv->socket, (struct sockaddr*)&prv->remote_un, len)
-					== -1)) {
-			ERROR("failed to connect to %s: %s\n", name, strerror(errno));
-			return -1;
-		}
-		rc = tdnbd_nbd_negotiate(prv, driver);
-		if (rc) {
-			ERROR("failed to negotiate with the NBD server\n");
+
+		if (tdnbd_conn_open_first(prv, -1) < 0) {
+			ERROR("failed to connect to %s\n", name);
 			return -1;
 		}
 	} else {
@@ -910,8 +1713,10 @@ tdnbd_open(td_driver_t* driver, const char* name,
 				return -1;
 
 		} else {
-			prv->socket = tdnbd_retrieve_passed_fd(name);
-			if (prv->socket < 0) {
+			int sock;
+
+			sock = tdnbd_retrieve_passed_fd(name);
+			if (sock < 0) {
 				ERROR("Couldn't find fd named: %s", name);
 				return -1;
 			}
@@ -920,18 +1725,14 @@ tdnbd_open(td_driver_t* driver, const char* name,
 			prv->peer_ip = NULL;
 			prv->name = strdup(name);
 			prv->port = -1;
-			if (tdnbd_nbd_negotiate(prv, driver) < 0) {
+			if (tdnbd_conn_open_first(prv, sock) < 0) {
 				ERROR("Failed to negotiate");
 				return -1;
 			}
 		}
 	}
 
-	prv->reader_event_id =
-		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-				prv->socket, TV_ZERO,
-				tdnbd_reader_cb,
-				(void *)prv);
+	tdnbd_open_extra_conns(prv);
 
 	prv->flags = flags;
 	prv->closed = 0;
@@ -948,43 +1749,67 @@ static int
 tdnbd_close(td_driver_t* driver)
 {
 	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
-	td_request_t treq;
-
-	bzero(&treq, sizeof(treq));
+	struct td_nbd_request *req;
+	struct tdnbd_conn *conn;
+	int i;
 
 	if (prv->closed == 3) {
 		INFO("NBD close: already decided that the connection is dead.");
-		if (prv->socket >= 0)
-			close(prv->socket);
-		prv->socket = -1;
-		return 0;
-	}
+	} else {
+		prv->closed = 1;
 
-	/* Send a close packet */
+		for (i = 0; i < prv->nr_conns && prv->closed != 3; i++) {
+			conn = &prv->conns[i];
+			if (conn->socket < 0)
+				continue;
 
-	INFO("Sending disconnect request");
-	tdnbd_queue_request(prv, TAPDISK_NBD_CMD_DISC, 0, 0, 0, treq, 0);
+			/* Send a close packet */
 
-	INFO("Switching socket to blocking IO mode");
-	fcntl(prv->socket, F_SETFL, fcntl(prv->socket, F_GETFL) & ~O_NONBLOCK);
+			INFO("Sending disconnect request");
+			req = tdnbd_alloc_request(prv, conn,
+						  TAPDISK_NBD_CMD_DISC, 0);
+			if (!req)
+				continue;
 
-	INFO("Writing disconnection request");
-	tdnbd_writer_cb(0, 0, prv);
+			INFO("Switching socket to blocking IO mode");
+			fcntl(conn->socket, F_SETFL,
+			      fcntl(conn->socket, F_GETFL) & ~O_NONBLOCK);
 
-	INFO("Written");
+			INFO("Writing disconnection request");
+			tdnbd_writer_cb(0, 0, conn);
+
+			INFO("Written");
+		}
+
+		if (prv->closed != 3)
+			tdnbd_disable(prv, -EIO);
+	}
+
+	for (i = 0; i < prv->nr_conns; i++) {
+		conn = &prv->conns[i];
+		if (conn->socket < 0)
+			continue;
+
+		if (prv->name && !i)
+			tdnbd_stash_passed_fd(conn->socket, prv->name, 0);
+		else
+			close(conn->socket);
+		conn->socket = -1;
+	}
 
 	if (prv->peer_ip) {
 		free(prv->peer_ip);
 		prv->peer_ip = NULL;
 	}
 
+	if (prv->remote) {
+		free(prv->remote);
+		prv->remote = NULL;
+	}
+
 	if (prv->name) {
-		tdnbd_stash_passed_fd(prv->socket, prv->name, 0);
 		free(prv->name);
-	} else {
-		if (prv->socket >= 0)
-			close(prv->socket);
-		prv->socket = -1;
+		prv->name = NULL;
 	}
 
 	return 0;
@@ -1001,7 +1826,7 @@ tdnbd_queue_read(td_driver_t* driver, td_request_t treq)
 		td_forward_request(treq);
 	else
 		tdnbd_queue_request(prv, TAPDISK_NBD_CMD_READ, offset, treq.buf, size,
-				treq, 0);
+				treq);
 }
 
 static void
@@ -1012,7 +1837,26 @@ tdnbd_queue_write(td_driver_t* driver, td_request_t treq)
 	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
 
 	tdnbd_queue_request(prv, TAPDISK_NBD_CMD_WRITE,
-			offset, treq.buf, size, treq, 0);
+			offset, treq.buf, size, treq);
+}
+
+/*
+ * A FLUSH covers the writes completed before it was sent; with several
+ * connections up, the server advertised NBD_FLAG_CAN_MULTI_CONN, which
+ * extends that to the writes completed on all of them.
+ */
+static void
+tdnbd_queue_sync(td_driver_t *driver, td_request_t treq)
+{
+	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+
+	if (!(prv->tflags & NBD_FLAG_SEND_FLUSH)) {
+		/* nothing volatile on the server */
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	tdnbd_queue_request(prv, TAPDISK_NBD_CMD_FLUSH, 0, NULL, 0, treq);
 }
 
 static int
@@ -1036,6 +1880,7 @@ struct tap_disk tapdisk_nbd = {
 	.td_close           = tdnbd_close,
 	.td_queue_read      = tdnbd_queue_read,
 	.td_queue_write     = tdnbd_queue_write,
+	.td_queue_sync      = tdnbd_queue_sync,
 	.td_get_parent_id   = tdnbd_get_parent_id,
 	.td_validate_parent = tdnbd_validate_parent,
 };
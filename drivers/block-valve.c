@@ -37,7 +37,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
 #include "tapdisk.h"
@@ -56,6 +60,9 @@ struct td_valve_request {
 	td_request_t            treq;
 	int                     secs;
 
+	int                     gntd; /* paid for through the socket */
+	uint64_t                ts;   /* forwarded, when timed */
+
 	struct list_head        entry;
 	td_valve_t             *valve;
 };
@@ -63,6 +70,7 @@ struct td_valve_request {
 struct td_valve_stats {
 	unsigned long long      stor;
 	unsigned long long      forw;
+	unsigned long long      shm;
 };
 
 struct td_valve {
@@ -74,18 +82,24 @@ struct td_valve {
 
 	event_id_t              sched_id;
 	event_id_t              retry_id;
+	event_id_t              lat_id;
 
 	unsigned int            cred;
 	unsigned int            need;
 	unsigned int            done;
 
+	struct td_rlb_shm      *shm;
+	unsigned int            pcred;
+
 	struct list_head        stor;
 	struct list_head        forw;
 
-	td_valve_request_t      reqv[MAX_REQUESTS];
-	td_valve_request_t     *free[MAX_REQUESTS];
+	td_valve_request_t      reqv[TAPDISK_DATA_REQUESTS];
+	td_valve_request_t     *free[TAPDISK_DATA_REQUESTS];
 	int                     n_free;
 
+	unsigned long           lat_hist[TD_VALVE_LAT_BUCKETS];
+
 	struct td_valve_stats   stats;
 };
 
@@ -97,13 +111,28 @@ struct td_valve {
 
 #define TD_VALVE_CONNECT_INTERVAL 2 /* s */
 
+/*
+ * Credit taken from a shared bucket ahead of need, so a burst of small
+ * requests doesn't debit it every time. Never more than a fraction of
+ * the bucket size, which would starve the other valves.
+ */
+#define TD_VALVE_PREFETCH         (256 << 10)
+#define TD_VALVE_PREFETCH_DIV     8
+
 #define TD_VALVE_RDLIMIT  (1<<0)
 #define TD_VALVE_WRLIMIT  (1<<1)
 #define TD_VALVE_KILLED   (1<<31)
 
+#define TD_VALVE_LATENCY  (1<<2)
+
+#define TD_VALVE_LIMITS   (TD_VALVE_RDLIMIT|TD_VALVE_WRLIMIT)
+
+#define TD_VALVE_LAT_INTERVAL 100000 /* us */
+
 static void valve_schedule_retry(td_valve_t *);
 static void valve_conn_receive(td_valve_t *);
-static void valve_conn_request(td_valve_t *, unsigned long);
+static void valve_conn_request(td_valve_t *, unsigned long, int);
+static void valve_conn_report(td_valve_t *);
 static void valve_forward_stored_requests(td_valve_t *);
 static void valve_kill(td_valve_t *);
 
@@ -189,12 +218,104 @@ __valve_sched_event(event_id_t id, char mode, void *private)
 
 	if (likely(valve->done > 0))
 		/* flush valve->done */
-		valve_conn_request(valve, 0);
+		valve_conn_request(valve, 0, TD_OP_WRITE);
+}
+
+static void
+valve_shm_unmap(td_valve_t *valve)
+{
+	struct td_rlb_shm *shm = valve->shm;
+
+	if (!shm)
+		return;
+
+	/* hand back what we prefetched */
+	if (valve->pcred && __atomic_load_n(&shm->enabled, __ATOMIC_ACQUIRE))
+		td_rlb_bucket_give(&shm->bucket, valve->pcred);
+
+	valve->pcred = 0;
+
+	munmap(shm, sizeof(*shm));
+	valve->shm = NULL;
+
+	valve->flags &= ~(TD_VALVE_LIMITS|TD_VALVE_LATENCY);
+	valve->flags |= TD_VALVE_WRLIMIT;
+}
+
+static void
+valve_shm_map(td_valve_t *valve, const char *sockpath)
+{
+	struct td_rlb_shm *shm;
+	char path[PATH_MAX];
+	unsigned int limits;
+	struct stat st;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s%s", sockpath, TD_RLB_SHM_SUFFIX);
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		/* bridge doesn't share a bucket */
+		if (errno != ENOENT)
+			PERROR("%s", path);
+		return;
+	}
+
+	err = fstat(fd, &st);
+	if (err || st.st_size < sizeof(*shm))
+		goto out;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		PERROR("mmap(%s)", path);
+		goto out;
+	}
+
+	if (shm->magic != TD_RLB_SHM_MAGIC ||
+	    shm->version != TD_RLB_SHM_VERSION) {
+		WARN("%s: unsupported format", path);
+		munmap(shm, sizeof(*shm));
+		goto out;
+	}
+
+	valve->shm   = shm;
+	valve->pcred = 0;
+
+	/* what td-rated wants to see */
+	limits = __atomic_load_n(&shm->limits, __ATOMIC_ACQUIRE);
+
+	valve->flags &= ~TD_VALVE_LIMITS;
+	if (limits & TD_RLB_LIMIT_READ)
+		valve->flags |= TD_VALVE_RDLIMIT;
+	if (limits & TD_RLB_LIMIT_WRITE)
+		valve->flags |= TD_VALVE_WRLIMIT;
+	if (limits & TD_RLB_REPORT_LATENCY)
+		valve->flags |= TD_VALVE_LATENCY;
+
+	INFO("Sharing credit through %s, limits %#x", path, limits);
+out:
+	close(fd);
+}
+
+static void
+__valve_lat_event(event_id_t id, char mode, void *private)
+{
+	td_valve_t *valve = private;
+
+	valve_conn_report(valve);
 }
 
 static void
 valve_sock_close(td_valve_t *valve)
 {
+	valve_shm_unmap(valve);
+
+	if (valve->lat_id >= 0) {
+		tapdisk_server_unregister_event(valve->lat_id);
+		valve->lat_id = -1;
+	}
+
 	if (valve->sock >= 0) {
 		close(valve->sock);
 		valve->sock = -1;
@@ -267,6 +388,23 @@ valve_sock_open(td_valve_t *valve)
 
 	INFO("Connected to %s", addr.sun_path);
 
+	valve_shm_map(valve, addr.sun_path);
+
+	if (valve->flags & TD_VALVE_LATENCY) {
+		memset(valve->lat_hist, 0, sizeof(valve->lat_hist));
+
+		id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						   -1, TV_USECS(TD_VALVE_LAT_INTERVAL),
+						   __valve_lat_event,
+						   valve);
+		if (id < 0) {
+			err = id;
+			goto fail;
+		}
+
+		valve->lat_id = id;
+	}
+
 	valve->cred = 0;
 	valve->need = 0;
 	valve->done = 0;
@@ -419,7 +557,7 @@ kill:
 }
 
 static void
-valve_conn_request(td_valve_t *valve, unsigned long size)
+valve_conn_request(td_valve_t *valve, unsigned long size, int op)
 {
 	struct td_valve_req _req;
 	int err;
@@ -427,6 +565,9 @@ valve_conn_request(td_valve_t *valve, unsigned long size)
 	_req.need    = size;
 	_req.done    = valve->done;
 
+	if (size && op == TD_OP_READ)
+		_req.need |= TD_VALVE_REQ_READ;
+
 	valve->need += size;
 	valve->done  = 0;
 
@@ -440,8 +581,77 @@ valve_conn_request(td_valve_t *valve, unsigned long size)
 	valve_conn_reset(valve);
 }
 
+static void
+valve_conn_report(td_valve_t *valve)
+{
+	struct td_valve_req msg[TD_VALVE_LAT_BUCKETS];
+	int i, n, err;
+
+	n = 0;
+
+	for (i = 0; i < TD_VALVE_LAT_BUCKETS; i++) {
+		if (!valve->lat_hist[i])
+			continue;
+
+		msg[n].need = TD_VALVE_REQ_LATENCY | i;
+		msg[n].done = valve->lat_hist[i];
+		valve->lat_hist[i] = 0;
+		n++;
+	}
+
+	if (!n)
+		return;
+
+	err = valve_sock_send(valve, msg, n * sizeof(msg[0]));
+	if (!err)
+		return;
+
+	VERR(err, "resetting connection");
+	valve_conn_reset(valve);
+}
+
+static int
+valve_shm_expend(td_valve_t *valve, unsigned long size)
+{
+	struct td_rlb_shm *shm = valve->shm;
+	struct td_rlb_bucket *b;
+	long long want, pref;
+
+	if (valve->pcred >= size) {
+		valve->pcred -= size;
+		return 0;
+	}
+
+	if (!shm ||
+	    !__atomic_load_n(&shm->enabled, __ATOMIC_ACQUIRE) ||
+	    __atomic_load_n(&shm->waiters, __ATOMIC_ACQUIRE))
+		return -EAGAIN;
+
+	b = &shm->bucket;
+	td_rlb_bucket_refill(b, td_rlb_now_ns());
+
+	want = size - valve->pcred;
+
+	pref = __atomic_load_n(&b->cap, __ATOMIC_RELAXED);
+	pref /= TD_VALVE_PREFETCH_DIV;
+	if (pref > TD_VALVE_PREFETCH)
+		pref = TD_VALVE_PREFETCH;
+
+	if (pref > 0 && !td_rlb_bucket_take(b, want + pref))
+		valve->pcred = pref;
+	else if (!td_rlb_bucket_take(b, want))
+		valve->pcred = 0;
+	else
+		return -EAGAIN;
+
+	valve->stats.shm++;
+
+	return 0;
+}
+
 static int
-valve_expend_request(td_valve_t *valve, const td_request_t treq)
+valve_expend_request(td_valve_t *valve, const td_request_t treq,
+		     int shared)
 {
 	if (valve->flags & TD_VALVE_KILLED)
 		return 0;
@@ -449,12 +659,19 @@ valve_expend_request(td_valve_t *valve, const td_request_t treq)
 	if (valve->sock < 0)
 		return 0;
 
-	if (valve->cred < TREQ_SIZE(treq))
-		return -EAGAIN;
+	if (valve->cred >= TREQ_SIZE(treq)) {
+		valve->cred -= TREQ_SIZE(treq);
+		return 0;
+	}
 
-	valve->cred -= TREQ_SIZE(treq);
+	/*
+	 * Stored requests asked td-rated already, and will be
+	 * paid for through the socket.
+	 */
+	if (shared)
+		return valve_shm_expend(valve, TREQ_SIZE(treq));
 
-	return 0;
+	return -EAGAIN;
 }
 
 static void
@@ -466,8 +683,16 @@ __valve_complete_treq(td_request_t treq, int error)
 	BUG_ON(req->secs < treq.secs);
 	req->secs -= treq.secs;
 
-	valve->done += TREQ_SIZE(treq);
-	valve_set_done_pending(valve);
+	if (req->gntd) {
+		valve->done += TREQ_SIZE(treq);
+		valve_set_done_pending(valve);
+	}
+
+	if (req->ts && (valve->flags & TD_VALVE_LATENCY)) {
+		uint64_t us = (td_rlb_now_ns() - req->ts) / 1000;
+
+		valve->lat_hist[td_valve_lat_bucket(us)]++;
+	}
 
 	/* Respond to original callback */
 	treq.cb = req->treq.cb;
@@ -479,29 +704,40 @@ __valve_complete_treq(td_request_t treq, int error)
 	}
 }
 
+static void
+valve_forward_request(td_valve_t *valve, td_valve_request_t *req)
+{
+	td_request_t clone;
+
+	clone         = req->treq;
+	clone.cb      = __valve_complete_treq;
+	clone.cb_data = req;
+
+	req->ts = 0;
+	if (valve->flags & TD_VALVE_LATENCY)
+		req->ts = td_rlb_now_ns();
+
+	list_move(&req->entry, &valve->forw);
+	/* 'list_move' must be run before td_forward_request.
+	 * 'req' may already be freed when td_forward_request returned.
+	 */
+	td_forward_request(clone);
+	valve->stats.forw++;
+}
+
 static void
 valve_forward_stored_requests(td_valve_t *valve)
 {
 	td_valve_request_t *req, *next;
-	td_request_t clone;
 	int err;
 
 	td_valve_for_each_stored_request(req, next, valve) {
 
-		err = valve_expend_request(valve, req->treq);
+		err = valve_expend_request(valve, req->treq, 0);
 		if (err)
 			break;
 
-		clone         = req->treq;
-		clone.cb      = __valve_complete_treq;
-		clone.cb_data = req;
-
-		list_move(&req->entry, &valve->forw);
-		/* 'list_move' must be run before td_forward_request.
-		 * 'req' may already be freed when td_forward_request returned.
-		 */
-		td_forward_request(clone);
-		valve->stats.forw++;
+		valve_forward_request(valve, req);
 	}
 }
 
@@ -514,10 +750,11 @@ valve_store_request(td_valve_t *valve, td_request_t treq)
 	if (!req)
 		return -EBUSY;
 
-	valve_conn_request(valve, TREQ_SIZE(treq));
+	valve_conn_request(valve, TREQ_SIZE(treq), treq.op);
 
 	req->treq = treq;
 	req->secs = treq.secs;
+	req->gntd = 1;
 
 	list_add_tail(&req->entry, &valve->stor);
 	valve->stats.stor++;
@@ -547,6 +784,7 @@ valve_init(td_valve_t *valve, unsigned long flags)
 
 	valve->retry_id = -1;
 	valve->sched_id = -1;
+	valve->lat_id   = -1;
 
 	valve->flags    = flags;
 
@@ -606,6 +844,7 @@ static void
 td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 {
 	td_valve_t *valve = driver->data;
+	td_valve_request_t *req;
 	int err;
 
 	switch (treq.op) {
@@ -626,7 +865,7 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 		BUG();
 	}
 
-	err = valve_expend_request(valve, treq);
+	err = valve_expend_request(valve, treq, list_empty(&valve->stor));
 	if (!err)
 		goto forward;
 
@@ -637,6 +876,19 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 	return;
 
 forward:
+	/* timed even if not limited, for the whole picture */
+	if (valve->flags & TD_VALVE_LATENCY) {
+		req = valve_alloc_request(valve);
+		if (req) {
+			req->treq = treq;
+			req->secs = treq.secs;
+			req->gntd = 0;
+
+			valve_forward_request(valve, req);
+			return;
+		}
+	}
+
 	td_forward_request(treq);
 	valve->stats.forw++;
 }
@@ -654,6 +906,37 @@ td_valve_validate_parent(td_driver_t *driver,
 	return -EINVAL;
 }
 
+/*
+ * Credit left in td-rated's buckets, as of now.
+ */
+static void
+valve_shm_stats(td_valve_t *valve, td_stats_t *st)
+{
+	static const char *names[TD_RLB_LEVELS] = TD_RLB_LEVEL_NAMES;
+	struct td_rlb_shm *shm = valve->shm;
+	unsigned int levels;
+	uint64_t now;
+	int i;
+
+	now    = td_rlb_now_ns();
+	levels = __atomic_load_n(&shm->levels, __ATOMIC_ACQUIRE);
+
+	tapdisk_stats_field(st, "rated", "{");
+
+	if (__atomic_load_n(&shm->enabled, __ATOMIC_ACQUIRE))
+		tapdisk_stats_field(st, "bucket", "lld",
+				    (long long)td_rlb_bucket_level(&shm->bucket,
+								   now));
+
+	for (i = 0; i < TD_RLB_LEVELS; i++)
+		if (levels & (1 << i))
+			tapdisk_stats_field(st, names[i], "lld",
+					    (long long)td_rlb_bucket_level(&shm->level[i],
+									   now));
+
+	tapdisk_stats_leave(st, '}');
+}
+
 static void
 td_valve_stats(td_driver_t *driver, td_stats_t *st)
 {
@@ -668,6 +951,20 @@ td_valve_stats(td_driver_t *driver, td_stats_t *st)
 	tapdisk_stats_field(st, "need", "d", valve->need);
 	tapdisk_stats_field(st, "done", "d", valve->done);
 
+	/*
+	 * shared is [ prefetched, total-debits ], if there is a
+	 * shared bucket
+	 */
+
+	if (valve->shm) {
+		tapdisk_stats_field(st, "shared", "[");
+		tapdisk_stats_val(st, "d", valve->pcred);
+		tapdisk_stats_val(st, "llu", valve->stats.shm);
+		tapdisk_stats_leave(st, ']');
+
+		valve_shm_stats(valve, st);
+	}
+
 	/*
 	 * stored is [ waiting, total-waits ]
 	 */
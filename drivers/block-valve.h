@@ -31,8 +31,12 @@
 #ifndef _TAPDISK_VALVE_H_
 #define _TAPDISK_VALVE_H_
 
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
 #define TD_VALVE_SOCKDIR          "/var/run/blktap/ratelimit"
-#define TD_RLB_CONN_MAX           1024
+#define TD_RLB_CONN_MAX           65536
 #define TD_RLB_REQUEST_MAX        (8 << 20)
 
 struct td_valve_req {
@@ -40,4 +44,209 @@ struct td_valve_req {
 	unsigned long done;
 };
 
+/*
+ * Tags a read in td_valve_req.need. Each request with a non-zero need
+ * is one I/O. Valves only limit reads if told so, below; otherwise
+ * they only send writes.
+ */
+#define TD_VALVE_REQ_READ         (1UL << (8 * sizeof(unsigned long) - 1))
+
+/*
+ * Completion latency, reported only when the bridge asks for it
+ * (TD_RLB_REPORT_LATENCY). Each message carries a histogram bucket in
+ * need, tagged, and the number of completions which fell into it in
+ * done. Buckets are a quarter of an octave wide, in microseconds.
+ */
+#define TD_VALVE_REQ_LATENCY      (1UL << (8 * sizeof(unsigned long) - 2))
+#define TD_VALVE_LAT_BUCKETS      104 /* up to ~64s */
+
+static inline unsigned int
+td_valve_lat_bucket(uint64_t us)
+{
+	unsigned int msb, b;
+
+	if (us < 4)
+		return us;
+
+	msb = 63 - __builtin_clzll(us);
+	b   = 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+
+	return b < TD_VALVE_LAT_BUCKETS ? b : TD_VALVE_LAT_BUCKETS - 1;
+}
+
+/* upper bound of a bucket, in microseconds */
+static inline uint64_t
+td_valve_lat_usec(unsigned int b)
+{
+	unsigned int msb;
+
+	if (b < 4)
+		return b;
+
+	msb = b / 4 + 1;
+
+	return ((uint64_t)(4 + b % 4 + 1) << (msb - 2)) - 1;
+}
+
+/*
+ * A td-rated running a token bucket publishes it in a file next to its
+ * socket, <socket>.shm. Valves debit the bucket directly and only fall
+ * back to the socket protocol above when it runs dry, or when other
+ * valves are already queued there (td-rated keeps 'waiters' up to
+ * date), so a valve can't jump that queue.
+ *
+ * Nobody has to wake up to refill: whoever finds the refill clock
+ * behind claims the elapsed interval with a compare-and-swap and adds
+ * the credit it earned.
+ */
+
+#define TD_RLB_SHM_SUFFIX         ".shm"
+#define TD_RLB_SHM_MAGIC          0x7472626b /* "trbk" */
+#define TD_RLB_SHM_VERSION        2
+
+/* I/O valves should send, td_rlb_shm.limits */
+#define TD_RLB_LIMIT_READ         (1 << 0)
+#define TD_RLB_LIMIT_WRITE        (1 << 1)
+#define TD_RLB_REPORT_LATENCY     (1 << 2)
+
+/* td-rated buckets published for information, td_rlb_shm.level[] */
+enum {
+	TD_RLB_LEVEL_READ_IOPS = 0,
+	TD_RLB_LEVEL_READ_BPS,
+	TD_RLB_LEVEL_WRITE_IOPS,
+	TD_RLB_LEVEL_WRITE_BPS,
+	TD_RLB_LEVEL_BURST_IOPS,
+	TD_RLB_LEVEL_BURST_BPS,
+	TD_RLB_LEVELS
+};
+
+#define TD_RLB_LEVEL_NAMES {						\
+		"read_iops", "read_bps", "write_iops", "write_bps",	\
+		"burst_iops", "burst_bps" }
+
+struct td_rlb_bucket {
+	int64_t       rate;     /* B/s */
+	int64_t       cap;      /* B */
+	int64_t       cred;     /* B, negative while in debt */
+	uint64_t      ts;       /* refill clock, CLOCK_MONOTONIC ns */
+};
+
+struct td_rlb_shm {
+	uint32_t      magic;
+	uint32_t      version;
+	uint32_t      enabled;  /* bucket may be debited directly */
+	uint32_t      waiters;  /* connections waiting for credit */
+	uint32_t      limits;   /* TD_RLB_LIMIT_* */
+	uint32_t      levels;   /* valid level[] entries, 1 << TD_RLB_LEVEL_* */
+
+	struct td_rlb_bucket bucket __attribute__((aligned(64)));
+
+	/* td-rated's own, debited by td-rated only */
+	struct td_rlb_bucket level[TD_RLB_LEVELS] __attribute__((aligned(64)));
+};
+
+static inline uint64_t
+td_rlb_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+td_rlb_bucket_refill(struct td_rlb_bucket *b, uint64_t now)
+{
+	int64_t rate, cap, cred, fill;
+	uint64_t ts, us, max_us, next;
+
+	rate = __atomic_load_n(&b->rate, __ATOMIC_RELAXED);
+	cap  = __atomic_load_n(&b->cap, __ATOMIC_RELAXED);
+	ts   = __atomic_load_n(&b->ts, __ATOMIC_ACQUIRE);
+
+	if (rate <= 0 || now <= ts)
+		return;
+
+	/* max time needed to refill up to cap */
+
+	cred   = __atomic_load_n(&b->cred, __ATOMIC_RELAXED);
+	max_us = cap > cred ? cap - cred : 0;
+	max_us = (max_us * 1000000 + rate - 1) / rate;
+
+	us = (now - ts) / 1000;
+	if (us >= max_us) {
+		fill = max_us * rate / 1000000;
+		next = now;
+	} else {
+		/* advance the clock only by what was turned into credit */
+		fill = us * rate / 1000000;
+		next = ts + fill * 1000000 / rate * 1000;
+	}
+
+	if (!fill && next != now)
+		return;
+
+	if (!__atomic_compare_exchange_n(&b->ts, &ts, next, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return; /* someone else got there first */
+
+	cred = __atomic_add_fetch(&b->cred, fill, __ATOMIC_ACQ_REL);
+
+	/* up to cap */
+
+	while (cred > cap)
+		if (__atomic_compare_exchange_n(&b->cred, &cred, cap, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			break;
+}
+
+/*
+ * Credit a bucket would hold if refilled now, without refilling it.
+ */
+static inline int64_t
+td_rlb_bucket_level(const struct td_rlb_bucket *b, uint64_t now)
+{
+	int64_t rate, cap, cred;
+	uint64_t ts, us;
+
+	rate = __atomic_load_n(&b->rate, __ATOMIC_RELAXED);
+	cap  = __atomic_load_n(&b->cap, __ATOMIC_RELAXED);
+	ts   = __atomic_load_n(&b->ts, __ATOMIC_ACQUIRE);
+	cred = __atomic_load_n(&b->cred, __ATOMIC_RELAXED);
+
+	if (rate <= 0 || now <= ts || cred >= cap)
+		return cred;
+
+	us = (now - ts) / 1000;
+	if (us >= (uint64_t)(cap - cred) * 1000000 / rate)
+		return cap;
+
+	return cred + us * rate / 1000000;
+}
+
+/*
+ * Takes @size bytes of credit, or none if that would put the bucket
+ * in debt. Only td-rated itself grants on credit.
+ */
+static inline int
+td_rlb_bucket_take(struct td_rlb_bucket *b, int64_t size)
+{
+	int64_t cred;
+
+	cred = __atomic_sub_fetch(&b->cred, size, __ATOMIC_ACQ_REL);
+	if (cred >= 0)
+		return 0;
+
+	__atomic_add_fetch(&b->cred, size, __ATOMIC_ACQ_REL);
+	return -EAGAIN;
+}
+
+static inline void
+td_rlb_bucket_give(struct td_rlb_bucket *b, int64_t size)
+{
+	__atomic_add_fetch(&b->cred, size, __ATOMIC_ACQ_REL);
+}
+
 #endif /* _TAPDISK_VALVE_H_ */
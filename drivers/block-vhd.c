@@ -59,6 +59,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <uuid/uuid.h> /* For whatever reason, Linux packages this in */
                        /* e2fsprogs-devel.                            */
@@ -75,6 +76,8 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-server.h"
+#include "timeout-math.h"
 #include "block-crypto.h"
 
 unsigned int SPB;
@@ -115,6 +118,20 @@ unsigned int SPB;
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
+/*
+ * Ciphertext buffers are carved out of a preallocated arena, in runs
+ * of contiguous slots, a slot per data request. First fit fragments
+ * the arena, so a run as large as any write (a data block, or
+ * VHD_CRYPTO_RSV_SECS for fixed images) is held in reserve behind it.
+ * A write finding no run in the arena takes the reserve, and so never
+ * waits on more than the one write holding it.
+ */
+#define VHD_CRYPTO_SLOT_SECS         8
+#define VHD_CRYPTO_SLOT_SIZE         (VHD_CRYPTO_SLOT_SECS << VHD_SECTOR_SHIFT)
+#define VHD_CRYPTO_RSV_SECS          4096
+
+#define VHD_BATLOG_ZERO_SIZE         (64 << 10)
+
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
 #define VHD_OP_DATA_WRITE            2
@@ -123,6 +140,10 @@ unsigned int SPB;
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
 #define VHD_OP_BLOCK_STATUS          7
+#define VHD_OP_ZERO_PROBE            8
+#define VHD_OP_COR_READ              9
+#define VHD_OP_BATLOG_CKPT          10
+#define VHD_OP_SYNC                 11
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -131,6 +152,11 @@ unsigned int SPB;
 #define VHD_BM_NOT_CACHED            4
 #define VHD_BM_READ_PENDING          5
 
+#define VHD_BS_UNKNOWN               0
+#define VHD_BS_EMPTY                 1
+#define VHD_BS_FULL                  2
+#define VHD_BS_MIXED                 3
+
 #define VHD_FLAG_OPEN_RDONLY         1
 #define VHD_FLAG_OPEN_NO_CACHE       2
 #define VHD_FLAG_OPEN_QUIET          4
@@ -139,6 +165,9 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 #define VHD_FLAG_OPEN_NO_O_DIRECT    64
 #define VHD_FLAG_OPEN_LOCAL_CACHE    128
+#define VHD_FLAG_OPEN_ELIDE_ZEROS    256
+#define VHD_FLAG_OPEN_BAT_LOG        512
+#define VHD_FLAG_OPEN_COR            1024
 
 #define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
@@ -152,11 +181,47 @@ unsigned int SPB;
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_COR_PENDING     16
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
 
-typedef uint8_t vhd_flag_t;
+typedef uint16_t vhd_flag_t;
+
+/*
+ * Copy-on-read: reads forwarded to the parent chain are counted per
+ * block, and once a block has been read more than 'threshold' times
+ * (0: on first read) the data just read is also written into this
+ * image. wgen and wpending let a promotion detect that the guest wrote
+ * to the block while the parent read was in flight, in which case the
+ * (now stale) parent data is dropped; busy holds off guest writes while
+ * a promotion write is outstanding.
+ */
+#define VHD_COR_THRESHOLD_DEFAULT    2
+#define VHD_COR_RATE_DEFAULT         (32 << 10)  /* KiB/s */
+
+struct vhd_cor_block {
+	uint8_t                   hits;
+	uint8_t                   busy;
+	uint16_t                  wgen;
+	uint16_t                  wpending;
+};
+
+struct vhd_cor {
+	struct vhd_cor_block     *blocks;
+	int                       threshold;
+	uint64_t                  rate;        /* bytes/s, 0: unlimited */
+	uint64_t                  budget;
+	struct timeval            last;
+	int                       inflight;
+
+	uint64_t                  promotions;
+	uint64_t                  promoted_secs;
+	uint64_t                  raced;
+	uint64_t                  throttled;
+	uint64_t                  failed;
+};
+
 
 struct vhd_state;
 struct vhd_request;
@@ -181,12 +246,41 @@ struct vhd_request {
 	vhd_flag_t                flags;
 	td_request_t              treq;
 	char			 *orig_buf;
+	int                       secs_pending; /* for zero probes, cor */
+	uint16_t                  wgen;         /* for cor */
+	uint64_t                  offset;       /* for deferred writes */
+	struct vhd_crypto_job     crypto;
 	struct tiocb              tiocb;
 	struct vhd_state         *state;
 	struct vhd_request       *next;
 	struct vhd_transaction   *tx;
 };
 
+struct vhd_batlog {
+	int                       fd;
+	char                     *path;
+	uint64_t                  gen;
+	uint32_t                  next;        /* next record slot */
+	uint8_t                  *dirty;       /* per BAT sector */
+	uint64_t                  appends;
+	uint64_t                  checkpoints;
+
+	/*
+	 * Checkpoints are written in the background, a dirty BAT sector
+	 * at a time, then the image is synced, then the header goes out.
+	 * Allocations meanwhile go in place.
+	 */
+	int                       busy;
+	int                       hdr;         /* header write in flight */
+	int                       syncing;     /* image sync in flight */
+	int                       unsynced;    /* BAT sectors written since */
+	int                       error;       /* of the last checkpoint */
+	uint32_t                  sec;         /* next BAT sector to check */
+	int                       appending;   /* pending BAT write is a record */
+	struct vhd_request        req;
+	void                     *buf;
+};
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
@@ -196,6 +290,17 @@ struct vhd_bat_state {
 	struct vhd_request        req;         /* for writing bat table */
 	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+
+	/*
+	 * Read-only images map the on-disk BAT and batmap instead of
+	 * reading them in; entries stay big-endian and are swapped on
+	 * lookup. bat.bat is NULL in this mode.
+	 */
+	uint32_t                 *bat_map;
+	void                     *bat_map_base;
+	size_t                    bat_map_size;
+	void                     *batmap_map_base;
+	size_t                    batmap_map_size;
 };
 
 struct vhd_bitmap {
@@ -245,10 +350,26 @@ struct vhd_state {
 	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
 	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
 
+	/*
+	 * Block status summary of each block's bitmap (VHD_BS_*), kept
+	 * across bitmap cache evictions. Allocated on first block status
+	 * request, refreshed whenever a bitmap is read or committed.
+	 */
+	uint8_t                  *bs_map;
+
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
 	struct vhd_request        vreq_list[VHD_REQS_DATA];
 
+	/* ciphertext buffer arena, and which of its slots are in use */
+	char                     *crypto_bufs;
+	uint8_t                  *crypto_used;
+	int                       crypto_slots;
+	int                       crypto_next;
+	int                       crypto_rsv_slots;
+	int                       crypto_rsv_busy;
+	int                       crypto_async;
+
 	/* for redundant bitmap writes */
 	int                       padbm_size;
 	char                     *padbm_buf;
@@ -264,6 +385,12 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+	uint64_t                  zero_probes;
+	uint64_t                  zero_writes_elided;
+	uint64_t                  zero_secs_elided;
+
+	struct vhd_batlog         batlog;
+	struct vhd_cor            cor;
 };
 
 /* Define access functions for VHD encryption */
@@ -273,22 +400,39 @@ struct crypto_interface
 		vhd_context_t *, const uint8_t *, size_t,
 		const char *);
 	void (*vhd_close_crypto)(vhd_context_t *);
-	void (*vhd_crypto_encrypt)(
+	int (*vhd_crypto_encrypt)(
 		vhd_context_t *, td_request_t *, char *);
-	void (*vhd_crypto_decrypt)(vhd_context_t *, td_request_t *);
+	int (*vhd_crypto_decrypt)(vhd_context_t *, td_request_t *);
+
+	/* optional, for offloading to the crypto worker threads */
+	int (*vhd_crypto_engine_get)(void);
+	void (*vhd_crypto_engine_put)(void);
+	void (*vhd_crypto_engine_submit)(struct vhd_crypto_job *);
+	void (*vhd_crypto_engine_complete)(void);
 };
 
 static struct crypto_interface *crypto_interface = NULL;
 static void *crypto_handle;
+static event_id_t crypto_event_id = -1;
+static int crypto_engine_users;
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
 #define set_vhd_flag(word, flag)   ((word) |= (flag))
 #define clear_vhd_flag(word, flag) ((word) &= ~(flag))
 
-#define bat_entry(s, blk)          ((s)->bat.bat.bat[(blk)])
+static inline uint32_t
+bat_entry(struct vhd_state *s, uint32_t blk)
+{
+	if (s->bat.bat_map)
+		return be32toh(s->bat.bat_map[blk]);
+	return s->bat.bat.bat[blk];
+}
 
 static void vhd_complete(void *, struct tiocb *, int);
+static void __vhd_queue_write(struct vhd_state *, td_request_t, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void vhd_batlog_close(struct vhd_state *);
+static void vhd_batlog_checkpoint_start(struct vhd_state *);
 
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
@@ -456,9 +600,303 @@ static void
 vhd_free_bat(struct vhd_state *s)
 {
 	free(s->bat.bat.bat);
-	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+
+	if (s->bat.bat_map_base)
+		munmap(s->bat.bat_map_base, s->bat.bat_map_size);
+
+	if (s->bat.batmap_map_base)
+		munmap(s->bat.batmap_map_base, s->bat.batmap_map_size);
+	else
+		free(s->bat.batmap.map);
+
+	memset(&s->bat, 0, sizeof(s->bat));
+	vhd_batlog_close(s);
+}
+
+static int
+vhd_batlog_present(struct vhd_state *s)
+{
+	char *path;
+	int present;
+
+	if (asprintf(&path, "%s%s", s->vhd.file, VHD_BATLOG_SUFFIX) < 0)
+		return 1;
+
+	present = !access(path, F_OK);
+	free(path);
+
+	return present;
+}
+
+/*
+ * Maps @size bytes of the image at @off read-only. Returns a pointer to
+ * @off inside the mapping; the page-aligned base and length go to
+ * @base and @len for munmap.
+ */
+static void *
+vhd_map_region(struct vhd_state *s, off64_t off, size_t size,
+	       void **base, size_t *len)
+{
+	long psize = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	off64_t start;
+	void *map;
+
+	*base = NULL;
+
+	/* touching a mapping past EOF would SIGBUS */
+	if (fstat(s->vhd.fd, &st) || off + (off64_t)size > st.st_size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	start = off & ~((off64_t)psize - 1);
+	*len  = size + (off - start);
+
+	map = mmap(NULL, *len, PROT_READ, MAP_SHARED, s->vhd.fd, start);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*base = map;
+	return (char *)map + (off - start);
+}
+
+/*
+ * Parents are immutable, so there is no need to read and byte-swap
+ * their whole BAT at open. Mapping it leaves the entries in the shared
+ * page cache, faulted in as lookups touch them.
+ */
+static int
+vhd_map_bat(struct vhd_state *s)
+{
+	vhd_context_t *vhd = &s->vhd;
+	uint32_t vhd_blks;
+	size_t size;
+	void *map;
+	int err;
+
+	vhd_blks = (vhd->footer.curr_size + ((1 << VHD_BLOCK_SHIFT) - 1))
+		>> VHD_BLOCK_SHIFT;
+	if (vhd->header.max_bat_size < vhd_blks)
+		return -EINVAL;
+
+	size = (size_t)vhd_blks * sizeof(uint32_t);
+	map  = vhd_map_region(s, vhd->header.table_offset, size,
+			      &s->bat.bat_map_base, &s->bat.bat_map_size);
+	if (!map)
+		return -errno;
+
+	s->bat.bat_map     = map;
+	s->bat.bat.spb     = vhd->header.block_size >> VHD_SECTOR_SHIFT;
+	s->bat.bat.entries = vhd_blks;
+	s->bat.bat.bat     = NULL;
+
+	if (!vhd_has_batmap(vhd))
+		return 0;
+
+	err = vhd_read_batmap_header(vhd, &s->bat.batmap);
+	if (!err)
+		err = vhd_validate_batmap_header(&s->bat.batmap);
+	if (err)
+		goto no_batmap;
+
+	size = vhd_sectors_to_bytes(s->bat.batmap.header.batmap_size);
+	map  = vhd_map_region(s, s->bat.batmap.header.batmap_offset, size,
+			      &s->bat.batmap_map_base,
+			      &s->bat.batmap_map_size);
+	if (!map)
+		goto no_batmap;
+
+	s->bat.batmap.map = map;
+
+	if (vhd_validate_batmap(vhd, &s->bat.batmap)) {
+		munmap(s->bat.batmap_map_base, s->bat.batmap_map_size);
+		s->bat.batmap_map_base = NULL;
+		goto no_batmap;
+	}
+
+	return 0;
+
+no_batmap:
+	EPRINTF("%s: ignoring non-critical batmap error\n", s->vhd.file);
+	memset(&s->bat.batmap, 0, sizeof(s->bat.batmap));
+	return 0;
+}
+
+static inline int
+vhd_batlog_active(struct vhd_state *s)
+{
+	return s->batlog.fd != -1 && s->batlog.dirty;
+}
+
+static void
+vhd_batlog_fill(struct vhd_state *s, void *buf, uint64_t seq,
+		uint32_t blk, uint32_t offset)
+{
+	struct vhd_batlog_sector *rec = buf;
+
+	memset(buf, 0, VHD_SECTOR_SIZE);
+	memcpy(rec->cookie, VHD_BATLOG_COOKIE, sizeof(rec->cookie));
+	uuid_copy(rec->uuid, s->vhd.footer.uuid);
+	rec->gen      = htobe64(s->batlog.gen);
+	rec->seq      = htobe64(seq);
+	rec->blk      = htobe32(blk);
+	rec->offset   = htobe32(offset);
+	rec->checksum = htobe32(vhd_batlog_checksum(rec));
+}
+
+static int
+vhd_batlog_write_header(struct vhd_state *s, void *buf)
+{
+	vhd_batlog_fill(s, buf, 0, 0, 0);
+
+	if (pwrite(s->batlog.fd, buf, VHD_SECTOR_SIZE, 0) != VHD_SECTOR_SIZE)
+		return errno ? -errno : -EIO;
+	if (fdatasync(s->batlog.fd))
+		return -errno;
+
+	return 0;
+}
+
+static void
+vhd_batlog_close(struct vhd_state *s)
+{
+	struct vhd_batlog *log = &s->batlog;
+
+	if (log->fd != -1)
+		close(log->fd);
+	free(log->path);
+	free(log->dirty);
+	free(log->buf);
+	memset(log, 0, sizeof(*log));
+	log->fd = -1;
+}
+
+/*
+ * Starts a new log for this session (VHD_FLAG_OPEN_BAT_LOG). One left
+ * behind by an earlier session was already folded into the image by
+ * vhd_open, or into a read-only BAT by vhd_read_bat.
+ */
+/*
+ * The lock tells other RDWR openers a tapdisk owns the log, so libvhd
+ * does not recover it under us. One may have recovered and unlinked it
+ * between our open and lock: -ESTALE, open it again.
+ */
+static int
+vhd_batlog_lock(struct vhd_batlog *log)
+{
+	struct stat st, path_st;
+
+	if (flock(log->fd, LOCK_EX | LOCK_NB))
+		return errno == EWOULDBLOCK ? -EBUSY : -errno;
+
+	if (fstat(log->fd, &st))
+		return -errno;
+
+	if (stat(log->path, &path_st))
+		return errno == ENOENT ? -ESTALE : -errno;
+
+	if (st.st_dev != path_st.st_dev || st.st_ino != path_st.st_ino)
+		return -ESTALE;
+
+	if (ftruncate(log->fd, 0))
+		return -errno;
+
+	return 0;
+}
+
+static int
+vhd_batlog_open(struct vhd_state *s)
+{
+	struct vhd_batlog *log = &s->batlog;
+	size_t size, count;
+	void *buf = NULL;
+	int err, o_flags;
+
+	log->fd = -1;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) ||
+	    !test_vhd_flag(s->flags, VHD_FLAG_OPEN_BAT_LOG) ||
+	    s->driver->storage == TAPDISK_STORAGE_TYPE_LVM)
+		return 0;
+
+	if (asprintf(&log->path, "%s%s", s->vhd.file, VHD_BATLOG_SUFFIX) < 0) {
+		log->path = NULL;
+		return -ENOMEM;
+	}
+
+	log->dirty = calloc((s->bat.bat.entries + 127) / 128, 1);
+	if (!log->dirty) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_BATLOG_ZERO_SIZE);
+	if (err) {
+		buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	err = posix_memalign(&log->buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	if (err) {
+		log->buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	/* a record is committed once its append completes */
+	o_flags = O_RDWR | O_CREAT | O_LARGEFILE | O_DSYNC;
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_NO_O_DIRECT))
+		o_flags |= O_DIRECT;
+
+	do {
+		if (log->fd != -1)
+			close(log->fd);
+
+		log->fd = open_optional_odirect(log->path, o_flags, 0644);
+		if (log->fd == -1) {
+			err = -errno;
+			goto fail;
+		}
+
+		err = vhd_batlog_lock(log);
+	} while (err == -ESTALE);
+	if (err)
+		goto fail;
+
+	/*
+	 * Written out, not fallocated: appends then land on written
+	 * extents, and O_DSYNC costs no allocation metadata per record.
+	 */
+	memset(buf, 0, VHD_BATLOG_ZERO_SIZE);
+	size = (size_t)(VHD_BATLOG_RECORDS + 1) * VHD_SECTOR_SIZE;
+	for (count = 0; count < size; count += VHD_BATLOG_ZERO_SIZE) {
+		size_t len = MIN(size - count, VHD_BATLOG_ZERO_SIZE);
+
+		if (pwrite(log->fd, buf, len, count) != (ssize_t)len) {
+			err = errno ? -errno : -EIO;
+			goto fail;
+		}
+	}
+
+	log->gen = 1;
+	err = vhd_batlog_write_header(s, buf);
+	if (err)
+		goto fail;
+
+	log->next = 1;
+	DPRINTF("%s: journaling bat updates to %s\n", s->vhd.file, log->path);
+
+	free(buf);
+	return 0;
+
+fail:
+	EPRINTF("%s: bat log %s: %d\n", s->vhd.file, log->path, err);
+	free(buf);
+	vhd_batlog_close(s);
+	return err;
 }
 
 static int
@@ -467,7 +905,23 @@ vhd_initialize_bat(struct vhd_state *s)
 	int err, batmap_required, i;
 	void *buf;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(s->bat));
+
+	/*
+	 * LVM volumes can be rewritten from other hosts behind our page
+	 * cache, so only map file-based images.
+	 */
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) &&
+	    s->driver->storage != TAPDISK_STORAGE_TYPE_LVM &&
+	    !vhd_batlog_present(s)) {
+		err = vhd_map_bat(s);
+		if (!err)
+			goto out;
+
+		DPRINTF("%s: mapping bat failed (%d), reading it\n",
+			s->vhd.file, err);
+		vhd_free_bat(s);
+	}
 
 	err = vhd_read_bat(&s->vhd, &s->bat.bat);
 	if (err) {
@@ -475,6 +929,10 @@ vhd_initialize_bat(struct vhd_state *s)
 		return err;
 	}
 
+	err = vhd_batlog_open(s);
+	if (err)
+		goto fail;
+
 	batmap_required = 1;
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
 		batmap_required = 0;
@@ -501,6 +959,7 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
+out:
 	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
 	if (err)
 		goto fail;
@@ -528,6 +987,9 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	}
 
 	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+
+	free(s->bs_map);
+	s->bs_map = NULL;
 }
 
 static int
@@ -660,6 +1122,13 @@ vhd_log_open(struct vhd_state *s)
 		return;
 	}
 
+	if (s->bat.bat_map) {
+		DPRINTF("%s version: %s 0x%08x, b: %u, mapped\n",
+			s->vhd.file, buf, s->vhd.footer.crtr_ver,
+			s->bat.bat.entries);
+		return;
+	}
+
 	allocated = 0;
 	full      = 0;
 
@@ -675,6 +1144,12 @@ vhd_log_open(struct vhd_state *s)
 		allocated, full, s->next_db);
 }
 
+static bool
+vhd_is_encrypted(struct vhd_state *s)
+{
+	return s->vhd.xts_tfm != NULL;
+}
+
 static int dummy_open_crypto(
 	vhd_context_t *vhd, const uint8_t *key, size_t key_bytes,
 	const char *name)
@@ -706,6 +1181,10 @@ __load_crypto(struct td_vbd_encryption *encryption)
 		crypto_interface->vhd_close_crypto = dummy_close_crypto;
 		crypto_interface->vhd_crypto_encrypt = NULL;
 		crypto_interface->vhd_crypto_decrypt = NULL;
+		crypto_interface->vhd_crypto_engine_get = NULL;
+		crypto_interface->vhd_crypto_engine_put = NULL;
+		crypto_interface->vhd_crypto_engine_submit = NULL;
+		crypto_interface->vhd_crypto_engine_complete = NULL;
 	} else {
 		dlerror();
 		crypto_handle = dlopen(LIBBLOCKCRYPTO_NAME, RTLD_LAZY);
@@ -724,11 +1203,11 @@ __load_crypto(struct td_vbd_encryption *encryption)
 			(void (*)(vhd_context_t *))
 			dlsym(crypto_handle, "vhd_close_crypto");
 		crypto_interface->vhd_crypto_encrypt =
-			(void (*)(vhd_context_t *, td_request_t *,
-				  char *))
+			(int (*)(vhd_context_t *, td_request_t *,
+				 char *))
 			dlsym(crypto_handle, "vhd_crypto_encrypt");
 		crypto_interface->vhd_crypto_decrypt =
-			(void (*)(vhd_context_t *, td_request_t *))
+			(int (*)(vhd_context_t *, td_request_t *))
 			dlsym(crypto_handle, "vhd_crypto_decrypt");
 
 		if (!crypto_interface->vhd_open_crypto ||
@@ -739,6 +1218,21 @@ __load_crypto(struct td_vbd_encryption *encryption)
 				dlerror());
 			return -EINVAL;
 		}
+
+		crypto_interface->vhd_crypto_engine_get =
+			(int (*)(void))
+			dlsym(crypto_handle, "vhd_crypto_engine_get");
+		crypto_interface->vhd_crypto_engine_put =
+			(void (*)(void))
+			dlsym(crypto_handle, "vhd_crypto_engine_put");
+		crypto_interface->vhd_crypto_engine_submit =
+			(void (*)(struct vhd_crypto_job *))
+			dlsym(crypto_handle, "vhd_crypto_engine_submit");
+		crypto_interface->vhd_crypto_engine_complete =
+			(void (*)(void))
+			dlsym(crypto_handle, "vhd_crypto_engine_complete");
+		dlerror();
+
 		DPRINTF("Loaded cryptography library\n");
 	}
 
@@ -754,10 +1248,79 @@ void vhd_atexit(void)
 }
 
 static void
-__vhd_free_crypto(vhd_context_t *vhd)
+vhd_crypto_event(event_id_t id, char mode, void *private)
+{
+	crypto_interface->vhd_crypto_engine_complete();
+}
+
+/*
+ * Moves the image onto the crypto worker threads if the library
+ * provides them. Failing that, encryption stays on the event loop.
+ */
+static void
+vhd_crypto_engine_attach(struct vhd_state *s)
+{
+	event_id_t id;
+	int fd;
+
+	if (!crypto_interface->vhd_crypto_engine_get ||
+	    !crypto_interface->vhd_crypto_engine_put ||
+	    !crypto_interface->vhd_crypto_engine_submit ||
+	    !crypto_interface->vhd_crypto_engine_complete)
+		return;
+
+	fd = crypto_interface->vhd_crypto_engine_get();
+	if (fd < 0) {
+		if (fd != -EOPNOTSUPP)
+			EPRINTF("%s: crypto engine unavailable: %d\n",
+				s->vhd.file, fd);
+		return;
+	}
+
+	if (crypto_event_id < 0) {
+		id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						   fd, TV_ZERO,
+						   vhd_crypto_event, NULL);
+		if (id < 0) {
+			EPRINTF("%s: failed to register crypto event: %d\n",
+				s->vhd.file, id);
+			crypto_interface->vhd_crypto_engine_put();
+			return;
+		}
+		crypto_event_id = id;
+	}
+
+	crypto_engine_users++;
+	s->crypto_async = 1;
+}
+
+static void
+vhd_crypto_engine_detach(struct vhd_state *s)
+{
+	if (!s->crypto_async)
+		return;
+
+	if (!--crypto_engine_users) {
+		tapdisk_server_unregister_event(crypto_event_id);
+		crypto_event_id = -1;
+	}
+
+	crypto_interface->vhd_crypto_engine_put();
+	s->crypto_async = 0;
+}
+
+static void
+__vhd_free_crypto(struct vhd_state *s)
 {
+	vhd_crypto_engine_detach(s);
+
+	free(s->crypto_bufs);
+	s->crypto_bufs = NULL;
+	free(s->crypto_used);
+	s->crypto_used = NULL;
+
 	if (crypto_interface) {
-		crypto_interface->vhd_close_crypto(vhd);
+		crypto_interface->vhd_close_crypto(&s->vhd);
 		atexit(vhd_atexit);
 	}
 }
@@ -778,6 +1341,51 @@ __load_and_open_crypto(vhd_context_t *vhd, struct td_vbd_encryption *encryption,
 		vhd, encryption->encryption_key, encryption->key_size, name);
 }
 
+/*
+ * Copy-on-read is only meaningful for a writable differencing image;
+ * anything else quietly opens without it.
+ */
+static int
+vhd_cor_init(struct vhd_state *s)
+{
+	struct vhd_cor *cor = &s->cor;
+	const char *env;
+
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_COR) ||
+	    test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) ||
+	    s->vhd.footer.type != HD_TYPE_DIFF)
+		return 0;
+
+	cor->threshold = VHD_COR_THRESHOLD_DEFAULT;
+	env = getenv("TAPDISK3_COR_THRESHOLD");
+	if (env)
+		cor->threshold = atoi(env);
+
+	cor->rate = VHD_COR_RATE_DEFAULT;
+	env = getenv("TAPDISK3_COR_RATE");
+	if (env)
+		cor->rate = strtoull(env, NULL, 10);
+	cor->rate  <<= 10;
+	cor->budget  = cor->rate;
+	gettimeofday(&cor->last, NULL);
+
+	cor->blocks = calloc(s->bat.bat.entries, sizeof(*cor->blocks));
+	if (!cor->blocks)
+		return -ENOMEM;
+
+	DPRINTF("%s: copy-on-read, threshold %d, rate %"PRIu64" KiB/s\n",
+		s->vhd.file, cor->threshold, cor->rate >> 10);
+
+	return 0;
+}
+
+static void
+vhd_cor_free(struct vhd_state *s)
+{
+	free(s->cor.blocks);
+	s->cor.blocks = NULL;
+}
+
 static int
 __vhd_open(td_driver_t *driver, const char *name,
 	   struct td_vbd_encryption *encryption, vhd_flag_t flags)
@@ -794,6 +1402,7 @@ __vhd_open(td_driver_t *driver, const char *name,
 
 	s->flags  = flags;
 	s->driver = driver;
+	s->batlog.fd = -1;
 
 	err = vhd_initialize(s);
 	if (err)
@@ -833,6 +1442,10 @@ __vhd_open(td_driver_t *driver, const char *name,
 
 	vhd_log_open(s);
 
+	err = vhd_cor_init(s);
+	if (err)
+		goto fail;
+
 	SPB = s->spb;
 
 	s->vreq_free_count = VHD_REQS_DATA;
@@ -852,6 +1465,32 @@ __vhd_open(td_driver_t *driver, const char *name,
 		goto fail;
 	}
 
+	if (vhd_is_encrypted(s)) {
+		s->crypto_slots = VHD_REQS_DATA;
+		s->crypto_rsv_slots =
+			(MAX(s->spb, VHD_CRYPTO_RSV_SECS) +
+			 VHD_CRYPTO_SLOT_SECS - 1) / VHD_CRYPTO_SLOT_SECS;
+
+		err = posix_memalign((void **)&s->crypto_bufs,
+				     VHD_SECTOR_SIZE,
+				     (size_t)(s->crypto_slots +
+					      s->crypto_rsv_slots) *
+				     VHD_CRYPTO_SLOT_SIZE);
+		if (err) {
+			s->crypto_bufs = NULL;
+			err = -err;
+			goto fail;
+		}
+
+		s->crypto_used = calloc(s->crypto_slots, 1);
+		if (!s->crypto_used) {
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		vhd_crypto_engine_attach(s);
+	}
+
 	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT) && 
 	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) {
 		err = vhd_kill_footer(s);
@@ -865,9 +1504,10 @@ __vhd_open(td_driver_t *driver, const char *name,
         return 0;
 
  fail:
+	vhd_cor_free(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
-	__vhd_free_crypto(&s->vhd);
+	__vhd_free_crypto(s);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 	return err;
@@ -894,6 +1534,12 @@ _vhd_open(td_driver_t *driver, const char *name,
 			      VHD_FLAG_OPEN_NO_CACHE);
 	if (flags & TD_OPEN_LOCAL_CACHE)
 		vhd_flags |= VHD_FLAG_OPEN_LOCAL_CACHE;
+	if (flags & TD_OPEN_ELIDE_ZEROS)
+		vhd_flags |= VHD_FLAG_OPEN_ELIDE_ZEROS;
+	if (flags & TD_OPEN_BAT_LOG)
+		vhd_flags |= VHD_FLAG_OPEN_BAT_LOG;
+	if (flags & TD_OPEN_COPY_ON_READ)
+		vhd_flags |= VHD_FLAG_OPEN_COR;
 
 	/* pre-allocate for all but NFS and LVM storage */
 	driver->storage = tapdisk_storage_type(name);
@@ -910,7 +1556,7 @@ vhd_log_close(struct vhd_state *s)
 {
 	uint32_t i, allocated, full;
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET) || s->bat.bat_map)
 		return;
 
 	allocated = 0;
@@ -949,6 +1595,19 @@ _vhd_close(td_driver_t *driver)
 	 *   - we killed it on open (opened with strict) 
 	 *   - we've written data since opening
 	 */
+	if (vhd_batlog_active(s)) {
+		/* checkpointed by _vhd_quiesce, unless that failed */
+		if (s->batlog.busy || s->batlog.next > 1)
+			EPRINTF("%s: keeping %s for recovery\n",
+				s->vhd.file, s->batlog.path);
+		else {
+			/* still locked, so no one recovers it meanwhile */
+			unlink(s->batlog.path);
+			close(s->batlog.fd);
+			s->batlog.fd = -1;
+		}
+	}
+
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes) {
 		memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
 		err = vhd_write_footer(&s->vhd, &s->vhd.footer);
@@ -967,9 +1626,10 @@ _vhd_close(td_driver_t *driver)
 
  free:
 	vhd_log_close(s);
+	vhd_cor_free(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
-	__vhd_free_crypto(&s->vhd);
+	__vhd_free_crypto(s);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
@@ -978,6 +1638,35 @@ _vhd_close(td_driver_t *driver)
 	return 0;
 }
 
+/*
+ * Waits out copy-on-read promotions, which are not tied to any vbd
+ * request, and retires the BAT log before close: records left in it
+ * would make the next open replay them. If the checkpoint fails, close
+ * keeps the log.
+ */
+static int
+_vhd_quiesce(td_driver_t *driver)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_batlog *log = &s->batlog;
+
+	if (s->cor.inflight)
+		return -EAGAIN;
+
+	if (!vhd_batlog_active(s))
+		return 0;
+
+	if (log->busy)
+		return -EAGAIN;
+
+	if (log->next > 1 && !log->error) {
+		vhd_batlog_checkpoint_start(s);
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
 int
 vhd_validate_parent(td_driver_t *child_driver,
 		    td_driver_t *parent_driver, td_flag_t flags)
@@ -1427,6 +2116,62 @@ read_bitmap_cache_span(struct vhd_state *s,
 	return ret;
 }
 
+static void
+vhd_bs_update(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	int i, n, set, clear;
+
+	if (!s->bs_map)
+		return;
+
+	set   = 0;
+	clear = 0;
+	n     = s->spb >> 3;
+
+	for (i = 0; i < n && !(set && clear); i++) {
+		if (bm->map[i] == (char)0xFF)
+			set = 1;
+		else if (bm->map[i] == 0)
+			clear = 1;
+		else
+			set = clear = 1;
+	}
+
+	if (set && clear)
+		s->bs_map[bm->blk] = VHD_BS_MIXED;
+	else
+		s->bs_map[bm->blk] = set ? VHD_BS_FULL : VHD_BS_EMPTY;
+}
+
+/*
+ * Number of sectors from @sector on, up to @nr_secs, that lie in
+ * consecutive blocks which are all unallocated (@full == 0) or all
+ * fully allocated (@full == 1), judging by the BAT and batmap alone.
+ * The first block is assumed to qualify.
+ */
+static int
+vhd_bs_run(struct vhd_state *s, uint64_t sector, int nr_secs, int full)
+{
+	uint32_t blk;
+	int ret;
+
+	blk = sector / s->spb;
+	ret = MIN(nr_secs, s->spb - (sector % s->spb));
+
+	while (ret < nr_secs) {
+		if (++blk >= s->vhd.header.max_bat_size)
+			break;
+
+		if (full ? !test_batmap(s, blk) :
+		    bat_entry(s, blk) != DD_BLK_UNUSED)
+			break;
+
+		ret += MIN(nr_secs - ret, (int)s->spb);
+	}
+
+	return ret;
+}
+
 static inline struct vhd_request *
 alloc_vhd_request(struct vhd_state *s)
 {
@@ -1466,11 +2211,12 @@ do_aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 }
 
 static inline void
-do_aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
+do_aio_write_fd(struct vhd_state *s, struct vhd_request *req, int fd,
+		uint64_t offset)
 {
 	struct tiocb *tiocb = &req->tiocb;
 
-	td_prep_write(s->driver, tiocb, s->vhd.fd, req->treq.buf,
+	td_prep_write(s->driver, tiocb, fd, req->treq.buf,
 		      vhd_sectors_to_bytes(req->treq.secs),
 		      offset, vhd_complete, req);
 	td_queue_tiocb(s->driver, tiocb);
@@ -1481,6 +2227,134 @@ do_aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+static inline void
+do_aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
+{
+	do_aio_write_fd(s, req, s->vhd.fd, offset);
+}
+
+static inline void
+do_aio_sync(struct vhd_state *s, struct vhd_request *req, int fd)
+{
+	struct tiocb *tiocb = &req->tiocb;
+
+	td_prep_sync(s->driver, tiocb, fd, vhd_complete, req);
+	td_queue_tiocb(s->driver, tiocb);
+
+	s->queued++;
+	TRACE(s);
+}
+
+/*
+ * Checkpoint taken from the event loop once the log fills up: dirty BAT
+ * sectors go out one aio at a time, then an fdsync of the image, then
+ * the header for the next generation, which retires the records. BAT
+ * updates issued meanwhile are written in place, and any that race a
+ * sector write re-dirty it (finish_bat_write), so are rewritten and
+ * synced again before the header.
+ */
+static void
+vhd_batlog_checkpoint_next(struct vhd_state *s)
+{
+	struct vhd_batlog *log = &s->batlog;
+	struct vhd_request *req = &log->req;
+	uint32_t i, j, nsecs;
+	uint64_t offset;
+
+	nsecs = (s->bat.bat.entries + 127) / 128;
+
+	for (i = log->sec; i < nsecs && !log->dirty[i]; i++)
+		;
+
+	init_vhd_request(s, req);
+	req->treq.secs = 1;
+	req->treq.buf  = log->buf;
+	req->op        = VHD_OP_BATLOG_CKPT;
+
+	if (i < nsecs) {
+		log->dirty[i] = 0;
+		log->sec      = i + 1;
+		req->treq.sec = i;
+
+		memset(log->buf, 0xff, VHD_SECTOR_SIZE);
+		for (j = 0; j < 128 && i * 128 + j < s->bat.bat.entries; j++)
+			((uint32_t *)log->buf)[j] =
+				htobe32(s->bat.bat.bat[i * 128 + j]);
+
+		offset = s->vhd.header.table_offset +
+			(uint64_t)i * VHD_SECTOR_SIZE;
+		log->unsynced = 1;
+		do_aio_write(s, req, offset);
+		return;
+	}
+
+	if (log->unsynced) {
+		log->unsynced = 0;
+		log->syncing  = 1;
+		do_aio_sync(s, req, s->vhd.fd);
+		return;
+	}
+
+	log->gen++;
+	log->hdr = 1;
+	vhd_batlog_fill(s, log->buf, 0, 0, 0);
+	do_aio_write_fd(s, req, log->fd, 0);
+}
+
+static void
+vhd_batlog_checkpoint_start(struct vhd_state *s)
+{
+	struct vhd_batlog *log = &s->batlog;
+
+	if (log->busy)
+		return;
+
+	log->busy = 1;
+	log->hdr  = 0;
+	log->sec  = 0;
+	vhd_batlog_checkpoint_next(s);
+}
+
+static void
+finish_batlog_checkpoint(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+	struct vhd_batlog *log = &s->batlog;
+
+	s->returned++;
+	TRACE(s);
+
+	if (req->error) {
+		/* retried by the next allocation, which finds the log full */
+		if (log->hdr)
+			log->gen--;
+		else if (log->syncing)
+			log->unsynced = 1;
+		else
+			log->dirty[req->treq.sec] = 1;
+		log->error   = req->error;
+		log->busy    = 0;
+		log->hdr     = 0;
+		log->syncing = 0;
+		return;
+	}
+
+	if (!log->hdr) {
+		log->syncing = 0;
+		vhd_batlog_checkpoint_next(s);
+		return;
+	}
+
+	log->next  = 1;
+	log->busy  = 0;
+	log->hdr   = 0;
+	log->error = 0;
+	log->checkpoints++;
+
+	DBG(TLOG_DBG, "%s: bat checkpoint, gen %"PRIu64"\n",
+	    s->vhd.file, log->gen);
+}
+
 /**
  * Reserves a new extent.
  *
@@ -1525,7 +2399,29 @@ schedule_bat_write(struct vhd_state *s)
 	blk = s->bat.pbw_blk;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	req->treq.secs = 1;
+	req->treq.buf  = buf;
+	req->op        = VHD_OP_BAT_WRITE;
+	req->next      = NULL;
+
+	s->batlog.appending = 0;
+
+	if (vhd_batlog_active(s)) {
+		/* while the log is full or being checkpointed, write in place */
+		if (!s->batlog.busy && s->batlog.next <= VHD_BATLOG_RECORDS) {
+			vhd_batlog_fill(s, buf, s->batlog.next,
+					blk, s->bat.pbw_offset);
+			offset = (uint64_t)s->batlog.next * VHD_SECTOR_SIZE;
+			s->batlog.appending = 1;
+			do_aio_write_fd(s, req, s->batlog.fd, offset);
+			set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+			return 0;
+		}
+
+		vhd_batlog_checkpoint_start(s);
+	}
+
+	memcpy(buf, &s->bat.bat.bat[blk - (blk % 128)], 512);
 
 	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
 
@@ -1533,10 +2429,6 @@ schedule_bat_write(struct vhd_state *s)
 		BE32_OUT(&((uint32_t *)buf)[i]);
 
 	offset         = s->vhd.header.table_offset + ((uint64_t)blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
-	req->treq.buf  = buf;
-	req->op        = VHD_OP_BAT_WRITE;
-	req->next      = NULL;
 
 	do_aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
@@ -1775,10 +2667,102 @@ schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	return 0;
 }
 
-static bool
-vhd_is_encrypted(struct vhd_state *s)
+static int
+vhd_crypto_max_secs(struct vhd_state *s)
 {
-	return s->vhd.xts_tfm != NULL;
+	return s->crypto_rsv_slots * VHD_CRYPTO_SLOT_SECS;
+}
+
+/*
+ * A run of free slots, first fit from where the last one ended, else
+ * the reserve.
+ */
+static char *
+vhd_crypto_buf_get(struct vhd_state *s, int secs)
+{
+	int n, i, run, start;
+
+	n = (secs + VHD_CRYPTO_SLOT_SECS - 1) / VHD_CRYPTO_SLOT_SECS;
+	if (n > s->crypto_slots)
+		goto reserve;
+
+	for (start = s->crypto_next; ; start = 0) {
+		for (i = start, run = 0; i < s->crypto_slots; i++) {
+			run = s->crypto_used[i] ? 0 : run + 1;
+			if (run == n)
+				goto found;
+		}
+
+		if (!start)
+			break;
+	}
+
+reserve:
+	ASSERT(n <= s->crypto_rsv_slots);
+	if (s->crypto_rsv_busy)
+		return NULL;
+
+	s->crypto_rsv_busy = 1;
+	return s->crypto_bufs + (size_t)s->crypto_slots * VHD_CRYPTO_SLOT_SIZE;
+
+found:
+	i -= n - 1;
+	memset(s->crypto_used + i, 1, n);
+	s->crypto_next = (i + n) % s->crypto_slots;
+
+	return s->crypto_bufs + (size_t)i * VHD_CRYPTO_SLOT_SIZE;
+}
+
+static void
+vhd_crypto_buf_put(struct vhd_state *s, char *buf, int secs)
+{
+	int n, i;
+
+	n = (secs + VHD_CRYPTO_SLOT_SECS - 1) / VHD_CRYPTO_SLOT_SECS;
+	i = (buf - s->crypto_bufs) / VHD_CRYPTO_SLOT_SIZE;
+
+	if (i == s->crypto_slots) {
+		ASSERT(s->crypto_rsv_busy);
+		s->crypto_rsv_busy = 0;
+		return;
+	}
+
+	ASSERT(i >= 0 && i + n <= s->crypto_slots);
+	memset(s->crypto_used + i, 0, n);
+}
+
+static void
+vhd_crypto_submit(struct vhd_state *s, struct vhd_request *req, int encrypt,
+		  void (*cb)(struct vhd_crypto_job *))
+{
+	struct vhd_crypto_job *job = &req->crypto;
+
+	job->vhd     = &s->vhd;
+	job->encrypt = encrypt;
+	job->sec     = req->treq.sec;
+	job->secs    = req->treq.secs;
+	job->src     = (uint8_t *)(encrypt ? req->orig_buf : req->treq.buf);
+	job->dst     = (uint8_t *)req->treq.buf;
+	job->cb      = cb;
+
+	crypto_interface->vhd_crypto_engine_submit(job);
+}
+
+static void
+vhd_crypto_write_done(struct vhd_crypto_job *job)
+{
+	struct vhd_request *req;
+
+	req = container_of(job, struct vhd_request, crypto);
+
+	/* fails the write as the aio would have */
+	if (job->error) {
+		req->state->queued++;
+		vhd_complete(req, NULL, job->error);
+		return;
+	}
+
+	do_aio_write(req->state, req, req->offset);
 }
 
 static int
@@ -1791,18 +2775,32 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	struct vhd_request *req = NULL;
 	char *crypto_buf = NULL;
 
-	if (vhd_is_encrypted(s)) {
-		err = posix_memalign((void **)&crypto_buf, VHD_SECTOR_SIZE,
-				     (size_t)treq.secs * VHD_SECTOR_SIZE);
-		if (err)
-			return -EBUSY;
-	}
 	req = alloc_vhd_request(s);
 	if (!req) {
 		err = -EBUSY;
 		goto fail;
 	}
 
+	if (vhd_is_encrypted(s)) {
+		/* retried once writes in flight give theirs back */
+		crypto_buf = vhd_crypto_buf_get(s, treq.secs);
+		if (!crypto_buf) {
+			err = -EBUSY;
+			goto fail;
+		}
+
+		/* before the BAT is touched, so failing is still simple */
+		if (!s->crypto_async) {
+			td_request_t ctreq = treq;
+
+			ctreq.buf = crypto_buf;
+			err = crypto_interface->vhd_crypto_encrypt(
+				&s->vhd, &ctreq, treq.buf);
+			if (err)
+				goto fail;
+		}
+	}
+
 	if (s->vhd.footer.type == HD_TYPE_FIXED) {
 		offset = vhd_sectors_to_bytes(treq.sec);
 	} else {
@@ -1836,11 +2834,14 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	req->op    = VHD_OP_DATA_WRITE;
 	req->next  = NULL;
 
+	if (s->cor.blocks) {
+		s->cor.blocks[treq.sec / s->spb].wpending++;
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_COR_PENDING);
+	}
+
 	if (vhd_is_encrypted(s)) {
 		req->orig_buf = req->treq.buf;
 		req->treq.buf = crypto_buf;
-		crypto_interface->vhd_crypto_encrypt(
-			&s->vhd, &req->treq, req->orig_buf);
 	}
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BITMAP)) {
@@ -1859,7 +2860,11 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		   test_batmap(s, blk))
 		schedule_redundant_bm_write(s, blk);
 
-	do_aio_write(s, req, offset);
+	if (vhd_is_encrypted(s) && s->crypto_async) {
+		req->offset = offset;
+		vhd_crypto_submit(s, req, 1, vhd_crypto_write_done);
+	} else
+		do_aio_write(s, req, offset);
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
 	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x\n",
@@ -1868,7 +2873,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	return 0;
 fail:
 	if (crypto_buf)
-		free(crypto_buf);
+		vhd_crypto_buf_put(s, crypto_buf, treq.secs);
 
 	if (req)
 		free_vhd_request(s, req);
@@ -2010,12 +3015,17 @@ vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 	DBG(TLOG_DBG, "block status: %s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+	if (!s->bs_map && vhd_type_dynamic(&s->vhd))
+		s->bs_map = calloc(s->vhd.header.max_bat_size, 1);
+
 	while (treq.secs) {
 		int err;
+		uint32_t blk;
 		td_request_t clone;
 
 		err   = 0;
 		clone = treq;
+		blk   = clone.sec / s->spb;
 
 		switch (read_bitmap_cache(s, clone.sec, VHD_OP_BLOCK_STATUS)) {
 		case -EINVAL:
@@ -2023,7 +3033,8 @@ vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 			goto fail;
 
 		case VHD_BM_BAT_CLEAR:
-			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			/* one forward for a whole run of unallocated blocks */
+			clone.secs = vhd_bs_run(s, clone.sec, clone.secs, 0);
 			td_forward_request(clone);
 			break;
 
@@ -2033,15 +3044,46 @@ vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 			break;
 
 		case VHD_BM_BIT_SET:
-			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
+			if (vhd_type_dynamic(&s->vhd) && test_batmap(s, blk))
+				clone.secs = vhd_bs_run(s, clone.sec, clone.secs, 1);
+			else
+				clone.secs = read_bitmap_cache_span(s, clone.sec,
+								    clone.secs, 1);
 			clone.status = TD_BLOCK_STATE_NONE;
 			td_complete_request(clone, 0);
 			break;
 
 		case VHD_BM_NOT_CACHED:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			clone.status = TD_BLOCK_STATE_NONE;
-			td_complete_request(clone, 0);
+
+			switch (s->bs_map ? s->bs_map[blk] : VHD_BS_UNKNOWN) {
+			case VHD_BS_FULL:
+				clone.status = TD_BLOCK_STATE_NONE;
+				td_complete_request(clone, 0);
+				break;
+
+			case VHD_BS_EMPTY:
+				td_forward_request(clone);
+				break;
+
+			default:
+				err = schedule_bitmap_read(s, blk);
+				if (!err)
+					err = __vhd_queue_request(s, VHD_OP_BLOCK_STATUS,
+								  clone);
+				if (err) {
+					/*
+					 * Out of bitmap slots or requests:
+					 * answer up to here, the client asks
+					 * again for the rest.
+					 */
+					clone.secs   = treq.secs;
+					clone.status = TD_BLOCK_STATE_UNKNOWN;
+					td_complete_request(clone, 0);
+					return;
+				}
+				break;
+			}
 			break;
 
 		case VHD_BM_READ_PENDING:
@@ -2059,7 +3101,8 @@ vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 
 		treq.sec  += clone.secs;
 		treq.secs -= clone.secs;
-		treq.buf  += vhd_sectors_to_bytes(clone.secs);
+		if (treq.buf)
+			treq.buf += vhd_sectors_to_bytes(clone.secs);
 		continue;
 
 	fail:
@@ -2069,6 +3112,187 @@ vhd_queue_block_status(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static inline struct vhd_cor_block *
+vhd_cor_block(struct vhd_state *s, uint64_t sec)
+{
+	return s->cor.blocks ? &s->cor.blocks[sec / s->spb] : NULL;
+}
+
+/*
+ * Token bucket on promoted bytes, refilled at cor.rate with one second
+ * worth of burst.
+ */
+static int
+vhd_cor_budget(struct vhd_state *s, int secs)
+{
+	struct vhd_cor *cor = &s->cor;
+	uint64_t bytes = vhd_sectors_to_bytes(secs), usecs;
+	struct timeval now, delta;
+
+	if (!cor->rate)
+		return 1;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &cor->last, &delta);
+	cor->last = now;
+
+	usecs = delta.tv_sec * 1000000ULL + delta.tv_usec;
+	cor->budget += cor->rate * usecs / 1000000;
+	if (cor->budget > cor->rate)
+		cor->budget = cor->rate;
+
+	if (cor->budget < bytes)
+		return 0;
+
+	cor->budget -= bytes;
+	return 1;
+}
+
+static void
+vhd_cor_write_done(td_request_t treq, int err)
+{
+	struct vhd_request *req = treq.cb_data;
+	struct vhd_state *s = req->state;
+	struct vhd_cor_block *b;
+
+	if (err)
+		req->error = err;
+
+	req->secs_pending -= treq.secs;
+	if (req->secs_pending)
+		return;
+
+	b = vhd_cor_block(s, req->treq.sec);
+	b->busy = 0;
+	b->hits = 0;
+
+	if (req->error) {
+		s->cor.failed++;
+		DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x: "
+		    "promotion failed: %d\n", s->vhd.file, req->treq.sec,
+		    req->treq.secs, req->error);
+	}
+
+	free(req->orig_buf);
+	free_vhd_request(s, req);
+	s->cor.inflight--;
+}
+
+/*
+ * Called with the parent data for the whole promoted range in the
+ * guest buffer, before the guest gets it back: take a copy and write
+ * it here, unless the guest has written to the block meanwhile.
+ */
+static void
+vhd_cor_promote(struct vhd_state *s, struct vhd_request *req)
+{
+	struct vhd_cor_block *b = vhd_cor_block(s, req->treq.sec);
+	td_request_t write;
+	void *buf;
+
+	if (req->error || b->busy || b->wpending || b->wgen != req->wgen) {
+		s->cor.raced++;
+		goto drop;
+	}
+
+	if (posix_memalign(&buf, VHD_SECTOR_SIZE,
+			   vhd_sectors_to_bytes(req->treq.secs)))
+		goto drop;
+
+	memcpy(buf, req->treq.buf, vhd_sectors_to_bytes(req->treq.secs));
+
+	write         = req->treq;
+	write.op      = TD_OP_WRITE;
+	write.buf     = buf;
+	write.status  = 0;
+	write.cb      = vhd_cor_write_done;
+	write.cb_data = req;
+	write.vreq    = NULL;
+
+	req->orig_buf     = buf;
+	req->secs_pending = write.secs;
+	req->error        = 0;
+	b->busy           = 1;
+
+	s->cor.promotions++;
+	s->cor.promoted_secs += write.secs;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x: promoting\n",
+	    s->vhd.file, write.sec, write.secs);
+
+	__vhd_queue_write(s, write, 0);
+	return;
+
+drop:
+	free_vhd_request(s, req);
+	s->cor.inflight--;
+}
+
+static void
+vhd_cor_read_done(td_request_t treq, int err)
+{
+	struct vhd_request *req = treq.cb_data;
+	struct vhd_state *s = req->state;
+
+	treq.cb      = req->treq.cb;
+	treq.cb_data = req->treq.cb_data;
+
+	if (err)
+		req->error = err;
+
+	/* the parent may complete the range piecemeal */
+	req->secs_pending -= treq.secs;
+	if (!req->secs_pending)
+		vhd_cor_promote(s, req);
+
+	td_complete_request(treq, err);
+}
+
+/*
+ * Forwards a read of sectors not present in this image, tapping it for
+ * promotion if the block is hot enough and there is room to do so
+ * without starving guest I/O.
+ */
+static void
+vhd_forward_read(struct vhd_state *s, td_request_t treq)
+{
+	struct vhd_cor_block *b = vhd_cor_block(s, treq.sec);
+	struct vhd_request *req;
+
+	if (!b)
+		goto forward;
+
+	if (b->hits < UINT8_MAX)
+		b->hits++;
+
+	if (b->hits <= s->cor.threshold || b->busy || b->wpending)
+		goto forward;
+
+	if (s->vreq_free_count <= VHD_REQS_DATA / 2)
+		goto forward;
+
+	if (!vhd_cor_budget(s, treq.secs)) {
+		s->cor.throttled++;
+		goto forward;
+	}
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		goto forward;
+
+	req->treq         = treq;
+	req->op           = VHD_OP_COR_READ;
+	req->secs_pending = treq.secs;
+	req->wgen         = b->wgen;
+	s->cor.inflight++;
+
+	treq.cb      = vhd_cor_read_done;
+	treq.cb_data = req;
+
+forward:
+	td_forward_request(treq);
+}
+
 static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -2091,12 +3315,12 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_BAT_CLEAR:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			td_forward_request(clone);
+			vhd_forward_read(s, clone);
 			break;
 
 		case VHD_BM_BIT_CLEAR:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
-			td_forward_request(clone);
+			vhd_forward_read(s, clone);
 			break;
 
 		case VHD_BM_BIT_SET:
@@ -2142,29 +3366,132 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * Zero write elision: a write of zeros to sectors which are not
+ * allocated in this image need not be written at all, provided the
+ * sectors already read as zeros.  That is trivially the case when
+ * there is no parent; otherwise the rest of the chain is asked for the
+ * block status of the range first.  Writes known to be zeroes (NBD
+ * WRITE_ZEROES, TRIM) are elided even without TD_OPEN_ELIDE_ZEROS, so
+ * they never allocate a block.
+ */
 static void
-vhd_queue_write(td_driver_t *driver, td_request_t treq)
+vhd_finish_zero_probe(struct vhd_request *req)
 {
-	struct vhd_state *s = (struct vhd_state *)driver->data;
+	td_request_t treq;
+	struct vhd_state *s = req->state;
+	int zero = !req->error;
+
+	treq = req->treq;
+	free_vhd_request(s, req);
+
+	if (zero) {
+		s->zero_writes_elided++;
+		s->zero_secs_elided += treq.secs;
+		td_complete_request(treq, 0);
+	} else
+		__vhd_queue_write(s, treq, 0);
+}
+
+static void
+vhd_zero_probe_complete(td_request_t probe, int err)
+{
+	struct vhd_request *req = probe.cb_data;
+
+	if (err || !(probe.status & (TD_BLOCK_STATE_HOLE|TD_BLOCK_STATE_ZERO)))
+		req->error = err ? : -ENOTEMPTY;
+
+	req->secs_pending -= probe.secs;
+	if (!req->secs_pending)
+		vhd_finish_zero_probe(req);
+}
+
+/*
+ * Returns 1 if the write was consumed, 0 if it must be written out.
+ */
+static int
+vhd_elide_zero_write(struct vhd_state *s, td_request_t treq)
+{
+	struct vhd_request *req;
+	td_request_t probe;
+
+	/* background writes have no vbd request to forward a probe on */
+	if (!treq.vreq)
+		return 0;
+
+	if (!treq.vreq->zeroes &&
+	    (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_ELIDE_ZEROS) ||
+	     !tapdisk_buf_is_zero(treq.buf, vhd_sectors_to_bytes(treq.secs))))
+		return 0;
+
+	if (s->vhd.footer.type != HD_TYPE_DIFF) {
+		s->zero_writes_elided++;
+		s->zero_secs_elided += treq.secs;
+		td_complete_request(treq, 0);
+		return 1;
+	}
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return 0;
+
+	req->treq         = treq;
+	req->op           = VHD_OP_ZERO_PROBE;
+	req->secs_pending = treq.secs;
+	s->zero_probes++;
 
+	probe         = treq;
+	probe.op      = TD_OP_BLOCK_STATUS;
+	probe.status  = TD_BLOCK_STATE_HOLE;
+	probe.cb      = vhd_zero_probe_complete;
+	probe.cb_data = req;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x: probing parent "
+	    "for zero write\n", s->vhd.file, treq.sec, treq.secs);
+
+	td_forward_request(probe);
+	return 1;
+}
+
+static void
+__vhd_queue_write(struct vhd_state *s, td_request_t treq, int elide)
+{
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
 	while (treq.secs) {
 		int err;
-		uint8_t flags;
+		vhd_flag_t flags;
 		td_request_t clone;
+		struct vhd_cor_block *cor;
 
 		err   = 0;
 		flags = 0;
 		clone = treq;
 
+		/* fixed images only, dynamic ones split at blocks anyway */
+		if (vhd_is_encrypted(s))
+			clone.secs = MIN(clone.secs, vhd_crypto_max_secs(s));
+
+		cor = vhd_cor_block(s, clone.sec);
+		if (cor && clone.cb != vhd_cor_write_done) {
+			/* let the promotion land first */
+			if (cor->busy) {
+				err = -EBUSY;
+				goto fail;
+			}
+			cor->wgen++;
+		}
+
 		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_WRITE)) {
 		case -EINVAL:
 			err = -EINVAL;
 			goto fail;
 
 		case VHD_BM_BAT_LOCKED:
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (elide && vhd_elide_zero_write(s, clone))
+				break;
 			err = -EBUSY;
 			goto fail;
 
@@ -2172,6 +3499,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
 				      VHD_FLAG_REQ_UPDATE_BITMAP);
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (elide && vhd_elide_zero_write(s, clone))
+				break;
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -2180,6 +3509,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		case VHD_BM_BIT_CLEAR:
 			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
+			if (elide && vhd_elide_zero_write(s, clone))
+				break;
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -2227,6 +3558,38 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+vhd_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	__vhd_queue_write(s, treq, 1);
+}
+
+static void
+__complete_request(struct vhd_state *s, struct vhd_request *r, int err)
+{
+	if (test_vhd_flag(r->flags, VHD_FLAG_REQ_COR_PENDING))
+		s->cor.blocks[r->treq.sec / s->spb].wpending--;
+
+	td_complete_request(r->treq, err);
+	DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
+	    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
+	free_vhd_request(s, r);
+
+	s->returned++;
+	TRACE(s);
+}
+
+static void
+vhd_crypto_read_done(struct vhd_crypto_job *job)
+{
+	struct vhd_request *req;
+
+	req = container_of(job, struct vhd_request, crypto);
+	__complete_request(req->state, req, job->error);
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -2247,23 +3610,26 @@ signal_completion(struct vhd_request *list, int error)
 		if (vhd_is_encrypted(s)) {
 			switch (r->op) {
 			case VHD_OP_DATA_READ:
-				crypto_interface->vhd_crypto_decrypt(
-					&s->vhd, &r->treq);
+				if (s->crypto_async && !err) {
+					vhd_crypto_submit(s, r, 0,
+							  vhd_crypto_read_done);
+					r = next;
+					continue;
+				}
+				if (!err)
+					err = crypto_interface->
+						vhd_crypto_decrypt(&s->vhd,
+								   &r->treq);
 				break;
 			case VHD_OP_DATA_WRITE:
-				free(r->treq.buf);
+				vhd_crypto_buf_put(s, r->treq.buf,
+						   r->treq.secs);
 				r->treq.buf = r->orig_buf;
 				break;
 			}
 		}
-		td_complete_request(r->treq, err);
-		DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
-		    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
-		free_vhd_request(s, r);
-		r    = next;
-
-		s->returned++;
-		TRACE(s);
+		__complete_request(s, r, err);
+		r = next;
 	}
 }
 
@@ -2363,6 +3729,7 @@ finish_bitmap_transaction(struct vhd_state *s,
 	} else {
 		/* complete atomic write */
 		memcpy(bm->map, bm->shadow, map_size);
+		vhd_bs_update(s, bm);
 		if (!test_batmap(s, bm->blk) && bitmap_full(s, bm))
 			set_batmap(s, bm->blk);
 	}
@@ -2418,8 +3785,22 @@ finish_bat_write(struct vhd_request *req)
 	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
 
 	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
+		s->bat.bat.bat[s->bat.pbw_blk] = s->bat.pbw_offset;
 		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
+
+		if (vhd_batlog_active(s)) {
+			uint32_t sec = s->bat.pbw_blk / 128;
+
+			if (s->batlog.appending) {
+				s->batlog.dirty[sec] = 1;
+				s->batlog.next++;
+				s->batlog.appends++;
+			} else if (s->batlog.busy) {
+				/* may have lost a race with the checkpoint */
+				s->batlog.dirty[sec] = 1;
+				s->batlog.sec = MIN(s->batlog.sec, sec);
+			}
+		}
 	} else
 		tx->error = req->error;
 
@@ -2514,6 +3895,7 @@ finish_bitmap_read(struct vhd_request *req)
 
 	if (!req->error) {
 		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
+		vhd_bs_update(s, bm);
 
 		while (r) {
 			struct vhd_request tmp;
@@ -2523,12 +3905,15 @@ finish_bitmap_read(struct vhd_request *req)
 			free_vhd_request(s, r);
 
 			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
+			       tmp.op == VHD_OP_DATA_WRITE ||
+			       tmp.op == VHD_OP_BLOCK_STATUS);
 
 			if (tmp.op == VHD_OP_DATA_READ)
 				vhd_queue_read(s->driver, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
+			else
+				vhd_queue_block_status(s->driver, tmp.treq);
 
 			r = next;
 		}
@@ -2619,6 +4004,44 @@ finish_data_write(struct vhd_request *req)
 	}
 }
 
+static void
+finish_sync(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	td_complete_request(req->treq, req->error);
+	free_vhd_request(s, req);
+}
+
+/*
+ * Writes complete once their BAT update did, in place or logged. The
+ * log is O_DSYNC, so only the image needs syncing.
+ */
+static void
+_vhd_queue_sync(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_request *req;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	req = alloc_vhd_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	req->treq = treq;
+	req->op   = VHD_OP_SYNC;
+	do_aio_sync(s, req, s->vhd.fd);
+}
+
 void
 vhd_complete(void *arg, struct tiocb *tiocb, int err)
 {
@@ -2666,6 +4089,14 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_BATLOG_CKPT:
+		finish_batlog_checkpoint(req);
+		break;
+
+	case VHD_OP_SYNC:
+		finish_sync(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
@@ -2745,6 +4176,36 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "zero_elide", "{");
+	tapdisk_stats_field(st, "enabled", "d",
+			    !!test_vhd_flag(s->flags, VHD_FLAG_OPEN_ELIDE_ZEROS));
+	tapdisk_stats_field(st, "probes", "llu", s->zero_probes);
+	tapdisk_stats_field(st, "writes", "llu", s->zero_writes_elided);
+	tapdisk_stats_field(st, "secs", "llu", s->zero_secs_elided);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "bat_log", "{");
+	tapdisk_stats_field(st, "enabled", "d", vhd_batlog_active(s));
+	tapdisk_stats_field(st, "appends", "llu", s->batlog.appends);
+	tapdisk_stats_field(st, "checkpoints", "llu", s->batlog.checkpoints);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "cor", "{");
+	tapdisk_stats_field(st, "enabled", "d", !!s->cor.blocks);
+	tapdisk_stats_field(st, "threshold", "d", s->cor.threshold);
+	tapdisk_stats_field(st, "promotions", "llu", s->cor.promotions);
+	tapdisk_stats_field(st, "secs", "llu", s->cor.promoted_secs);
+	tapdisk_stats_field(st, "raced", "llu", s->cor.raced);
+	tapdisk_stats_field(st, "throttled", "llu", s->cor.throttled);
+	tapdisk_stats_field(st, "failed", "llu", s->cor.failed);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2755,7 +4216,10 @@ struct tap_disk tapdisk_vhd = {
 	.td_queue_block_status
 			    = vhd_queue_block_status,
 	.td_queue_write     = vhd_queue_write,
+	.td_queue_sync      = _vhd_queue_sync,
+	.td_quiesce         = _vhd_quiesce,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
 };
@@ -51,8 +51,17 @@
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 #define WARN(_f, _a...)              tlog_write(TLOG_WARN, _f, ##_a)
 
+/*
+ * Index blocks are cached in an LRU sized to hold the whole index of
+ * the VDI, up to TAPDISK3_VINDEX_CACHE_SIZE (MB). Lookups go through
+ * a map from BAT entry to cached block, files through a hash of open
+ * descriptors with an LRU of the idle ones.
+ */
 #define VHD_INDEX_FILE_POOL_SIZE     12
+#define VHD_INDEX_FILE_POOL_MAX      256
+#define VHD_INDEX_FILE_HASH_SIZE     64
 #define VHD_INDEX_CACHE_SIZE         4
+#define VHD_INDEX_CACHE_MEM          64 /* MB */
 #define VHD_INDEX_REQUESTS           (TAPDISK_DATA_REQUESTS + VHD_INDEX_CACHE_SIZE)
 
 #define VHD_INDEX_BLOCK_READ_PENDING 0x0001
@@ -80,7 +89,7 @@ struct vhd_index_request {
 
 struct vhd_index_block {
 	uint64_t                     blk;
-	uint32_t                     seqno;
+	struct list_head             lru;
 	td_flag_t                    state;
 	vhdi_block_t                 vhdi_block;
 	int                          table_size;
@@ -91,8 +100,9 @@ struct vhd_index_block {
 struct vhd_index_file_ref {
 	int                          fd;
 	vhdi_file_id_t               fid;
-	uint32_t                     seqno;
 	uint32_t                     refcnt;
+	struct list_head             hash;
+	struct list_head             lru;
 };
 
 struct vhd_index {
@@ -102,13 +112,16 @@ struct vhd_index {
 	vhdi_context_t               vhdi;
 	vhdi_file_table_t            files;
 
-	vhd_index_file_ref_t         fds[VHD_INDEX_FILE_POOL_SIZE];
-
-	vhd_index_block_t           *cache[VHD_INDEX_CACHE_SIZE];
+	vhd_index_file_ref_t        *fds;
+	int                          fds_size;
+	struct list_head             fds_hash[VHD_INDEX_FILE_HASH_SIZE];
+	struct list_head             fds_lru;
 
-	int                          cache_free_cnt;
-	vhd_index_block_t           *cache_free_list[VHD_INDEX_CACHE_SIZE];
-	vhd_index_block_t            cache_list[VHD_INDEX_CACHE_SIZE];
+	vhd_index_block_t          **cache;
+	int                          cache_size;
+	struct list_head             cache_free;
+	struct list_head             cache_lru;
+	vhd_index_block_t           *cache_list;
 
 	int                          requests_free_cnt;
 	vhd_index_request_t         *requests_free_list[VHD_INDEX_REQUESTS];
@@ -147,11 +160,8 @@ vhd_index_init(vhd_index_t *index)
 
 	memset(index, 0, sizeof(vhd_index_t));
 
-	index->cache_free_cnt = VHD_INDEX_CACHE_SIZE;
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		index->cache_free_list[i] = index->cache_list + i;
-		vhd_index_initialize_block(index->cache_free_list[i]);
-	}
+	INIT_LIST_HEAD(&index->cache_free);
+	INIT_LIST_HEAD(&index->cache_lru);
 
 	index->requests_free_cnt = VHD_INDEX_REQUESTS;
 	for (i = 0; i < VHD_INDEX_REQUESTS; i++) {
@@ -159,8 +169,31 @@ vhd_index_init(vhd_index_t *index)
 		vhd_index_initialize_request(index->requests_free_list[i]);
 	}
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		index->fds[i].fd = -1;
+	for (i = 0; i < VHD_INDEX_FILE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&index->fds_hash[i]);
+	INIT_LIST_HEAD(&index->fds_lru);
+}
+
+static int
+vhd_index_cache_size(vhd_index_t *index, size_t table_size)
+{
+	uint64_t i, allocated, mem;
+	const char *env;
+
+	allocated = 0;
+	for (i = 0; i < index->bat.vhd_blocks; i++)
+		if (index->bat.table[i] != DD_BLK_UNUSED)
+			allocated++;
+
+	mem = VHD_INDEX_CACHE_MEM;
+	env = getenv("TAPDISK3_VINDEX_CACHE_SIZE");
+	if (env)
+		mem = strtoull(env, NULL, 10);
+	mem <<= 20;
+
+	allocated = MIN(allocated, mem / table_size);
+
+	return MAX(allocated, VHD_INDEX_CACHE_SIZE);
 }
 
 static int
@@ -172,26 +205,60 @@ vhd_index_allocate_cache(vhd_index_t *index)
 
 	size = vhd_bytes_padded(index->vhdi.spb * sizeof(vhdi_entry_t));
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
+	index->cache = calloc(index->bat.vhd_blocks, sizeof(*index->cache));
+	if (!index->cache)
+		return -ENOMEM;
+
+	index->cache_size = vhd_index_cache_size(index, size);
+	index->cache_list = calloc(index->cache_size,
+				   sizeof(*index->cache_list));
+	if (!index->cache_list)
+		return -ENOMEM;
+
+	for (i = 0; i < index->cache_size; i++) {
+		vhd_index_block_t *block = index->cache_list + i;
+
 		err = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
 		if (err)
-			goto fail;
+			return -ENOMEM;
 
 		memset(buf, 0, size);
-		index->cache_list[i].vhdi_block.table   = (vhdi_entry_t *)buf;
-		index->cache_list[i].vhdi_block.entries = index->vhdi.spb;
-		index->cache_list[i].table_size         = size;
+		block->vhdi_block.table   = (vhdi_entry_t *)buf;
+		block->vhdi_block.entries = index->vhdi.spb;
+		block->table_size         = size;
+
+		vhd_index_initialize_block(block);
+		list_add_tail(&block->lru, &index->cache_free);
 	}
 
+	DPRINTF("%s: caching %d index blocks of %"PRIu64"\n",
+		index->name, index->cache_size, (uint64_t)index->bat.vhd_blocks);
+
 	return 0;
+}
 
-fail:
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		free(index->cache_list[i].vhdi_block.table);
-		index->cache_list[i].vhdi_block.table = NULL;
+static int
+vhd_index_allocate_file_pool(vhd_index_t *index)
+{
+	int i;
+
+	index->fds_size = MIN(MAX(index->files.entries,
+				  VHD_INDEX_FILE_POOL_SIZE),
+			      VHD_INDEX_FILE_POOL_MAX);
+
+	index->fds = calloc(index->fds_size, sizeof(*index->fds));
+	if (!index->fds)
+		return -ENOMEM;
+
+	for (i = 0; i < index->fds_size; i++) {
+		vhd_index_file_ref_t *ref = index->fds + i;
+
+		ref->fd = -1;
+		INIT_LIST_HEAD(&ref->hash);
+		list_add_tail(&ref->lru, &index->fds_lru);
 	}
 
-	return -ENOMEM;
+	return 0;
 }
 
 static void
@@ -199,12 +266,17 @@ vhd_index_free(vhd_index_t *index)
 {
 	int i;
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-		free(index->cache_list[i].vhdi_block.table);
+	if (index->cache_list)
+		for (i = 0; i < index->cache_size; i++)
+			free(index->cache_list[i].vhdi_block.table);
+	free(index->cache_list);
+	free(index->cache);
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		if (index->fds[i].fd != -1)
-			close(index->fds[i].fd);
+	if (index->fds)
+		for (i = 0; i < index->fds_size; i++)
+			if (index->fds[i].fd != -1)
+				close(index->fds[i].fd);
+	free(index->fds);
 
 	vhdi_file_table_free(&index->files);
 	free(index->bat.table);
@@ -264,10 +336,12 @@ vhd_index_open(td_driver_t *driver, const char *name,
 	}
 
 	err = vhd_index_allocate_cache(index);
-	if (err) {
-		vhd_index_free(index);
-		return err;
-	}
+	if (err)
+		goto fail;
+
+	err = vhd_index_allocate_file_pool(index);
+	if (err)
+		goto fail;
 
 	driver->info.size = index->bat.vhd_blocks * index->bat.vhd_block_size;
 	driver->info.sector_size = VHD_SECTOR_SIZE;
@@ -278,6 +352,11 @@ vhd_index_open(td_driver_t *driver, const char *name,
 	DPRINTF("opened vhd index %s\n", name);
 
 	return 0;
+
+fail:
+	vhdi_close(&index->vhdi);
+	vhd_index_free(index);
+	return err;
 }
 
 static int
@@ -295,49 +374,24 @@ vhd_index_close(td_driver_t *driver)
 	return 0;
 }
 
-static inline void
-vhd_index_touch_file_ref(vhd_index_t *index, vhd_index_file_ref_t *ref)
+static inline struct list_head *
+vhd_index_file_bucket(vhd_index_t *index, vhdi_file_id_t id)
 {
-	int i;
-
-	if (++ref->seqno == 0xFFFFFFFF)
-		for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-			index->fds[i].seqno >>= 1;
+	return &index->fds_hash[id % VHD_INDEX_FILE_HASH_SIZE];
 }
 
 static inline void
 vhd_index_get_file_ref(vhd_index_file_ref_t *ref)
 {
-	++ref->refcnt;
+	if (!ref->refcnt++)
+		list_del_init(&ref->lru);
 }
 
 static inline void
-vhd_index_put_file_ref(vhd_index_file_ref_t *ref)
+vhd_index_put_file_ref(vhd_index_t *index, vhd_index_file_ref_t *ref)
 {
-	--ref->refcnt;
-}
-
-static inline vhd_index_file_ref_t *
-vhd_index_find_lru_file_ref(vhd_index_t *index)
-{
-	int i;
-	uint32_t min;
-	vhd_index_file_ref_t *lru;
-
-	lru = NULL;
-	min = (uint32_t)-1;
-
-	for (i = 1; i < VHD_INDEX_FILE_POOL_SIZE; i++) {
-		if (index->fds[i].refcnt)
-			continue;
-
-		if (!lru || index->fds[i].seqno < min) {
-			min = index->fds[i].seqno;
-			lru = index->fds + i;
-		}
-	}
-
-	return lru;
+	if (!--ref->refcnt)
+		list_add_tail(&ref->lru, &index->fds_lru);
 }
 
 static inline int
@@ -372,23 +426,25 @@ static int
 vhd_index_get_file(vhd_index_t *index,
 		   vhdi_file_id_t id, vhd_index_file_ref_t **ref)
 {
-	int i, err;
+	int err;
+	struct list_head *bucket;
 	vhd_index_file_ref_t *lru;
 
-	*ref = NULL;
+	*ref   = NULL;
+	bucket = vhd_index_file_bucket(index, id);
 
-	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		if (id == index->fds[i].fid) {
-			*ref = index->fds + i;
-			vhd_index_touch_file_ref(index, *ref);
-			vhd_index_get_file_ref(*ref);
+	list_for_each_entry(lru, bucket, hash)
+		if (lru->fid == id) {
+			vhd_index_get_file_ref(lru);
+			*ref = lru;
 			return 0;
 		}
 
-	lru = vhd_index_find_lru_file_ref(index);
-	if (!lru)
+	if (list_empty(&index->fds_lru))
 		return -EBUSY;
 
+	lru = list_first_entry(&index->fds_lru, vhd_index_file_ref_t, lru);
+	list_del_init(&lru->hash);
 	if (lru->fd != -1)
 		close(lru->fd);
 
@@ -396,7 +452,7 @@ vhd_index_get_file(vhd_index_t *index,
 	if (err)
 		goto fail;
 
-	vhd_index_touch_file_ref(index, lru);
+	list_add(&lru->hash, bucket);
 	vhd_index_get_file_ref(lru);
 	*ref = lru;
 	return 0;
@@ -440,44 +496,23 @@ vhd_index_block_valid(vhd_index_block_t *block)
 static inline void
 vhd_index_touch_block(vhd_index_t *index, vhd_index_block_t *block)
 {
-	int i;
-
-	if (++block->seqno == 0xFFFFFFFF)
-		for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-			index->cache_list[i].seqno >>= 1;
+	list_move_tail(&block->lru, &index->cache_lru);
 }
 
 static inline vhd_index_block_t *
 vhd_index_get_lru_block(vhd_index_t *index)
 {
-	int i, idx;
-	uint32_t min;
-	vhd_index_block_t *block, *lru;
-
-	lru = NULL;
-	min = (uint32_t)-1;
-	idx = 0;
-
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		block = index->cache[i];
-
-		if (!block)
-			continue;
+	vhd_index_block_t *block;
 
+	list_for_each_entry(block, &index->cache_lru, lru) {
 		if (td_flag_test(block->state, VHD_INDEX_BLOCK_READ_PENDING))
 			continue;
 
-		if (!lru || block->seqno < min) {
-			lru = block;
-			min = block->seqno;
-			idx = i;
-		}
+		index->cache[block->blk] = NULL;
+		return block;
 	}
 
-	if (lru)
-		index->cache[idx] = NULL;
-
-	return lru;
+	return NULL;
 }
 
 static inline int
@@ -487,8 +522,9 @@ vhd_index_allocate_block(vhd_index_t *index, vhd_index_block_t **block)
 
 	*block = NULL;
 
-	if (index->cache_free_cnt > 0)
-		b = index->cache_free_list[--index->cache_free_cnt];
+	if (!list_empty(&index->cache_free))
+		b = list_first_entry(&index->cache_free,
+				     vhd_index_block_t, lru);
 	else {
 		b = vhd_index_get_lru_block(index);
 		if (!b)
@@ -506,7 +542,7 @@ static int
 vhd_index_install_block(vhd_index_t *index,
 			vhd_index_block_t **block, uint32_t blk)
 {
-	int i, err;
+	int err;
 	vhd_index_block_t *b;
 
 	*block = NULL;
@@ -517,13 +553,8 @@ vhd_index_install_block(vhd_index_t *index,
 
 	b->blk = blk;
 
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++)
-		if (!index->cache[i]) {
-			index->cache[i] = b;
-			break;
-		}
-
-	ASSERT(i < VHD_INDEX_CACHE_SIZE);
+	ASSERT(!index->cache[blk]);
+	index->cache[blk] = b;
 	*block = b;
 
 	return 0;
@@ -532,19 +563,7 @@ vhd_index_install_block(vhd_index_t *index,
 static inline vhd_index_block_t *
 vhd_index_get_block(vhd_index_t *index, uint32_t blk)
 {
-	int i;
-	vhd_index_block_t *block;
-
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
-		block = index->cache[i];
-		if (!block)
-			continue;
-
-		if (block->blk == blk)
-			return block;
-	}
-
-	return NULL;
+	return index->cache[blk];
 }
 
 static int
@@ -777,7 +796,7 @@ vhd_index_signal_completion(vhd_index_t *index,
 			    vhd_index_request_t *req, int err)
 {
 	td_complete_request(req->treq, err);
-	vhd_index_put_file_ref(req->file);
+	vhd_index_put_file_ref(index, req->file);
 	vhd_index_free_request(index, req);
 }
 
@@ -859,7 +878,7 @@ vhd_index_debug(td_driver_t *driver)
 		fd     = -1;
 		refcnt = 0;
 
-		for (j = 0; j < VHD_INDEX_FILE_POOL_SIZE; j++)
+		for (j = 0; j < index->fds_size; j++)
 			if (index->fds[j].fid == index->files.table[i].file_id) {
 				fd     = index->fds[j].fd;
 				refcnt = index->fds[j].refcnt;
@@ -886,15 +905,15 @@ vhd_index_debug(td_driver_t *driver)
 	}
 
 	WARN("BLOCKS:\n");
-	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
+	for (i = 0; i < index->cache_size; i++) {
 		int queued;
 		vhd_index_block_t *block;
 		vhd_index_request_t *req, *tmp;
 
 		queued = 0;
-		block  = index->cache[i];
+		block  = index->cache_list + i;
 
-		if (!block)
+		if (index->cache[block->blk] != block)
 			continue;
 
 		vhd_index_block_for_each_request(block, req, tmp)
@@ -67,6 +67,9 @@ typedef	int (*submit_tiocbs_queue)(tqueue );
 typedef	void (*prep_tiocb_queue)(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
 
+/* rw argument of prep: 0 reads, 1 writes, TIO_FDSYNC syncs the fd */
+#define TIO_FDSYNC 2
+
 struct backend {
 	debug_queue debug;
 	init_queue init;
@@ -218,6 +218,10 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
+	if (io->aio_lio_opcode != IO_CMD_PREAD &&
+	    io->aio_lio_opcode != IO_CMD_PWRITE)
+		return -EINVAL;
+
 	if (iocb_vectorized(head->aio_lio_opcode) != iocb_vectorized(io->aio_lio_opcode))
 		return -EINVAL;
 
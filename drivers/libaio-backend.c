@@ -84,6 +84,9 @@ typedef struct _libaio_queue {
 	struct tlist          deferred;
 	int                   tiocbs_deferred;
 
+	/* fdsyncs done at submit time, on kernels without aio fsync */
+	struct tlist          syncs;
+
 	/* optional tapdisk filter */
 	struct tfilter       *filter;
 
@@ -245,6 +248,40 @@ libaio_backend_lio_check_resfd(void)
 	return tapdisk_linux_version() >= KERNEL_VERSION(2, 6, 22);
 }
 
+static int
+libaio_backend_lio_check_fdsync(void)
+{
+	static int fdsync = -1;
+
+	if (fdsync < 0)
+		fdsync = tapdisk_linux_version() >= KERNEL_VERSION(4, 18, 0);
+
+	return fdsync;
+}
+
+/*
+ * Older kernels fail IOCB_CMD_FDSYNC, and with it the rest of the
+ * batch, so those syncs are done synchronously, ahead of it.
+ */
+static void
+libaio_backend_lio_complete_syncs(libaio_queue *queue)
+{
+	struct tiocb *tiocb, *next;
+	struct iocb *iocb;
+	int err;
+
+	tiocb = queue->syncs.head;
+	queue->syncs.head = queue->syncs.tail = NULL;
+
+	for (; tiocb != NULL; tiocb = next) {
+		next  = tiocb->next;
+		iocb  = &tiocb->uiocb.io;
+		err   = fdatasync(iocb->aio_fildes) ? -errno : 0;
+		tiocb->next = NULL;
+		tiocb->cb(tiocb->arg, tiocb, err);
+	}
+}
+
 static void
 libaio_backend_lio_destroy_aio(libaio_queue *queue)
 {
@@ -472,6 +509,9 @@ libaio_backend_lio_submit(libaio_queue *queue)
 	struct lio *lio = queue->tio_data;
 	int merged, submitted, err = 0;
 
+	if (queue->syncs.head)
+		libaio_backend_lio_complete_syncs(queue);
+
 	if (!queue->queued)
 		return 0;
 
@@ -648,7 +688,9 @@ libaio_backend_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t
 {
 	struct iocb *iocb = &(tiocb->uiocb.io);
 
-	if (rw)
+	if (rw == TIO_FDSYNC)
+		io_prep_fdsync(iocb, fd);
+	else if (rw)
 		io_prep_pwrite(iocb, fd, buf, size, offset);
 	else
 		io_prep_pread(iocb, fd, buf, size, offset);
@@ -663,6 +705,18 @@ static void
 libaio_backend_queue_tiocb(tqueue q, struct tiocb *tiocb)
 {
 	libaio_queue* queue = (libaio_queue*)q;
+	struct iocb *iocb = &(tiocb->uiocb.io);
+
+	if (iocb->aio_lio_opcode == IO_CMD_FDSYNC &&
+	    !libaio_backend_lio_check_fdsync()) {
+		struct tlist *list = &queue->syncs;
+
+		if (!list->head)
+			list->head = list->tail = tiocb;
+		else
+			list->tail = list->tail->next = tiocb;
+		return;
+	}
 
 	if (!libaio_backend_queue_full(queue))
 		queue_tiocb(queue, tiocb);
@@ -689,7 +743,7 @@ libaio_backend_submit_all_tiocbs(tqueue q)
 	libaio_queue* queue = (libaio_queue*)q;
 	do {
 		submitted += libaio_backend_submit_tiocbs(queue);
-	} while (!libaio_backend_queue_empty(queue));
+	} while (!libaio_backend_queue_empty(queue) || queue->syncs.head);
 
 	return submitted;
 }
@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <aio.h>
+#include <fcntl.h>
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -356,15 +357,22 @@ posixaio_backend_lio_submit(posix_aio_queue *queue)
 	int j, err = 0, queued = queue->queued;
 	struct aiocb **aiocbList = queue->aiocbList;
 	struct tiocb **tiocbList = queue->tiocbList;
+	struct tiocb *tiocb, *failed = NULL;
 	if(queued == 0)
 		return 0;
 	
 	for(j = 0; j < queue->queued; j++)
 	{ 
+		/* lio_listio skips LIO_NOP, which stands for fdsync here */
+		if (aiocbList[j]->aio_lio_opcode == LIO_NOP &&
+		    aio_fsync(O_DSYNC, aiocbList[j])) {
+			tiocbList[j]->next = failed;
+			failed = tiocbList[j];
+			continue;
+		}
 		pending_tiocb(queue, tiocbList[j]);
 	}
 
-	ASSERT(queue->pending.tail == tiocbList[queued-1])
 	err = lio_listio(LIO_NOWAIT, aiocbList, queued, NULL);
 
 	if (err) {
@@ -376,6 +384,14 @@ posixaio_backend_lio_submit(posix_aio_queue *queue)
 
 	queue->queued = 0;
 
+	/* may queue more tiocbs */
+	while ((tiocb = failed)) {
+		failed = tiocb->next;
+		tiocb->next = NULL;
+		tiocb->cb(tiocb->arg, tiocb,
+			  fdatasync(tiocb->uiocb.aio.aio_fildes) ? -errno : 0);
+	}
+
 	return queued;
 }
 
@@ -544,7 +560,10 @@ posixaio_backend_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size
 	aiocb->aio_sigevent.sigev_signo = IO_SIGNAL;
 	aiocb->aio_sigevent.sigev_value.sival_ptr = NULL;
 
-	aiocb->aio_lio_opcode = rw ? LIO_WRITE : LIO_READ;
+	if (rw == TIO_FDSYNC)
+		aiocb->aio_lio_opcode = LIO_NOP;
+	else
+		aiocb->aio_lio_opcode = rw ? LIO_WRITE : LIO_READ;
 
 	tiocb->cb   = cb;
 	tiocb->arg  = arg;
@@ -737,6 +737,18 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		flags |= TD_OPEN_RDONLY;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_NO_O_DIRECT)
 		flags |= TD_OPEN_NO_O_DIRECT;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ELIDE_ZEROS)
+		flags |= TD_OPEN_ELIDE_ZEROS;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_BAT_LOG)
+		flags |= TD_OPEN_BAT_LOG;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_COR)
+		flags |= TD_OPEN_COPY_ON_READ;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_WRITEBACK)
+		flags |= TD_OPEN_WRITEBACK;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC) {
+		flags |= TD_OPEN_MIRROR_ASYNC;
+		vbd->mirror_lag = request->u.params.mirror_lag;
+	}
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SHARED)
 		flags |= TD_OPEN_SHAREABLE;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_CACHE)
@@ -954,6 +966,18 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 		err = 0;
 	}
 
+	if (err)
+		goto out;
+
+	do {
+		err = tapdisk_vbd_quiesce_images(vbd);
+		if (!err || err != -EAGAIN)
+			break;
+
+		tapdisk_server_iterate();
+
+	} while (conn->fd >= 0);
+
 	if (err)
 		goto out;
 
@@ -1069,6 +1093,11 @@ tapdisk_control_resume_vbd(struct tapdisk_ctl_conn *conn,
 		INFO("resuming VBD %d with secondary '%s'\n", request->cookie, name);
 		vbd->secondary_name = name;
 		vbd->flags |= TD_OPEN_SECONDARY;
+		if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC) {
+			vbd->flags |= TD_OPEN_MIRROR_ASYNC;
+			vbd->mirror_lag = request->u.params.mirror_lag;
+		} else
+			vbd->flags &= ~TD_OPEN_MIRROR_ASYNC;
 
 		/* TODO If an error occurs below we're not undoing this. */
 	}
@@ -267,6 +267,55 @@ fail:
 	td_complete_request(*treq, err);
 }
 
+void
+td_queue_sync(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	if (!driver->ops->td_queue_sync) {
+		/* nothing volatile */
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	driver->ops->td_queue_sync(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+int
+td_quiesce(td_image_t *image)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 0;
+
+	if (!driver->ops->td_quiesce)
+		return 0;
+
+	return driver->ops->td_quiesce(driver);
+}
+
 void
 td_forward_request(td_request_t treq)
 {
@@ -299,6 +348,14 @@ td_prep_write(td_driver_t *driver, struct tiocb *tiocb, int fd, char *buf, size_
 	tapdisk_driver_prep_tiocb(driver, tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+void
+td_prep_sync(td_driver_t *driver, struct tiocb *tiocb, int fd,
+	     td_queue_callback_t cb, void *arg)
+{
+	tapdisk_driver_prep_tiocb(driver, tiocb, fd, TIO_FDSYNC, NULL, 0, 0,
+				  cb, arg);
+}
+
 void
 td_debug(td_image_t *image)
 {
@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-log.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-mirror.h"
+#include "timeout-math.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "mirror: " _f, ##_a)
+#define ERROR(_f, _a...)           tlog_syslog(TLOG_WARN, "mirror: " _f, ##_a)
+
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+
+#define TD_MIRROR_CHUNK_SHIFT      7        /* 64k */
+#define TD_MIRROR_CHUNK_SECS       (1 << TD_MIRROR_CHUNK_SHIFT)
+#define TD_MIRROR_RESYNC_DEPTH     4
+#define TD_MIRROR_RESYNC_CHUNKS    16       /* per request */
+#define TD_MIRROR_MAX_COPIES       128
+#define TD_MIRROR_INTERVAL         100000   /* usecs */
+
+typedef struct td_mirror_extent    td_mirror_extent_t;
+
+struct td_mirror_extent {
+	struct list_head           next;
+	td_mirror_t               *m;
+
+	td_sector_t                sec;
+	int                        secs;
+	char                      *buf;
+	int                        resync;
+
+	int                        pending;
+	int                        error;
+	int                        failed_write;
+
+	td_vbd_request_t           vreq;
+	struct td_iovec            iov;
+};
+
+struct td_mirror {
+	td_vbd_t                  *vbd;
+	td_sector_t                size;
+
+	uint64_t                  *dirty;
+	uint64_t                   chunks;
+	uint64_t                   n_dirty;
+	uint64_t                   cursor;
+
+	struct list_head           inflight;
+	int                        n_copies;
+	int                        n_resync;
+	uint64_t                   inflight_bytes;
+	uint64_t                   max_lag;
+
+	event_id_t                 timer;
+	int                        failed;
+	int                        closed;     /* freed once drained */
+
+	uint64_t                   copied;
+	uint64_t                   copied_secs;
+	uint64_t                   deferred;
+	uint64_t                   resynced;
+	uint64_t                   resynced_secs;
+	uint64_t                   errors;
+};
+
+static void
+td_mirror_mark_dirty(td_mirror_t *m, td_sector_t sec, int secs)
+{
+	uint64_t c, end;
+
+	c   = sec >> TD_MIRROR_CHUNK_SHIFT;
+	end = (sec + secs + TD_MIRROR_CHUNK_SECS - 1) >> TD_MIRROR_CHUNK_SHIFT;
+
+	for (; c < end && c < m->chunks; c++) {
+		uint64_t bit = 1ULL << (c % 64);
+
+		if (m->dirty[c / 64] & bit)
+			continue;
+
+		m->dirty[c / 64] |= bit;
+		m->n_dirty++;
+	}
+}
+
+static inline int
+td_mirror_test_dirty(td_mirror_t *m, uint64_t c)
+{
+	return !!(m->dirty[c / 64] & (1ULL << (c % 64)));
+}
+
+static inline void
+td_mirror_clear_dirty(td_mirror_t *m, uint64_t c)
+{
+	m->dirty[c / 64] &= ~(1ULL << (c % 64));
+	m->n_dirty--;
+}
+
+static int
+td_mirror_overlaps(td_mirror_t *m, td_sector_t sec, int secs)
+{
+	td_mirror_extent_t *e;
+
+	list_for_each_entry(e, &m->inflight, next)
+		if (e->sec < sec + secs && sec < e->sec + e->secs)
+			return 1;
+
+	return 0;
+}
+
+static void
+td_mirror_fail(td_mirror_t *m, int err)
+{
+	td_vbd_t *vbd = m->vbd;
+	td_image_t *image = vbd->secondary;
+
+	ERROR("%s: secondary failed: %s, disabling mirroring\n",
+	      vbd->name, strerror(-err));
+
+	m->failed = err;
+
+	memset(m->dirty, 0, (m->chunks + 63) / 64 * sizeof(uint64_t));
+	m->n_dirty = 0;
+
+	if (!image)
+		return;
+
+	if (image->type == DISK_TYPE_NBD)
+		vbd->nbd_mirror_failed = 1;
+
+	list_del_init(&image->next);
+	vbd->retired        = image;
+	vbd->secondary      = NULL;
+	vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
+}
+
+static void
+td_mirror_extent_free(td_mirror_extent_t *e)
+{
+	free(e->buf);
+	free(e);
+}
+
+static void
+td_mirror_free(td_mirror_t *m)
+{
+	free(m->dirty);
+	free(m);
+}
+
+static void
+td_mirror_extent_release(td_mirror_extent_t *e)
+{
+	td_mirror_t *m = e->m;
+
+	list_del(&e->next);
+	m->inflight_bytes -= (uint64_t)e->secs << SECTOR_SHIFT;
+	if (e->resync)
+		m->n_resync--;
+	else
+		m->n_copies--;
+
+	td_mirror_extent_free(e);
+}
+
+static void
+td_mirror_extent_done(td_mirror_extent_t *e)
+{
+	td_mirror_t *m = e->m;
+
+	if (m->closed) {
+		td_mirror_extent_release(e);
+		if (list_empty(&m->inflight))
+			td_mirror_free(m);
+		return;
+	}
+
+	if (e->error) {
+		m->errors++;
+
+		switch (abs(e->error)) {
+		case EAGAIN:
+		case EBUSY:
+		case EINTR:
+			break;
+		default:
+			/* the primary failing a read back is not our problem */
+			if (e->failed_write && !m->failed)
+				td_mirror_fail(m, e->error);
+		}
+
+		if (!m->failed)
+			td_mirror_mark_dirty(m, e->sec, e->secs);
+	} else if (e->resync) {
+		m->resynced++;
+		m->resynced_secs += e->secs;
+	} else {
+		m->copied++;
+		m->copied_secs += e->secs;
+	}
+
+	td_mirror_extent_release(e);
+	td_mirror_kick(m);
+}
+
+static void
+__td_mirror_write_cb(td_request_t treq, int err)
+{
+	td_mirror_extent_t *e = treq.cb_data;
+
+	if (err)
+		e->failed_write = 1;
+
+	e->error    = e->error ? : err;
+	e->pending -= treq.secs;
+	if (!e->pending)
+		td_mirror_extent_done(e);
+}
+
+/*
+ * The secondary is written behind the vbd's back: there is no vbd
+ * request to complete, nor to forward on.
+ */
+static void
+td_mirror_write_secondary(td_mirror_extent_t *e)
+{
+	td_image_t *image = e->m->vbd->secondary;
+	td_request_t treq;
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_WRITE;
+	treq.sec     = e->sec;
+	treq.secs    = e->secs;
+	treq.buf     = e->buf;
+	treq.image   = image;
+	treq.cb      = __td_mirror_write_cb;
+	treq.cb_data = e;
+
+	e->pending = e->secs;
+
+	if (!image || e->m->failed) {
+		td_complete_request(treq, -ENODEV);
+		return;
+	}
+
+	td_queue_write(image, treq);
+}
+
+static td_mirror_extent_t *
+td_mirror_extent_alloc(td_mirror_t *m, td_sector_t sec, int secs)
+{
+	td_mirror_extent_t *e;
+	int err;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+
+	err = posix_memalign((void **)&e->buf, SECTOR_SIZE,
+			     (size_t)secs << SECTOR_SHIFT);
+	if (err) {
+		free(e);
+		return NULL;
+	}
+
+	e->m    = m;
+	e->sec  = sec;
+	e->secs = secs;
+
+	list_add_tail(&e->next, &m->inflight);
+	m->inflight_bytes += (uint64_t)secs << SECTOR_SHIFT;
+
+	return e;
+}
+
+void
+td_mirror_write_done(td_mirror_t *m, td_sector_t sec, int secs,
+		     const char *buf)
+{
+	uint64_t bytes = (uint64_t)secs << SECTOR_SHIFT;
+	td_mirror_extent_t *e;
+
+	if (m->failed)
+		return;
+
+	if (m->n_copies >= TD_MIRROR_MAX_COPIES ||
+	    m->inflight_bytes + bytes > m->max_lag ||
+	    td_mirror_overlaps(m, sec, secs))
+		goto defer;
+
+	e = td_mirror_extent_alloc(m, sec, secs);
+	if (!e)
+		goto defer;
+
+	m->n_copies++;
+	memcpy(e->buf, buf, bytes);
+
+	td_mirror_write_secondary(e);
+	return;
+
+defer:
+	m->deferred++;
+	td_mirror_mark_dirty(m, sec, secs);
+	td_mirror_kick(m);
+}
+
+static void
+__td_mirror_read_cb(td_vbd_request_t *vreq, int error,
+		    void *token, int final)
+{
+	td_mirror_extent_t *e = token;
+
+	if (error || e->m->closed) {
+		e->error = error ? : -ECANCELED;
+		td_mirror_extent_done(e);
+		return;
+	}
+
+	td_mirror_write_secondary(e);
+}
+
+/*
+ * Finds the next run of dirty chunks not overlapping a write in
+ * flight, clears them and returns its start, or -1.
+ */
+static int64_t
+td_mirror_next_run(td_mirror_t *m, int *n)
+{
+	uint64_t c, i;
+
+	for (i = 0; i < m->chunks; i++) {
+		c = (m->cursor + i) % m->chunks;
+
+		if (!m->dirty[c / 64]) {
+			i += 63 - c % 64;
+			continue;
+		}
+
+		if (!td_mirror_test_dirty(m, c))
+			continue;
+
+		if (td_mirror_overlaps(m, c << TD_MIRROR_CHUNK_SHIFT,
+				       TD_MIRROR_CHUNK_SECS))
+			continue;
+
+		for (*n = 0; *n < TD_MIRROR_RESYNC_CHUNKS &&
+			     c + *n < m->chunks &&
+			     td_mirror_test_dirty(m, c + *n) &&
+			     !td_mirror_overlaps(m,
+						 (c + *n) << TD_MIRROR_CHUNK_SHIFT,
+						 TD_MIRROR_CHUNK_SECS);
+		     (*n)++)
+			td_mirror_clear_dirty(m, c + *n);
+
+		m->cursor = c + *n;
+		return c;
+	}
+
+	return -1;
+}
+
+/*
+ * Reads back from the vbd, i.e. through the whole chain, so a chunk
+ * never written to the leaf still copies correctly. These go ahead
+ * of anything queued: guest writes may be waiting on them.
+ */
+static int
+td_mirror_resync(td_mirror_t *m)
+{
+	td_mirror_extent_t *e;
+	td_vbd_request_t *vreq;
+	td_sector_t sec;
+	int64_t c;
+	int n, secs, err;
+
+	c = td_mirror_next_run(m, &n);
+	if (c < 0)
+		return -ENOENT;
+
+	sec  = (td_sector_t)c << TD_MIRROR_CHUNK_SHIFT;
+	secs = MIN((td_sector_t)n << TD_MIRROR_CHUNK_SHIFT, m->size - sec);
+
+	e = td_mirror_extent_alloc(m, sec, secs);
+	if (!e) {
+		td_mirror_mark_dirty(m, sec, secs);
+		return -ENOMEM;
+	}
+
+	e->resync = 1;
+	m->n_resync++;
+
+	e->iov.base  = e->buf;
+	e->iov.secs  = secs;
+
+	vreq         = &e->vreq;
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &e->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = __td_mirror_read_cb;
+	vreq->token  = e;
+	vreq->name   = "mirror";
+
+	err = tapdisk_vbd_queue_request(m->vbd, vreq);
+	if (err) {
+		e->error = err;
+		td_mirror_extent_done(e);
+		return err;
+	}
+
+	list_move(&vreq->next, &m->vbd->new_requests);
+
+	return 0;
+}
+
+void
+td_mirror_kick(td_mirror_t *m)
+{
+	if (m->failed || m->closed)
+		return;
+
+	while (m->n_dirty && m->n_resync < TD_MIRROR_RESYNC_DEPTH)
+		if (td_mirror_resync(m))
+			break;
+}
+
+static void
+td_mirror_timer(event_id_t id, char mode, void *private)
+{
+	td_mirror_kick(private);
+}
+
+int
+td_mirror_lagging(td_mirror_t *m)
+{
+	uint64_t dirty;
+
+	if (m->failed)
+		return 0;
+
+	dirty = (m->n_dirty << TD_MIRROR_CHUNK_SHIFT) << SECTOR_SHIFT;
+
+	return m->inflight_bytes + dirty > m->max_lag;
+}
+
+int
+td_mirror_idle(td_mirror_t *m)
+{
+	return !m->n_dirty && list_empty(&m->inflight);
+}
+
+td_mirror_t *
+td_mirror_create(td_vbd_t *vbd, td_sector_t size)
+{
+	td_mirror_t *m;
+	const char *env;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->vbd    = vbd;
+	m->size   = size;
+	m->chunks = (size + TD_MIRROR_CHUNK_SECS - 1) >> TD_MIRROR_CHUNK_SHIFT;
+	INIT_LIST_HEAD(&m->inflight);
+
+	m->dirty = calloc((m->chunks + 63) / 64, sizeof(uint64_t));
+	if (!m->dirty)
+		goto fail;
+
+	m->max_lag = TD_MIRROR_MAX_LAG_DEFAULT;
+	env = getenv("TAPDISK3_MIRROR_MAX_LAG");
+	if (env)
+		m->max_lag = strtoull(env, NULL, 10);
+	if (vbd->mirror_lag > 0)
+		m->max_lag = vbd->mirror_lag;
+	m->max_lag <<= 20;
+
+	m->timer = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+						 TV_USECS(TD_MIRROR_INTERVAL),
+						 td_mirror_timer, m);
+	if (m->timer < 0)
+		goto fail;
+
+	INFO("%s: asynchronous, lag up to %"PRIu64" MiB\n",
+	     vbd->name, m->max_lag >> 20);
+
+	return m;
+
+fail:
+	free(m->dirty);
+	free(m);
+	return NULL;
+}
+
+/*
+ * A resync read still queued on the vbd, not yet issued.
+ */
+static int
+td_mirror_extent_queued(td_mirror_t *m, td_mirror_extent_t *e)
+{
+	td_vbd_request_t *vreq;
+
+	if (!e->resync)
+		return 0;
+
+	list_for_each_entry(vreq, &m->vbd->new_requests, next)
+		if (vreq == &e->vreq)
+			return 1;
+
+	list_for_each_entry(vreq, &m->vbd->failed_requests, next)
+		if (vreq == &e->vreq)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Callers wait for td_mirror_idle first (tapdisk_vbd_quiesce_images):
+ * in-flight extents hold on to the vbd and images. Otherwise, queued
+ * resyncs are cancelled and the rest freed as they complete.
+ */
+void
+td_mirror_destroy(td_mirror_t *m)
+{
+	td_mirror_extent_t *e, *tmp;
+
+	if (!m)
+		return;
+
+	tapdisk_server_unregister_event(m->timer);
+	m->closed = 1;
+
+	list_for_each_entry_safe(e, tmp, &m->inflight, next)
+		if (td_mirror_extent_queued(m, e)) {
+			list_del(&e->vreq.next);
+			td_mirror_extent_release(e);
+		}
+
+	if (!td_mirror_idle(m))
+		ERROR("%s: destroyed with %"PRIu64" chunks dirty, "
+		      "%"PRIu64" bytes in flight\n",
+		      m->vbd->name, m->n_dirty, m->inflight_bytes);
+
+	if (list_empty(&m->inflight))
+		td_mirror_free(m);
+}
+
+void
+td_mirror_stats(td_mirror_t *m, td_stats_t *st)
+{
+	uint64_t dirty = (m->n_dirty << TD_MIRROR_CHUNK_SHIFT) << SECTOR_SHIFT;
+
+	tapdisk_stats_field(st, "failed", "d", m->failed);
+	tapdisk_stats_field(st, "max_lag", "llu", m->max_lag);
+	tapdisk_stats_field(st, "lag", "llu", m->inflight_bytes + dirty);
+	tapdisk_stats_field(st, "dirty_chunks", "llu", m->n_dirty);
+	tapdisk_stats_field(st, "inflight", "d", m->n_copies + m->n_resync);
+	tapdisk_stats_field(st, "copied", "llu", m->copied);
+	tapdisk_stats_field(st, "copied_secs", "llu", m->copied_secs);
+	tapdisk_stats_field(st, "deferred", "llu", m->deferred);
+	tapdisk_stats_field(st, "resynced", "llu", m->resynced);
+	tapdisk_stats_field(st, "resynced_secs", "llu", m->resynced_secs);
+	tapdisk_stats_field(st, "errors", "llu", m->errors);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_MIRROR_H_
+#define _TAPDISK_MIRROR_H_
+
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Asynchronous mirroring to vbd->secondary. Guest writes complete on
+ * the primary alone; their data is copied and written to the
+ * secondary in the background. Whatever can't be copied right away,
+ * because it overlaps a copy in flight, exceeds the lag budget or
+ * failed to write, is marked in a dirty bitmap and later read back
+ * from the vbd and written again.
+ *
+ * The lag (bytes in flight to the secondary plus dirty bytes) is
+ * bounded by tap-ctl -L, else TAPDISK3_MIRROR_MAX_LAG (MiB): beyond
+ * it, the vbd holds back new guest writes until the mirror caught up.
+ */
+
+#define TD_MIRROR_MAX_LAG_DEFAULT    64 /* MiB */
+
+typedef struct td_mirror             td_mirror_t;
+
+td_mirror_t *td_mirror_create(td_vbd_t *, td_sector_t size);
+void td_mirror_destroy(td_mirror_t *);
+
+/* Called for every write completed on the primary */
+void td_mirror_write_done(td_mirror_t *, td_sector_t sec, int secs,
+			  const char *buf);
+
+/* Lag over budget, hold back guest writes */
+int td_mirror_lagging(td_mirror_t *);
+
+/* Nothing dirty nor in flight: the secondary matches the primary */
+int td_mirror_idle(td_mirror_t *);
+
+void td_mirror_kick(td_mirror_t *);
+void td_mirror_stats(td_mirror_t *, td_stats_t *);
+
+#endif
@@ -40,6 +40,8 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
 #include "tapdisk-protocol-new.h"
 #include <byteswap.h>
 
@@ -66,9 +68,69 @@
 
 #define MEGABYTES 1024 * 1024
 
-#define NBD_SERVER_NUM_REQS 8
+/*
+ * Requests in flight per client, TAPDISK3_NBD_QUEUE_DEPTH overrides the
+ * default.
+ */
+#define NBD_SERVER_NUM_REQS 64
+#define NBD_SERVER_MAX_REQS 256
 #define MAX_REQUEST_SIZE (64 * MEGABYTES)
 
+/*
+ * Stop reading requests while the buffers of the requests in flight add
+ * up to this much, whatever the queue depth.
+ */
+#define NBD_SERVER_MAX_BUF_BYTES (128 * MEGABYTES)
+
+/*
+ * Stop reading requests while this many reply bytes are waiting for the
+ * client to read them, resume once it drained half of it.
+ */
+#define NBD_SERVER_MAX_TX_BYTES (16 * MEGABYTES)
+
+/* Bounds a block status reply; the client asks again for the rest */
+#define NBD_SERVER_MAX_EXTENTS 16384
+
+/*
+ * NBD_CMD_CACHE reads its range through the chain a chunk of this
+ * size at a time, into a buffer it then drops.
+ */
+#define NBD_SERVER_CACHE_CHUNK (1 * MEGABYTES)
+
+#define NBD_SERVER_TX_IOVS 64
+
+/*
+ * WRITE_ZEROES is written from one zeroed buffer of this size, repeated
+ * as many times as needed.
+ */
+#define NBD_SERVER_ZERO_BUF_SIZE (1 * MEGABYTES)
+
+/*
+ * Structured reads describe unallocated ranges of at least this many
+ * sectors with a HOLE chunk instead of sending their zeroes.
+ */
+#define NBD_SERVER_MIN_HOLE_SECS 8
+
+/*
+ * Idle request buffers kept per server, beyond this they are freed.
+ */
+#define NBD_SERVER_POOL_MAX_BYTES (32 * MEGABYTES)
+
+/*
+ * Send with MSG_ZEROCOPY when a batch carries at least this much: below
+ * it, the page pinning and completion costs more than the copy.
+ * TAPDISK3_NBD_ZEROCOPY=0 turns it off.
+ */
+#define NBD_SERVER_ZC_MIN_BYTES (64 * 1024)
+
+enum {
+	NBD_RX_HDR = 0,
+	NBD_RX_DATA,
+	NBD_RX_CFLAGS,		/* negotiation: client flags */
+	NBD_RX_OPT_HDR,		/* negotiation: option header */
+	NBD_RX_OPT_DATA		/* negotiation: option data */
+};
+
 uint16_t gflags = (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
 
 /*
@@ -87,12 +149,6 @@ uint16_t gflags = (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
 		BUG();						\
 	}
 
-struct td_nbdserver_req {
-	td_vbd_request_t        vreq;
-	char                    id[16];
-	struct td_iovec         iov;
-};
-
 int recv_fully_or_fail(int f, void *buf, size_t len) {
 	ssize_t res;
 	int err = 0;
@@ -156,75 +212,168 @@ free_extents(struct tapdisk_extents *extents)
 	free(extents);
 }
 
+static int
+tapdisk_nbdserver_cmp_extent(const void *a, const void *b)
+{
+	const tapdisk_extent_t *x = *(tapdisk_extent_t * const *)a;
+	const tapdisk_extent_t *y = *(tapdisk_extent_t * const *)b;
+
+	if (x->start < y->start)
+		return -1;
+	return x->start > y->start;
+}
+
+/*
+ * Extents come back from the chain in completion order: sort them,
+ * merge neighbours of equal status and stop at the first range left
+ * unknown (or at a gap). With @one, only the first descriptor is kept.
+ */
 struct nbd_block_descriptor *
-convert_extents_to_block_descriptors (struct tapdisk_extents *extents)
+convert_extents_to_block_descriptors(struct tapdisk_extents *extents,
+				     td_sector_t start, int one, size_t *count)
 {
-    size_t i, nr_extents = extents->count;
-    struct nbd_block_descriptor *blocks;
-    tapdisk_extent_t *curr_extent = extents->head;
-    
-    blocks = calloc (nr_extents, sizeof (struct nbd_block_descriptor));
-    if(blocks == NULL) {
-	    return NULL;
-    }
+	tapdisk_extent_t **sorted, *ext;
+	struct nbd_block_descriptor *blocks;
+	td_sector_t sec = start, length = 0;
+	size_t i, n;
+	int flag = 0;
+
+	n = extents->count < NBD_SERVER_MAX_EXTENTS ?
+		extents->count : NBD_SERVER_MAX_EXTENTS;
+	sorted = calloc(extents->count + 1, sizeof(*sorted));
+	blocks = calloc(n + 1, sizeof(*blocks));
+	n = 0;
+	if (!sorted || !blocks) {
+		free(sorted);
+		free(blocks);
+		return NULL;
+	}
+
+	for (i = 0, ext = extents->head; ext; ext = ext->next)
+		sorted[i++] = ext;
+	qsort(sorted, i, sizeof(*sorted), tapdisk_nbdserver_cmp_extent);
+
+	for (i = 0; i < extents->count; i++) {
+		ext = sorted[i];
+
+		if (ext->start != sec)
+			break;
+
+		if (ext->flag & TD_BLOCK_STATE_UNKNOWN) {
+			/* must answer something: call the first range data */
+			if (!length && !n) {
+				flag = TD_BLOCK_STATE_NONE;
+				length = ext->length;
+			}
+			break;
+		}
+
+		if (length && ext->flag == flag) {
+			length += ext->length;
+		} else {
+			if (length) {
+				if (one || n + 1 == NBD_SERVER_MAX_EXTENTS)
+					break;
+				blocks[n].length = htobe32(length << SECTOR_SHIFT);
+				blocks[n].status_flags = htobe32(flag);
+				n++;
+			}
+			flag = ext->flag;
+			length = ext->length;
+		}
+
+		sec += ext->length;
+	}
+
+	if (length) {
+		blocks[n].length = htobe32(length << SECTOR_SHIFT);
+		blocks[n].status_flags = htobe32(flag);
+		n++;
+	}
 
-    for (i = 0; i < nr_extents; ++i) {
-      blocks[i].length = htobe32 ((curr_extent->length << SECTOR_SHIFT));
-      blocks[i].status_flags = htobe32(curr_extent->flag);
-      curr_extent = curr_extent->next;
-    }
-    return blocks;
+	free(sorted);
+	*count = n;
+	return blocks;
 }
 
 static int
-send_structured_reply_block_status (int fd, char* id, struct tapdisk_extents *extents)
+tapdisk_nbdserver_pool_class(size_t len)
 {
-	struct nbd_structured_reply reply;
-	struct nbd_block_descriptor *blocks;
-	size_t i, nr_blocks = extents->count;
-	uint32_t context_id;
-	int ret = 0;
+	int shift = TAPDISK_NBDSERVER_POOL_MIN_SHIFT;
 
-	blocks = convert_extents_to_block_descriptors (extents);
-	if(blocks == NULL) {
-		ERR("Could not allocate blocks for extents");
-		ret = -1;
-		goto done;
-	}	
-
-	reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-	memcpy(&reply.handle, id, sizeof(reply.handle));
-	reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-	reply.type = htobe16 (NBD_REPLY_TYPE_BLOCK_STATUS);
-	reply.length = htobe32 (sizeof context_id +
-				nr_blocks * sizeof (struct nbd_block_descriptor));
-
-	int rc = send (fd, &reply, sizeof(reply), 0);
-	if(rc != sizeof(reply)) {
-		ERR("Could  not send stuctured reply struct");
-		ret = -errno;
-		goto done;
-	}	
-
-	context_id = htobe32 (base_allocation_id);
-	rc = send (fd, &context_id, sizeof(context_id), 0);
-	if(rc != sizeof(context_id)) {
-		ERR("Could  not send contect_id");
-		ret = -errno;
-		goto done;
-	}	
-
-	for (i = 0; i < nr_blocks; ++i) {
-		rc = send (fd, &blocks[i], sizeof blocks[i], 0);
-		if(rc != sizeof(blocks[i])) {
-			ERR("Could not send extent block");
-			ret = -errno;
-			goto done;
-		}	
-	}
-done:
-	free(blocks);
-	return ret;   
+	while (((size_t)1 << shift) < len)
+		shift++;
+
+	if (shift > TAPDISK_NBDSERVER_POOL_MAX_SHIFT)
+		return -1;
+
+	return shift - TAPDISK_NBDSERVER_POOL_MIN_SHIFT;
+}
+
+/*
+ * Request buffers come from the server pool, rounded up to their size
+ * class. Larger ones are allocated and freed each time.
+ */
+void *
+tapdisk_nbdserver_get_buf(td_nbdserver_t *server, size_t len)
+{
+	int c = tapdisk_nbdserver_pool_class(len);
+	void *buf;
+
+	if (c >= 0 && server->pool[c]) {
+		buf = server->pool[c];
+		server->pool[c] = *(void **)buf;
+		server->pool_bytes -= (size_t)1 << (c + TAPDISK_NBDSERVER_POOL_MIN_SHIFT);
+		return buf;
+	}
+
+	if (c >= 0)
+		len = (size_t)1 << (c + TAPDISK_NBDSERVER_POOL_MIN_SHIFT);
+
+	if (posix_memalign(&buf, 4096, len))
+		return NULL;
+
+	return buf;
+}
+
+void
+tapdisk_nbdserver_put_buf(td_nbdserver_t *server, void *buf, size_t len)
+{
+	int c = tapdisk_nbdserver_pool_class(len);
+	size_t size;
+
+	if (!buf)
+		return;
+
+	if (c < 0) {
+		free(buf);
+		return;
+	}
+
+	size = (size_t)1 << (c + TAPDISK_NBDSERVER_POOL_MIN_SHIFT);
+	if (server->pool_bytes + size > NBD_SERVER_POOL_MAX_BYTES) {
+		free(buf);
+		return;
+	}
+
+	*(void **)buf = server->pool[c];
+	server->pool[c] = buf;
+	server->pool_bytes += size;
+}
+
+static void
+tapdisk_nbdserver_pool_free(td_nbdserver_t *server)
+{
+	void *buf;
+	int c;
+
+	for (c = 0; c < TAPDISK_NBDSERVER_POOL_CLASSES; c++)
+		while ((buf = server->pool[c])) {
+			server->pool[c] = *(void **)buf;
+			free(buf);
+		}
+
+	server->pool_bytes = 0;
 }
 
 td_nbdserver_req_t *
@@ -242,65 +391,38 @@ tapdisk_nbdserver_alloc_request(td_nbdserver_client_t *client)
 	if (pending > client->max_used_reqs)
 		client->max_used_reqs = pending;
 
-	if (unlikely(client->n_reqs_free == 0)) {
-		/* last free request, mask the events */
-		tapdisk_server_mask_event(client->client_event_id, 1);
-	}
-
-
 	return req;
 }
 
-static int
-send_fixed_option_reply(int fd, uint32_t option, uint32_t reply)
+/*
+ * Stop reading requests while no request is free or too many replies
+ * are queued, with some hysteresis. A write payload, or the client
+ * flags and option data in negotiation, are always read to the end.
+ */
+static void
+tapdisk_nbdserver_update_events(td_nbdserver_client_t *client)
 {
-	struct nbd_fixed_new_option_reply fixed_new_option_reply;
-
-	fixed_new_option_reply.magic = htobe64(NBD_REP_MAGIC);
-	fixed_new_option_reply.option = htobe32(option);
-	fixed_new_option_reply.reply = htobe32(reply);
-	fixed_new_option_reply.replylen = htobe32(0);
+	bool mask;
 
-	int rc = send_fully_or_fail(fd, &fixed_new_option_reply, sizeof(fixed_new_option_reply));
-	if(rc < 0) {
-		ERR("Failed to send new_option_reply");
-		return -1;
-	}
-	return 0;
-}
-
-static int
-send_nbd_rep_server(int fd, const char *name, int namelen)
-{
-	struct nbd_fixed_new_option_reply *reply;
-	struct nbd_fixed_new_option_rep_server *rep;
-	size_t 	size = sizeof(struct nbd_fixed_new_option_reply) + sizeof(struct nbd_fixed_new_option_rep_server) + namelen;
-	int 	rc;
+	if (client->client_event_id < 0)
+		return;
 
-	reply = malloc(size);
-	if (!reply) {
-		ERR("Failed to allocate memory for NBD_REP_SERVER");
-		goto fail;
+	if (client->rx_state != NBD_RX_HDR &&
+	    client->rx_state != NBD_RX_OPT_HDR)
+		mask = false;
+	else if (client->rx_masked)
+		mask = client->n_reqs_free < (client->n_reqs + 3) / 4 ||
+			client->tx_bytes > NBD_SERVER_MAX_TX_BYTES / 2 ||
+			client->buf_bytes > NBD_SERVER_MAX_BUF_BYTES / 2;
+	else
+		mask = !client->n_reqs_free ||
+			client->tx_bytes >= NBD_SERVER_MAX_TX_BYTES ||
+			client->buf_bytes >= NBD_SERVER_MAX_BUF_BYTES;
+
+	if (mask != client->rx_masked) {
+		tapdisk_server_mask_event(client->client_event_id, mask);
+		client->rx_masked = mask;
 	}
-	reply->magic = htobe64(NBD_REP_MAGIC);
-	reply->option = htobe32(NBD_OPT_LIST);
-	reply->reply = htobe32(NBD_REP_SERVER);
-	reply->replylen = htobe32(sizeof(struct nbd_fixed_new_option_rep_server) + namelen);
-	rep = (struct nbd_fixed_new_option_rep_server *)reply->data;
-	rep->namelen = htobe32(namelen);
-	memcpy(rep->name, name, namelen);
-	rc = send_fully_or_fail(fd, reply, size);
-	if(rc < 0) {
-		ERR("Failed to send NBD_REP_SERVER");
-		goto fail2;
-	}
-	free(reply);
-	return 0;
-
-fail2:
-	free(reply);
-fail:
-	return -1;
 }
 
 static void
@@ -320,10 +442,7 @@ tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 {
 	tapdisk_nbdserver_set_free_request(client, req);
 
-	if (unlikely(client->n_reqs_free == (client->n_reqs / 4))) {
-		/* free requests, unmask the events */
-		tapdisk_server_mask_event(client->client_event_id, 0);
-	}
+	tapdisk_nbdserver_update_events(client);
 
 	if (unlikely(free_client_if_dead &&
 		     client->dead &&
@@ -350,359 +469,16 @@ tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
 	}
 }
 
-static int 
-send_info_export (int new_fd, uint32_t option, uint32_t reply, uint16_t info, uint64_t exportsize,
-		  uint16_t flags)
-{
-	struct nbd_fixed_new_option_reply fixed_new_option_reply;
-	struct nbd_fixed_new_option_reply_info_export export;
-
-	fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
-	fixed_new_option_reply.option = htobe32 (option);
-	fixed_new_option_reply.reply = htobe32 (reply);
-	fixed_new_option_reply.replylen = htobe32 (sizeof(export));
-
-	export.info = htobe16 (info);
-	export.exportsize = htobe64 (exportsize);
-	export.eflags = htobe16 (flags);
-
-	int rc = send_fully_or_fail(new_fd, &fixed_new_option_reply, sizeof(fixed_new_option_reply));
-	if(rc < 0) {
-		ERR("Failed to send new_option_reply");
-		return -1;
-	}
-
-	rc = send_fully_or_fail(new_fd, &export, sizeof(export));
-	if(rc < 0) {
-		ERR("Failed to send info export");
-		return -1;
-	}
-
-	return 0;
-}
-
-int
-send_info_block_size (int new_fd, uint32_t option, uint32_t reply, uint16_t info,
-		      uint32_t min_block_size, uint32_t preferred_block_size,
-		      uint32_t max_block_size)
-{
-	struct nbd_fixed_new_option_reply fixed_new_option_reply;
-	struct nbd_fixed_new_option_reply_info_block_size block_info;
-
-	fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
-	fixed_new_option_reply.option = htobe32 (option);
-	fixed_new_option_reply.reply = htobe32 (reply);
-	fixed_new_option_reply.replylen = htobe32 (sizeof (block_info));
-
-	block_info.info = htobe16 (info);
-	block_info.min_block_size = htobe32(min_block_size);
-	block_info.preferred_block_size = htobe32(preferred_block_size);
-	block_info.max_block_size = htobe32(max_block_size);
-	int rc = send_fully_or_fail(new_fd, &fixed_new_option_reply, sizeof(fixed_new_option_reply));
-	if (rc < 0) {
-		ERR("Failed to send new_option_reply");
-		return -1;
-	}
-
-	rc = send_fully_or_fail(new_fd, &block_info, sizeof(block_info));
-	if (rc < 0) {
-		ERR("Failed to send info block size");
-		return -1;
-	}
-
-	return 0;
-}
-
-int
-send_meta_context (int new_fd, uint32_t reply, uint32_t context_id, const char *name)
-{
-	struct nbd_fixed_new_option_reply fixed_new_option_reply;
-	struct nbd_fixed_new_option_reply_meta_context context;
-	const size_t namelen = strlen (name);
-
-	fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
-	fixed_new_option_reply.option = htobe32 (NBD_OPT_SET_META_CONTEXT);
-	fixed_new_option_reply.reply = htobe32 (reply);
-	fixed_new_option_reply.replylen = htobe32 (sizeof context + namelen);
-	context.context_id = htobe32 (context_id);
-
-	int rc = send (new_fd, &fixed_new_option_reply, sizeof(fixed_new_option_reply), 0);
-	if(rc != sizeof(fixed_new_option_reply)) {
-		ERR("Failed to send new_option_reply, sent %d of %lu",
-		    rc, sizeof(fixed_new_option_reply));
-		return -1;
-	}
-	rc = send (new_fd, &context, sizeof(context), 0);
-	if(rc != sizeof(context)) {
-		ERR("Failed to send context, sent %d of %lu",
-		    rc, sizeof(context));
-		return -1;
-	}
-	rc = send (new_fd, name, namelen, 0);
-	if(rc != namelen) {
-		ERR("Failed to send name, sent %d of %lu",
-		    rc, namelen);
-		return -1;
-	}
-
-	return 0;
-}
-
 #define NBD_EXPORTSIZE(X) (uint64_t)((X)->info.size * (X)->info.sector_size)
-#define NBD_FLAGS (uint16_t)(NBD_FLAG_HAS_FLAGS)
-
-/**
- * Sends an NBD_OPT_INFO or an NBD_OPT_GO response. These are identical; the only difference is that
- * NBD_OPT_GO moves to the transmission phase immediately, while NPD_OPT_INFO does not.
- *
- * We cheat outrageously here, by accepting whatever exportname the client provides as meaning they
- * want our single fixed export (because it's all we have).
- *
+/*
+ * All connections to an export share the VBD and its request queue: a
+ * write completed on one is visible to reads on any other, and a flush
+ * waits for the writes in flight on all of them.
  */
-int
-send_nbd_opt_infogo(int fd, td_nbdserver_t *server, int option)
-{
-	uint32_t exportnamelen;
-	uint16_t nrInfoReq;
-	char *exportname = NULL;
-
-	if (recv_fully_or_fail(fd, &exportnamelen, sizeof(exportnamelen)) < 0)
-		goto fail;
-	exportnamelen = be32toh(exportnamelen);
-
-	if (exportnamelen > MAX_NBD_EXPORT_NAME_LEN) {
-		ERR("Received %u as export name length which exceeds the maximum of %u",
-			exportnamelen, MAX_NBD_EXPORT_NAME_LEN);
-		goto fail;
-	}
-
-	exportname = malloc(exportnamelen + 1);
-	if (exportname == NULL) {
-		ERR("Could not malloc space for export name");
-		goto fail;
-	}
-	if (recv_fully_or_fail(fd, exportname, exportnamelen) < 0)
-		goto fail1;
-	exportname[exportnamelen] = '\0';
-	INFO("Exportname %s", exportname);
-
-	if (recv_fully_or_fail(fd, &nrInfoReq, sizeof(nrInfoReq)) < 0)
-		goto fail1;
-
-	nrInfoReq = be16toh(nrInfoReq);
-	INFO("nrInfoReq is %d", nrInfoReq);
-
-	while(nrInfoReq--) {
-		uint16_t request;
-		if (recv_fully_or_fail(fd, &request, sizeof(request)) < 0) {
-			ERR("Failed to read NBD_INFO");
-			goto fail1;
-		}
-		request = be16toh(request);
-		INFO("Client requested NBD_INFO %u", request);
-	}
-
-	/* Always send NBD_INFO_EXPORT*/
-	if (send_info_export(fd, option, NBD_REP_INFO, NBD_INFO_EXPORT, NBD_EXPORTSIZE(server), NBD_FLAGS)){
-		ERR("Could not send reply info export");
-		goto fail1;
-	}
-
-	if (send_info_block_size(fd, option, NBD_REP_INFO, NBD_INFO_BLOCK_SIZE, 1, 4096, 2 * MEGABYTES)) {
-		ERR("Could not send reply info block size");
-		goto fail1;
-	}
-
-	if (send_fixed_option_reply(fd, option, NBD_REP_ACK)) {
-		ERR("Could not send new style option reply");
-		goto fail1;
-	}
-	free(exportname);
-	return 0;
-
-fail1:
-	free(exportname);
-fail:
-	return -1;
-}
-
-
-int
-receive_info(int fd, char* buf, int size)
-{
-	return recv_fully_or_fail(fd, buf, size);
-}
-
-static int
-receive_newstyle_options(td_nbdserver_client_t *client, int new_fd, bool no_zeroes)
-{
-	struct nbd_new_option n_option;
-	size_t n_options;
-	uint32_t opt_code;
-	uint32_t opt_len;
-	struct nbd_export_name_option_reply handshake_finish;
-	td_nbdserver_t *server = client->server;
-
-	for (n_options = 0; n_options < MAX_OPTIONS; n_options++) {
-		if(receive_info(new_fd, (char *)&n_option, sizeof(n_option)) < 0)
-			goto fail;
-
-		if (NBD_OPT_MAGIC != be64toh(n_option.version)) {
-			ERR("Bad NBD option version %" PRIx64 ", expected %" PRIx64,
-				be64toh(n_option.version), NBD_OPT_MAGIC);
-			goto fail;
-		}
-		opt_len = be32toh (n_option.optlen);
-		if (opt_len > MAX_REQUEST_SIZE) {
-			ERR ("NBD optlen to big (%" PRIu32 ")", opt_len);
-			goto fail;
-		}
-		opt_code = be32toh (n_option.option);
-
-		switch (opt_code) {
-			case NBD_OPT_EXPORT_NAME:
-			{
-				char *buf = NULL;
-
-				INFO("Processing NBD_OPT_EXPORT_NAME");
-				if (!(buf=malloc(opt_len + 1))) { ERR("malloc fail"); goto fail; }
-				if(receive_info(new_fd, (char *)buf, opt_len) < 0) {
-					ERR ("Failed to received data for NBD_OPT_EXPORT_NAME");
-					free(buf);
-					goto fail;
-				}
-				buf[opt_len] = '\0';
-				INFO("Exportname %s", buf);
-
-				bzero(&handshake_finish, sizeof handshake_finish);
-				handshake_finish.exportsize = htobe64(NBD_EXPORTSIZE(server));
-				handshake_finish.eflags = htobe16(NBD_FLAGS);
-				ssize_t len = no_zeroes ? 10 : sizeof(handshake_finish);
-				ssize_t sent = send (new_fd, &handshake_finish,len, 0);
-				if(sent != len) {
-					ERR ("Failed to send handshake finish");
-					free(buf);
-					goto fail;
-				}
-				/* Immediately enter data transfer */
-				free(buf);
-				goto done;
-			}
-			break;
-			case NBD_OPT_ABORT:
-				INFO("Processing NBD_OPT_ABORT");
-				/* Failure of this is irrelevant */
-				send_fixed_option_reply(new_fd, opt_code, NBD_REP_ACK);
-				/* There will be nothing after this */
-				goto done;
-				break;
-			case NBD_OPT_LIST:
-				INFO("Processing NBD_OPT_LIST('%s')",NBD_FIXED_SINGLE_EXPORT);
-				if (send_nbd_rep_server(new_fd, NBD_FIXED_SINGLE_EXPORT, strlen(NBD_FIXED_SINGLE_EXPORT)))
-					goto fail;
-				if (send_fixed_option_reply(new_fd, opt_code, NBD_REP_ACK))
-					goto fail;
-				break;
-			case NBD_OPT_STARTTLS:
-				ERR("NBD_OPT_STARTTLS: not implemented");
-				if (send_fixed_option_reply(new_fd, opt_code, NBD_REP_ERR_UNSUP))
-					goto fail;
-				break;
-			case NBD_OPT_INFO:
-				INFO("Processing NBD_OPT_INFO");
-				if (send_nbd_opt_infogo(new_fd, server, NBD_OPT_INFO))
-					goto fail;
-				break;
-			case NBD_OPT_GO:
-				INFO("Processing NBD_OPT_GO");
-				if (send_nbd_opt_infogo(new_fd, server, NBD_OPT_GO)) goto fail;
-				/* Immediately enter data transfer */
-				goto done;
-				break;
-			case NBD_OPT_STRUCTURED_REPLY:
-				INFO("Processing NBD_OPT_STRUCTURED_REPLY");
-				if (opt_len != 0) {
-					send_fixed_option_reply(new_fd, opt_code, NBD_REP_ERR_INVALID);
-					goto fail;
-				}
-
-				if (send_fixed_option_reply(new_fd, opt_code, NBD_REP_ACK) == -1)
-					goto fail;
-
-				client->structured_reply = true;
-				break;
-			case NBD_OPT_LIST_META_CONTEXT:
-			{
-				char *buf = NULL;
-				INFO("NBD_OPT_LIST_META_CONTEXT: not implemented");
-				/* We may not support the option, but we still need to read and discard it */
-				if (!(buf=malloc(opt_len + 1))) { ERR("malloc fail"); goto fail; }
-				receive_info(new_fd, (char *)buf, opt_len);
-				free(buf); /* Don't care about the contents */
-				if (send_fixed_option_reply(new_fd, opt_code, NBD_REP_ERR_UNSUP)) goto fail;
-			}
-			break;
-			case NBD_OPT_SET_META_CONTEXT:
-			{
-				char *buf = NULL;
-				uint32_t opt_index;
-				uint32_t exportnamelen;
-				uint32_t nr_queries;
-				uint32_t querylen;
-
-				INFO("Processing NBD_OPT_SET_META_CONTEXT");
-				if (!(buf=malloc(opt_len + 1))) { ERR("malloc fail"); goto fail; }
-				if (recv_fully_or_fail(new_fd, buf, opt_len) < 0) {
-					free(buf);
-					goto fail;
-				}
-
-				memcpy (&exportnamelen, &buf[0], 4);
-				exportnamelen = be32toh (exportnamelen);
-				opt_index = 4 + exportnamelen;
-
-				memcpy (&nr_queries, &buf[opt_index], 4);
-				nr_queries = be32toh (nr_queries);
-				opt_index += 4;
-				while (nr_queries > 0) {
-					char temp[16];
-					memcpy (&querylen, &buf[opt_index], 4);
-					querylen = be32toh (querylen);
-					opt_index += 4;
-					memcpy (temp, &buf[opt_index], 15);
-					temp[15]= '\0';
-					INFO("actual string %s\n", temp);
-					if (querylen == 15 && strncmp (&buf[opt_index], "base:allocation", 15) == 0) {
-						if (send_meta_context (new_fd, NBD_REP_META_CONTEXT, 1, "base:allocation") !=0) {
-							free(buf);
-							goto fail;
-						}
-					}
-					nr_queries--;
-				}
-				if (send_fixed_option_reply(new_fd, opt_code, NBD_REP_ACK) == -1) {
-					free(buf);
-					goto fail;
-				}
-				free(buf);
-			}
-			break;
-			default:
-				goto fail;
-		}
-	} 
-
-	if (n_options >= MAX_OPTIONS) {
-		ERR("Max number of nbd options exceeded (%d)", MAX_OPTIONS);
-		goto fail;
-	}
-
-done:
-	return 0;
-
-fail:
-	return -1;
-}
+#define NBD_FLAGS (uint16_t)(NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN | \
+			     NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | \
+			     NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES | \
+			     NBD_FLAG_SEND_CACHE)
 
 int
 tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs)
@@ -769,6 +545,9 @@ tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client)
 		return client->client_event_id;
 	}
 
+	client->rx_masked = false;
+	tapdisk_nbdserver_update_events(client);
+
 	return client->client_event_id;
 }
 
@@ -784,8 +563,26 @@ tapdisk_nbdserver_disable_client(td_nbdserver_client_t *client)
 	client->client_event_id = -1;
 }
 
-td_nbdserver_client_t *
-tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
+static int
+tapdisk_nbdserver_queue_depth(void)
+{
+	int n_reqs = NBD_SERVER_NUM_REQS;
+	char *env;
+
+	env = getenv("TAPDISK3_NBD_QUEUE_DEPTH");
+	if (env)
+		n_reqs = atoi(env);
+
+	if (n_reqs < 1)
+		n_reqs = 1;
+	if (n_reqs > NBD_SERVER_MAX_REQS)
+		n_reqs = NBD_SERVER_MAX_REQS;
+
+	return n_reqs;
+}
+
+td_nbdserver_client_t *
+tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 {
 	td_nbdserver_client_t *client = NULL;
 	int err;
@@ -801,7 +598,8 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 		goto fail;
 	}
 
-	err = tapdisk_nbdserver_reqs_init(client, NBD_SERVER_NUM_REQS);
+	err = tapdisk_nbdserver_reqs_init(client,
+					  tapdisk_nbdserver_queue_depth());
 	if (err < 0) {
 		ERR("Couldn't allocate client reqs: %d", err);
 		goto fail;
@@ -809,6 +607,11 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 
 	client->client_fd = -1;
 	client->client_event_id = -1;
+	client->tx_event_id = -1;
+	INIT_LIST_HEAD(&client->tx_queue);
+	client->zc_fd = -1;
+	client->zc_event_id = -1;
+	INIT_LIST_HEAD(&client->zc_wait);
 	client->server = server;
 	INIT_LIST_HEAD(&client->clientlist);
 	list_add(&client->clientlist, &server->clients);
@@ -826,6 +629,523 @@ fail:
 	return NULL;
 }
 
+static void tapdisk_nbd_server_free_vreq(
+	td_nbdserver_client_t *client, td_vbd_request_t *vreq, bool free_client_if_dead)
+{
+	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+	if (req->iov.base)
+		client->buf_bytes -= req->iov.secs << SECTOR_SHIFT;
+	tapdisk_nbdserver_put_buf(client->server, req->iov.base,
+				  req->iov.secs << SECTOR_SHIFT);
+	free(req->tx_extra);
+	req->tx_extra = NULL;
+	if (vreq->holes) {
+		free_extents(vreq->holes);
+		vreq->holes = NULL;
+	}
+	tapdisk_nbdserver_free_request(client, req, free_client_if_dead);
+}
+
+static void
+tapdisk_nbdserver_drop_replies(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req, *next;
+
+	if (client->tx_event_id >= 0) {
+		tapdisk_server_unregister_event(client->tx_event_id);
+		client->tx_event_id = -1;
+	}
+
+	list_for_each_entry_safe(req, next, &client->tx_queue, tx_next) {
+		list_del(&req->tx_next);
+		tapdisk_nbd_server_free_vreq(client, &req->vreq, false);
+	}
+
+	client->tx_bytes = 0;
+
+	if (client->zc_event_id >= 0) {
+		tapdisk_server_unregister_event(client->zc_event_id);
+		client->zc_event_id = -1;
+	}
+
+	/*
+	 * The kernel may still be sending from these: free the buffers
+	 * rather than pool them for reuse. It holds its own references
+	 * to the pages.
+	 */
+	list_for_each_entry_safe(req, next, &client->zc_wait, tx_next) {
+		list_del(&req->tx_next);
+		if (req->iov.base) {
+			client->buf_bytes -= req->iov.secs << SECTOR_SHIFT;
+			free(req->iov.base);
+			req->iov.base = NULL;
+		}
+		tapdisk_nbd_server_free_vreq(client, &req->vreq, false);
+	}
+
+	if (client->zc_fd >= 0) {
+		close(client->zc_fd);
+		client->zc_fd = -1;
+	}
+	client->zc = false;
+}
+
+static void
+tapdisk_nbdserver_enable_zerocopy(td_nbdserver_client_t *client)
+{
+	struct sockaddr_storage ss;
+	struct epoll_event ev;
+	socklen_t len = sizeof(ss);
+	char *env;
+	int fd, one = 1;
+
+	env = getenv("TAPDISK3_NBD_ZEROCOPY");
+	if (env && !atoi(env))
+		return;
+
+	/* AF_UNIX sockets always copy */
+	if (getsockname(client->client_fd, (struct sockaddr *)&ss, &len) ||
+	    (ss.ss_family != AF_INET && ss.ss_family != AF_INET6))
+		return;
+
+	if (setsockopt(client->client_fd, SOL_SOCKET, SO_ZEROCOPY,
+		       &one, sizeof(one))) {
+		INFO("SO_ZEROCOPY not available: %s", strerror(errno));
+		return;
+	}
+
+	/*
+	 * No events asked for: POLLERR only, reported as completions
+	 * are queued, edge triggered so unread requests don't keep it
+	 * ready.
+	 */
+	fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd < 0) {
+		INFO("no epoll for zerocopy completions: %s", strerror(errno));
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLET;
+	if (epoll_ctl(fd, EPOLL_CTL_ADD, client->client_fd, &ev)) {
+		INFO("no epoll for zerocopy completions: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	client->zc_fd = fd;
+	client->zc = true;
+}
+
+/*
+ * Read the MSG_ZEROCOPY completions off the socket error queue and
+ * release the requests whose sends are all done. If the kernel reports
+ * it had to copy anyway, as it does over loopback, stop asking.
+ */
+static void
+tapdisk_nbdserver_zc_reap(td_nbdserver_client_t *client)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct sock_extended_err *serr;
+	td_nbdserver_req_t *req, *next;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(client->client_fd, &msg,
+			    MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP &&
+			      cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			      cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* ids complete in order, [ee_info, ee_data] */
+			if ((int32_t)(serr->ee_data + 1 - client->zc_done) > 0)
+				client->zc_done = serr->ee_data + 1;
+
+			if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+			    client->zc) {
+				INFO("zerocopy sends were copied, "
+				     "turning them off");
+				client->zc = false;
+			}
+		}
+	}
+
+	list_for_each_entry_safe(req, next, &client->zc_wait, tx_next) {
+		if ((int32_t)(req->zc_id - client->zc_done) >= 0)
+			continue;
+
+		list_del(&req->tx_next);
+		tapdisk_nbd_server_free_vreq(client, &req->vreq, false);
+	}
+
+	if (list_empty(&client->zc_wait) && client->zc_event_id >= 0) {
+		tapdisk_server_unregister_event(client->zc_event_id);
+		client->zc_event_id = -1;
+	}
+}
+
+static void
+tapdisk_nbdserver_zc_cb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+	struct epoll_event ev;
+
+	/* rearm before reaping, so later completions signal again */
+	epoll_wait(client->zc_fd, &ev, 1, 0);
+
+	tapdisk_nbdserver_zc_reap(client);
+}
+
+static void tapdisk_nbdserver_tx_cb(event_id_t id, char mode, void *data);
+
+static void
+tapdisk_nbdserver_add_reply(td_nbdserver_client_t *client,
+			    td_nbdserver_req_t *req)
+{
+	int i;
+
+	if (!req->tx_iov) {
+		req->tx_iov_buf[0].iov_base = req->tx_hdr;
+		req->tx_iov_buf[0].iov_len  = req->tx_hdr_len;
+		req->tx_iov_buf[1].iov_base = req->tx_data;
+		req->tx_iov_buf[1].iov_len  = req->tx_data_len;
+		req->tx_iov    = req->tx_iov_buf;
+		req->tx_iovcnt = 2;
+	}
+
+	req->tx_len = 0;
+	for (i = 0; i < req->tx_iovcnt; i++)
+		req->tx_len += req->tx_iov[i].iov_len;
+
+	req->tx_off = 0;
+	list_add_tail(&req->tx_next, &client->tx_queue);
+	client->tx_bytes += req->tx_len;
+}
+
+/*
+ * Send as much of the queued replies as the socket takes, gathering
+ * several of them per sendmsg(). Fully sent replies release their
+ * request. Whatever remains is retried when the socket becomes
+ * writable.
+ */
+int
+tapdisk_nbdserver_send_replies(td_nbdserver_client_t *client)
+{
+	struct iovec iov[NBD_SERVER_TX_IOVS];
+	td_nbdserver_req_t *req, *next;
+	struct msghdr msg;
+	size_t off, bytes;
+	int i, cnt, flags;
+	bool nozc = false;
+	uint32_t zc_id = 0;
+	ssize_t n;
+
+	while (!list_empty(&client->tx_queue)) {
+		cnt = 0;
+		bytes = 0;
+		list_for_each_entry(req, &client->tx_queue, tx_next) {
+			off = req->tx_off;
+			for (i = 0; i < req->tx_iovcnt; i++) {
+				size_t len = req->tx_iov[i].iov_len;
+
+				if (off >= len) {
+					off -= len;
+					continue;
+				}
+
+				if (cnt == NBD_SERVER_TX_IOVS)
+					break;
+
+				iov[cnt].iov_base = req->tx_iov[i].iov_base + off;
+				iov[cnt].iov_len  = len - off;
+				bytes += iov[cnt].iov_len;
+				cnt++;
+				off = 0;
+			}
+
+			if (cnt == NBD_SERVER_TX_IOVS)
+				break;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = cnt;
+
+		flags = MSG_DONTWAIT;
+		if (client->zc && !nozc && bytes >= NBD_SERVER_ZC_MIN_BYTES)
+			flags |= MSG_ZEROCOPY;
+
+		n = sendmsg(client->client_fd, &msg, flags);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				/* out of pinned page budget, copy this time */
+				nozc = true;
+				continue;
+			}
+			ERR("Send failed: %s", strerror(errno));
+			return -errno;
+		}
+
+		if (flags & MSG_ZEROCOPY)
+			zc_id = client->zc_next++;
+
+		client->tx_bytes -= n;
+
+		list_for_each_entry_safe(req, next, &client->tx_queue, tx_next) {
+			size_t left = req->tx_len - req->tx_off;
+
+			if (!n)
+				break;
+
+			if (flags & MSG_ZEROCOPY) {
+				req->zc = true;
+				req->zc_id = zc_id;
+			}
+
+			if (n < left) {
+				req->tx_off += n;
+				break;
+			}
+
+			n -= left;
+			list_del(&req->tx_next);
+			if (req->zc)
+				/* released once the kernel is done with it */
+				list_add_tail(&req->tx_next, &client->zc_wait);
+			else
+				tapdisk_nbd_server_free_vreq(client,
+							     &req->vreq, false);
+		}
+	}
+
+	if (!list_empty(&client->zc_wait) && client->zc_event_id < 0) {
+		client->zc_event_id = tapdisk_server_register_event(
+				SCHEDULER_POLL_READ_FD,
+				client->zc_fd, TV_ZERO,
+				tapdisk_nbdserver_zc_cb,
+				client);
+		if (client->zc_event_id < 0) {
+			ERR("Error registering zerocopy event on client: %d",
+			    client->zc_event_id);
+			return client->zc_event_id;
+		}
+	}
+
+	if (list_empty(&client->tx_queue)) {
+		if (client->tx_event_id >= 0) {
+			tapdisk_server_unregister_event(client->tx_event_id);
+			client->tx_event_id = -1;
+		}
+	} else if (client->tx_event_id < 0) {
+		client->tx_event_id = tapdisk_server_register_event(
+				SCHEDULER_POLL_WRITE_FD,
+				client->client_fd, TV_ZERO,
+				tapdisk_nbdserver_tx_cb,
+				client);
+		if (client->tx_event_id < 0) {
+			ERR("Error registering write event on client: %d",
+			    client->tx_event_id);
+			return client->tx_event_id;
+		}
+	}
+
+	tapdisk_nbdserver_update_events(client);
+
+	return 0;
+}
+
+static void
+tapdisk_nbdserver_tx_cb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+
+	if (!list_empty(&client->zc_wait))
+		tapdisk_nbdserver_zc_reap(client);
+
+	if (tapdisk_nbdserver_send_replies(client) < 0)
+		tapdisk_nbdserver_free_client(client);
+}
+
+/*
+ * Queue the reply prepared in req and try to send it right away. The
+ * request is released once the reply went out, or immediately if the
+ * client is gone. The client may be freed on return.
+ */
+void
+tapdisk_nbdserver_queue_reply(td_nbdserver_client_t *client,
+			      td_nbdserver_req_t *req)
+{
+	if (client->dead) {
+		tapdisk_nbd_server_free_vreq(client, &req->vreq, true);
+		return;
+	}
+
+	tapdisk_nbdserver_add_reply(client, req);
+
+	if (tapdisk_nbdserver_send_replies(client) < 0)
+		tapdisk_nbdserver_free_client(client);
+}
+
+static void
+tapdisk_nbdserver_prep_simple_reply(td_nbdserver_req_t *req, int error)
+{
+	struct nbd_reply reply;
+
+	reply.magic = htonl(NBD_REPLY_MAGIC);
+	reply.error = htonl(abs(error));
+	memcpy(reply.handle, req->id, sizeof(reply.handle));
+
+	memcpy(req->tx_hdr, &reply, sizeof(reply));
+	req->tx_hdr_len = sizeof(reply);
+	req->tx_data = NULL;
+	req->tx_data_len = 0;
+}
+
+static void tapdisk_nbdserver_sync(td_nbdserver_t *server);
+
+static void
+tapdisk_nbdserver_sync_reply(struct list_head *list, int err)
+{
+	td_nbdserver_req_t *req, *next;
+
+	list_for_each_entry_safe(req, next, list, wr_next) {
+		list_del(&req->wr_next);
+		tapdisk_nbdserver_prep_simple_reply(req, err);
+		tapdisk_nbdserver_queue_reply(req->vreq.token, req);
+	}
+}
+
+static void
+tapdisk_nbdserver_sync_done(void *arg, int err)
+{
+	td_nbdserver_t *server = arg;
+
+	server->sync_inflight = false;
+
+	if (err) {
+		ERR("failed to sync: %s", strerror(-err));
+		/* the writes it covered still need one */
+		server->unsynced = true;
+	}
+
+	tapdisk_nbdserver_sync_reply(&server->synced, err);
+
+	/* those which came meanwhile need another */
+	if (!list_empty(&server->syncs))
+		tapdisk_nbdserver_sync(server);
+}
+
+/*
+ * Sync the VBD once for all flushes and FUA writes waiting, if any
+ * write completed since the last sync, and reply to them once it is
+ * done. Those arriving while a sync is in flight wait for the next.
+ */
+static void
+tapdisk_nbdserver_sync(td_nbdserver_t *server)
+{
+	int err;
+
+	if (server->sync_inflight)
+		return;
+
+	list_splice_tail(&server->syncs, &server->synced);
+	INIT_LIST_HEAD(&server->syncs);
+
+	if (!server->unsynced) {
+		tapdisk_nbdserver_sync_reply(&server->synced, 0);
+		return;
+	}
+
+	server->unsynced = false;
+	server->sync_inflight = true;
+
+	err = tapdisk_vbd_sync(server->vbd, tapdisk_nbdserver_sync_done,
+			       server);
+	if (err)
+		tapdisk_nbdserver_sync_done(server, err);
+}
+
+static void
+tapdisk_nbdserver_sync_cb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_t *server = data;
+
+	tapdisk_server_unregister_event(server->sync_event_id);
+	server->sync_event_id = -1;
+
+	tapdisk_nbdserver_sync(server);
+}
+
+/*
+ * Have @req replied to after the next sync. Requests added during the
+ * same event loop iteration share it.
+ */
+static void
+tapdisk_nbdserver_queue_sync(td_nbdserver_t *server, td_nbdserver_req_t *req)
+{
+	event_id_t id;
+
+	list_add_tail(&req->wr_next, &server->syncs);
+
+	if (server->sync_event_id >= 0)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					   TV_ZERO, tapdisk_nbdserver_sync_cb,
+					   server);
+	if (id < 0) {
+		ERR("failed to register sync event: %d", id);
+		tapdisk_nbdserver_sync(server);
+		return;
+	}
+
+	server->sync_event_id = id;
+}
+
+/*
+ * Sync for flushes once no write submitted before them is left in
+ * flight, on whichever client.
+ */
+static void
+tapdisk_nbdserver_complete_flushes(td_nbdserver_t *server)
+{
+	td_nbdserver_req_t *req, *next;
+	uint64_t oldest;
+
+	if (list_empty(&server->writes))
+		oldest = server->write_seq + 1;
+	else
+		oldest = list_first_entry(&server->writes,
+					  td_nbdserver_req_t, wr_next)->seq;
+
+	list_for_each_entry_safe(req, next, &server->flushes, wr_next) {
+		if (req->seq >= oldest)
+			break;
+
+		list_del(&req->wr_next);
+		tapdisk_nbdserver_queue_sync(server, req);
+	}
+}
+
 void
 tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 {
@@ -836,6 +1156,21 @@ tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 	if (client->client_event_id >= 0)
 		tapdisk_nbdserver_disable_client(client);
 
+	tapdisk_nbdserver_drop_replies(client);
+
+	if (client->rx_req) {
+		tapdisk_nbd_server_free_vreq(client, &client->rx_req->vreq,
+					     false);
+		client->rx_req = NULL;
+		client->rx_state = NBD_RX_HDR;
+	}
+
+	free(client->rx_opt_buf);
+	client->rx_opt_buf = NULL;
+	free(client->opt_tx);
+	client->opt_tx = NULL;
+	client->opt_tx_len = 0;
+
 	INFO("Freeing client, max used requests %d", client->max_used_reqs);
 
 	if (likely(!tapdisk_nbdserver_reqs_pending(client))) {
@@ -855,14 +1190,6 @@ static void
 	return &(((struct sockaddr_in6*)ss)->sin6_addr);
 }
 
-static void tapdisk_nbd_server_free_vreq(
-	td_nbdserver_client_t *client, td_vbd_request_t *vreq, bool free_client_if_dead)
-{
-	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req, free_client_if_dead);
-}
-
 
 static void
 __tapdisk_nbdserver_block_status_cb(td_vbd_request_t *vreq, int err,
@@ -871,31 +1198,185 @@ __tapdisk_nbdserver_block_status_cb(td_vbd_request_t *vreq, int err,
 	td_nbdserver_client_t *client = token;
 	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
 	tapdisk_extents_t* extents = (tapdisk_extents_t *)(vreq->data);
-	send_structured_reply_block_status (client->client_fd, req->id, extents);
+	struct nbd_structured_reply reply;
+	struct nbd_block_descriptor *blocks;
+	uint32_t context_id;
+	size_t len, count = 0;
+
+	blocks = err ? NULL :
+		convert_extents_to_block_descriptors(extents, vreq->sec,
+				req->flags & NBD_CMD_FLAG_REQ_ONE, &count);
 	free_extents(extents);
-	tapdisk_nbd_server_free_vreq(client, vreq, true);
+	vreq->data = NULL;
+
+	if (!err && !blocks) {
+		ERR("Could not allocate blocks for extents");
+		err = -ENOMEM;
+	}
+
+	if (err || !count) {
+		free(blocks);
+		tapdisk_nbdserver_prep_simple_reply(req, err ? err : -EIO);
+		tapdisk_nbdserver_queue_reply(client, req);
+		return;
+	}
+
+	len = count * sizeof(struct nbd_block_descriptor);
+
+	reply.magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC);
+	memcpy(&reply.handle, req->id, sizeof(reply.handle));
+	reply.flags = htobe16(NBD_REPLY_FLAG_DONE);
+	reply.type = htobe16(NBD_REPLY_TYPE_BLOCK_STATUS);
+	reply.length = htobe32(sizeof(context_id) + len);
+	context_id = htobe32(base_allocation_id);
+
+	memcpy(req->tx_hdr, &reply, sizeof(reply));
+	memcpy(req->tx_hdr + sizeof(reply), &context_id, sizeof(context_id));
+	req->tx_hdr_len = sizeof(reply) + sizeof(context_id);
+	req->tx_data = blocks;
+	req->tx_data_len = len;
+	req->tx_extra = blocks;
+
+	tapdisk_nbdserver_queue_reply(client, req);
 }
 
-static int
-__tapdisk_nbdserver_send_structured_reply(
-	int fd, uint16_t type, uint16_t flags, char *handle, uint32_t length)
+static void
+tapdisk_nbdserver_add_chunk(td_nbdserver_req_t *req, char *hdr,
+			    struct iovec *iov, int *n, uint16_t type,
+			    td_sector_t sec, td_sector_t secs, void *data)
 {
 	struct nbd_structured_reply reply;
-	int rc = 0;
+	uint64_t offset = htobe64(sec << SECTOR_SHIFT);
+	uint32_t length = htobe32(secs << SECTOR_SHIFT);
+	size_t hdr_len = sizeof(reply) + sizeof(offset);
 
 	reply.magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC);
-	reply.flags = htobe16(flags);
+	reply.flags = 0;
 	reply.type = htobe16(type);
-	memcpy(&reply.handle, handle, sizeof(reply.handle));
-	reply.length = htobe32(length);
+	memcpy(&reply.handle, req->id, sizeof(reply.handle));
 
-	rc = send_fully_or_fail(fd, &reply, sizeof(reply));
-	if (rc < 0) {
-		ERR("Short send/error in callback");
-		return -1;
+	if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+		reply.length = htobe32(sizeof(offset) + sizeof(length));
+		memcpy(hdr + hdr_len, &length, sizeof(length));
+		hdr_len += sizeof(length);
+	} else
+		reply.length = htobe32(sizeof(offset) +
+				       (secs << SECTOR_SHIFT));
+
+	memcpy(hdr, &reply, sizeof(reply));
+	memcpy(hdr + sizeof(reply), &offset, sizeof(offset));
+
+	iov[*n].iov_base = hdr;
+	iov[*n].iov_len = hdr_len;
+	(*n)++;
+
+	if (type == NBD_REPLY_TYPE_OFFSET_DATA) {
+		iov[*n].iov_base = data;
+		iov[*n].iov_len = secs << SECTOR_SHIFT;
+		(*n)++;
 	}
+}
 
-	return 0;
+/*
+ * Split a structured read reply into DATA and HOLE chunks, following the
+ * ranges the vbd found unallocated in the whole chain. Returns 0 if
+ * there are no holes worth it, and the reply is left to the caller.
+ */
+static int
+tapdisk_nbdserver_prep_sparse_read(td_nbdserver_req_t *req)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	tapdisk_extents_t *holes = vreq->holes;
+	td_sector_t sec, end, pos, hs, he;
+	tapdisk_extent_t **sorted, *e;
+	struct nbd_structured_reply *last = NULL;
+	struct iovec *iov;
+	size_t i, j, n;
+	int cnt = 0;
+	char *hdrs;
+	void *buf;
+
+	if (!holes || !holes->count)
+		return 0;
+
+	sorted = malloc(holes->count * sizeof(*sorted));
+	if (!sorted)
+		return 0;
+
+	for (n = 0, e = holes->head; e; e = e->next)
+		sorted[n++] = e;
+	qsort(sorted, n, sizeof(*sorted), tapdisk_nbdserver_cmp_extent);
+
+	/* merge, and keep only the holes big enough */
+	sec = vreq->sec;
+	end = vreq->sec + vreq->iov->secs;
+	for (i = 0, j = 0; i < n; i++) {
+		if (j && sorted[i]->start <=
+		    sorted[j - 1]->start + sorted[j - 1]->length) {
+			he = sorted[i]->start + sorted[i]->length;
+			if (he > sorted[j - 1]->start + sorted[j - 1]->length)
+				sorted[j - 1]->length =
+					he - sorted[j - 1]->start;
+			continue;
+		}
+		sorted[j++] = sorted[i];
+	}
+	for (i = 0, n = 0; i < j; i++)
+		if (sorted[i]->length >= NBD_SERVER_MIN_HOLE_SECS &&
+		    sorted[i]->start >= sec &&
+		    sorted[i]->start + sorted[i]->length <= end)
+			sorted[n++] = sorted[i];
+
+	if (!n) {
+		free(sorted);
+		return 0;
+	}
+
+	/* at most a DATA chunk before each hole and one after the last */
+	req->tx_extra = malloc((3 * n + 2) * sizeof(struct iovec) +
+			       (2 * n + 1) * 32);
+	if (!req->tx_extra) {
+		free(sorted);
+		return 0;
+	}
+
+	iov  = req->tx_extra;
+	hdrs = (char *)(iov + 3 * n + 2);
+	buf  = vreq->iov->base;
+
+	for (i = 0, pos = sec; i < n; i++) {
+		hs = sorted[i]->start;
+		he = hs + sorted[i]->length;
+
+		if (pos < hs) {
+			tapdisk_nbdserver_add_chunk(req, hdrs, iov, &cnt,
+					NBD_REPLY_TYPE_OFFSET_DATA, pos,
+					hs - pos,
+					buf + ((pos - sec) << SECTOR_SHIFT));
+			hdrs += 32;
+		}
+
+		last = (struct nbd_structured_reply *)hdrs;
+		tapdisk_nbdserver_add_chunk(req, hdrs, iov, &cnt,
+				NBD_REPLY_TYPE_OFFSET_HOLE, hs, he - hs, NULL);
+		hdrs += 32;
+		pos = he;
+	}
+
+	if (pos < end) {
+		last = (struct nbd_structured_reply *)hdrs;
+		tapdisk_nbdserver_add_chunk(req, hdrs, iov, &cnt,
+				NBD_REPLY_TYPE_OFFSET_DATA, pos, end - pos,
+				buf + ((pos - sec) << SECTOR_SHIFT));
+	}
+
+	last->flags = htobe16(NBD_REPLY_FLAG_DONE);
+
+	req->tx_iov = iov;
+	req->tx_iovcnt = cnt;
+
+	free(sorted);
+	return 1;
 }
 
 static void
@@ -905,10 +1386,10 @@ __tapdisk_nbdserver_structured_read_cb(
 	td_nbdserver_client_t *client = token;
 	td_nbdserver_t *server = client->server;
 	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+	struct nbd_structured_reply reply;
 	unsigned long long interval;
 	struct timeval now;
 	uint64_t offset;
-	int rc = 0;
 	int len = 0;
 
 	gettimeofday(&now, NULL);
@@ -918,46 +1399,69 @@ __tapdisk_nbdserver_structured_read_cb(
 		INFO("request took %llu microseconds to complete", interval);
 	}
 
-	if (client->client_fd < 0) {
-		ERR("Finishing request for client that has disappeared");
-		goto finish;
-	}
-
 	len = vreq->iov->secs << SECTOR_SHIFT;
 
-	/* For now, say we're done, if we have to support multiple chunks it will be harder */
-	if (__tapdisk_nbdserver_send_structured_reply(
-		client->client_fd, NBD_REPLY_TYPE_OFFSET_DATA,
-		NBD_REPLY_FLAG_DONE, req->id, len + sizeof(uint64_t)) == -1)
-	{
-		ERR("Failed to send structured reply header");
-		goto finish;
-	}
-
-	offset = vreq->sec << SECTOR_SHIFT;
-	offset = htobe64(offset);
-	rc = send_fully_or_fail(client->client_fd, &offset, sizeof(offset));
-	if (rc < 0) {
-		ERR("Failed to send offset for structured read reply");
-		goto finish;
-	}
-
 	server->nbd_stats.stats->read_reqs_completed++;
 	server->nbd_stats.stats->read_sectors += vreq->iov->secs;
 	server->nbd_stats.stats->read_total_ticks += interval;
-	rc = send_fully_or_fail(client->client_fd,
-				vreq->iov->base, len);
-	if (rc < 0) {
-		ERR("Short send/error in callback");
-		goto finish;
-	}
 
 	if (error)
 		server->nbd_stats.stats->io_errors++;
+	else if (tapdisk_nbdserver_prep_sparse_read(req)) {
+		tapdisk_nbdserver_queue_reply(client, req);
+		return;
+	}
+
+	/* a single chunk for the whole range */
+	reply.magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC);
+	reply.flags = htobe16(NBD_REPLY_FLAG_DONE);
+	reply.type = htobe16(NBD_REPLY_TYPE_OFFSET_DATA);
+	memcpy(&reply.handle, req->id, sizeof(reply.handle));
+	reply.length = htobe32(len + sizeof(offset));
+	offset = htobe64(vreq->sec << SECTOR_SHIFT);
+
+	memcpy(req->tx_hdr, &reply, sizeof(reply));
+	memcpy(req->tx_hdr + sizeof(reply), &offset, sizeof(offset));
+	req->tx_hdr_len = sizeof(reply) + sizeof(offset);
+	req->tx_data = vreq->iov->base;
+	req->tx_data_len = len;
+
+	tapdisk_nbdserver_queue_reply(client, req);
+}
+
+/*
+ * Reads are what warm the chain: VHD bitmaps get cached, and local
+ * caches and copy-on-read populate from them. Read on, one chunk at a
+ * time, and reply once the range is done.
+ */
+static void
+__tapdisk_nbdserver_cache_cb(td_vbd_request_t *vreq, int error,
+		void *token, int final)
+{
+	td_nbdserver_client_t *client = token;
+	td_nbdserver_t *server = client->server;
+	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+	td_sector_t left;
+
+	vreq->sec += vreq->iov->secs;
+	left = req->cache_end - vreq->sec;
 
-finish:
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req, true);
+	if (!error && left && !client->dead) {
+		if (left < vreq->iov->secs)
+			vreq->iov->secs = left;
+		vreq->error = 0;
+		vreq->prev_error = 0;
+		vreq->num_retries = 0;
+
+		if (!tapdisk_vbd_queue_request(server->vbd, vreq))
+			return;
+	}
+
+	/* as allocated, for the buffer to go back to its pool */
+	vreq->iov->secs = req->cache_secs;
+
+	tapdisk_nbdserver_prep_simple_reply(req, error);
+	tapdisk_nbdserver_queue_reply(client, req);
 }
 
 static void
@@ -969,12 +1473,7 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
 	unsigned long long interval;
 	struct timeval now;
-	struct nbd_reply reply;
-	int rc = 0;
-
-	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = htonl(error);
-	memcpy(reply.handle, req->id, sizeof(reply.handle));
+	int i, op, secs = 0;
 
 	gettimeofday(&now, NULL);
 	interval = timeval_to_us(&now) - timeval_to_us(&vreq->ts);
@@ -983,105 +1482,483 @@ __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 		INFO("request took %llu microseconds to complete", interval);
 	}
 
-	if (client->client_fd < 0) {
-		ERR("Finishing request for client that has disappeared");
-		goto finish;
-	}
+	for (i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
 
-	rc = send_fully_or_fail(client->client_fd,
-				&reply,
-				sizeof(reply));
-	if (rc < 0) {
-		ERR("Short send/error in callback");
-		goto finish;
-	}
+	tapdisk_nbdserver_prep_simple_reply(req, error);
 
 	switch(vreq->op) {
 	case TD_OP_READ:
 		server->nbd_stats.stats->read_reqs_completed++;
-		server->nbd_stats.stats->read_sectors += vreq->iov->secs;
+		server->nbd_stats.stats->read_sectors += secs;
 		server->nbd_stats.stats->read_total_ticks += interval;
-		rc = send_fully_or_fail(client->client_fd,
-					vreq->iov->base,
-					vreq->iov->secs << SECTOR_SHIFT);
-		if (rc < 0) {
-			ERR("Short send/error in callback");
-			goto finish;
-		}
+		req->tx_data = vreq->iov->base;
+		req->tx_data_len = vreq->iov->secs << SECTOR_SHIFT;
 		break;
 	case TD_OP_WRITE:
 		server->nbd_stats.stats->write_reqs_completed++;
-		server->nbd_stats.stats->write_sectors += vreq->iov->secs;
+		server->nbd_stats.stats->write_sectors += secs;
 		server->nbd_stats.stats->write_total_ticks += interval;
+		list_del(&req->wr_next);
+		server->unsynced = true;
 	default:
 		break;
 	}
 
-	if (error)
-		server->nbd_stats.stats->io_errors++;
-
-finish:
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req, true);
-}
+	if (error)
+		server->nbd_stats.stats->io_errors++;
+
+	/* req and client may be gone after this */
+	op = vreq->op;
+	if (op == TD_OP_WRITE && !error && (req->flags & NBD_CMD_FLAG_FUA))
+		tapdisk_nbdserver_queue_sync(server, req);
+	else
+		tapdisk_nbdserver_queue_reply(client, req);
+
+	if (op == TD_OP_WRITE)
+		tapdisk_nbdserver_complete_flushes(server);
+}
+
+/*
+ * Negotiation
+ *
+ * The fixed newstyle handshake goes through the same receive and reply
+ * paths as transmission: the client flags and options are read as they
+ * arrive, and the replies to each option are gathered in client->opt_tx
+ * and queued as a single request.
+ */
+
+static int
+tapdisk_nbdserver_opt_append(td_nbdserver_client_t *client,
+			     const void *data, size_t len)
+{
+	char *buf;
+
+	if (!len)
+		return 0;
+
+	buf = realloc(client->opt_tx, client->opt_tx_len + len);
+	if (!buf) {
+		ERR("Failed to allocate negotiation reply");
+		return -1;
+	}
+
+	memcpy(buf + client->opt_tx_len, data, len);
+	client->opt_tx = buf;
+	client->opt_tx_len += len;
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_opt_reply_hdr(td_nbdserver_client_t *client,
+				uint32_t option, uint32_t reply, size_t len)
+{
+	struct nbd_fixed_new_option_reply fixed_new_option_reply;
+
+	fixed_new_option_reply.magic = htobe64(NBD_REP_MAGIC);
+	fixed_new_option_reply.option = htobe32(option);
+	fixed_new_option_reply.reply = htobe32(reply);
+	fixed_new_option_reply.replylen = htobe32(len);
+
+	return tapdisk_nbdserver_opt_append(client, &fixed_new_option_reply,
+					    sizeof(fixed_new_option_reply));
+}
+
+static int
+tapdisk_nbdserver_opt_reply(td_nbdserver_client_t *client, uint32_t option,
+			    uint32_t reply, const void *data, size_t len)
+{
+	if (tapdisk_nbdserver_opt_reply_hdr(client, option, reply, len))
+		return -1;
+
+	return tapdisk_nbdserver_opt_append(client, data, len);
+}
+
+/*
+ * Queue what was gathered in opt_tx, sent with the next batch of
+ * replies.
+ */
+static int
+tapdisk_nbdserver_opt_queue(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req;
+
+	if (!client->opt_tx_len)
+		return 0;
+
+	req = tapdisk_nbdserver_alloc_request(client);
+	if (!req) {
+		ERR("No request free for a negotiation reply");
+		return -1;
+	}
+
+	memset(req, 0, sizeof(td_nbdserver_req_t));
+	req->tx_data = client->opt_tx;
+	req->tx_data_len = client->opt_tx_len;
+	req->tx_extra = client->opt_tx;
+	client->opt_tx = NULL;
+	client->opt_tx_len = 0;
+
+	tapdisk_nbdserver_add_reply(client, req);
+
+	return 0;
+}
+
+/**
+ * Replies to an NBD_OPT_INFO or an NBD_OPT_GO. These are identical; the only difference is that
+ * NBD_OPT_GO moves to the transmission phase immediately, while NPD_OPT_INFO does not.
+ *
+ * We cheat outrageously here, by accepting whatever exportname the client provides as meaning they
+ * want our single fixed export (because it's all we have).
+ *
+ */
+static int
+tapdisk_nbdserver_opt_infogo(td_nbdserver_client_t *client, uint32_t option,
+			     const char *buf, uint32_t len)
+{
+	td_nbdserver_t *server = client->server;
+	struct nbd_fixed_new_option_reply_info_export export;
+	struct nbd_fixed_new_option_reply_info_block_size block_info;
+	uint32_t exportnamelen, off;
+	uint16_t nrInfoReq, request;
+
+	if (len < sizeof(exportnamelen))
+		goto invalid;
+	memcpy(&exportnamelen, buf, sizeof(exportnamelen));
+	exportnamelen = be32toh(exportnamelen);
+
+	if (exportnamelen > MAX_NBD_EXPORT_NAME_LEN) {
+		ERR("Received %u as export name length which exceeds the maximum of %u",
+			exportnamelen, MAX_NBD_EXPORT_NAME_LEN);
+		return -1;
+	}
+
+	off = sizeof(exportnamelen) + exportnamelen;
+	if (len < off + sizeof(nrInfoReq))
+		goto invalid;
+	INFO("Exportname %.*s", exportnamelen, buf + sizeof(exportnamelen));
+
+	memcpy(&nrInfoReq, buf + off, sizeof(nrInfoReq));
+	nrInfoReq = be16toh(nrInfoReq);
+	off += sizeof(nrInfoReq);
+	INFO("nrInfoReq is %d", nrInfoReq);
+
+	if (len < off + nrInfoReq * sizeof(request))
+		goto invalid;
+
+	while (nrInfoReq--) {
+		memcpy(&request, buf + off, sizeof(request));
+		off += sizeof(request);
+		INFO("Client requested NBD_INFO %u", be16toh(request));
+	}
+
+	/* Always send NBD_INFO_EXPORT*/
+	export.info = htobe16(NBD_INFO_EXPORT);
+	export.exportsize = htobe64(NBD_EXPORTSIZE(server));
+	export.eflags = htobe16(NBD_FLAGS);
+	if (tapdisk_nbdserver_opt_reply(client, option, NBD_REP_INFO,
+					&export, sizeof(export)))
+		return -1;
+
+	block_info.info = htobe16(NBD_INFO_BLOCK_SIZE);
+	block_info.min_block_size = htobe32(1);
+	block_info.preferred_block_size = htobe32(4096);
+	block_info.max_block_size = htobe32(2 * MEGABYTES);
+	if (tapdisk_nbdserver_opt_reply(client, option, NBD_REP_INFO,
+					&block_info, sizeof(block_info)))
+		return -1;
+
+	return tapdisk_nbdserver_opt_reply(client, option, NBD_REP_ACK, NULL, 0);
+
+invalid:
+	ERR("Truncated option %u data (%u bytes)", option, len);
+	return -1;
+}
+
+static int
+tapdisk_nbdserver_opt_set_meta_context(td_nbdserver_client_t *client,
+				       const char *buf, uint32_t len)
+{
+	static const char base_allocation[] = "base:allocation";
+	const uint32_t option = NBD_OPT_SET_META_CONTEXT;
+	struct nbd_fixed_new_option_reply_meta_context context;
+	uint32_t exportnamelen, nr_queries, querylen, off;
+	bool found = false;
+
+	if (len < sizeof(exportnamelen))
+		goto invalid;
+	memcpy(&exportnamelen, buf, sizeof(exportnamelen));
+	exportnamelen = be32toh(exportnamelen);
+	off = sizeof(exportnamelen);
+
+	if (exportnamelen > len - off ||
+	    len - off - exportnamelen < sizeof(nr_queries))
+		goto invalid;
+	off += exportnamelen;
+
+	memcpy(&nr_queries, buf + off, sizeof(nr_queries));
+	nr_queries = be32toh(nr_queries);
+	off += sizeof(nr_queries);
+
+	while (nr_queries > 0) {
+		if (len - off < sizeof(querylen))
+			goto invalid;
+		memcpy(&querylen, buf + off, sizeof(querylen));
+		querylen = be32toh(querylen);
+		off += sizeof(querylen);
+
+		if (querylen > len - off)
+			goto invalid;
+		INFO("Client asked for meta context %.*s", querylen, buf + off);
+
+		if (querylen == sizeof(base_allocation) - 1 &&
+		    !memcmp(buf + off, base_allocation, querylen))
+			found = true;
+
+		off += querylen;
+		nr_queries--;
+	}
+
+	if (found) {
+		context.context_id = htobe32(base_allocation_id);
+		if (tapdisk_nbdserver_opt_reply_hdr(client, option,
+				NBD_REP_META_CONTEXT,
+				sizeof(context) + sizeof(base_allocation) - 1) ||
+		    tapdisk_nbdserver_opt_append(client, &context,
+				sizeof(context)) ||
+		    tapdisk_nbdserver_opt_append(client, base_allocation,
+				sizeof(base_allocation) - 1))
+			return -1;
+	}
+
+	return tapdisk_nbdserver_opt_reply(client, option, NBD_REP_ACK, NULL, 0);
+
+invalid:
+	ERR("Malformed NBD_OPT_SET_META_CONTEXT (%u bytes)", len);
+	return tapdisk_nbdserver_opt_reply(client, option, NBD_REP_ERR_INVALID,
+					   NULL, 0);
+}
+
+/*
+ * Act on the option just read, with its data in rx_opt_buf. Returns 1 to
+ * carry on, in negotiation or transmission, or -1 to drop the client.
+ */
+static int
+tapdisk_nbdserver_handle_option(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	struct nbd_export_name_option_reply handshake_finish;
+	uint32_t opt_code = be32toh(client->rx_opt.option);
+	uint32_t opt_len = be32toh(client->rx_opt.optlen);
+	const char *buf = client->rx_opt_buf;
+	int next = NBD_RX_OPT_HDR;
+	int err = 0;
+
+	switch (opt_code) {
+		case NBD_OPT_EXPORT_NAME:
+			INFO("Processing NBD_OPT_EXPORT_NAME");
+			INFO("Exportname %.*s", opt_len, buf);
+
+			bzero(&handshake_finish, sizeof handshake_finish);
+			handshake_finish.exportsize = htobe64(NBD_EXPORTSIZE(server));
+			handshake_finish.eflags = htobe16(NBD_FLAGS);
+			err = tapdisk_nbdserver_opt_append(client, &handshake_finish,
+					client->no_zeroes ? 10 : sizeof(handshake_finish));
+			/* Immediately enter data transfer */
+			next = NBD_RX_HDR;
+			break;
+		case NBD_OPT_ABORT:
+			INFO("Processing NBD_OPT_ABORT");
+			/* Failure of this is irrelevant */
+			if (!tapdisk_nbdserver_opt_reply(client, opt_code, NBD_REP_ACK,
+							 NULL, 0) &&
+			    !tapdisk_nbdserver_opt_queue(client))
+				tapdisk_nbdserver_send_replies(client);
+			/* There will be nothing after this */
+			err = -1;
+			break;
+		case NBD_OPT_LIST:
+		{
+			uint32_t namelen = strlen(NBD_FIXED_SINGLE_EXPORT);
+			uint32_t be_namelen = htobe32(namelen);
+
+			INFO("Processing NBD_OPT_LIST('%s')",NBD_FIXED_SINGLE_EXPORT);
+			err = tapdisk_nbdserver_opt_reply_hdr(client, opt_code,
+					NBD_REP_SERVER, sizeof(be_namelen) + namelen) ||
+			      tapdisk_nbdserver_opt_append(client, &be_namelen,
+					sizeof(be_namelen)) ||
+			      tapdisk_nbdserver_opt_append(client,
+					NBD_FIXED_SINGLE_EXPORT, namelen) ||
+			      tapdisk_nbdserver_opt_reply(client, opt_code,
+					NBD_REP_ACK, NULL, 0);
+			break;
+		}
+		case NBD_OPT_STARTTLS:
+			ERR("NBD_OPT_STARTTLS: not implemented");
+			err = tapdisk_nbdserver_opt_reply(client, opt_code,
+					NBD_REP_ERR_UNSUP, NULL, 0);
+			break;
+		case NBD_OPT_INFO:
+			INFO("Processing NBD_OPT_INFO");
+			err = tapdisk_nbdserver_opt_infogo(client, opt_code,
+					buf, opt_len);
+			break;
+		case NBD_OPT_GO:
+			INFO("Processing NBD_OPT_GO");
+			err = tapdisk_nbdserver_opt_infogo(client, opt_code,
+					buf, opt_len);
+			/* Immediately enter data transfer */
+			next = NBD_RX_HDR;
+			break;
+		case NBD_OPT_STRUCTURED_REPLY:
+			INFO("Processing NBD_OPT_STRUCTURED_REPLY");
+			if (opt_len != 0) {
+				err = tapdisk_nbdserver_opt_reply(client, opt_code,
+						NBD_REP_ERR_INVALID, NULL, 0);
+				break;
+			}
+
+			err = tapdisk_nbdserver_opt_reply(client, opt_code,
+					NBD_REP_ACK, NULL, 0);
+			client->structured_reply = true;
+			break;
+		case NBD_OPT_LIST_META_CONTEXT:
+			INFO("NBD_OPT_LIST_META_CONTEXT: not implemented");
+			err = tapdisk_nbdserver_opt_reply(client, opt_code,
+					NBD_REP_ERR_UNSUP, NULL, 0);
+			break;
+		case NBD_OPT_SET_META_CONTEXT:
+			INFO("Processing NBD_OPT_SET_META_CONTEXT");
+			err = tapdisk_nbdserver_opt_set_meta_context(client,
+					buf, opt_len);
+			break;
+		default:
+			ERR("Unknown NBD option %u", opt_code);
+			err = -1;
+	}
+
+	free(client->rx_opt_buf);
+	client->rx_opt_buf = NULL;
+
+	if (!err)
+		err = tapdisk_nbdserver_opt_queue(client);
+	if (err) {
+		INFO("Option negotiation terminated");
+		return -1;
+	}
+
+	client->rx_state = next;
+	return 1;
+}
+
+static int
+tapdisk_nbdserver_handle_option_hdr(td_nbdserver_client_t *client)
+{
+	uint32_t opt_len;
+
+	if (++client->n_options > MAX_OPTIONS) {
+		ERR("Max number of nbd options exceeded (%d)", MAX_OPTIONS);
+		return -1;
+	}
+
+	if (NBD_OPT_MAGIC != be64toh(client->rx_opt.version)) {
+		ERR("Bad NBD option version %" PRIx64 ", expected %" PRIx64,
+			be64toh(client->rx_opt.version), NBD_OPT_MAGIC);
+		return -1;
+	}
+
+	opt_len = be32toh(client->rx_opt.optlen);
+	if (opt_len > MAX_REQUEST_SIZE) {
+		ERR ("NBD optlen to big (%" PRIu32 ")", opt_len);
+		return -1;
+	}
 
-void
-tapdisk_nbdserver_handshake_cb(event_id_t id, char mode, void *data)
-{
-	uint32_t cflags = 0;
+	client->rx_opt_buf = malloc(opt_len + 1);
+	if (!client->rx_opt_buf) {
+		ERR("Failed to allocate %u bytes of option data", opt_len);
+		return -1;
+	}
 
-	td_nbdserver_client_t *client = (td_nbdserver_client_t*)data;
-	td_nbdserver_t *server = client->server;
+	if (!opt_len)
+		return tapdisk_nbdserver_handle_option(client);
 
-	int rc = recv_fully_or_fail(server->handshake_fd, &cflags, sizeof(cflags));
-	if(rc < 0) {
-		ERR("Could not receive client flags");
-		return;
-	}
+	client->rx_state = NBD_RX_OPT_DATA;
+	return 1;
+}
 
-	cflags = be32toh (cflags);
-	bool no_zeroes = (NBD_FLAG_NO_ZEROES & cflags) != 0;
+static int
+tapdisk_nbdserver_handle_cflags(td_nbdserver_client_t *client)
+{
+	uint32_t cflags = be32toh(client->rx_cflags);
 
-        /* Receive newstyle options. */
-        if (receive_newstyle_options (client, server->handshake_fd, no_zeroes) == -1)
-			INFO("Option negotiation terminated");
+	client->no_zeroes = (NBD_FLAG_NO_ZEROES & cflags) != 0;
+	client->rx_state = NBD_RX_OPT_HDR;
 
-	tapdisk_server_unregister_event(id);
+	return 1;
 }
 
+/*
+ * Queue the fixed newstyle greeting. The client flags and options are
+ * then taken in as they arrive, like requests: we may need to wait upto
+ * 40 seconds for them, especially during SXM.
+ */
 int
 tapdisk_nbdserver_new_protocol_handshake(td_nbdserver_client_t *client, int new_fd)
 {
-	td_nbdserver_t *server = client->server;
 	struct nbd_new_handshake handshake;
 
 	handshake.nbdmagic = htobe64 (NBD_MAGIC);
 	handshake.version = htobe64 (NBD_OPT_MAGIC);
 	handshake.gflags = htobe16 (gflags);
 
-	int rc = send_fully_or_fail(new_fd, &handshake, sizeof(handshake));
-	if (rc < 0) {
-		ERR("Sending newstyle handshake");
+	client->client_fd = new_fd;
+	client->rx_state = NBD_RX_CFLAGS;
+	client->rx_off = 0;
+
+	if (tapdisk_nbdserver_opt_append(client, &handshake, sizeof(handshake)) ||
+	    tapdisk_nbdserver_opt_queue(client)) {
+		ERR("Queueing newstyle handshake");
 		return -1;
 	}
-	server->handshake_fd = new_fd;
-	/* We may need to wait upto 40 seconds for a reply especially during
-	 * SXM contexts, so setup an event and return so that tapdisk is 
-	 * reponsive during the interim*/
 
-	tapdisk_server_register_event( SCHEDULER_POLL_READ_FD,
-				       new_fd, TV_ZERO,
-				       tapdisk_nbdserver_handshake_cb,
-				       client);
 	return 0;
 }
 
+/*
+ * Start reading from a new client, and send what was queued for it as
+ * far as the socket takes it.
+ */
+static void
+tapdisk_nbdserver_start_client(td_nbdserver_client_t *client)
+{
+	int fd = client->client_fd;
+
+	tapdisk_nbdserver_enable_zerocopy(client);
+
+	INFO("About to enable client on fd %d", fd);
+	if (tapdisk_nbdserver_enable_client(client) < 0) {
+		ERR("Error enabling client");
+		goto fail;
+	}
+
+	if (tapdisk_nbdserver_send_replies(client) < 0) {
+		INFO("Write failed in negotiation");
+		goto fail;
+	}
+
+	return;
+
+fail:
+	tapdisk_nbdserver_free_client(client);
+	close(fd);
+}
+
 static void
 tapdisk_nbdserver_newclient_fd_old(td_nbdserver_t *server, int new_fd)
 {
 	td_nbdserver_client_t *client;
 	char buffer[256];
-	int rc;
 	uint64_t tmp64;
 	uint32_t tmp32;
 
@@ -1090,6 +1967,17 @@ tapdisk_nbdserver_newclient_fd_old(td_nbdserver_t *server, int new_fd)
 
 	INFO("Got a new client!");
 
+	INFO("About to alloc client");
+	client = tapdisk_nbdserver_alloc_client(server);
+	if (client == NULL) {
+		ERR("Error allocating client");
+		close(new_fd);
+		return;
+	}
+
+	INFO("Got an allocated client at %p", client);
+	client->client_fd = new_fd;
+
 	/* Spit out the NBD connection stuff */
 
 	memcpy(buffer, "NBDMAGIC", 8);
@@ -1102,30 +1990,15 @@ tapdisk_nbdserver_newclient_fd_old(td_nbdserver_t *server, int new_fd)
 	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
 	bzero(buffer + 28, 124);
 
-	rc = send_fully_or_fail(new_fd, buffer, 152);
-	if (rc < 0) {
-		close(new_fd);
-		INFO("Write failed in negotiation");
-		return;
-	}
-
-	INFO("About to alloc client");
-	client = tapdisk_nbdserver_alloc_client(server);
-	if (client == NULL) {
-		ERR("Error allocating client");
+	if (tapdisk_nbdserver_opt_append(client, buffer, 152) ||
+	    tapdisk_nbdserver_opt_queue(client)) {
+		ERR("Queueing negotiation");
+		tapdisk_nbdserver_free_client(client);
 		close(new_fd);
 		return;
 	}
 
-	INFO("Got an allocated client at %p", client);
-	client->client_fd = new_fd;
-
-	INFO("About to enable client on fd %d", client->client_fd);
-	if (tapdisk_nbdserver_enable_client(client) < 0) {
-		ERR("Error enabling client");
-		tapdisk_nbdserver_free_client(client);
-		close(new_fd);
-	}
+	tapdisk_nbdserver_start_client(client);
 }
 
 static void
@@ -1147,8 +2020,6 @@ tapdisk_nbdserver_newclient_fd_new_fixed(td_nbdserver_t *server, int new_fd)
 	}
 	INFO("Got an allocated client at %p", client);
 
-	client->client_fd = new_fd;
-
 	if(tapdisk_nbdserver_new_protocol_handshake(client, new_fd) != 0) {
 		ERR("Error handshaking new client connection");
 		tapdisk_nbdserver_free_client(client);
@@ -1156,12 +2027,7 @@ tapdisk_nbdserver_newclient_fd_new_fixed(td_nbdserver_t *server, int new_fd)
 		return;
 	}
 
-	INFO("About to enable client on fd %d", client->client_fd);
-	if (tapdisk_nbdserver_enable_client(client) < 0) {
-		ERR("Error enabling client");
-		tapdisk_nbdserver_free_client(client);
-		close(new_fd);
-	}
+	tapdisk_nbdserver_start_client(client);
 }
 
 static void
@@ -1180,7 +2046,6 @@ tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
 static td_vbd_request_t *create_request_vreq(
 	td_nbdserver_client_t *client, struct nbd_request request, uint32_t len)
 {
-	int rc;
 	td_nbdserver_t *server = client->server;
 	td_vbd_request_t *vreq;
 	td_nbdserver_req_t *req;
@@ -1198,16 +2063,19 @@ static td_vbd_request_t *create_request_vreq(
 	bzero(req->id, sizeof(req->id));
 	memcpy(req->id, request.handle, sizeof(request.handle));
 
-	rc = posix_memalign(&req->iov.base, 512, len);
-	if (rc < 0) {
-		ERR("posix_memalign failed (%d)", rc);
-		goto fail;
+	if (len) {
+		req->iov.base = tapdisk_nbdserver_get_buf(server, len);
+		if (!req->iov.base) {
+			ERR("Failed to allocate a %u bytes buffer", len);
+			goto fail;
+		}
 	}
 
 	vreq->sec = request.from >> SECTOR_SHIFT;
 	vreq->iovcnt = 1;
 	vreq->iov = &req->iov;
 	vreq->iov->secs = len >> SECTOR_SHIFT;
+	client->buf_bytes += vreq->iov->secs << SECTOR_SHIFT;
 	vreq->token = client;
 	vreq->name = req->id;
 	vreq->vbd = server->vbd;
@@ -1221,24 +2089,157 @@ failreq:
 }
 
 
-void
-tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+static int
+tapdisk_nbdserver_submit_request(td_nbdserver_client_t *client,
+				 td_vbd_request_t *vreq)
 {
-	td_nbdserver_client_t *client = data;
 	td_nbdserver_t *server = client->server;
+	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
 	int rc;
-	uint32_t len;
-	int fd = client->client_fd;
-	td_vbd_request_t *vreq = NULL;
-	struct nbd_request request;
 
-	/* Read the request the client has sent */
-	rc = recv_fully_or_fail(fd, &request, sizeof(request));
-	if (rc < 0) {
-		ERR("failed to receive from client. Closing connection");
-		goto fail;
+	rc = tapdisk_vbd_queue_request(server->vbd, vreq);
+	if (rc) {
+		ERR("tapdisk_vbd_queue_request failed: %d", rc);
+		tapdisk_nbd_server_free_vreq(client, vreq, false);
+		return -1;
+	}
+
+	if (vreq->op == TD_OP_WRITE) {
+		req->seq = ++server->write_seq;
+		list_add_tail(&req->wr_next, &server->writes);
+	}
+
+	return 1;
+}
+
+/*
+ * Reply right away, without any I/O. The reply goes out with the next
+ * batch sent to the client.
+ */
+static int
+tapdisk_nbdserver_reply_now(td_nbdserver_client_t *client,
+			    struct nbd_request request, int error)
+{
+	td_vbd_request_t *vreq;
+	td_nbdserver_req_t *req;
+
+	vreq = create_request_vreq(client, request, 0);
+	if (!vreq) {
+		ERR("Failed to create vreq");
+		return -1;
+	}
+
+	req = container_of(vreq, td_nbdserver_req_t, vreq);
+	tapdisk_nbdserver_prep_simple_reply(req, error);
+	tapdisk_nbdserver_add_reply(client, req);
+
+	return 1;
+}
+
+/*
+ * A flush completes once every write submitted before it, on any client,
+ * did, and the VBD was synced after. Flushes arriving meanwhile wait for
+ * the same writes and share the sync.
+ */
+static int
+tapdisk_nbdserver_flush(td_nbdserver_client_t *client,
+			struct nbd_request request)
+{
+	td_nbdserver_t *server = client->server;
+	td_vbd_request_t *vreq;
+	td_nbdserver_req_t *req;
+
+	if (list_empty(&server->writes) && !server->unsynced &&
+	    !server->sync_inflight)
+		return tapdisk_nbdserver_reply_now(client, request, 0);
+
+	vreq = create_request_vreq(client, request, 0);
+	if (!vreq) {
+		ERR("Failed to create vreq");
+		return -1;
 	}
 
+	req = container_of(vreq, td_nbdserver_req_t, vreq);
+	if (list_empty(&server->writes))
+		tapdisk_nbdserver_queue_sync(server, req);
+	else {
+		req->seq = server->write_seq;
+		list_add_tail(&req->wr_next, &server->flushes);
+	}
+
+	return 1;
+}
+
+/*
+ * WRITE_ZEROES and TRIM carry no payload: write the range from the
+ * server's zero buffer, one iovec per NBD_SERVER_ZERO_BUF_SIZE. The
+ * vreq is marked as zeroes, drivers zero the range in place or don't
+ * allocate for it where they can.
+ */
+static td_vbd_request_t *
+create_zeroes_vreq(td_nbdserver_client_t *client, struct nbd_request request,
+		   uint32_t len)
+{
+	td_nbdserver_t *server = client->server;
+	td_vbd_request_t *vreq;
+	td_nbdserver_req_t *req;
+	struct td_iovec *iov;
+	uint32_t n, i, chunk;
+	int rc;
+
+	if (!server->zero_buf) {
+		rc = posix_memalign(&server->zero_buf, 4096,
+				    NBD_SERVER_ZERO_BUF_SIZE);
+		if (rc) {
+			ERR("posix_memalign failed (%d)", rc);
+			server->zero_buf = NULL;
+			return NULL;
+		}
+		memset(server->zero_buf, 0, NBD_SERVER_ZERO_BUF_SIZE);
+	}
+
+	vreq = create_request_vreq(client, request, 0);
+	if (!vreq)
+		return NULL;
+
+	req = container_of(vreq, td_nbdserver_req_t, vreq);
+
+	n = (len + NBD_SERVER_ZERO_BUF_SIZE - 1) / NBD_SERVER_ZERO_BUF_SIZE;
+	iov = calloc(n, sizeof(*iov));
+	if (!iov) {
+		ERR("Failed to allocate %u iovecs", n);
+		tapdisk_nbd_server_free_vreq(client, vreq, false);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		chunk = len - i * NBD_SERVER_ZERO_BUF_SIZE;
+		if (chunk > NBD_SERVER_ZERO_BUF_SIZE)
+			chunk = NBD_SERVER_ZERO_BUF_SIZE;
+		iov[i].base = server->zero_buf;
+		iov[i].secs = chunk >> SECTOR_SHIFT;
+	}
+
+	req->tx_extra = iov;
+	vreq->iov = iov;
+	vreq->iovcnt = n;
+
+	return vreq;
+}
+
+/*
+ * Act on the request header just received. Returns 1 on success, 2 if
+ * the client asked to disconnect, -1 if the client must be dropped.
+ */
+static int
+tapdisk_nbdserver_handle_request(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	struct nbd_request request = client->rx_hdr;
+	td_vbd_request_t *vreq = NULL;
+	uint16_t flags;
+	uint32_t len;
+
 	if (request.magic != htonl(NBD_REQUEST_MAGIC)) {
 		ERR("Not enough magic, %X", request.magic);
 		goto fail;
@@ -1252,6 +2253,19 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 				request.from, len);
 	}
 
+	/* the upper half of the type carries NBD_CMD_FLAG_* */
+	flags = request.type >> 16;
+	request.type &= 0xffff;
+
+	if (len > MAX_REQUEST_SIZE &&
+	    request.type != TAPDISK_NBD_CMD_WRITE_ZEROES &&
+	    request.type != TAPDISK_NBD_CMD_TRIM &&
+	    request.type != TAPDISK_NBD_CMD_CACHE &&
+	    request.type != TAPDISK_NBD_CMD_BLOCK_STATUS) {
+		ERR("Request too large (%"PRIu64", %u)", request.from, len);
+		goto fail;
+	}
+
 	switch(request.type) {
 	case TAPDISK_NBD_CMD_READ:
 		vreq = create_request_vreq(client, request, len);
@@ -1263,6 +2277,9 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 			__tapdisk_nbdserver_structured_read_cb :
 		        __tapdisk_nbdserver_request_cb;
 		vreq->op = TD_OP_READ;
+		if (client->structured_reply)
+			/* without it, holes are simply sent as zeroes */
+			vreq->holes = calloc(1, sizeof(tapdisk_extents_t));
                 server->nbd_stats.stats->read_reqs_submitted++;
 		break;
 	case TAPDISK_NBD_CMD_WRITE:
@@ -1273,37 +2290,94 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 		}
 		vreq->cb = __tapdisk_nbdserver_request_cb;
 		vreq->op = TD_OP_WRITE;
+		/* NBD_CMD_FLAG_FUA: replied to after a sync */
+		container_of(vreq, td_nbdserver_req_t, vreq)->flags = flags;
 		server->nbd_stats.stats->write_reqs_submitted++;
-		rc = recv_fully_or_fail(fd, vreq->iov->base, len);
-		if (rc < 0) {
-			ERR("Short send or error in "
-			    "callback: %d", rc);
-			goto fail;
-		}
 
+		if (len) {
+			/* the payload follows, submit once it is all in */
+			client->rx_req = container_of(vreq, td_nbdserver_req_t,
+						      vreq);
+			client->rx_state = NBD_RX_DATA;
+			return 1;
+		}
 		break;
 	case TAPDISK_NBD_CMD_DISC:
-		INFO("Received close message. Sending reconnect header");
-		tapdisk_nbdserver_free_client(client);
-		INFO("About to send initial connection message");
-		tapdisk_nbdserver_newclient_fd(server, fd);
-		INFO("Sent initial connection message");
-		return;
+		return 2;
+	case TAPDISK_NBD_CMD_FLUSH:
+		return tapdisk_nbdserver_flush(client, request);
+	case TAPDISK_NBD_CMD_CACHE:
+	{
+		td_nbdserver_req_t *req;
+
+		if (request.from + len > NBD_EXPORTSIZE(server))
+			return tapdisk_nbdserver_reply_now(client, request,
+							   -EINVAL);
+		if (len < DEFAULT_SECTOR_SIZE)
+			return tapdisk_nbdserver_reply_now(client, request, 0);
+
+		vreq = create_request_vreq(client, request,
+					   len < NBD_SERVER_CACHE_CHUNK ?
+					   len : NBD_SERVER_CACHE_CHUNK);
+		if (!vreq) {
+			ERR("Failed to create vreq");
+			goto fail;
+		}
+		req = container_of(vreq, td_nbdserver_req_t, vreq);
+		req->cache_end = (request.from + len) >> SECTOR_SHIFT;
+		req->cache_secs = vreq->iov->secs;
+		vreq->cb = __tapdisk_nbdserver_cache_cb;
+		vreq->op = TD_OP_READ;
+	}
+		break;
+	case TAPDISK_NBD_CMD_TRIM:
+	case TAPDISK_NBD_CMD_WRITE_ZEROES:
+		if (flags & NBD_CMD_FLAG_FAST_ZERO)
+			return tapdisk_nbdserver_reply_now(client, request,
+							   -EOPNOTSUPP);
+		if (request.from + len > NBD_EXPORTSIZE(server))
+			return tapdisk_nbdserver_reply_now(client, request,
+							   -EINVAL);
+		if (!len)
+			return tapdisk_nbdserver_reply_now(client, request, 0);
+
+		vreq = create_zeroes_vreq(client, request, len);
+		if (!vreq) {
+			ERR("Failed to create vreq");
+			goto fail;
+		}
+		vreq->cb = __tapdisk_nbdserver_request_cb;
+		vreq->op = TD_OP_WRITE;
+		/* a TRIM reads back as zeroes too, the space may go */
+		vreq->zeroes = request.type == TAPDISK_NBD_CMD_TRIM ||
+			!(flags & NBD_CMD_FLAG_NO_HOLE) ?
+			TD_ZEROES_DISCARD : TD_ZEROES_WRITE;
+		container_of(vreq, td_nbdserver_req_t, vreq)->flags = flags;
+		server->nbd_stats.stats->write_reqs_submitted++;
+		break;
 	case TAPDISK_NBD_CMD_BLOCK_STATUS:
 	{
 		if (!client->structured_reply)
 			ERR("NBD_CMD_BLOCK_STATUS: when not in structured reply");
 
-		if (len > 2 * MEGABYTES) {
-			/* limit request to 2MB */
-			len = 2 * MEGABYTES;
-		}
-
-		vreq = create_request_vreq(client, request, len);
+		/*
+		 * Answered from metadata alone: no data buffer, and any
+		 * length up to the end of the export.
+		 */
+		if (request.from >= NBD_EXPORTSIZE(server) ||
+		    len < DEFAULT_SECTOR_SIZE)
+			return tapdisk_nbdserver_reply_now(client, request,
+							   -EINVAL);
+		if (request.from + len > NBD_EXPORTSIZE(server))
+			len = NBD_EXPORTSIZE(server) - request.from;
+
+		vreq = create_request_vreq(client, request, 0);
 		if (!vreq) {
 			ERR("Failed to create vreq");
 			goto fail;
 		}
+		vreq->iov->secs = len >> SECTOR_SHIFT;
+		container_of(vreq, td_nbdserver_req_t, vreq)->flags = flags;
 		tapdisk_extents_t *extents = (tapdisk_extents_t*)malloc(sizeof(tapdisk_extents_t));
 		if(extents == NULL) {
 			ERR("Could not allocate memory for tapdisk_extents_t");
@@ -1320,20 +2394,124 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 		goto fail;
 	}
 
-	rc = tapdisk_vbd_queue_request(server->vbd, vreq);
-	if (rc) {
-		ERR("tapdisk_vbd_queue_request failed: %d", rc);
-		goto fail;
-	}
-
-	return;
+	return tapdisk_nbdserver_submit_request(client, vreq);
 
 fail:
 	if (vreq)
 		tapdisk_nbd_server_free_vreq(client, vreq, false);
+	return -1;
+}
 
-	tapdisk_nbdserver_free_client(client);
-	return;
+/*
+ * Read whatever is available of the current header or write payload, or
+ * during negotiation, of the client flags or option. Returns 0 when the socket has nothing more for now, otherwise as
+ * tapdisk_nbdserver_handle_request.
+ */
+static int
+tapdisk_nbdserver_receive(td_nbdserver_client_t *client)
+{
+	td_vbd_request_t *vreq;
+	size_t len;
+	ssize_t n;
+	void *buf;
+
+	switch (client->rx_state) {
+	case NBD_RX_HDR:
+		buf = (char *)&client->rx_hdr + client->rx_off;
+		len = sizeof(client->rx_hdr) - client->rx_off;
+		break;
+	case NBD_RX_CFLAGS:
+		buf = (char *)&client->rx_cflags + client->rx_off;
+		len = sizeof(client->rx_cflags) - client->rx_off;
+		break;
+	case NBD_RX_OPT_HDR:
+		buf = (char *)&client->rx_opt + client->rx_off;
+		len = sizeof(client->rx_opt) - client->rx_off;
+		break;
+	case NBD_RX_OPT_DATA:
+		buf = client->rx_opt_buf + client->rx_off;
+		len = be32toh(client->rx_opt.optlen) - client->rx_off;
+		break;
+	default:
+		vreq = &client->rx_req->vreq;
+		buf = vreq->iov->base + client->rx_off;
+		len = (vreq->iov->secs << SECTOR_SHIFT) - client->rx_off;
+	}
+
+	n = recv(client->client_fd, buf, len, MSG_DONTWAIT);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		ERR("failed to receive from client: %s", strerror(errno));
+		return -1;
+	}
+
+	if (n == 0) {
+		INFO("Zero return from recv");
+		return -1;
+	}
+
+	client->rx_off += n;
+	if (n < len)
+		return 0;
+
+	client->rx_off = 0;
+
+	switch (client->rx_state) {
+	case NBD_RX_HDR:
+		return tapdisk_nbdserver_handle_request(client);
+	case NBD_RX_CFLAGS:
+		return tapdisk_nbdserver_handle_cflags(client);
+	case NBD_RX_OPT_HDR:
+		return tapdisk_nbdserver_handle_option_hdr(client);
+	case NBD_RX_OPT_DATA:
+		return tapdisk_nbdserver_handle_option(client);
+	}
+
+	vreq = &client->rx_req->vreq;
+	client->rx_req = NULL;
+	client->rx_state = NBD_RX_HDR;
+
+	return tapdisk_nbdserver_submit_request(client, vreq);
+}
+
+void
+tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+	td_nbdserver_t *server = client->server;
+	int fd = client->client_fd;
+	int rc;
+
+	if (!list_empty(&client->zc_wait))
+		tapdisk_nbdserver_zc_reap(client);
+
+	/*
+	 * Take in requests until the socket runs dry or we run out of
+	 * requests or reply space.
+	 */
+	do {
+		rc = tapdisk_nbdserver_receive(client);
+		tapdisk_nbdserver_update_events(client);
+	} while (rc == 1 && !client->rx_masked);
+
+	/* send the replies which needed no I/O */
+	if (rc >= 0 && rc != 2 && tapdisk_nbdserver_send_replies(client) < 0)
+		rc = -1;
+
+	switch (rc) {
+	case -1:
+		ERR("failed to receive from client. Closing connection");
+		tapdisk_nbdserver_free_client(client);
+		break;
+	case 2:
+		INFO("Received close message. Sending reconnect header");
+		tapdisk_nbdserver_free_client(client);
+		INFO("About to send initial connection message");
+		tapdisk_nbdserver_newclient_fd(server, fd);
+		INFO("Sent initial connection message");
+		break;
+	}
 }
 
 static void
@@ -1426,6 +2604,11 @@ tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info, nbd_protocol_style_t
 	server->unix_listening_event_id = -1;
 	server->style = style;
 	INIT_LIST_HEAD(&server->clients);
+	INIT_LIST_HEAD(&server->writes);
+	INIT_LIST_HEAD(&server->flushes);
+	INIT_LIST_HEAD(&server->syncs);
+	INIT_LIST_HEAD(&server->synced);
+	server->sync_event_id = -1;
 
 	switch (style) {
 		case TAPDISK_NBD_PROTOCOL_OLD:
@@ -1758,6 +2941,15 @@ tapdisk_nbdserver_free(td_nbdserver_t *server)
 	list_for_each_entry_safe(pos, q, &server->clients, clientlist)
 		tapdisk_nbdserver_free_client(pos);
 
+	/* VBD syncs were waited for before, see tapdisk_vbd_quiesce_images */
+	BUG_ON(server->sync_inflight);
+
+	if (server->sync_event_id >= 0) {
+		tapdisk_server_unregister_event(server->sync_event_id);
+		server->sync_event_id = -1;
+	}
+	tapdisk_nbdserver_sync_reply(&server->syncs, -EIO);
+
 	if (server->fdrecv_listening_event_id >= 0) {
 		tapdisk_server_unregister_event(server->fdrecv_listening_event_id);
 		server->fdrecv_listening_event_id = -1;
@@ -1790,6 +2982,8 @@ tapdisk_nbdserver_free(td_nbdserver_t *server)
 	if (err)
 		ERR("failed to delete NBD metrics: %s\n", strerror(errno));
 
+	free(server->zero_buf);
+	tapdisk_nbdserver_pool_free(server);
 	free(server);
 }
 
@@ -38,7 +38,9 @@ typedef struct td_nbdserver_client td_nbdserver_client_t;
 #include "blktap2.h"
 #include "tapdisk-vbd.h"
 #include "list.h"
+#include "tapdisk-protocol-new.h"
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <stdbool.h>
 
 #define NBD_NEGOTIATION_MAGIC 0x00420281861253LL
@@ -77,12 +79,60 @@ struct nbd_reply {
 
 
 #define TAPDISK_NBDSERVER_MAX_PATH_LEN 256
+
+/*
+ * Request buffers are pooled in power of two size classes, from 4 KiB
+ * to 2 MiB.
+ */
+#define TAPDISK_NBDSERVER_POOL_MIN_SHIFT 12
+#define TAPDISK_NBDSERVER_POOL_MAX_SHIFT 21
+#define TAPDISK_NBDSERVER_POOL_CLASSES \
+	(TAPDISK_NBDSERVER_POOL_MAX_SHIFT - TAPDISK_NBDSERVER_POOL_MIN_SHIFT + 1)
 #define TAPDISK_NBDCLIENT_LISTEN_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbdclient"
 #define TAPDISK_NBDSERVER_OLD_LISTEN_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbdserver"
 #define TAPDISK_NBDSERVER_NEW_LISTEN_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbdserver-new"
 #define TAPDISK_NBDSERVER_OLD_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbd-old"
 #define TAPDISK_NBDSERVER_NEW_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbd"
 
+struct td_nbdserver_req {
+	td_vbd_request_t        vreq;
+	char                    id[16];
+	uint16_t                flags;   /* NBD_CMD_FLAG_* */
+	struct td_iovec         iov;
+
+	/*
+	 * Reply: a header, followed by an optional payload, sent from
+	 * client->tx_queue. Replies made of several chunks set tx_iov
+	 * instead. tx_extra is freed with the request.
+	 */
+	struct list_head        tx_next;
+	char                    tx_hdr[32];
+	size_t                  tx_hdr_len;
+	void                   *tx_data;
+	size_t                  tx_data_len;
+	struct iovec            tx_iov_buf[2];
+	struct iovec           *tx_iov;
+	int                     tx_iovcnt;
+	size_t                  tx_len;
+	size_t                  tx_off;
+	void                   *tx_extra;
+
+	/*
+	 * Writes: position in server->writes. Flushes: position in
+	 * server->flushes, covering writes up to seq.
+	 */
+	struct list_head        wr_next;
+	uint64_t                seq;
+
+	/* NBD_CMD_CACHE: end of the range, and size of the buffer */
+	td_sector_t             cache_end;
+	unsigned int            cache_secs;
+
+	/* sent with MSG_ZEROCOPY, up to send id zc_id */
+	bool                    zc;
+	uint32_t                zc_id;
+};
+
 struct td_nbdserver {
 	td_vbd_t               *vbd;
 	td_disk_info_t          info;
@@ -104,11 +154,6 @@ struct td_nbdserver {
 	 */
 	int                     unix_listening_fd;
 
-	/**
-	 * Socket opened during handshake negotiation.
-	 */
-	int                     handshake_fd;
-
 	/**
 	 * Event ID for the file descriptor receiver.
 	 */
@@ -126,6 +171,37 @@ struct td_nbdserver {
 
 	struct list_head        clients;
 
+	/**
+	 * Writes in flight on any client, in submission order, and the
+	 * flushes waiting for them.
+	 */
+	struct list_head        writes;
+	struct list_head        flushes;
+	uint64_t                write_seq;
+
+	/**
+	 * Flushes and FUA writes waiting for the next sync of the VBD,
+	 * issued once per event loop iteration, and those covered by the
+	 * sync in flight. Writes completed since the last one set
+	 * unsynced.
+	 */
+	struct list_head        syncs;
+	struct list_head        synced;
+	event_id_t              sync_event_id;
+	bool                    sync_inflight;
+	bool                    unsynced;
+
+	/**
+	 * Shared source buffer of NBD_CMD_WRITE_ZEROES and TRIM.
+	 */
+	void                   *zero_buf;
+
+	/**
+	 * Idle request buffers, one free list per size class.
+	 */
+	void                   *pool[TAPDISK_NBDSERVER_POOL_CLASSES];
+	size_t                  pool_bytes;
+
 	stats_t                 nbd_stats;
 
 	nbd_protocol_style_t	style;
@@ -154,6 +230,56 @@ struct td_nbdserver_client {
 	bool                    structured_reply;
 
 	int                     max_used_reqs;
+
+	/**
+	 * Receive state: the request header being read and, for writes,
+	 * the request whose payload is being read into.
+	 */
+	int                     rx_state;
+	struct nbd_request      rx_hdr;
+	size_t                  rx_off;
+	td_nbdserver_req_t     *rx_req;
+	bool                    rx_masked;
+
+	/**
+	 * Fixed newstyle negotiation: the client flags, the option being
+	 * read, its data, how many options were received, and the replies
+	 * to the current one, queued as a single request once it is handled.
+	 */
+	uint32_t                rx_cflags;
+	bool                    no_zeroes;
+	struct nbd_new_option   rx_opt;
+	char                   *rx_opt_buf;
+	int                     n_options;
+	char                   *opt_tx;
+	size_t                  opt_tx_len;
+
+	/**
+	 * Replies waiting to be sent, in completion order, and the event
+	 * waiting for the socket to become writable while there are any.
+	 */
+	struct list_head        tx_queue;
+	size_t                  tx_bytes;
+	int                     tx_event_id;
+
+	/**
+	 * Bytes of request buffers allocated, in flight or queued.
+	 */
+	size_t                  buf_bytes;
+
+	/**
+	 * MSG_ZEROCOPY sends, TCP only: replies fully sent whose buffers
+	 * the kernel may still read from, until the send ids they used
+	 * are reported done on the socket error queue. zc_fd is an epoll
+	 * instance watching the socket for POLLERR only, readable when
+	 * completions were queued.
+	 */
+	bool                    zc;
+	uint32_t                zc_next;
+	uint32_t                zc_done;
+	struct list_head        zc_wait;
+	int                     zc_fd;
+	int                     zc_event_id;
 };
 
 td_nbdserver_t *tapdisk_nbdserver_alloc(td_vbd_t *, td_disk_info_t, nbd_protocol_style_t);
@@ -175,7 +301,9 @@ int tapdisk_nbdserver_unpause(td_nbdserver_t *);
 /**
  * Callback to be executed when the client socket becomes ready. It is the core
  * NBD server function that deals with NBD client requests (e.g. I/O read,
- * I/O write, disconnect, etc.).
+ * I/O write, disconnect, etc.). The socket is read without blocking: partial
+ * headers and write payloads are kept in the client and completed on the next
+ * call.
  */
 void tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data);
 int tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs);
@@ -204,7 +332,6 @@ void tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 int tapdisk_nbdserver_reqs_pending(td_nbdserver_client_t *client);
 
 int tapdisk_nbdserver_new_protocol_handshake(td_nbdserver_client_t *client, int);
-void tapdisk_nbdserver_handshake_cb(event_id_t, char, void*);
 
 /**
  * Send and receive from the NBD socket
@@ -212,6 +339,23 @@ void tapdisk_nbdserver_handshake_cb(event_id_t, char, void*);
 int recv_fully_or_fail(int f, void *buf, size_t len);
 int send_fully_or_fail(int f, void *buf, size_t len);
 
+/**
+ * Request buffers, from the server pool when @len has a size class.
+ */
+void *tapdisk_nbdserver_get_buf(td_nbdserver_t *server, size_t len);
+void tapdisk_nbdserver_put_buf(td_nbdserver_t *server, void *buf, size_t len);
+
+/**
+ * Queue the reply prepared in @req and send what the socket takes of
+ * the queue. The client may be freed on return.
+ */
+void tapdisk_nbdserver_queue_reply(td_nbdserver_client_t *client,
+				   td_nbdserver_req_t *req);
+int tapdisk_nbdserver_send_replies(td_nbdserver_client_t *client);
+
 void free_extents(struct tapdisk_extents *extents);
+struct nbd_block_descriptor *
+convert_extents_to_block_descriptors(struct tapdisk_extents *extents,
+				     td_sector_t start, int one, size_t *count);
 
 #endif /* _TAPDISK_NBDSERVER_H_ */
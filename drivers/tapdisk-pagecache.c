@@ -0,0 +1,715 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libvhd.h"
+#include "tapdisk.h"
+#include "tapdisk-log.h"
+#include "tapdisk-pagecache.h"
+
+#define TD_PAGECACHE_MAGIC            0x74647063 /* "tdpc" */
+#define TD_PAGECACHE_VERSION          3
+
+/* hash slots examined per lookup/insert, must stay well below nbuckets */
+#define TD_PAGECACHE_PROBES           8
+
+/* names per page of data, leaving room for what sharing saves */
+#define TD_PAGECACHE_NAMES_PER_PAGE   2
+
+#define TD_PAGECACHE_KEY_SIZE         32
+
+#define ALIGN_UP(_x, _a)              (((_x) + (_a) - 1) & ~((uint64_t)(_a) - 1))
+
+/*
+ * Segment layout: header, the name table, the content table, page
+ * data. Each table is a bucket index followed by slot descriptors, and
+ * each section is page aligned.
+ *
+ * Page data is stored once for the whole host: content slots are keyed
+ * by a fingerprint of the data, and one is only shared by another
+ * insert after comparing the data itself. Name slots map an (image,
+ * page) key to a content slot, along with the sequence that slot had
+ * when the name was added, so a name whose content has since been
+ * recycled simply misses.
+ *
+ * An index is an open addressed table of 64 bit entries, the upper
+ * half a tag taken from the key hash, the lower half slot + 1. Entries
+ * are published with compare-and-swap and never removed; an entry whose
+ * slot has since been recycled for another key simply fails the tag or
+ * key check and gets overwritten by the next insert that probes it.
+ *
+ * Each slot is guarded by a sequence count: odd while its owner fills
+ * it, even otherwise. Readers copy the page out and retry nothing, they
+ * just treat a changed sequence as a miss. Eviction is CLOCK, one hand
+ * per table shared by all processes, ref bits set on hit.
+ *
+ * The upper half of the sequence word holds the owner's pid while the
+ * count is odd, so that a slot left locked by a tapdisk that died
+ * mid-fill can be taken over by the next eviction sweeping past it.
+ */
+
+struct td_pagecache_table_header {
+	uint32_t                      nslots;
+	uint32_t                      nbuckets;
+	uint64_t                      buckets_off;
+	uint64_t                      slots_off;
+	uint32_t                      hand;
+	uint32_t                      pad;
+};
+
+struct td_pagecache_header {
+	uint32_t                      magic;
+	uint32_t                      version;
+	uint64_t                      size;
+	uint64_t                      data_off;
+	struct td_pagecache_table_header names;
+	struct td_pagecache_table_header pages;
+};
+
+struct td_pagecache_slot {
+	uint64_t                      seq;         /* owner pid << 32 | count */
+	uint32_t                      ref;
+	uint32_t                      pad;
+	uint8_t                       key[TD_PAGECACHE_KEY_SIZE];
+	uint64_t                      val[2];      /* names: page slot, seq */
+};
+
+struct td_pagecache_table {
+	struct td_pagecache_table_header *hdr;
+	uint64_t                     *buckets;
+	struct td_pagecache_slot     *slots;
+	uint32_t                      mask;
+};
+
+struct td_pagecache {
+	int                           refcnt;
+	void                         *base;
+	size_t                        size;
+
+	struct td_pagecache_header   *hdr;
+	struct td_pagecache_table     names;
+	struct td_pagecache_table     pages;
+	char                         *data;
+};
+
+static td_pagecache_t *pagecache;
+
+static inline uint64_t
+td_pagecache_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t
+td_pagecache_hash(const uint8_t *key)
+{
+	uint64_t w, h = 0;
+	int i;
+
+	for (i = 0; i < TD_PAGECACHE_KEY_SIZE; i += sizeof(w)) {
+		memcpy(&w, key + i, sizeof(w));
+		h = td_pagecache_mix(h ^ w);
+	}
+
+	return h;
+}
+
+static inline void
+td_pagecache_name_key(const uint8_t *id, uint64_t page, uint8_t *key)
+{
+	memcpy(key, id, TD_PAGECACHE_ID_SIZE);
+	memcpy(key + TD_PAGECACHE_ID_SIZE, &page, sizeof(page));
+}
+
+/*
+ * Content key of a page: a 128 bit fingerprint, zero padded. Matches
+ * are confirmed by comparing the data, so it only needs to spread.
+ */
+static void
+td_pagecache_content_key(const void *src, uint8_t *key)
+{
+	const char *p = src;
+	uint64_t a, b, fp[2], h1 = 0, h2 = 0x9e3779b97f4a7c15ULL;
+	int i;
+
+	for (i = 0; i < TD_PAGECACHE_PAGE_SIZE; i += 2 * sizeof(a)) {
+		memcpy(&a, p + i, sizeof(a));
+		memcpy(&b, p + i + sizeof(a), sizeof(b));
+
+		h1  = (h1 ^ a) * 0x87c37b91114253d5ULL;
+		h1  = (h1 << 31) | (h1 >> 33);
+		h2  = (h2 ^ b) * 0x4cf5ad432745937fULL;
+		h2  = (h2 << 29) | (h2 >> 35);
+		h2 += h1;
+	}
+
+	fp[0] = td_pagecache_mix(h1 ^ h2);
+	fp[1] = td_pagecache_mix(h2 + fp[0]);
+
+	memset(key, 0, TD_PAGECACHE_KEY_SIZE);
+	memcpy(key, fp, sizeof(fp));
+}
+
+static inline uint64_t
+td_pagecache_entry(uint64_t hash, uint32_t n)
+{
+	return (hash & 0xffffffff00000000ULL) | (n + 1);
+}
+
+static inline char *
+td_pagecache_data(td_pagecache_t *pc, uint32_t n)
+{
+	return pc->data + ((size_t)n << TD_PAGECACHE_PAGE_SHIFT);
+}
+
+static uint64_t
+td_pagecache_format_table(struct td_pagecache_table_header *t,
+			  uint64_t off, uint32_t nslots)
+{
+	uint32_t b;
+
+	for (b = 1; b < nslots << 1; b <<= 1)
+		;
+
+	t->nslots      = nslots;
+	t->nbuckets    = b;
+	t->hand        = 0;
+	t->buckets_off = off;
+	t->slots_off   = off +
+		ALIGN_UP((uint64_t)b * sizeof(uint64_t),
+			 TD_PAGECACHE_PAGE_SIZE);
+
+	return t->slots_off +
+		ALIGN_UP((uint64_t)nslots * sizeof(struct td_pagecache_slot),
+			 TD_PAGECACHE_PAGE_SIZE);
+}
+
+static void
+td_pagecache_format(struct td_pagecache_header *hdr, uint32_t npages)
+{
+	uint64_t off;
+
+	off = td_pagecache_format_table(&hdr->names, TD_PAGECACHE_PAGE_SIZE,
+					npages * TD_PAGECACHE_NAMES_PER_PAGE);
+	off = td_pagecache_format_table(&hdr->pages, off, npages);
+
+	hdr->data_off    = off;
+	hdr->size        = off + ((uint64_t)npages << TD_PAGECACHE_PAGE_SHIFT);
+	hdr->version     = TD_PAGECACHE_VERSION;
+	hdr->magic       = TD_PAGECACHE_MAGIC;
+}
+
+static int
+td_pagecache_geometry(size_t size, uint32_t *npages)
+{
+	uint64_t n;
+
+	n = size / (TD_PAGECACHE_PAGE_SIZE +
+		    (1 + TD_PAGECACHE_NAMES_PER_PAGE) *
+		    (sizeof(struct td_pagecache_slot) + 2 * sizeof(uint64_t)));
+	if (n < TD_PAGECACHE_PROBES || n > UINT32_MAX >> 3)
+		return -EINVAL;
+
+	*npages = n;
+	return 0;
+}
+
+static void
+td_pagecache_table_init(td_pagecache_t *pc, struct td_pagecache_table *t,
+			struct td_pagecache_table_header *hdr)
+{
+	t->hdr     = hdr;
+	t->buckets = pc->base + hdr->buckets_off;
+	t->slots   = pc->base + hdr->slots_off;
+	t->mask    = hdr->nbuckets - 1;
+}
+
+static int
+td_pagecache_map(td_pagecache_t *pc, size_t size)
+{
+	int fd, err, created;
+	uint32_t npages = 0;
+	struct td_pagecache_header hdr;
+	struct stat st;
+	void *base;
+
+	base    = MAP_FAILED;
+	created = 0;
+
+	fd = shm_open(TD_PAGECACHE_NAME, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		return -errno;
+
+	/* serializes formatting against concurrent attaches */
+	if (flock(fd, LOCK_EX)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (!st.st_size) {
+		err = td_pagecache_geometry(size, &npages);
+		if (err)
+			goto out;
+
+		memset(&hdr, 0, sizeof(hdr));
+		td_pagecache_format(&hdr, npages);
+
+		if (ftruncate(fd, hdr.size)) {
+			err = -errno;
+			goto out;
+		}
+
+		created = 1;
+		size    = hdr.size;
+	} else {
+		/* whoever created the segment picked its size */
+		if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		    hdr.magic != TD_PAGECACHE_MAGIC ||
+		    hdr.version != TD_PAGECACHE_VERSION ||
+		    hdr.size != st.st_size) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		size = hdr.size;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	pc->base    = base;
+	pc->size    = size;
+	pc->hdr     = base;
+
+	if (created)
+		td_pagecache_format(pc->hdr, npages);
+
+	td_pagecache_table_init(pc, &pc->names, &pc->hdr->names);
+	td_pagecache_table_init(pc, &pc->pages, &pc->hdr->pages);
+	pc->data    = base + pc->hdr->data_off;
+	err         = 0;
+
+out:
+	/* let the next attach format it afresh */
+	if (err && created && ftruncate(fd, 0))
+		EPRINTF("truncating %s: %d\n", TD_PAGECACHE_NAME, -errno);
+	flock(fd, LOCK_UN);
+	close(fd);
+	return err;
+}
+
+td_pagecache_t *
+td_pagecache_get(void)
+{
+	td_pagecache_t *pc;
+	const char *env;
+	size_t size;
+	int err;
+
+	if (pagecache) {
+		pagecache->refcnt++;
+		return pagecache;
+	}
+
+	size = TD_PAGECACHE_SIZE_DEFAULT;
+	env  = getenv("TAPDISK3_PAGECACHE_SIZE");
+	if (env)
+		size = strtoul(env, NULL, 10);
+	if (!size)
+		return NULL;
+
+	pc = calloc(1, sizeof(*pc));
+	if (!pc)
+		return NULL;
+
+	err = td_pagecache_map(pc, size << 20);
+	if (err) {
+		EPRINTF("shared page cache unavailable: %d\n", err);
+		free(pc);
+		return NULL;
+	}
+
+	DPRINTF("shared page cache: %u pages, %zu bytes\n",
+		pc->hdr->pages.nslots, pc->size);
+
+	pc->refcnt = 1;
+	pagecache  = pc;
+
+	return pc;
+}
+
+void
+td_pagecache_put(td_pagecache_t *pc)
+{
+	if (!pc || --pc->refcnt)
+		return;
+
+	munmap(pc->base, pc->size);
+	free(pc);
+	pagecache = NULL;
+}
+
+size_t
+td_pagecache_size(td_pagecache_t *pc)
+{
+	return pc ?
+		(size_t)pc->hdr->pages.nslots << TD_PAGECACHE_PAGE_SHIFT : 0;
+}
+
+int
+td_pagecache_image_id(const char *path, uint8_t *id)
+{
+	int err;
+	struct stat st;
+	vhd_context_t vhd;
+	uint64_t key[2], gen;
+
+	if (stat(path, &st))
+		return -errno;
+
+	err = vhd_open(&vhd, path,
+		       VHD_OPEN_RDONLY | VHD_OPEN_FAST | VHD_OPEN_CACHED);
+	if (!err) {
+		memcpy(key, vhd.footer.uuid, sizeof(key));
+		vhd_close(&vhd);
+	} else {
+		key[0] = st.st_dev;
+		key[1] = st.st_ino;
+	}
+
+	gen = td_pagecache_mix(((uint64_t)st.st_mtim.tv_sec << 30) ^
+			       st.st_mtim.tv_nsec) ^ st.st_size;
+
+	memcpy(id, key, sizeof(key));
+	memcpy(id + sizeof(key), &gen, sizeof(gen));
+
+	return 0;
+}
+
+/*
+ * Returns the slot of @t currently holding @key as seen through bucket
+ * entry @e, with its (even) sequence in @seq, or NULL.
+ */
+static struct td_pagecache_slot *
+td_pagecache_match(struct td_pagecache_table *t, uint64_t e, uint64_t hash,
+		   const uint8_t *key, uint64_t *seq)
+{
+	struct td_pagecache_slot *slot;
+	uint32_t n;
+
+	if (!e || (e >> 32) != (hash >> 32))
+		return NULL;
+
+	n = (uint32_t)e - 1;
+	if (n >= t->hdr->nslots)
+		return NULL;
+
+	slot = t->slots + n;
+	*seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (*seq & 1)
+		return NULL;
+
+	if (memcmp(slot->key, key, TD_PAGECACHE_KEY_SIZE))
+		return NULL;
+
+	return slot;
+}
+
+static struct td_pagecache_slot *
+td_pagecache_find(struct td_pagecache_table *t, uint64_t hash,
+		  const uint8_t *key, uint64_t *seq)
+{
+	struct td_pagecache_slot *slot;
+	uint64_t e;
+	int i;
+
+	for (i = 0; i < TD_PAGECACHE_PROBES; i++) {
+		e    = __atomic_load_n(&t->buckets[(hash + i) & t->mask],
+				       __ATOMIC_ACQUIRE);
+		slot = td_pagecache_match(t, e, hash, key, seq);
+		if (slot)
+			return slot;
+	}
+
+	return NULL;
+}
+
+int
+td_pagecache_lookup(td_pagecache_t *pc, const uint8_t *id,
+		    uint64_t page, void *dst, td_pagecache_stats_t *stats)
+{
+	struct td_pagecache_slot *name, *slot;
+	uint8_t key[TD_PAGECACHE_KEY_SIZE];
+	uint64_t seq, n, data_seq;
+
+	td_pagecache_name_key(id, page, key);
+
+	name = td_pagecache_find(&pc->names, td_pagecache_hash(key),
+				 key, &seq);
+	if (!name)
+		goto miss;
+
+	n        = __atomic_load_n(&name->val[0], __ATOMIC_RELAXED);
+	data_seq = __atomic_load_n(&name->val[1], __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&name->seq, __ATOMIC_RELAXED) != seq ||
+	    n >= pc->pages.hdr->nslots)
+		goto miss;
+
+	slot = pc->pages.slots + n;
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != data_seq)
+		goto miss;
+
+	memcpy(dst, td_pagecache_data(pc, n), TD_PAGECACHE_PAGE_SIZE);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != data_seq)
+		goto miss;
+
+	__atomic_store_n(&name->ref, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+	stats->hits++;
+	return 1;
+
+miss:
+	stats->misses++;
+	return 0;
+}
+
+/*
+ * A slot is locked by a process that no longer exists.
+ */
+static int
+td_pagecache_orphaned(uint64_t s)
+{
+	pid_t pid = s >> 32;
+
+	return pid && kill(pid, 0) && errno == ESRCH;
+}
+
+/*
+ * Advances the CLOCK hand of @t to a slot with a clear reference bit
+ * and locks it, returning the count to publish it under in @seq. Two
+ * sweeps are enough to find one unless every slot is being filled at
+ * once.
+ */
+static int
+td_pagecache_evict(struct td_pagecache_table *t, uint64_t *seq)
+{
+	struct td_pagecache_slot *slot;
+	uint64_t i, s, owner;
+	uint32_t n, count;
+
+	owner = (uint64_t)getpid() << 32;
+
+	for (i = 0; i < (uint64_t)t->hdr->nslots << 1; i++) {
+		n    = __atomic_fetch_add(&t->hdr->hand, 1, __ATOMIC_RELAXED);
+		n   %= t->hdr->nslots;
+		slot = t->slots + n;
+
+		if (__atomic_exchange_n(&slot->ref, 0, __ATOMIC_RELAXED))
+			continue;
+
+		s = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		count = (uint32_t)s;
+		if (count & 1) {
+			if (!td_pagecache_orphaned(s))
+				continue;
+			/* skip the odd count, stale readers must not match */
+			count++;
+		}
+
+		if (__atomic_compare_exchange_n(&slot->seq, &s,
+						owner | (count + 1), 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			*seq = count + 2;
+			return n;
+		}
+	}
+
+	return -EBUSY;
+}
+
+/*
+ * An index entry is reusable once its slot holds some other key, or
+ * is being refilled.
+ */
+static int
+td_pagecache_stale(struct td_pagecache_table *t, uint64_t e)
+{
+	struct td_pagecache_slot *slot;
+	uint64_t seq;
+	uint32_t n;
+
+	n = (uint32_t)e - 1;
+	if (n >= t->hdr->nslots)
+		return 1;
+
+	slot = t->slots + n;
+	seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return 1;
+
+	return (td_pagecache_hash(slot->key) >> 32) != (e >> 32);
+}
+
+/*
+ * Fills slot @n, locked by td_pagecache_evict, and indexes it.
+ */
+static void
+td_pagecache_publish(struct td_pagecache_table *t, uint32_t n,
+		     uint64_t seq, uint64_t hash, const uint8_t *key)
+{
+	struct td_pagecache_slot *slot = t->slots + n;
+	uint64_t e, *b;
+	int i;
+
+	memcpy(slot->key, key, TD_PAGECACHE_KEY_SIZE);
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+
+	for (i = 0; i < TD_PAGECACHE_PROBES; i++) {
+		b = &t->buckets[(hash + i) & t->mask];
+		e = __atomic_load_n(b, __ATOMIC_ACQUIRE);
+		if (e && !td_pagecache_stale(t, e))
+			continue;
+
+		if (__atomic_compare_exchange_n(b, &e,
+						td_pagecache_entry(hash, n), 0,
+						__ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			return;
+	}
+
+	/* window full of live entries: displace the home entry */
+	__atomic_store_n(&t->buckets[hash & t->mask],
+			 td_pagecache_entry(hash, n), __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns a content slot already holding the data of @src, and the
+ * sequence it was compared at in @seq, or -ENOENT.
+ */
+static int
+td_pagecache_share(td_pagecache_t *pc, uint64_t hash, const uint8_t *key,
+		   const void *src, uint64_t *seq)
+{
+	struct td_pagecache_slot *slot;
+	uint32_t n;
+
+	slot = td_pagecache_find(&pc->pages, hash, key, seq);
+	if (!slot)
+		return -ENOENT;
+
+	n = slot - pc->pages.slots;
+	if (memcmp(td_pagecache_data(pc, n), src, TD_PAGECACHE_PAGE_SIZE))
+		return -ENOENT;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != *seq)
+		return -ENOENT;
+
+	__atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+int
+td_pagecache_insert(td_pagecache_t *pc, const uint8_t *id,
+		    uint64_t page, const void *src, td_pagecache_stats_t *stats)
+{
+	struct td_pagecache_slot *name;
+	uint8_t key[TD_PAGECACHE_KEY_SIZE], data_key[TD_PAGECACHE_KEY_SIZE];
+	uint64_t hash, data_hash, seq, data_seq;
+	int n, m;
+
+	td_pagecache_name_key(id, page, key);
+	hash = td_pagecache_hash(key);
+
+	if (td_pagecache_find(&pc->names, hash, key, &seq))
+		return 0;
+
+	td_pagecache_content_key(src, data_key);
+	data_hash = td_pagecache_hash(data_key);
+
+	m = td_pagecache_share(pc, data_hash, data_key, src, &data_seq);
+	if (m >= 0)
+		stats->shared++;
+	else {
+		m = td_pagecache_evict(&pc->pages, &data_seq);
+		if (m < 0)
+			return m;
+
+		if (data_seq > 2)
+			stats->evictions++;
+
+		memcpy(td_pagecache_data(pc, m), src, TD_PAGECACHE_PAGE_SIZE);
+		td_pagecache_publish(&pc->pages, m, data_seq,
+				     data_hash, data_key);
+		stats->inserts++;
+	}
+
+	n = td_pagecache_evict(&pc->names, &seq);
+	if (n < 0)
+		return n;
+
+	name = pc->names.slots + n;
+	__atomic_store_n(&name->val[0], m, __ATOMIC_RELAXED);
+	__atomic_store_n(&name->val[1], data_seq, __ATOMIC_RELAXED);
+	td_pagecache_publish(&pc->names, n, seq, hash, key);
+
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_PAGECACHE_H_
+#define _TAPDISK_PAGECACHE_H_
+
+#include <stdint.h>
+
+/*
+ * Host-wide cache of read-only image pages, shared by every tapdisk
+ * through one POSIX shared memory segment. Pages are keyed by a 24 byte
+ * image identity and a 4K page number. The identity is the VHD uuid,
+ * where there is one, so tapdisks opening the same parent under
+ * different paths still share, plus a generation taken from the file's
+ * mtime and size, so pages of an image modified in place (coalesced
+ * into, say) are not served again.
+ *
+ * Page data is stored by content: identical pages of different images,
+ * or at different offsets, take memory once for the whole host.
+ */
+
+#define TD_PAGECACHE_NAME             "/tapdisk3-pagecache"
+#define TD_PAGECACHE_PAGE_SHIFT       12
+#define TD_PAGECACHE_PAGE_SIZE        (1 << TD_PAGECACHE_PAGE_SHIFT)
+#define TD_PAGECACHE_ID_SIZE          24
+
+/* segment size in MiB, TAPDISK3_PAGECACHE_SIZE overrides; 0 disables */
+#define TD_PAGECACHE_SIZE_DEFAULT     128
+
+typedef struct td_pagecache           td_pagecache_t;
+typedef struct td_pagecache_stats     td_pagecache_stats_t;
+
+struct td_pagecache_stats {
+	uint64_t                      hits;
+	uint64_t                      misses;
+	uint64_t                      inserts;
+	uint64_t                      shared;      /* inserts of known data */
+	uint64_t                      evictions;
+};
+
+/*
+ * Maps the segment, creating it if this is the first tapdisk on the
+ * host to get here. One mapping is shared by all users in a process.
+ * Returns NULL if the cache is disabled or can't be set up.
+ */
+td_pagecache_t *td_pagecache_get(void);
+void td_pagecache_put(td_pagecache_t *);
+
+size_t td_pagecache_size(td_pagecache_t *);
+
+/*
+ * Fills in the identity pages of @path are cached under: the VHD uuid,
+ * or the inode for other images, and the current generation.
+ */
+int td_pagecache_image_id(const char *path, uint8_t *id);
+
+/*
+ * Copies a cached page to @dst. Returns 1 on a hit, 0 otherwise; never
+ * blocks on other processes.
+ */
+int td_pagecache_lookup(td_pagecache_t *, const uint8_t *id,
+			uint64_t page, void *dst, td_pagecache_stats_t *);
+
+/*
+ * Adds a page, sharing the data of an identical one already cached or
+ * evicting another. Best effort: returns -EBUSY rather than wait for a
+ * slot.
+ */
+int td_pagecache_insert(td_pagecache_t *, const uint8_t *id,
+			uint64_t page, const void *src, td_pagecache_stats_t *);
+
+#endif
@@ -301,6 +301,24 @@ uint64_t ntohll(uint64_t a) {
 #define htonll ntohll
 
 
+int
+tapdisk_buf_is_zero(const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+	size_t i, head;
+
+	head = MIN(size, 16);
+	for (i = 0; i < head; i++)
+		if (p[i])
+			return 0;
+
+	/*
+	 * The first 16 bytes are zero, so the buffer is all zeros iff
+	 * every byte equals the one 16 bytes before it.
+	 */
+	return !memcmp(p, p + head, size - head);
+}
+
 /**
  * Simplified version of snprintf that return 0 if everything has gone OK and
  * +errno if not (including the buffer not being large enough to hold the
@@ -53,6 +53,13 @@ int tapdisk_linux_version(void);
 uint64_t ntohll(uint64_t);
 #define htonll ntohll
 
+/**
+ * Tells whether the buffer contains nothing but zeros. The bulk of the
+ * comparison is done by memcmp(3), which uses the widest vector unit the
+ * C library was built for.
+ */
+int tapdisk_buf_is_zero(const void *buf, size_t size);
+
 
 /**
  * Simplified version of snprintf that returns 0 if everything has gone OK and
@@ -56,6 +56,7 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-stats.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-mirror.h"
 #include "tapdisk-nbdserver.h"
 #include "td-stats.h"
 #include "tapdisk-utils.h"
@@ -70,9 +71,10 @@
 #define TD_VBD_EIO_SLEEP            1
 #define TD_VBD_WATCHDOG_TIMEOUT     10
 
-char* op_strings[TD_OPS_END] ={"read", "write", "block_status"};
+char* op_strings[TD_OPS_END] ={"read", "write", "block_status", "sync"};
 
 static void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
+static void tapdisk_vbd_reissue_syncs(td_vbd_t *);
 static int  tapdisk_vbd_queue_ready(td_vbd_t *);
 static void tapdisk_vbd_check_complete_requests(td_vbd_t *);
 static void tapdisk_vbd_check_requests_for_issue(td_vbd_t *);
@@ -111,6 +113,7 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->pending_requests);
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
+	INIT_LIST_HEAD(&vbd->busy_syncs);
 	INIT_LIST_HEAD(&vbd->next);
 	INIT_LIST_HEAD(&vbd->rings);
 	INIT_LIST_HEAD(&vbd->dead_rings);
@@ -250,6 +253,42 @@ out:
     return -err;
 }
 
+/*
+ * Lets drivers, an asynchronous mirror and VBD syncs finish I/O of
+ * their own, not tied to any guest request, before
+ * tapdisk_vbd_close_vdi. Returns -EAGAIN while some is left.
+ */
+int
+tapdisk_vbd_quiesce_images(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+	int err = 0;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (td_quiesce(image) == -EAGAIN)
+			err = -EAGAIN;
+
+	if (vbd->secondary && td_quiesce(vbd->secondary) == -EAGAIN)
+		err = -EAGAIN;
+
+	if (vbd->retired && td_quiesce(vbd->retired) == -EAGAIN)
+		err = -EAGAIN;
+
+	/* mirror extents in flight hold on to the vbd and its images */
+	if (vbd->mirror && !td_mirror_idle(vbd->mirror)) {
+		td_mirror_kick(vbd->mirror);
+		err = -EAGAIN;
+	}
+
+	/* as do syncs */
+	if (vbd->syncs) {
+		tapdisk_vbd_reissue_syncs(vbd);
+		err = -EAGAIN;
+	}
+
+	return err;
+}
+
 void
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
@@ -266,10 +305,14 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
         EPRINTF("failed to destroy stats file: %s\n", strerror(-err));
     }
 
+	td_mirror_destroy(vbd->mirror);
+	vbd->mirror = NULL;
+
 	tapdisk_image_close_chain(&vbd->images);
 
 	if (vbd->secondary &&
-	    vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR) {
+	    vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR &&
+	    vbd->secondary_mode != TD_VBD_SECONDARY_ASYNC) {
 		tapdisk_image_close(vbd->secondary);
 		vbd->secondary = NULL;
 	}
@@ -440,12 +483,30 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		goto fail;
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_MIRROR_ASYNC) &&
+	    !td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
+		vbd->mirror = td_mirror_create(vbd, leaf->info.size);
+		if (!vbd->mirror) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+
 	vbd->secondary = second;
-	leaf->flags |= TD_IGNORE_ENOSPC;
-	if (td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
+	if (vbd->mirror) {
+		/*
+		 * writes complete on the primary alone, so ENOSPC there
+		 * has to fail them
+		 */
+		DPRINTF("In asynchronous mirror mode\n");
+		vbd->secondary_mode = TD_VBD_SECONDARY_ASYNC;
+		list_add(&second->next, &leaf->next);
+	} else if (td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
 		DPRINTF("In standby mode\n");
+		leaf->flags |= TD_IGNORE_ENOSPC;
 		vbd->secondary_mode = TD_VBD_SECONDARY_STANDBY;
 	} else {
+		leaf->flags |= TD_IGNORE_ENOSPC;
 		DPRINTF("In mirror mode\n");
 		vbd->secondary_mode = TD_VBD_SECONDARY_MIRROR;
 		/*
@@ -576,6 +637,7 @@ int
 tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_devnum)
 {
 	char *tmp = vbd->name;
+	struct timeval start, now;
 	int err;
 
 	if (!list_empty(&vbd->images)) {
@@ -596,10 +658,18 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
+	gettimeofday(&start, NULL);
+
 	err = tapdisk_image_open_chain(vbd->name, flags, prt_devnum, &vbd->encryption, &vbd->images);
 	if (err)
 		goto fail;
 
+	gettimeofday(&now, NULL);
+	timersub(&now, &start, &now);
+	vbd->open_chain_usecs = now.tv_sec * 1000000ULL + now.tv_usec;
+	DPRINTF("%s: opened image chain in %"PRIu64" usecs\n",
+		vbd->name, vbd->open_chain_usecs);
+
 	td_flag_clear(vbd->state, TD_VBD_CLOSED);
 	vbd->flags = flags;
 
@@ -787,6 +857,9 @@ tapdisk_vbd_close(td_vbd_t *vbd)
 	if (!list_empty(&vbd->pending_requests))
 		goto fail;
 
+	if (vbd->mirror && !td_mirror_idle(vbd->mirror))
+		goto fail;
+
 	/* 
 	 * if the queue is still active and we have more
 	 * requests, try to complete them before closing.
@@ -797,6 +870,9 @@ tapdisk_vbd_close(td_vbd_t *vbd)
 	     !list_empty(&vbd->completed_requests)))
 		goto fail;
 
+	if (tapdisk_vbd_quiesce_images(vbd))
+		goto fail;
+
 	return tapdisk_vbd_shutdown(vbd);
 
 fail:
@@ -957,10 +1033,22 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 	list_for_each_entry(blkif, &vbd->rings, entry)
 		tapdisk_xenblkif_suspend(blkif);
 
+	/*
+	 * pausing is what precedes a cutover to the secondary: let an
+	 * asynchronous mirror converge first
+	 */
+	if (vbd->mirror && !td_mirror_idle(vbd->mirror)) {
+		td_mirror_kick(vbd->mirror);
+		return -EAGAIN;
+	}
+
 	err = tapdisk_vbd_quiesce_queue(vbd);
 	if (err)
 		return err;
 
+	err = tapdisk_vbd_quiesce_images(vbd);
+	if (err)
+		return err;
 
 	tapdisk_vbd_close_vdi(vbd);
 
@@ -1099,6 +1187,9 @@ tapdisk_vbd_check_state(td_vbd_t *vbd)
 {
 	struct td_xenblkif *blkif;
 
+	if (!list_empty(&vbd->busy_syncs))
+		tapdisk_vbd_reissue_syncs(vbd);
+
 	/* Don't check if we're already quiesced */
 	if (td_flag_test(vbd->state, TD_VBD_QUIESCED))
 		return;
@@ -1112,7 +1203,8 @@ tapdisk_vbd_check_state(td_vbd_t *vbd)
 	tapdisk_vbd_check_complete_requests(vbd);
 
 	if (!td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED) &&
-	      !td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
+	    (!td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED) ||
+	     (vbd->mirror && !td_mirror_idle(vbd->mirror))))
 		tapdisk_vbd_check_requests_for_issue(vbd);
 
 	if (td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
@@ -1281,6 +1373,17 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	tapdisk_vbd_complete_vbd_request(vbd, vreq);
 }
 
+static void
+tapdisk_vbd_note_hole(td_vbd_request_t *vreq, td_request_t treq)
+{
+	if (treq.op != TD_OP_READ || !vreq->holes || !treq.secs)
+		return;
+
+	/* a hole not noted reads as zeroed data, which is still correct */
+	treq.status = TD_BLOCK_STATE_HOLE;
+	add_extent(vreq->holes, &treq);
+}
+
 static void
 __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 				 td_image_t *image, td_request_t treq)
@@ -1298,6 +1401,7 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 			treq.status = TD_BLOCK_STATE_HOLE;
 		} else {
 			memset(treq.buf, 0, (size_t)treq.secs << SECTOR_SHIFT);
+			tapdisk_vbd_note_hole(vreq, treq);
 		}
 		td_complete_request(treq, 0);
 		goto done;
@@ -1321,12 +1425,18 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 			int secs    = parent->info.size - treq.sec;
 			clone.sec  += secs;
 			clone.secs -= secs;
-			clone.buf  += (secs << SECTOR_SHIFT);
+			if (clone.buf)
+				clone.buf += (secs << SECTOR_SHIFT);
 			treq.secs   = secs;
 		} else
 			treq.secs   = 0;
 
-		memset(clone.buf, 0, (size_t)clone.secs << SECTOR_SHIFT);
+		if (unlikely(treq.op == TD_OP_BLOCK_STATUS))
+			clone.status = TD_BLOCK_STATE_HOLE;
+		else {
+			memset(clone.buf, 0, (size_t)clone.secs << SECTOR_SHIFT);
+			tapdisk_vbd_note_hole(vreq, clone);
+		}
 		td_complete_request(clone, 0);
 
 		if (!treq.secs)
@@ -1399,17 +1509,16 @@ add_extent(tapdisk_extents_t *extents, td_request_t *vreq)
 int
 block_status_add_extent(tapdisk_extents_t *extents, td_request_t *vreq)
 {
-	int ret  = 0;
-	if(extents->tail == NULL) {
-		ret = add_extent(extents, vreq);
-	} else {
-		if(extents->tail->flag == vreq->status) {
-			extents->tail->length += vreq->secs;
-		} else {
-			ret = add_extent(extents, vreq);
-		}
+	tapdisk_extent_t *tail = extents->tail;
+
+	/* pieces may complete out of order; only extend a contiguous tail */
+	if (tail && tail->flag == vreq->status &&
+	    tail->start + tail->length == vreq->sec) {
+		tail->length += vreq->secs;
+		return 0;
 	}
-	return ret;
+
+	return add_extent(extents, vreq);
 }
 
 void
@@ -1490,6 +1599,10 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 		}
 	}
 
+	if (!res && vbd->mirror && treq.op == TD_OP_WRITE &&
+	    image == tapdisk_vbd_first_image(vbd))
+		td_mirror_write_done(vbd->mirror, treq.sec, treq.secs, treq.buf);
+
 	DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08"PRIx64
 	    " secs 0x%04x buf %p op %d res %d\n", image->name,
 	    vreq->name, treq.sidx, treq.sec, treq.secs,
@@ -1679,6 +1792,14 @@ tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 	td_vbd_request_t *vreq, *tmp;
 
 	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
+		/*
+		 * an asynchronous mirror too far behind holds back
+		 * writes until it caught up
+		 */
+		if (vreq->op == TD_OP_WRITE && vbd->mirror &&
+		    td_mirror_lagging(vbd->mirror))
+			return -EBUSY;
+
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		/*
 		 * if this request failed, but was not completed,
@@ -1765,6 +1886,139 @@ tapdisk_vbd_queue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	return 0;
 }
 
+/*
+ * A sync of the VBD: a TD_OP_SYNC request on every image which may
+ * have taken writes, done once they all are. Those a driver had no room
+ * for (-EBUSY) wait on vbd->busy_syncs to be reissued.
+ */
+struct td_vbd_sync;
+
+struct td_vbd_sync_image {
+	struct td_vbd_sync         *sync;
+	td_image_t                 *image;
+	struct list_head            next;
+};
+
+struct td_vbd_sync {
+	td_vbd_t                   *vbd;
+	int                         pending;
+	int                         error;
+	td_vbd_sync_cb_t            cb;
+	void                       *arg;
+	struct td_vbd_sync_image    images[0];
+};
+
+static void
+tapdisk_vbd_sync_put(struct td_vbd_sync *sync, int err)
+{
+	td_vbd_t *vbd = sync->vbd;
+
+	if (err && !sync->error)
+		sync->error = err;
+
+	if (--sync->pending)
+		return;
+
+	vbd->syncs--;
+	sync->cb(sync->arg, sync->error);
+	free(sync);
+}
+
+static void
+tapdisk_vbd_complete_sync(td_request_t treq, int res)
+{
+	struct td_vbd_sync_image *si = treq.cb_data;
+	td_vbd_t *vbd = si->sync->vbd;
+
+	if (res == -EBUSY) {
+		list_add_tail(&si->next, &vbd->busy_syncs);
+		return;
+	}
+
+	if (res) {
+		ERROR("%s: sync failed: %s", si->image->name, strerror(-res));
+		vbd->errors++;
+	}
+
+	tapdisk_vbd_sync_put(si->sync, res);
+}
+
+static void
+tapdisk_vbd_issue_sync(struct td_vbd_sync_image *si)
+{
+	td_request_t treq;
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_SYNC;
+	treq.image   = si->image;
+	treq.cb      = tapdisk_vbd_complete_sync;
+	treq.cb_data = si;
+
+	td_queue_sync(si->image, treq);
+}
+
+static void
+tapdisk_vbd_reissue_syncs(td_vbd_t *vbd)
+{
+	struct td_vbd_sync_image *si, *next;
+	struct list_head busy;
+
+	/* those still busy go back on the list */
+	INIT_LIST_HEAD(&busy);
+	list_splice(&vbd->busy_syncs, &busy);
+	INIT_LIST_HEAD(&vbd->busy_syncs);
+
+	list_for_each_entry_safe(si, next, &busy, next) {
+		list_del(&si->next);
+		tapdisk_vbd_issue_sync(si);
+	}
+}
+
+/*
+ * Make the writes completed so far durable, on every image which may
+ * have taken some, and call @cb with the first error. It may be called
+ * before this returns.
+ */
+int
+tapdisk_vbd_sync(td_vbd_t *vbd, td_vbd_sync_cb_t cb, void *arg)
+{
+	struct td_vbd_sync *sync;
+	td_image_t *image, *tmp;
+	int i, n = 1;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		n++;
+
+	sync = calloc(1, sizeof(*sync) + n * sizeof(sync->images[0]));
+	if (!sync)
+		return -ENOMEM;
+
+	sync->vbd = vbd;
+	sync->cb  = cb;
+	sync->arg = arg;
+
+	n = 0;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (!td_flag_test(image->flags, TD_OPEN_RDONLY))
+			sync->images[n++].image = image;
+
+	if (vbd->secondary)
+		sync->images[n++].image = vbd->secondary;
+
+	/* held until all are issued */
+	sync->pending = n + 1;
+	vbd->syncs++;
+
+	for (i = 0; i < n; i++) {
+		sync->images[i].sync = sync;
+		tapdisk_vbd_issue_sync(&sync->images[i]);
+	}
+
+	tapdisk_vbd_sync_put(sync, 0);
+
+	return 0;
+}
+
 void
 tapdisk_vbd_kick(td_vbd_t *vbd)
 {
@@ -1903,6 +2157,12 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 			"nbd_mirror_failed",
 			"d", vbd->nbd_mirror_failed);
 
+	if (vbd->mirror) {
+		tapdisk_stats_field(st, "mirror", "{");
+		td_mirror_stats(vbd->mirror, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
 	tapdisk_stats_field(st,
 			"reqs_outstanding",
 			"d", tapdisk_vbd_reqs_outstanding(vbd));
@@ -1911,6 +2171,10 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 			"read_caching",
 			"s",  read_caching ? "true": "false");
 
+	tapdisk_stats_field(st,
+			"open_chain_usecs",
+			"llu", vbd->open_chain_usecs);
+
 	tapdisk_stats_leave(st, '}');
 }
 
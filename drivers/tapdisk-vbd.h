@@ -60,9 +60,13 @@
 #define TD_VBD_SECONDARY_DISABLED   0
 #define TD_VBD_SECONDARY_MIRROR     1
 #define TD_VBD_SECONDARY_STANDBY    2
+#define TD_VBD_SECONDARY_ASYNC      3
 
 struct td_nbdserver;
 
+/* completion of tapdisk_vbd_sync */
+typedef void (*td_vbd_sync_cb_t)(void *arg, int err);
+
 struct td_vbd_rrd {
 
     struct shm shm;
@@ -130,11 +134,19 @@ struct td_vbd_handle {
 
 	int                         nbd_mirror_failed;
 
+	/* TD_VBD_SECONDARY_ASYNC */
+	struct td_mirror           *mirror;
+	int                         mirror_lag;    /* MiB, 0: default */
+
 	struct list_head            new_requests;
 	struct list_head            pending_requests;
 	struct list_head            failed_requests;
 	struct list_head            completed_requests;
 
+	/* tapdisk_vbd_sync calls in flight, and image syncs to retry */
+	int                         syncs;
+	struct list_head            busy_syncs;
+
 	td_vbd_request_t            request_list[MAX_REQUESTS]; /* XXX */
 
 	struct list_head            next;
@@ -142,6 +154,9 @@ struct td_vbd_handle {
 	uint16_t                    req_timeout; /* in seconds */
 	struct timeval              ts;
 
+	/* time spent in tapdisk_image_open_chain() by the last open */
+	uint64_t                    open_chain_usecs;
+
 	uint64_t                    received;
 	uint64_t                    returned;
 	uint64_t                    kicked;
@@ -206,12 +221,14 @@ int tapdisk_vbd_close(td_vbd_t *);
  */
 int tapdisk_vbd_open_vdi(td_vbd_t * vbd, const char *params, td_flag_t flags,
         int prt_devnum);
+int tapdisk_vbd_quiesce_images(td_vbd_t *);
 void tapdisk_vbd_close_vdi(td_vbd_t *);
 
 int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
 void tapdisk_vbd_detach(td_vbd_t *);
 
 int tapdisk_vbd_queue_request(td_vbd_t *, td_vbd_request_t *);
+int tapdisk_vbd_sync(td_vbd_t *, td_vbd_sync_cb_t, void *);
 void tapdisk_vbd_forward_request(td_request_t);
 
 int tapdisk_vbd_get_disk_info(td_vbd_t *, td_disk_info_t *);
@@ -229,6 +246,7 @@ void tapdisk_vbd_free(td_vbd_t *);
 
 void tapdisk_vbd_complete_td_request(td_request_t, int);
 int add_extent(tapdisk_extents_t *, td_request_t *);
+int block_status_add_extent(tapdisk_extents_t *, td_request_t *);
 int tapdisk_vbd_issue_request(td_vbd_t *, td_vbd_request_t *);
 
 /**
@@ -44,7 +44,7 @@
  * 
  * and passing in a completion callback, which the disk is responsible for 
  * tracking.  Disks should transform these requests as necessary and return
- * the resulting iocbs to tapdisk using td_prep_[read,write]() and 
+ * the resulting iocbs to tapdisk using td_prep_[read,write,sync]() and 
  * td_queue_tiocb().
  *
  * NOTE: tapdisk uses the number of sectors submitted per request as a 
@@ -89,6 +89,7 @@ enum TD_OPS{
 	TD_OP_READ = 0,
 	TD_OP_WRITE,
 	TD_OP_BLOCK_STATUS,
+	TD_OP_SYNC,
 	TD_OPS_END
 };
 
@@ -106,6 +107,11 @@ enum TD_OPS{
 #define TD_OPEN_STANDBY              0x00800
 #define TD_IGNORE_ENOSPC             0x01000
 #define TD_OPEN_NO_O_DIRECT          0x02000
+#define TD_OPEN_ELIDE_ZEROS          0x04000
+#define TD_OPEN_BAT_LOG              0x08000
+#define TD_OPEN_COPY_ON_READ         0x10000
+#define TD_OPEN_WRITEBACK            0x20000
+#define TD_OPEN_MIRROR_ASYNC         0x40000
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
@@ -117,6 +123,12 @@ enum TD_OPS{
 #define TD_BLOCK_STATE_NONE  0
 #define TD_BLOCK_STATE_HOLE  (1 <<0)
 #define TD_BLOCK_STATE_ZERO  (1 <<1)
+/* Internal only: not looked up, the answer stops short of this range */
+#define TD_BLOCK_STATE_UNKNOWN (1 <<2)
+
+/* td_vbd_request.zeroes */
+#define TD_ZEROES_WRITE      1 /* zero the range */
+#define TD_ZEROES_DISCARD    2 /* zero it, releasing its space */
 
 typedef uint16_t                     td_uuid_t;
 typedef uint32_t                     td_flag_t;
@@ -176,6 +188,18 @@ struct td_vbd_request {
 	td_vbd_t                   *vbd;
 	struct list_head            next;
 	struct list_head           *list_head;
+
+	/*
+	 * Reads: if set, collects the ranges found unallocated in the
+	 * whole chain, which read as zeroes.
+	 */
+	struct tapdisk_extents     *holes;
+
+	/*
+	 * Writes: if set, as TD_ZEROES_*, the buffers hold zeroes only.
+	 * Drivers may zero the range rather than write them out.
+	 */
+	int                         zeroes;
 };
 
 struct td_request {
@@ -217,6 +241,20 @@ struct tap_disk {
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_block_status)(td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
+
+	/**
+	 * Make writes completed so far durable, then complete the
+	 * TD_OP_SYNC request. Drivers keeping nothing volatile leave it
+	 * NULL.
+	 */
+	void (*td_queue_sync)        (td_driver_t *, td_request_t);
+
+	/**
+	 * Finish I/O the driver started on its own, outside any request.
+	 * Called ahead of td_close with the queue drained, until it stops
+	 * returning -EAGAIN. May be NULL.
+	 */
+	int (*td_quiesce)            (td_driver_t *);
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
 
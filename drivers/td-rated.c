@@ -35,15 +35,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <getopt.h>
 #include <syslog.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 
 #include "block-valve.h"
 #include "compiler.h"
@@ -100,13 +106,40 @@ static int debug = 0;
 
 typedef struct ratelimit_bridge        td_rlb_t;
 typedef struct ratelimit_connection    td_rlb_conn_t;
+typedef struct ratelimit_listener      td_rlb_listener_t;
+
+struct ratelimit_pool;
+
+/* what an epoll event is about */
+
+enum {
+	RLB_FD_LISTEN = 1,
+	RLB_FD_CONN,
+	RLB_FD_SIGNAL,
+	RLB_FD_TIMER,
+	RLB_FD_STDIN,
+};
+
+struct rlb_fd {
+	int                            type;
+	int                            fd;
+};
 
 struct ratelimit_connection {
-	int                            sock;
+	struct rlb_fd                  efd;
+	int                            id;
+	unsigned long long             serial;
+
+	struct ratelimit_pool         *pool; /* of the listener */
+	void                          *data; /* valve's, free()d on close */
 
 	unsigned long                  need; /* I/O requested */
 	unsigned long                  gntd; /* I/O granted, pending */
 
+	/* of need, by RLB_OP_* */
+	unsigned long                  ios[2];
+	unsigned long                  bytes[2];
+
 	struct list_head               open; /* connected */
 	struct list_head               wait; /* need > 0 */
 
@@ -116,7 +149,19 @@ struct ratelimit_connection {
 	} wstat;
 };
 
-#define RLB_CONN_MAX                   1024
+#define RLB_CONN_MAX                   TD_RLB_CONN_MAX
+#define RLB_EVENTS_MAX                 64
+
+struct ratelimit_listener {
+	struct rlb_fd                  efd;
+	struct sockaddr_un             addr;
+	char                          *path;
+	struct ratelimit_pool         *pool;
+	struct list_head               entry;
+};
+
+#define RLB_OP_READ                    0
+#define RLB_OP_WRITE                   1
 
 struct ratelimit_ops {
 	void    (*usage)(td_rlb_t *rlb, FILE *stream, void *data);
@@ -130,24 +175,41 @@ struct ratelimit_ops {
 	void    (*timeout)(td_rlb_t *rlb, void *data);
 	void    (*dispatch)(td_rlb_t *rlb, void *data);
 	void    (*reset)(td_rlb_t *rlb, void *data);
+
+	/* TD_RLB_LIMIT_*, writes only if not set */
+	unsigned int (*limits)(td_rlb_t *rlb, void *data);
 };
 
 struct ratelimit_bridge {
 	char                          *name;
 	char                          *ident;
 
-	struct sockaddr_un             addr;
-	char                          *path;
-	int                            sock;
+	td_rlb_listener_t              lsn;       /* <name> */
+	struct list_head               listeners; /* all, lsn first */
+
+	int                            epfd;
+	struct rlb_fd                  sfd;       /* signals */
+	struct rlb_fd                  tfd;       /* valve timeout */
+	struct rlb_fd                  ifd;       /* stdin */
 
 	struct list_head               open; /* all connections */
 	struct list_head               wait; /* all in need */
+	struct list_head               dead; /* closed, not freed yet */
+	int                            n_conns;
+	int                            n_wait;
+	long long                      gntd; /* all connections */
+	int                            lsn_paused; /* out of fds */
+
+	struct td_rlb_shm             *shm;
+	char                          *shm_path;
 
-	struct timeval                 ts, now;
+	unsigned long long             serial;
 
-	td_rlb_conn_t                  connv[RLB_CONN_MAX];
-	td_rlb_conn_t                 *free[RLB_CONN_MAX];
-	int                            n_free;
+	/* completion latency reported since the valve last looked */
+	unsigned long                  lat[TD_VALVE_LAT_BUCKETS];
+	unsigned long                  lat_nr;
+
+	struct timeval                 now;
 
 	struct rlb_valve {
 		struct ratelimit_ops  *ops;
@@ -161,8 +223,8 @@ struct ratelimit_bridge {
 #define rlb_for_each_conn_safe(_conn, _next, _rlb)			\
 	list_for_each_entry_safe(_conn, _next, &(_rlb)->open, open)
 
-#define rlb_for_each_waiting(_conn, _next, _rlb)			\
-	list_for_each_entry(_conn, _next, &(_rlb)->wait, wait)
+#define rlb_for_each_waiting(_conn, _rlb)				\
+	list_for_each_entry(_conn, &(_rlb)->wait, wait)
 
 #define rlb_for_each_waiting_safe(_conn, _next, _rlb)			\
 	list_for_each_entry_safe(_conn, _next, &(_rlb)->wait, wait)
@@ -174,6 +236,8 @@ struct ratelimit_bridge {
 	list_entry(_list, td_rlb_conn_t, wait)
 
 static struct ratelimit_ops *rlb_find_valve(const char *name);
+static struct ratelimit_ops rlb_token_ops;
+static struct ratelimit_ops rlb_dual_ops;
 
 static int rlb_create_valve(td_rlb_t *, struct rlb_valve *,
 			    const char *name, int argc, char **argv);
@@ -365,73 +429,243 @@ rlb_argv_shift(int *optind, int *argc, char ***argv)
 	*optind  = 1;
 }
 
+/*
+ * shared bucket
+ */
+
+static void
+rlb_shm_close(td_rlb_t *rlb)
+{
+	if (rlb->shm) {
+		__atomic_store_n(&rlb->shm->enabled, 0, __ATOMIC_RELEASE);
+		munmap(rlb->shm, sizeof(*rlb->shm));
+		rlb->shm = NULL;
+	}
+
+	if (rlb->shm_path) {
+		unlink(rlb->shm_path);
+		free(rlb->shm_path);
+		rlb->shm_path = NULL;
+	}
+}
+
+static int
+rlb_shm_open(td_rlb_t *rlb)
+{
+	struct td_rlb_shm *shm;
+	int fd, err;
+
+	fd = -1;
+
+	rlb->shm_path = mprintf("%s%s", rlb->lsn.path, TD_RLB_SHM_SUFFIX);
+	if (!rlb->shm_path) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	fd = open(rlb->shm_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		PERROR("%s", rlb->shm_path);
+		err = -errno;
+		goto fail;
+	}
+
+	err = ftruncate(fd, sizeof(*shm));
+	if (err) {
+		PERROR("ftruncate(%s)", rlb->shm_path);
+		err = -errno;
+		goto fail;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		PERROR("mmap(%s)", rlb->shm_path);
+		err = -errno;
+		goto fail;
+	}
+
+	close(fd);
+
+	/* stays disabled unless a token valve shares its bucket */
+	shm->magic   = TD_RLB_SHM_MAGIC;
+	shm->version = TD_RLB_SHM_VERSION;
+	rlb->shm     = shm;
+
+	return 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	rlb_shm_close(rlb);
+	return err;
+}
+
+static void
+rlb_shm_publish(td_rlb_t *rlb)
+{
+	struct rlb_valve *v = &rlb->valve;
+	unsigned int limits;
+
+	if (!rlb->shm)
+		return;
+
+	limits = TD_RLB_LIMIT_WRITE;
+	if (v->ops->limits)
+		limits = v->ops->limits(rlb, v->data);
+
+	__atomic_store_n(&rlb->shm->limits, limits, __ATOMIC_RELEASE);
+}
+
+static void
+rlb_shm_update(td_rlb_t *rlb)
+{
+	if (rlb->shm)
+		__atomic_store_n(&rlb->shm->waiters, rlb->n_wait,
+				 __ATOMIC_RELEASE);
+}
+
 /*
  * socket I/O
  */
 
+static int
+rlb_epoll_add(td_rlb_t *rlb, struct rlb_fd *efd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = efd };
+	int err;
+
+	err = epoll_ctl(rlb->epfd, EPOLL_CTL_ADD, efd->fd, &ev);
+	if (err) {
+		PERROR("epoll_ctl(%d)", efd->fd);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void
+rlb_epoll_del(td_rlb_t *rlb, struct rlb_fd *efd)
+{
+	epoll_ctl(rlb->epfd, EPOLL_CTL_DEL, efd->fd, NULL);
+}
+
+/*
+ * Out of fds, a pending connection keeps the listeners readable, and
+ * accept() failing. Stop listening until a connection went away.
+ */
+static void
+rlb_listeners_pause(td_rlb_t *rlb, int pause)
+{
+	struct epoll_event ev = { .events = pause ? 0 : EPOLLIN };
+	td_rlb_listener_t *lsn;
+
+	if (rlb->lsn_paused == pause)
+		return;
+
+	list_for_each_entry(lsn, &rlb->listeners, entry) {
+		ev.data.ptr = &lsn->efd;
+		if (epoll_ctl(rlb->epfd, EPOLL_CTL_MOD, lsn->efd.fd, &ev))
+			PERROR("epoll_ctl(%d)", lsn->efd.fd);
+	}
+
+	rlb->lsn_paused = pause;
+
+	INFO("%s accepting connections.", pause ? "Stopped" : "Resumed");
+}
+
 static void
-rlb_sock_close(td_rlb_t *rlb)
+rlb_listener_close(td_rlb_t *rlb, td_rlb_listener_t *lsn)
 {
-	if (rlb->path) {
-		unlink(rlb->path);
-		rlb->path = NULL;
+	if (lsn == &rlb->lsn)
+		rlb_shm_close(rlb);
+
+	if (lsn->path) {
+		unlink(lsn->path);
+		lsn->path = NULL;
 	}
 
-	if (rlb->sock >= 0) {
-		close(rlb->sock);
-		rlb->sock = -1;
+	if (lsn->efd.fd >= 0) {
+		rlb_epoll_del(rlb, &lsn->efd);
+		close(lsn->efd.fd);
+		lsn->efd.fd = -1;
 	}
+
+	if (!list_empty(&lsn->entry))
+		list_del_init(&lsn->entry);
 }
 
+/*
+ * Listens on @name, for connections to be served from @pool. Ours is
+ * the bridge's own socket, and comes with the shared segment.
+ */
 static int
-rlb_sock_open(td_rlb_t *rlb)
+rlb_listener_open(td_rlb_t *rlb, td_rlb_listener_t *lsn,
+		  const char *name, struct ratelimit_pool *pool)
 {
 	int s, err;
 
-	rlb->sock = -1;
+	lsn->efd.type = RLB_FD_LISTEN;
+	lsn->efd.fd   = -1;
+	lsn->path     = NULL;
+	lsn->pool     = pool;
+	INIT_LIST_HEAD(&lsn->entry);
 
-	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (s < 0) {
 		PERROR("socket");
 		err = -errno;
 		goto fail;
 	}
 
-	rlb->sock = s;
+	lsn->efd.fd = s;
 
-	rlb->addr.sun_family = AF_UNIX;
+	lsn->addr.sun_family = AF_UNIX;
 
-	if (rlb->name[0] == '/') {
-		if (unlikely(strlen(rlb->name) >= sizeof(rlb->addr.sun_path))) {
-			ERR("socket name too long: %s\n", rlb->name);
+	if (name[0] == '/') {
+		if (unlikely(strlen(name) >= sizeof(lsn->addr.sun_path))) {
+			ERR("socket name too long: %s\n", name);
 			err = -ENAMETOOLONG;
 			goto fail;
 		}
-		safe_strncpy(rlb->addr.sun_path, rlb->name, sizeof(rlb->addr.sun_path));
+		safe_strncpy(lsn->addr.sun_path, name, sizeof(lsn->addr.sun_path));
 	} else
-		snprintf(rlb->addr.sun_path, sizeof(rlb->addr.sun_path),
-			 "%s/%s", TD_VALVE_SOCKDIR, rlb->name);
+		snprintf(lsn->addr.sun_path, sizeof(lsn->addr.sun_path),
+			 "%s/%s", TD_VALVE_SOCKDIR, name);
 
-	err = bind(rlb->sock, &rlb->addr, sizeof(rlb->addr));
+	err = bind(s, &lsn->addr, sizeof(lsn->addr));
 	if (err) {
-		PERROR("%s", rlb->addr.sun_path);
+		PERROR("%s", lsn->addr.sun_path);
 		err = -errno;
 		goto fail;
 	}
 
-	rlb->path = rlb->addr.sun_path;
+	lsn->path = lsn->addr.sun_path;
+
+	/* before anyone can connect and look for it */
+	if (lsn == &rlb->lsn) {
+		err = rlb_shm_open(rlb);
+		if (err)
+			goto fail;
+	}
 
-	err = listen(rlb->sock, RLB_CONN_MAX);
+	err = listen(s, SOMAXCONN);
 	if (err) {
-		PERROR("listen(%s)", rlb->addr.sun_path);
+		PERROR("listen(%s)", lsn->addr.sun_path);
 		err = -errno;
 		goto fail;
 	}
 
+	err = rlb_epoll_add(rlb, &lsn->efd);
+	if (err)
+		goto fail;
+
+	list_add_tail(&lsn->entry, &rlb->listeners);
+
 	return 0;
 
 fail:
-	rlb_sock_close(rlb);
+	rlb_listener_close(rlb, lsn);
 	return err;
 }
 
@@ -441,7 +675,7 @@ rlb_sock_send(td_rlb_t *rlb, td_rlb_conn_t *conn,
 {
 	ssize_t n;
 
-	n = send(conn->sock, msg, size, MSG_DONTWAIT);
+	n = send(conn->efd.fd, msg, size, MSG_DONTWAIT);
 	if (n < 0)
 		return -errno;
 	if (n && n != size)
@@ -456,7 +690,7 @@ rlb_sock_recv(td_rlb_t *rlb, td_rlb_conn_t *conn,
 {
 	ssize_t n;
 
-	n = recv(conn->sock, msg, size, MSG_DONTWAIT);
+	n = recv(conn->efd.fd, msg, size, MSG_DONTWAIT);
 	if (n < 0)
 		return -errno;
 
@@ -468,8 +702,11 @@ rlb_conn_alloc(td_rlb_t *rlb)
 {
 	td_rlb_conn_t *conn = NULL;
 
-	if (likely(rlb->n_free > 0))
-		conn = rlb->free[--rlb->n_free];
+	if (likely(rlb->n_conns < RLB_CONN_MAX))
+		conn = calloc(1, sizeof(*conn));
+
+	if (conn)
+		rlb->n_conns++;
 
 	return conn;
 }
@@ -477,15 +714,31 @@ rlb_conn_alloc(td_rlb_t *rlb)
 static void
 rlb_conn_free(td_rlb_t *rlb, td_rlb_conn_t *conn)
 {
-	BUG_ON(rlb->n_free >= RLB_CONN_MAX);
+	BUG_ON(rlb->n_conns <= 0);
+
+	if (conn->data)
+		free(conn->data);
+
+	free(conn);
+	rlb->n_conns--;
+}
+
+/* connections closed in this iteration may still have events pending */
+static void
+rlb_conn_reap(td_rlb_t *rlb)
+{
+	td_rlb_conn_t *conn, *next;
 
-	rlb->free[rlb->n_free++] = conn;
+	list_for_each_entry_safe(conn, next, &rlb->dead, open) {
+		list_del(&conn->open);
+		rlb_conn_free(rlb, conn);
+	}
 }
 
 static int
 rlb_conn_id(td_rlb_t *rlb, td_rlb_conn_t *conn)
 {
-	return conn - rlb->connv;
+	return conn->id;
 }
 
 static void
@@ -520,20 +773,28 @@ rlb_conn_infos(td_rlb_t *rlb)
 static void
 rlb_conn_close(td_rlb_t *rlb, td_rlb_conn_t *conn)
 {
-	int s = conn->sock;
+	int s = conn->efd.fd;
 
 	INFO("Connection %d closed.", rlb_conn_id(rlb, conn));
 	rlb_conn_info(rlb, conn);
 
-	if (s) {
+	if (s >= 0) {
+		rlb_epoll_del(rlb, &conn->efd);
 		close(s);
-		conn->sock = -1;
+		conn->efd.fd = -1;
+	}
+
+	if (!list_empty(&conn->wait)) {
+		list_del_init(&conn->wait);
+		rlb->n_wait--;
 	}
 
-	list_del_init(&conn->wait);
-	list_del(&conn->open);
+	rlb->gntd -= conn->gntd;
+	conn->gntd = 0;
+
+	list_move(&conn->open, &rlb->dead);
 
-	rlb_conn_free(rlb, conn);
+	rlb_listeners_pause(rlb, 0);
 }
 
 static void
@@ -559,8 +820,26 @@ rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 	}
 
 	for (i = 0; i < n / sizeof(buf[0]); i++) {
+		int op;
+
 		req = buf[i];
 
+		if (req.need & TD_VALVE_REQ_LATENCY) {
+			unsigned long b = req.need & ~TD_VALVE_REQ_LATENCY;
+
+			if (unlikely(b >= TD_VALVE_LAT_BUCKETS)) {
+				err = -EINVAL;
+				goto fail;
+			}
+
+			rlb->lat[b] += req.done;
+			rlb->lat_nr += req.done;
+			continue;
+		}
+
+		op = req.need & TD_VALVE_REQ_READ ? RLB_OP_READ : RLB_OP_WRITE;
+		req.need &= ~TD_VALVE_REQ_READ;
+
 		if (unlikely(req.need > TD_RLB_REQUEST_MAX)) {
 			err = -EINVAL;
 			goto fail;
@@ -573,6 +852,10 @@ rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 
 		conn->need += req.need;
 		conn->gntd -= req.done;
+		rlb->gntd  -= req.done;
+
+		conn->ios[op]   += !!req.need;
+		conn->bytes[op] += req.need;
 
 		DBG(8, "rcv: %lu/%lu need=%lu gntd=%lu",
 		    req.need, req.done, conn->need, conn->gntd);
@@ -586,6 +869,7 @@ rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 	if (conn->need && list_empty(&conn->wait)) {
 		list_add_tail(&conn->wait, &rlb->wait);
 		conn->wstat.since = rlb->now;
+		rlb->n_wait++;
 	}
 
 	return;
@@ -615,16 +899,21 @@ rlb_conn_respond(td_rlb_t *rlb, td_rlb_conn_t *conn, unsigned long need)
 
 	conn->need -= need;
 	conn->gntd += need;
+	rlb->gntd  += need;
 
 	DBG(8, "snd: %lu need=%lu gntd=%lu", need, conn->need, conn->gntd);
 
 	if (!conn->need) {
 		struct timeval delta;
 
+		memset(conn->ios, 0, sizeof(conn->ios));
+		memset(conn->bytes, 0, sizeof(conn->bytes));
+
 		timersub(&rlb->now, &conn->wstat.since, &delta);
 		timeradd(&conn->wstat.total, &delta, &conn->wstat.total);
 
 		list_del_init(&conn->wait);
+		rlb->n_wait--;
 	}
 
 	return;
@@ -635,14 +924,16 @@ fail:
 }
 
 static void
-rlb_accept_conn(td_rlb_t *rlb)
+rlb_accept_conn(td_rlb_t *rlb, td_rlb_listener_t *lsn)
 {
 	td_rlb_conn_t *conn;
 	int s, err;
 
-	s = accept(rlb->sock, NULL, NULL);
-	if (!s) {
+	s = accept4(lsn->efd.fd, NULL, NULL, SOCK_CLOEXEC);
+	if (s < 0) {
 		err = -errno;
+		if (err == -EMFILE || err == -ENFILE)
+			rlb_listeners_pause(rlb, 1);
 		goto fail;
 	}
 
@@ -653,13 +944,21 @@ rlb_accept_conn(td_rlb_t *rlb)
 		goto fail;
 	}
 
-	INFO("Accepting connection %td.", conn - rlb->connv);
-
-	memset(conn, 0, sizeof(*conn));
 	INIT_LIST_HEAD(&conn->wait);
-	conn->sock = s;
+	conn->efd.type = RLB_FD_CONN;
+	conn->efd.fd   = s;
+	conn->serial   = ++rlb->serial;
+	conn->id       = (int)conn->serial;
+	conn->pool     = lsn->pool;
 	list_add_tail(&conn->open, &rlb->open);
 
+	INFO("Accepting connection %d on %s.",
+	     rlb_conn_id(rlb, conn), lsn->path);
+
+	err = rlb_epoll_add(rlb, &conn->efd);
+	if (err)
+		rlb_conn_close(rlb, conn);
+
 	return;
 
 fail:
@@ -669,13 +968,7 @@ fail:
 static long long
 rlb_pending(td_rlb_t *rlb)
 {
-	td_rlb_conn_t *conn;
-	long long pend = 0;
-
-	rlb_for_each_conn(conn, rlb)
-		pend += conn->gntd;
-
-	return pend;
+	return rlb->gntd;
 }
 
 /*
@@ -684,10 +977,15 @@ rlb_pending(td_rlb_t *rlb)
 
 typedef struct ratelimit_token td_rlb_token_t;
 
+/*
+ * A top-level token bucket lives in the shared segment, where valves
+ * debit it without asking. We only serve those waiting on the socket,
+ * from the same bucket.
+ */
+
 struct ratelimit_token {
-	long                      cred;
-	long                      cap;
-	long                      rate;
+	struct td_rlb_bucket     *b;
+	struct td_rlb_bucket      local;
 	struct timeval            timeo;
 };
 
@@ -696,18 +994,23 @@ rlb_token_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 {
 	td_rlb_token_t *token = data;
 	struct timeval *tv = &token->timeo;
-	long long us;
+	long long us, cred;
 
 	if (list_empty(&rlb->wait)) {
 		*_tv = NULL;
 		return;
 	}
 
-	WARN_ON(token->cred >= 0);
+	cred = __atomic_load_n(&token->b->cred, __ATOMIC_ACQUIRE);
 
-	us  = -token->cred;
+	/* valves may have refilled meanwhile */
+	if (cred >= 0)
+		cred = -1;
+
+	us  = -cred;
 	us *= 1000000;
-	us /= token->rate;
+	us += token->b->rate - 1;
+	us /= token->b->rate;
 
 	tv->tv_sec  = us / 1000000;
 	tv->tv_usec = us % 1000000;
@@ -717,47 +1020,22 @@ rlb_token_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 	*_tv = tv;
 }
 
-static void
-rlb_token_refill(td_rlb_t *rlb, td_rlb_token_t *token)
-{
-	struct timeval tv;
-	long long cred, max_usec;
-
-	/* max time needed to refill up to cap */
-
-	max_usec  = token->cap - token->cred;
-	max_usec *= 1000000;
-	max_usec += token->rate - 1;
-	max_usec /= token->rate;
-
-	/* actual credit gained */
-
-	timersub(&rlb->now, &rlb->ts, &tv);
-
-	cred  = rlb_tv_usec(&tv);
-	cred  = MIN(cred, max_usec);
-	cred *= token->rate;
-	cred /= 1000000;
-
-	/* up to cap */
-
-	token->cred += cred;
-	token->cred  = MIN(token->cred, token->cap);
-}
-
 static void
 rlb_token_dispatch(td_rlb_t *rlb, void *data)
 {
 	td_rlb_token_t *token = data;
 	td_rlb_conn_t *conn, *next;
+	long long cred;
 
-	rlb_token_refill(rlb, token);
+	td_rlb_bucket_refill(token->b, td_rlb_now_ns());
 
 	rlb_for_each_waiting_safe(conn, next, rlb) {
-		if (token->cred < 0)
+		cred = __atomic_load_n(&token->b->cred, __ATOMIC_ACQUIRE);
+		if (cred < 0)
 			break;
 
-		token->cred -= conn->need;
+		__atomic_sub_fetch(&token->b->cred, conn->need,
+				   __ATOMIC_ACQ_REL);
 
 		rlb_conn_respond(rlb, conn, conn->need);
 	}
@@ -768,7 +1046,8 @@ rlb_token_reset(td_rlb_t *rlb, void *data)
 {
 	td_rlb_token_t *token = data;
 
-	token->cred = token->cap;
+	__atomic_store_n(&token->b->cred, token->b->cap, __ATOMIC_RELEASE);
+	__atomic_store_n(&token->b->ts, td_rlb_now_ns(), __ATOMIC_RELEASE);
 }
 
 static void
@@ -784,6 +1063,7 @@ static int
 rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 {
 	td_rlb_token_t *token;
+	long rate, cap;
 	int err;
 
 	token = calloc(1, sizeof(*token));
@@ -792,8 +1072,8 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 		goto fail;
 	}
 
-	token->rate = 0;
-	token->cap  = 0;
+	rate = 0;
+	cap  = 0;
 
 	do {
 		const struct option longopts[] = {
@@ -809,16 +1089,16 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 
 		switch (c) {
 		case 'r':
-			token->rate = rlb_strtol(optarg);
-			if (token->rate < 0) {
+			rate = rlb_strtol(optarg);
+			if (rate < 0) {
 				ERR("invalid --rate");
 				goto usage;
 			}
 			break;
 
 		case 'c':
-			token->cap = rlb_strtol(optarg);
-			if (token->cap < 0) {
+			cap = rlb_strtol(optarg);
+			if (cap < 0) {
 				ERR("invalid --cap");
 				goto usage;
 			}
@@ -832,13 +1112,25 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 		}
 	} while (1);
 
-	if (!token->rate) {
+	if (!rate) {
 		ERR("--rate required");
 		goto usage;
 	}
 
+	/* a token valve nested in another one isn't the whole story */
+	if (rlb->shm && rlb->valve.ops == &rlb_token_ops)
+		token->b = &rlb->shm->bucket;
+	else
+		token->b = &token->local;
+
+	token->b->rate = rate;
+	token->b->cap  = cap;
+
 	rlb_token_reset(rlb, token);
 
+	if (token->b != &token->local)
+		__atomic_store_n(&rlb->shm->enabled, 1, __ATOMIC_RELEASE);
+
 	*data = token;
 
 	return 0;
@@ -868,8 +1160,10 @@ rlb_token_info(td_rlb_t *rlb, void *data)
 {
 	td_rlb_token_t *token = data;
 
-	INFO("TOKEN: rate: %ld B/s cap: %ld B cred: %ld B",
-	     token->rate, token->cap, token->cred);
+	INFO("TOKEN: rate: %lld B/s cap: %lld B cred: %lld B%s",
+	     (long long)token->b->rate, (long long)token->b->cap,
+	     (long long)__atomic_load_n(&token->b->cred, __ATOMIC_RELAXED),
+	     token->b != &token->local ? " (shared)" : "");
 }
 
 static struct ratelimit_ops rlb_token_ops = {
@@ -885,231 +1179,284 @@ static struct ratelimit_ops rlb_token_ops = {
 };
 
 /*
- * meminfo valve
+ * dual valve: IOPS and bandwidth
+ *
+ * Reads and writes each get an IOPS and a byte rate bucket. A
+ * dimension whose bucket is in debt may still be paid for from its
+ * burst bucket, shared by reads and writes, which refills at its own
+ * (typically lower) rate while the baseline isn't exceeded.
  */
 
-typedef struct ratelimit_meminfo td_rlb_meminfo_t;
+typedef struct ratelimit_dual td_rlb_dual_t;
 
-struct ratelimit_meminfo {
-	unsigned int                   period;
-	struct timeval                 ts;
+struct ratelimit_dual {
+	struct td_rlb_bucket     *b; /* [TD_RLB_LEVELS] */
+	struct td_rlb_bucket      local[TD_RLB_LEVELS];
+	unsigned int              levels;
+	struct timeval            timeo;
+};
 
-	FILE                          *s;
+static const char *rlb_dual_names[TD_RLB_LEVELS] = TD_RLB_LEVEL_NAMES;
 
-	unsigned long                  total;
-	unsigned long                  dirty;
-	unsigned long                  writeback;
+#define rlb_dual_limited(_d, _i)  ((_d)->levels & (1 << (_i)))
 
-	unsigned int                   limit_hi;
-	unsigned int                   limit_lo;
-	unsigned int                   congested;
+#define rlb_dual_for_each_level(_i, _d)				\
+	for ((_i) = 0; (_i) < TD_RLB_LEVELS; (_i)++)			\
+		if (rlb_dual_limited(_d, _i))
 
-	struct rlb_valve               valve;
-	struct timeval                 timeo;
-};
+/* dim is 0 for IOPS, 1 for bytes */
 
-static void
-rlb_meminfo_info(td_rlb_t *rlb, void *data)
+static long long
+rlb_dual_amount(td_rlb_conn_t *conn, int op, int dim)
 {
-	td_rlb_meminfo_t *m = data;
+	unsigned long long total;
 
-	INFO("MEMINFO: lo/hi: %u/%u%% period: %u ms",
-	     m->limit_lo, m->limit_hi, m->period);
+	if (!dim)
+		return conn->ios[op];
 
-	INFO("MEMINFO: total %lu kB, dirty/writeback %lu/%lu kB",
-	     m->total, m->dirty, m->writeback);
+	/*
+	 * Partial grants (meminfo) are taken off the total only: charge
+	 * each op its share of what is left.
+	 */
+	total = conn->bytes[RLB_OP_READ] + conn->bytes[RLB_OP_WRITE];
+	if (total <= conn->need)
+		return conn->bytes[op];
 
-	m->valve.ops->info(rlb, m->valve.data);
+	return conn->bytes[op] * (unsigned long long)conn->need / total;
 }
 
-static void
-rlb_meminfo_close(td_rlb_meminfo_t *m)
+static int
+rlb_dual_open(td_rlb_dual_t *d, int i)
 {
-	if (m->s) {
-		fclose(m->s);
-		m->s = NULL;
-	}
+	return !rlb_dual_limited(d, i) || d->b[i].cred >= 0;
 }
 
+/*
+ * The bucket paying for @dim of @op, -1 for none needed, or -EAGAIN if
+ * we have to wait.
+ */
 static int
-rlb_meminfo_open(td_rlb_meminfo_t *m)
+rlb_dual_payer(td_rlb_dual_t *d, td_rlb_conn_t *conn, int op, int dim)
 {
-	FILE *s;
-	int err;
-
-	m->s = NULL;
+	int i = 2 * op + dim, j = TD_RLB_LEVEL_BURST_IOPS + dim;
 
-	s = fopen("/proc/meminfo", "r");
-	if (!s) {
-		err = -errno;
-		goto fail;
-	}
+	if (!rlb_dual_amount(conn, op, dim) || !rlb_dual_limited(d, i))
+		return -1;
 
-	m->s = s;
+	if (rlb_dual_open(d, i))
+		return i;
 
-	return 0;
+	if (rlb_dual_limited(d, j) && rlb_dual_open(d, j))
+		return j;
 
-fail:
-	rlb_meminfo_close(m);
-	return err;
+	return -EAGAIN;
 }
 
-static inline int __test_bit(int n, unsigned long *bitmap)
+static long long
+rlb_dual_usec(td_rlb_dual_t *d, int i)
 {
-	return !!(*bitmap & (1UL<<n));
+	struct td_rlb_bucket *b = &d->b[i];
+	long long us;
+
+	if (!rlb_dual_limited(d, i))
+		return LLONG_MAX;
+
+	us  = -b->cred;
+	us *= 1000000;
+	us += b->rate - 1;
+	us /= b->rate;
+
+	return MAX(us, 1);
 }
 
-static inline void __clear_bit(int n, unsigned long *bitmap)
+static void
+rlb_dual_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 {
-	*bitmap &= ~(1UL<<n);
-}
+	td_rlb_dual_t *d = data;
+	struct timeval *tv = &d->timeo;
+	td_rlb_conn_t *conn;
+	long long us, _us;
+	int op, dim, i;
 
-static struct ratelimit_meminfo_scan {
-	const char    *format;
-	ptrdiff_t      ptrdiff;
-} rlb_meminfo_scanfs[] = {
-	{ "MemTotal:  %lu kB",
-	  offsetof(struct ratelimit_meminfo, total) },
-	{ "Dirty:     %lu kB",
-	  offsetof(struct ratelimit_meminfo, dirty) },
-	{ "Writeback: %lu kB",
-	  offsetof(struct ratelimit_meminfo, writeback) },
-};
+	if (list_empty(&rlb->wait)) {
+		*_tv = NULL;
+		return;
+	}
 
-static int
-rlb_meminfo_scan(td_rlb_meminfo_t *m)
-{
-	const int n_keys = ARRAY_SIZE(rlb_meminfo_scanfs);
-	unsigned long pending;
-	int err;
+	/* until the first in line can be served */
 
-	err = rlb_meminfo_open(m);
-	if (err)
-		goto fail;
+	conn = rlb_wait_entry(rlb->wait.next);
+	us   = 1;
 
-	pending = (1UL << n_keys) - 1;
+	for (op = 0; op < 2; op++)
+		for (dim = 0; dim < 2; dim++) {
+			if (rlb_dual_payer(d, conn, op, dim) != -EAGAIN)
+				continue;
 
-	do {
-		char buf[80], *b;
-		int i;
+			i   = 2 * op + dim;
+			_us = MIN(rlb_dual_usec(d, i),
+				  rlb_dual_usec(d, TD_RLB_LEVEL_BURST_IOPS + dim));
+			us  = MAX(us, _us);
+		}
 
-		b = fgets(buf, sizeof(buf), m->s);
-		if (!b)
-			break;
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
 
-		for (i = 0; i < n_keys; i++) {
-			struct ratelimit_meminfo_scan *scan;
-			unsigned long val, *ptr;
-			int n;
+	*_tv = tv;
+}
 
-			if (!__test_bit(i, &pending))
-				continue;
+static void
+rlb_dual_refill(td_rlb_dual_t *d)
+{
+	uint64_t now = td_rlb_now_ns();
+	int i;
 
-			scan = &rlb_meminfo_scanfs[i];
+	rlb_dual_for_each_level(i, d)
+		td_rlb_bucket_refill(&d->b[i], now);
+}
 
-			n = sscanf(buf, scan->format, &val);
-			if (n != 1)
-				continue;
+static void
+rlb_dual_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_dual_t *d = data;
+	td_rlb_conn_t *conn, *next;
+	int pay[2][2], op, dim;
 
-			ptr  = (void*)m + scan->ptrdiff;
-			*ptr = val;
+	rlb_dual_refill(d);
 
-			__clear_bit(i, &pending);
-		}
+	rlb_for_each_waiting_safe(conn, next, rlb) {
 
-	} while (pending);
+		for (op = 0; op < 2; op++)
+			for (dim = 0; dim < 2; dim++) {
+				pay[op][dim] = rlb_dual_payer(d, conn, op, dim);
+				if (pay[op][dim] == -EAGAIN)
+					return;
+			}
 
-	if (pending) {
-		err = -ESRCH;
-		goto fail;
-	}
+		for (op = 0; op < 2; op++)
+			for (dim = 0; dim < 2; dim++)
+				if (pay[op][dim] >= 0)
+					d->b[pay[op][dim]].cred -=
+						rlb_dual_amount(conn, op, dim);
 
-	err = 0;
-fail:
-	rlb_meminfo_close(m);
-	return err;
+		rlb_conn_respond(rlb, conn, conn->need);
+	}
 }
 
 static void
-rlb_meminfo_usage(td_rlb_t *rlb, FILE *stream, void *data)
+rlb_dual_reset(td_rlb_t *rlb, void *data)
 {
-	td_rlb_meminfo_t *m = data;
+	td_rlb_dual_t *d = data;
+	uint64_t now = td_rlb_now_ns();
+	int i;
 
-	fprintf(stream,
-		" {-t|--type}=meminfo "
-		" {-H|--high}=<percent> {-L|--low}=<percent>"
-		" {-p|--period}=<msecs> --");
+	/* burst credit is kept */
 
-	if (m && m->valve.ops) {
-		m->valve.ops->usage(rlb, stream, m->valve.data);
-	} else
-		fprintf(stream, " {-t|--type}={...}");
+	for (i = 0; i < TD_RLB_LEVEL_BURST_IOPS; i++) {
+		d->b[i].cred = d->b[i].cap;
+		d->b[i].ts   = now;
+	}
+}
+
+static unsigned int
+rlb_dual_limits(td_rlb_t *rlb, void *data)
+{
+	td_rlb_dual_t *d = data;
+	unsigned int limits = 0;
+
+	if (rlb_dual_limited(d, TD_RLB_LEVEL_READ_IOPS) ||
+	    rlb_dual_limited(d, TD_RLB_LEVEL_READ_BPS))
+		limits |= TD_RLB_LIMIT_READ;
+
+	if (rlb_dual_limited(d, TD_RLB_LEVEL_WRITE_IOPS) ||
+	    rlb_dual_limited(d, TD_RLB_LEVEL_WRITE_BPS))
+		limits |= TD_RLB_LIMIT_WRITE;
+
+	return limits;
 }
 
 static void
-rlb_meminfo_destroy(td_rlb_t *rlb, void *data)
+rlb_dual_destroy(td_rlb_t *rlb, void *data)
 {
-	td_rlb_meminfo_t *m = data;
+	td_rlb_dual_t *d = data;
 
-	if (m) {
-		if (m->valve.data) {
-			m->valve.ops->destroy(rlb, m->valve.data);
-			m->valve.data = NULL;
-		}
+	if (d)
+		free(d);
+}
 
-		free(m);
+/* <rate [KMG]>[:<cap [KMG]>] */
+static int
+rlb_dual_parse(td_rlb_dual_t *d, int i, char *arg)
+{
+	struct td_rlb_bucket *b = &d->local[i];
+	char *cap;
+
+	cap = strchr(arg, ':');
+	if (cap)
+		*cap++ = 0;
+
+	b->rate = rlb_strtol(arg);
+	if (b->rate <= 0)
+		return -EINVAL;
+
+	b->cap = 0;
+	if (cap) {
+		b->cap = rlb_strtol(cap);
+		if (b->cap < 0)
+			return -EINVAL;
 	}
+
+	d->levels |= 1 << i;
+
+	return 0;
 }
 
 static int
-rlb_meminfo_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+rlb_dual_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 {
-	td_rlb_meminfo_t *m;
-	const char *type;
-	long dbr;
-	int err;
+	td_rlb_dual_t *d;
+	int i, err;
 
-	m = calloc(1, sizeof(*m));
-	if (!m) {
-		PERROR("calloc");
-		err = -errno;
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		err = -ENOMEM;
 		goto fail;
 	}
 
-	type      = NULL;
-	m->period = 100;
-
 	do {
 		const struct option longopts[] = {
-			{ "period",    1, NULL, 'p' },
-			{ "type",      1, NULL, 't' },
-			{ "high",      1, NULL, 'H' },
-			{ "low",       1, NULL, 'L' },
-			{ NULL,        0, NULL,  0  }
+			{ "read-iops",   1, NULL, 'i' },
+			{ "read-bps",    1, NULL, 'b' },
+			{ "write-iops",  1, NULL, 'I' },
+			{ "write-bps",   1, NULL, 'B' },
+			{ "burst-iops",  1, NULL, 'x' },
+			{ "burst-bps",   1, NULL, 'X' },
+			{ NULL,          0, NULL,  0  }
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "p:t:H:L:", longopts, NULL);
+		c = getopt_long(argc, argv, "i:b:I:B:x:X:", longopts, NULL);
 		if (c < 0)
 			break;
 
 		switch (c) {
-		case 'p':
-			m->period = rlb_strtol(optarg);
-			if (m->period < 0)
-				goto usage;
+		case 'i':
+			i = TD_RLB_LEVEL_READ_IOPS;
 			break;
-
-		case 'H':
-			m->limit_hi = strtoul(optarg, NULL, 0);
+		case 'b':
+			i = TD_RLB_LEVEL_READ_BPS;
 			break;
-
-		case 'L':
-			m->limit_lo = strtoul(optarg, NULL, 0);
+		case 'I':
+			i = TD_RLB_LEVEL_WRITE_IOPS;
 			break;
-
-		case 't':
-			type = optarg;
+		case 'B':
+			i = TD_RLB_LEVEL_WRITE_BPS;
+			break;
+		case 'x':
+			i = TD_RLB_LEVEL_BURST_IOPS;
+			break;
+		case 'X':
+			i = TD_RLB_LEVEL_BURST_BPS;
 			break;
 
 		case '?':
@@ -1118,193 +1465,1590 @@ rlb_meminfo_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 		default:
 			BUG();
 		}
+
+		err = rlb_dual_parse(d, i, optarg);
+		if (err) {
+			ERR("invalid %s limit", rlb_dual_names[i]);
+			goto usage;
+		}
 	} while (1);
 
-	if (!m->limit_hi || !m->limit_lo) {
-		ERR("--high/--low required");
+	if (!rlb_dual_limits(rlb, d)) {
+		ERR("a read or write limit is required");
 		goto usage;
 	}
 
-	if (m->limit_lo >= m->limit_hi) {
-		ERR("invalid --high/--low ratio");
-		goto usage;
-	}
+	for (i = TD_RLB_LEVEL_BURST_IOPS; i < TD_RLB_LEVELS; i++)
+		if (rlb_dual_limited(d, i) && !d->local[i].cap) {
+			ERR("--%s needs a cap", rlb_dual_names[i]);
+			goto usage;
+		}
 
-	if (!type) {
-		ERR("(sub) --type required");
-		goto usage;
+	/* published in the shared segment, if we're the top level */
+	d->b = d->local;
+	if (rlb->shm && rlb->valve.ops == &rlb_dual_ops) {
+		memcpy(rlb->shm->level, d->local, sizeof(d->local));
+		d->b = rlb->shm->level;
 	}
 
-	dbr = sysctl_strtoul("vm/dirty_background_ratio");
-	if (dbr < 0) {
-		err = dbr;
-		ERR("vm/dirty_background_ratio: %d", err);
-		goto fail;
-	}
+	rlb_dual_reset(rlb, d);
 
-	if (0 && m->limit_lo < dbr) {
-		ERR("--low %u is less than vm.dirty_background_ratio (= %ld)",
-		    m->limit_lo, dbr);
-		err = -EINVAL;
-		goto fail;
+	/* start out with full burst credit */
+	for (i = TD_RLB_LEVEL_BURST_IOPS; i < TD_RLB_LEVELS; i++) {
+		d->b[i].cred = d->b[i].cap;
+		d->b[i].ts   = td_rlb_now_ns();
 	}
 
-	*data = m;
-
-	rlb_argv_shift(&optind, &argc, &argv);
-
-	err = rlb_create_valve(rlb, &m->valve, type, argc, argv);
-	if (err) {
-		if (err == -EINVAL)
-			goto usage;
-		goto fail;
-	}
+	if (d->b != d->local)
+		__atomic_store_n(&rlb->shm->levels, d->levels,
+				 __ATOMIC_RELEASE);
 
-	err = rlb_meminfo_scan(m);
-	if (err) {
-		PERROR("/proc/meminfo");
-		goto fail;
-	}
+	*data = d;
 
 	return 0;
 
 fail:
-	ERR("err = %d", err);
+	if (d)
+		free(d);
+
 	return err;
 
 usage:
 	err = -EINVAL;
-	return err;
+	goto fail;
+}
+
+static void
+rlb_dual_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=dual --"
+		" [--{read,write}-iops=<rate>[:<cap>]]"
+		" [--{read,write}-bps=<rate [KMG]>[:<size [KMG]>]]"
+		" [--burst-iops=<rate>:<cap>]"
+		" [--burst-bps=<rate [KMG]>:<size [KMG]>]");
+}
+
+static void
+rlb_dual_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_dual_t *d = data;
+	int i;
+
+	rlb_dual_refill(d);
+
+	rlb_dual_for_each_level(i, d)
+		INFO("DUAL: %s: rate: %lld/s cap: %lld cred: %lld",
+		     rlb_dual_names[i],
+		     (long long)d->b[i].rate, (long long)d->b[i].cap,
+		     (long long)d->b[i].cred);
+}
+
+static struct ratelimit_ops rlb_dual_ops = {
+	.usage    = rlb_dual_usage,
+	.create   = rlb_dual_create,
+	.destroy  = rlb_dual_destroy,
+	.info     = rlb_dual_info,
+
+	.settimeo = rlb_dual_settimeo,
+	.timeout  = rlb_dual_dispatch,
+	.dispatch = rlb_dual_dispatch,
+	.reset    = rlb_dual_reset,
+	.limits   = rlb_dual_limits,
+};
+
+/*
+ * latency valve
+ *
+ * Valves report completion latency, for everything going to the SR.
+ * At the end of each window we look at the p99 over all of them: if
+ * above target, connections which got at least their fair share of
+ * the window are slowed down multiplicatively, from what they actually
+ * got. Otherwise everybody speeds up by a fixed step. As in CoDel,
+ * windows shorten with the square root of the number of decreases in
+ * a row, so a standing queue is cleared faster the longer it stands.
+ */
+
+#define RLB_LAT_DECREASE               25  /* % */
+#define RLB_LAT_MIN_SAMPLES            100
+
+typedef struct ratelimit_latency td_rlb_latency_t;
+
+/* conn->data */
+struct ratelimit_latency_conn {
+	struct td_rlb_bucket      b;
+	long long                 bytes; /* granted in this window */
+};
+
+struct ratelimit_latency {
+	long long                 target;   /* us */
+	long long                 interval; /* us */
+	long long                 max;      /* B/s */
+	long long                 min;
+	long long                 step;
+
+	uint64_t                  start;    /* of this window, ns */
+	long long                 window;   /* us */
+	int                       dropping;
+	unsigned int              count;    /* decreases in a row */
+	long long                 p99;      /* last seen, us */
+
+	struct timeval            timeo;
 };
 
+static long long
+rlb_isqrt(long long n)
+{
+	long long x = 1;
+
+	while (x * x <= n)
+		x++;
+
+	return x - 1;
+}
+
 static void
-rlb_meminfo_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+rlb_latency_setrate(td_rlb_latency_t *l, struct ratelimit_latency_conn *c,
+		    long long rate, uint64_t now)
 {
-	td_rlb_meminfo_t *m = data;
-	int idle;
+	rate = MAX(rate, l->min);
+	rate = MIN(rate, l->max);
 
-	idle = list_empty(&rlb->wait);
-	BUG_ON(!idle && !m->congested);
+	/* settle at the old rate first */
+	td_rlb_bucket_refill(&c->b, now);
 
-	if (m->congested) {
-		m->valve.ops->settimeo(rlb, _tv, m->valve.data);
-		return;
+	c->b.rate = rate;
+	c->b.cap  = rate * l->interval / 1000000;
+	c->b.cred = MIN(c->b.cred, c->b.cap);
+}
+
+static struct ratelimit_latency_conn *
+rlb_latency_conn(td_rlb_t *rlb, td_rlb_latency_t *l, td_rlb_conn_t *conn)
+{
+	struct ratelimit_latency_conn *c = conn->data;
+	uint64_t now;
+
+	if (unlikely(!c)) {
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			return NULL;
+
+		now     = td_rlb_now_ns();
+		c->b.ts = now;
+
+		/* newcomers start out unthrottled */
+		rlb_latency_setrate(l, c, l->max, now);
+		c->b.cred = c->b.cap;
+
+		conn->data = c;
 	}
 
-	*_tv = NULL;
+	return c;
+}
+
+static long long
+rlb_latency_p99(td_rlb_t *rlb)
+{
+	unsigned long n, tail;
+	int b;
+
+	if (rlb->lat_nr < RLB_LAT_MIN_SAMPLES)
+		return -1;
+
+	n    = 0;
+	tail = rlb->lat_nr / 100;
+
+	for (b = TD_VALVE_LAT_BUCKETS - 1; b > 0; b--) {
+		n += rlb->lat[b];
+		if (n > tail)
+			break;
+	}
+
+	return td_valve_lat_usec(b);
 }
 
 static void
-rlb_meminfo_timeout(td_rlb_t *rlb, void *data)
+rlb_latency_decrease(td_rlb_t *rlb, td_rlb_latency_t *l,
+		     long long us, uint64_t now)
 {
-	td_rlb_meminfo_t *m = data;
+	struct ratelimit_latency_conn *c;
+	td_rlb_conn_t *conn;
+	long long total, fair, rate;
+	int n;
 
-	WARN_ON(!m->congested);
+	n     = 0;
+	total = 0;
 
-	if (m->congested)
-		m->valve.ops->timeout(rlb, m->valve.data);
+	rlb_for_each_conn(conn, rlb) {
+		c = rlb_latency_conn(rlb, l, conn);
+		if (c && c->bytes) {
+			total += c->bytes;
+			n++;
+		}
+	}
+
+	if (!n)
+		return;
+
+	fair = total / n;
+
+	rlb_for_each_conn(conn, rlb) {
+		c = rlb_latency_conn(rlb, l, conn);
+		if (!c || !c->bytes || c->bytes < fair)
+			continue;
+
+		rate  = c->bytes * 1000000 / MAX(us, 1);
+		rate  = MIN(rate, c->b.rate);
+		rate -= rate * RLB_LAT_DECREASE / 100;
+
+		rlb_latency_setrate(l, c, rate, now);
+	}
 }
 
-static int
-rlb_meminfo_test_high(td_rlb_t *rlb, td_rlb_meminfo_t *m, long long cred)
+static void
+rlb_latency_increase(td_rlb_t *rlb, td_rlb_latency_t *l, uint64_t now)
 {
-	long long lo;
+	struct ratelimit_latency_conn *c;
+	td_rlb_conn_t *conn;
 
-	if (m->congested) {
-		/* hysteresis */
+	rlb_for_each_conn(conn, rlb) {
+		c = rlb_latency_conn(rlb, l, conn);
+		if (c && c->b.rate < l->max)
+			rlb_latency_setrate(l, c, c->b.rate + l->step, now);
+	}
+}
+
+static void
+rlb_latency_control(td_rlb_t *rlb, td_rlb_latency_t *l, uint64_t now)
+{
+	struct ratelimit_latency_conn *c;
+	td_rlb_conn_t *conn;
+	long long us, p99;
+
+	us = (now - l->start) / 1000;
+	if (us < l->window)
+		return;
+
+	/* not enough to go by, keep looking */
+	p99 = rlb_latency_p99(rlb);
+	if (p99 < 0)
+		return;
+
+	l->p99 = p99;
+
+	if (p99 > l->target) {
+		l->count    = l->dropping ? l->count + 1 : 1;
+		l->dropping = 1;
+		l->window   = l->interval / rlb_isqrt(l->count);
+
+		rlb_latency_decrease(rlb, l, us, now);
+	} else {
+		l->count    = 0;
+		l->dropping = 0;
+		l->window   = l->interval;
+
+		rlb_latency_increase(rlb, l, now);
+	}
+
+	DBG(3, "p99=%lld us over %lld samples, %s (%u)",
+	    p99, (long long)rlb->lat_nr,
+	    l->dropping ? "dropping" : "ok", l->count);
+
+	memset(rlb->lat, 0, sizeof(rlb->lat));
+	rlb->lat_nr = 0;
+
+	rlb_for_each_conn(conn, rlb) {
+		c = conn->data;
+		if (c)
+			c->bytes = 0;
+	}
+
+	l->start = now;
+}
+
+static void
+rlb_latency_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_latency_t *l = data;
+	struct timeval *tv = &l->timeo;
+	struct ratelimit_latency_conn *c;
+	td_rlb_conn_t *conn, *next;
+	long long us, _us;
+	uint64_t now;
+
+	if (list_empty(&rlb->wait)) {
+		*_tv = NULL;
+		return;
+	}
+
+	now = td_rlb_now_ns();
+
+	/* until the end of the window, if there is anything to go by */
+
+	us = LLONG_MAX;
+	if (rlb->lat_nr >= RLB_LAT_MIN_SAMPLES)
+		us = l->window - (long long)(now - l->start) / 1000;
+
+	/* or the first waiter whose bucket is out of debt */
+
+	rlb_for_each_waiting_safe(conn, next, rlb) {
+		c = rlb_latency_conn(rlb, l, conn);
+		if (!c)
+			continue;
+
+		_us  = -td_rlb_bucket_level(&c->b, now);
+		_us *= 1000000;
+		_us += c->b.rate - 1;
+		_us /= c->b.rate;
+
+		us = MIN(us, _us);
+	}
+
+	us = MAX(us, 1);
+
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+
+	*_tv = tv;
+}
+
+static void
+rlb_latency_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+	struct ratelimit_latency_conn *c;
+	td_rlb_conn_t *conn, *next;
+	uint64_t now;
+
+	now = td_rlb_now_ns();
+
+	rlb_latency_control(rlb, l, now);
+
+	rlb_for_each_waiting_safe(conn, next, rlb) {
+		c = rlb_latency_conn(rlb, l, conn);
+		if (!c)
+			continue;
+
+		td_rlb_bucket_refill(&c->b, now);
+		if (c->b.cred < 0)
+			continue;
+
+		c->b.cred -= conn->need;
+		c->bytes  += conn->need;
+
+		rlb_conn_respond(rlb, conn, conn->need);
+	}
+}
+
+static void
+rlb_latency_reset(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+	struct ratelimit_latency_conn *c;
+	td_rlb_conn_t *conn;
+
+	rlb_for_each_conn(conn, rlb) {
+		c = rlb_latency_conn(rlb, l, conn);
+		if (!c)
+			continue;
+
+		c->b.cred = c->b.cap;
+		c->b.ts   = td_rlb_now_ns();
+	}
+}
+
+static unsigned int
+rlb_latency_limits(td_rlb_t *rlb, void *data)
+{
+	return TD_RLB_LIMIT_READ | TD_RLB_LIMIT_WRITE | TD_RLB_REPORT_LATENCY;
+}
+
+static void
+rlb_latency_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	if (l)
+		free(l);
+}
+
+static int
+rlb_latency_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_latency_t *l;
+	int err;
+
+	l = calloc(1, sizeof(*l));
+	if (!l) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	l->interval = 100;
+	l->min      = -1;
+	l->step     = -1;
+
+	do {
+		const struct option longopts[] = {
+			{ "target",      1, NULL, 'T' },
+			{ "interval",    1, NULL, 'i' },
+			{ "max",         1, NULL, 'M' },
+			{ "min",         1, NULL, 'm' },
+			{ "step",        1, NULL, 's' },
+			{ NULL,          0, NULL,  0  }
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "T:i:M:m:s:", longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'T':
+			l->target = rlb_strtol(optarg);
+			if (l->target <= 0) {
+				ERR("invalid --target");
+				goto usage;
+			}
+			break;
+
+		case 'i':
+			l->interval = rlb_strtol(optarg);
+			if (l->interval <= 0) {
+				ERR("invalid --interval");
+				goto usage;
+			}
+			break;
+
+		case 'M':
+			l->max = rlb_strtol(optarg);
+			if (l->max <= 0) {
+				ERR("invalid --max");
+				goto usage;
+			}
+			break;
+
+		case 'm':
+			l->min = rlb_strtol(optarg);
+			if (l->min <= 0) {
+				ERR("invalid --min");
+				goto usage;
+			}
+			break;
+
+		case 's':
+			l->step = rlb_strtol(optarg);
+			if (l->step <= 0) {
+				ERR("invalid --step");
+				goto usage;
+			}
+			break;
+
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+	} while (1);
+
+	if (!l->target || !l->max) {
+		ERR("--target and --max required");
+		goto usage;
+	}
+
+	if (l->min < 0)
+		l->min = MAX(l->max / 100, 1);
+
+	if (l->step < 0)
+		l->step = MAX(l->max / 20, 1);
+
+	if (l->min > l->max) {
+		ERR("--min exceeds --max");
+		goto usage;
+	}
+
+	/* ms on the command line */
+	l->target   *= 1000;
+	l->interval *= 1000;
+
+	l->window = l->interval;
+	l->start  = td_rlb_now_ns();
+
+	*data = l;
+
+	return 0;
+
+fail:
+	if (l)
+		free(l);
+
+	return err;
+
+usage:
+	err = -EINVAL;
+	goto fail;
+}
+
+static void
+rlb_latency_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=latency --"
+		" {-T|--target}=<msecs>"
+		" {-M|--max}=<rate [KMG]>"
+		" [{-m|--min}=<rate [KMG]>]"
+		" [{-s|--step}=<rate [KMG]>]"
+		" [{-i|--interval}=<msecs>]");
+}
+
+static void
+rlb_latency_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+	struct ratelimit_latency_conn *c;
+	td_rlb_conn_t *conn;
+	uint64_t now;
+
+	INFO("LATENCY: target: %lld us interval: %lld ms"
+	     " rate: %lld..%lld B/s step: %lld B/s",
+	     l->target, l->interval / 1000, l->min, l->max, l->step);
+
+	INFO("LATENCY: p99: %lld us%s (%u)",
+	     l->p99, l->dropping ? " dropping" : "", l->count);
+
+	now = td_rlb_now_ns();
+
+	rlb_for_each_conn(conn, rlb) {
+		c = rlb_latency_conn(rlb, l, conn);
+		if (!c)
+			continue;
+
+		INFO("LATENCY: conn[%d] rate: %lld B/s cred: %lld B",
+		     rlb_conn_id(rlb, conn), (long long)c->b.rate,
+		     (long long)td_rlb_bucket_level(&c->b, now));
+	}
+}
+
+static struct ratelimit_ops rlb_latency_ops = {
+	.usage    = rlb_latency_usage,
+	.create   = rlb_latency_create,
+	.destroy  = rlb_latency_destroy,
+	.info     = rlb_latency_info,
+
+	.settimeo = rlb_latency_settimeo,
+	.timeout  = rlb_latency_dispatch,
+	.dispatch = rlb_latency_dispatch,
+	.reset    = rlb_latency_reset,
+	.limits   = rlb_latency_limits,
+};
+
+/*
+ * meminfo valve
+ */
+
+typedef struct ratelimit_meminfo td_rlb_meminfo_t;
+
+struct ratelimit_meminfo {
+	unsigned int                   period;
+	struct timeval                 ts;
+
+	FILE                          *s;
+
+	unsigned long                  total;
+	unsigned long                  dirty;
+	unsigned long                  writeback;
+
+	unsigned int                   limit_hi;
+	unsigned int                   limit_lo;
+	unsigned int                   congested;
+
+	struct rlb_valve               valve;
+	struct timeval                 timeo;
+};
+
+static void
+rlb_meminfo_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	INFO("MEMINFO: lo/hi: %u/%u%% period: %u ms",
+	     m->limit_lo, m->limit_hi, m->period);
+
+	INFO("MEMINFO: total %lu kB, dirty/writeback %lu/%lu kB",
+	     m->total, m->dirty, m->writeback);
+
+	m->valve.ops->info(rlb, m->valve.data);
+}
+
+static void
+rlb_meminfo_close(td_rlb_meminfo_t *m)
+{
+	if (m->s) {
+		fclose(m->s);
+		m->s = NULL;
+	}
+}
+
+static int
+rlb_meminfo_open(td_rlb_meminfo_t *m)
+{
+	FILE *s;
+	int err;
+
+	m->s = NULL;
+
+	s = fopen("/proc/meminfo", "r");
+	if (!s) {
+		err = -errno;
+		goto fail;
+	}
+
+	m->s = s;
+
+	return 0;
+
+fail:
+	rlb_meminfo_close(m);
+	return err;
+}
+
+static inline int __test_bit(int n, unsigned long *bitmap)
+{
+	return !!(*bitmap & (1UL<<n));
+}
+
+static inline void __clear_bit(int n, unsigned long *bitmap)
+{
+	*bitmap &= ~(1UL<<n);
+}
+
+static struct ratelimit_meminfo_scan {
+	const char    *format;
+	ptrdiff_t      ptrdiff;
+} rlb_meminfo_scanfs[] = {
+	{ "MemTotal:  %lu kB",
+	  offsetof(struct ratelimit_meminfo, total) },
+	{ "Dirty:     %lu kB",
+	  offsetof(struct ratelimit_meminfo, dirty) },
+	{ "Writeback: %lu kB",
+	  offsetof(struct ratelimit_meminfo, writeback) },
+};
+
+static int
+rlb_meminfo_scan(td_rlb_meminfo_t *m)
+{
+	const int n_keys = ARRAY_SIZE(rlb_meminfo_scanfs);
+	unsigned long pending;
+	int err;
+
+	err = rlb_meminfo_open(m);
+	if (err)
+		goto fail;
+
+	pending = (1UL << n_keys) - 1;
+
+	do {
+		char buf[80], *b;
+		int i;
+
+		b = fgets(buf, sizeof(buf), m->s);
+		if (!b)
+			break;
+
+		for (i = 0; i < n_keys; i++) {
+			struct ratelimit_meminfo_scan *scan;
+			unsigned long val, *ptr;
+			int n;
+
+			if (!__test_bit(i, &pending))
+				continue;
+
+			scan = &rlb_meminfo_scanfs[i];
+
+			n = sscanf(buf, scan->format, &val);
+			if (n != 1)
+				continue;
+
+			ptr  = (void*)m + scan->ptrdiff;
+			*ptr = val;
+
+			__clear_bit(i, &pending);
+		}
+
+	} while (pending);
+
+	if (pending) {
+		err = -ESRCH;
+		goto fail;
+	}
+
+	err = 0;
+fail:
+	rlb_meminfo_close(m);
+	return err;
+}
+
+static void
+rlb_meminfo_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	fprintf(stream,
+		" {-t|--type}=meminfo "
+		" {-H|--high}=<percent> {-L|--low}=<percent>"
+		" {-p|--period}=<msecs> --");
+
+	if (m && m->valve.ops) {
+		m->valve.ops->usage(rlb, stream, m->valve.data);
+	} else
+		fprintf(stream, " {-t|--type}={...}");
+}
+
+static void
+rlb_meminfo_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	if (m) {
+		if (m->valve.data) {
+			m->valve.ops->destroy(rlb, m->valve.data);
+			m->valve.data = NULL;
+		}
+
+		free(m);
+	}
+}
+
+static int
+rlb_meminfo_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_meminfo_t *m;
+	const char *type;
+	long dbr;
+	int err;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		PERROR("calloc");
+		err = -errno;
+		goto fail;
+	}
+
+	type      = NULL;
+	m->period = 100;
+
+	do {
+		const struct option longopts[] = {
+			{ "period",    1, NULL, 'p' },
+			{ "type",      1, NULL, 't' },
+			{ "high",      1, NULL, 'H' },
+			{ "low",       1, NULL, 'L' },
+			{ NULL,        0, NULL,  0  }
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "p:t:H:L:", longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'p':
+			m->period = rlb_strtol(optarg);
+			if (m->period < 0)
+				goto usage;
+			break;
+
+		case 'H':
+			m->limit_hi = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'L':
+			m->limit_lo = strtoul(optarg, NULL, 0);
+			break;
+
+		case 't':
+			type = optarg;
+			break;
+
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+	} while (1);
+
+	if (!m->limit_hi || !m->limit_lo) {
+		ERR("--high/--low required");
+		goto usage;
+	}
+
+	if (m->limit_lo >= m->limit_hi) {
+		ERR("invalid --high/--low ratio");
+		goto usage;
+	}
+
+	if (!type) {
+		ERR("(sub) --type required");
+		goto usage;
+	}
+
+	dbr = sysctl_strtoul("vm/dirty_background_ratio");
+	if (dbr < 0) {
+		err = dbr;
+		ERR("vm/dirty_background_ratio: %d", err);
+		goto fail;
+	}
+
+	if (0 && m->limit_lo < dbr) {
+		ERR("--low %u is less than vm.dirty_background_ratio (= %ld)",
+		    m->limit_lo, dbr);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	*data = m;
+
+	rlb_argv_shift(&optind, &argc, &argv);
+
+	err = rlb_create_valve(rlb, &m->valve, type, argc, argv);
+	if (err) {
+		if (err == -EINVAL)
+			goto usage;
+		goto fail;
+	}
+
+	err = rlb_meminfo_scan(m);
+	if (err) {
+		PERROR("/proc/meminfo");
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	ERR("err = %d", err);
+	return err;
+
+usage:
+	err = -EINVAL;
+	return err;
+};
+
+static void
+rlb_meminfo_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+	int idle;
+
+	idle = list_empty(&rlb->wait);
+	BUG_ON(!idle && !m->congested);
+
+	if (m->congested) {
+		m->valve.ops->settimeo(rlb, _tv, m->valve.data);
+		return;
+	}
+
+	*_tv = NULL;
+}
+
+static void
+rlb_meminfo_timeout(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	WARN_ON(!m->congested);
+
+	if (m->congested)
+		m->valve.ops->timeout(rlb, m->valve.data);
+}
+
+static int
+rlb_meminfo_test_high(td_rlb_t *rlb, td_rlb_meminfo_t *m, long long cred)
+{
+	long long lo;
+
+	if (m->congested) {
+		/* hysteresis */
+
+		lo  = m->total;
+		lo *= m->limit_lo;
+		lo /= 100;
+
+		if (cred >= lo)
+			return 0;
+
+	} else
+		if (cred <= 0) {
+			m->valve.ops->reset(rlb, m->valve.data);
+			return 1;
+		}
+
+	return m->congested;
+}
+
+static void
+rlb_meminfo_dispatch_low(td_rlb_t *rlb, td_rlb_meminfo_t *m,
+			 long long *_cred)
+{
+	td_rlb_conn_t *conn, *next;
+	long long cred = *_cred, grant;
+
+	rlb_for_each_waiting_safe(conn, next, rlb) {
+
+		if (cred <= 0)
+			break;
+
+		grant = MIN(cred, conn->need);
+
+		rlb_conn_respond(rlb, conn, grant);
+
+		cred -= grant;
+	}
+
+	*_cred = cred;
+}
+
+static void
+rlb_meminfo_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+	long long us, hi, cred, dirty, pend;
+
+	/* we run only once per m->period */
+
+	us = rlb_usec_since(rlb, &m->ts);
+	if (us / 1000 > m->period) {
+		rlb_meminfo_scan(m);
+		m->ts = rlb->now;
+	}
+
+	/* uncongested credit:
+	   memory below hi watermark minus pending I/O */
+
+	hi  = m->total;
+	hi *= m->limit_hi;
+	hi /= 100;
+
+	dirty = m->dirty + m->writeback;
+
+	cred  = hi - dirty;
+	cred *= 1000;
+
+	pend  = rlb_pending(rlb);
+	cred -= pend;
+
+	m->congested = rlb_meminfo_test_high(rlb, m, cred);
+
+	DBG(3, "dirty=%lld (%lld) pend=%llu cred=%lld %s",
+	    dirty, dirty * 100 / m->total, pend, cred,
+	    m->congested ? "congested" : "");
+
+	if (!m->congested) {
+		rlb_meminfo_dispatch_low(rlb, m, &cred);
+
+		m->congested = rlb_meminfo_test_high(rlb, m, cred);
+	}
+
+	if (m->congested)
+		m->valve.ops->dispatch(rlb, m->valve.data);
+}
+
+static unsigned int
+rlb_meminfo_limits(td_rlb_t *rlb, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+	unsigned int limits = TD_RLB_LIMIT_WRITE;
+
+	/* only writes dirty memory, but the next valve may want to know */
+	if (m->valve.ops->limits)
+		limits |= m->valve.ops->limits(rlb, m->valve.data) &
+			TD_RLB_REPORT_LATENCY;
+
+	return limits;
+}
+
+static struct ratelimit_ops rlb_meminfo_ops = {
+	.usage    = rlb_meminfo_usage,
+	.create   = rlb_meminfo_create,
+	.destroy  = rlb_meminfo_destroy,
+	.info     = rlb_meminfo_info,
+
+	.settimeo = rlb_meminfo_settimeo,
+	.timeout  = rlb_meminfo_timeout,
+	.dispatch = rlb_meminfo_dispatch,
+	.limits   = rlb_meminfo_limits,
+};
+
+/*
+ * tree valve: hierarchical pools
+ *
+ * Pools nest (host, SR, tenant, ...), each with an optional token
+ * bucket of its own, and a socket valves connect to. The bridge's own
+ * socket is the root pool. A grant is debited from every bucket on the
+ * way up, so is only made while none of them is in debt.
+ *
+ * Siblings share what their parent lets through by weight, in start
+ * time fair queuing order: a pool's virtual time advances by what it
+ * got, over its weight, and the one furthest behind goes first. A
+ * pool's own connections count as one more child, of weight 1, and
+ * are served FIFO. Pools blocked on their own bucket don't hold up
+ * their siblings.
+ */
+
+#define RLB_POOL_WEIGHT_MAX            10000
+#define RLB_POOL_VSCALE                1024
+
+typedef struct ratelimit_tree td_rlb_tree_t;
+typedef struct ratelimit_pool td_rlb_pool_t;
+
+struct ratelimit_pool {
+	char                     *name;
+	td_rlb_pool_t            *parent;
+	struct list_head          children;
+	struct list_head          sibling;
+	struct list_head          entry;    /* all, parents first */
+	int                       depth;
+
+	struct td_rlb_bucket      b;        /* rate 0 for unlimited */
+	unsigned int              weight;
+
+	/* virtual time, in the parent's and our own terms */
+	unsigned long long        vtime;
+	unsigned long long        vclock;
+	unsigned long long        vown;     /* of our own connections */
+	int                       active;
+	int                       own_active;
+	unsigned long long        pass;     /* last found blocked */
+
+	struct list_head          wait;     /* own connections in need */
+	int                       n_wait;   /* in the subtree */
+
+	unsigned long long        granted;  /* B */
+
+	td_rlb_listener_t         lsn;
+};
+
+/* conn->data */
+struct ratelimit_tree_conn {
+	td_rlb_conn_t            *conn;
+	struct list_head          entry;
+};
+
+struct ratelimit_tree {
+	td_rlb_pool_t             root;
+	struct list_head          pools;
+	unsigned long long        pass;
+	struct timeval            timeo;
+};
+
+#define rlb_tree_for_each_pool(_p, _t)				\
+	list_for_each_entry(_p, &(_t)->pools, entry)
+
+static td_rlb_pool_t *
+rlb_tree_pool(td_rlb_tree_t *t, td_rlb_conn_t *conn)
+{
+	return conn->pool ? conn->pool : &t->root;
+}
+
+static int
+rlb_pool_limited(td_rlb_pool_t *p)
+{
+	return p->b.rate > 0;
+}
+
+static int
+rlb_pool_open(td_rlb_pool_t *p)
+{
+	return !rlb_pool_limited(p) || p->b.cred >= 0;
+}
+
+static td_rlb_pool_t *
+rlb_tree_find(td_rlb_tree_t *t, const char *name)
+{
+	td_rlb_pool_t *p;
+
+	rlb_tree_for_each_pool(p, t)
+		if (p->name && !strcmp(p->name, name))
+			return p;
+
+	return NULL;
+}
+
+static void
+rlb_tree_refill(td_rlb_tree_t *t)
+{
+	uint64_t now = td_rlb_now_ns();
+	td_rlb_pool_t *p;
+
+	rlb_tree_for_each_pool(p, t)
+		if (rlb_pool_limited(p))
+			td_rlb_bucket_refill(&p->b, now);
+}
+
+/* sort waiting connections into their pools */
+static int
+rlb_tree_queue(td_rlb_t *rlb, td_rlb_tree_t *t)
+{
+	td_rlb_conn_t *conn, *next;
+	td_rlb_pool_t *p, *q;
+
+	rlb_tree_for_each_pool(p, t) {
+		INIT_LIST_HEAD(&p->wait);
+		p->n_wait = 0;
+	}
+
+	rlb_for_each_waiting_safe(conn, next, rlb) {
+		struct ratelimit_tree_conn *tc = conn->data;
+
+		if (unlikely(!tc)) {
+			tc = calloc(1, sizeof(*tc));
+			if (!tc) {
+				WARN("out of memory, closing connection %d",
+				     rlb_conn_id(rlb, conn));
+				rlb_conn_close(rlb, conn);
+				continue;
+			}
+			tc->conn   = conn;
+			conn->data = tc;
+		}
+
+		p = rlb_tree_pool(t, conn);
+		list_add_tail(&tc->entry, &p->wait);
+
+		for (q = p; q; q = q->parent)
+			q->n_wait++;
+	}
+
+	/* back from idle, without credit for the time away */
+
+	rlb_tree_for_each_pool(p, t) {
+		if (p->n_wait && !p->active && p->parent)
+			p->vtime = MAX(p->vtime, p->parent->vclock);
+		p->active = !!p->n_wait;
+
+		if (!list_empty(&p->wait) && !p->own_active)
+			p->vown = MAX(p->vown, p->vclock);
+		p->own_active = !list_empty(&p->wait);
+	}
+
+	return t->root.n_wait;
+}
+
+/* next in line under @p, NULL if blocked */
+static td_rlb_conn_t *
+rlb_tree_select(td_rlb_tree_t *t, td_rlb_pool_t *p, td_rlb_pool_t **_pool)
+{
+	td_rlb_pool_t *c, *best;
+	td_rlb_conn_t *conn;
+
+	if (!rlb_pool_open(p))
+		return NULL;
+
+	do {
+		best = NULL;
+
+		list_for_each_entry(c, &p->children, sibling)
+			if (c->n_wait && c->pass != t->pass &&
+			    (!best || c->vtime < best->vtime))
+				best = c;
+
+		if (!list_empty(&p->wait) && (!best || p->vown <= best->vtime)) {
+			*_pool = p;
+			return list_entry(p->wait.next,
+					  struct ratelimit_tree_conn, entry)->conn;
+		}
+
+		if (!best)
+			return NULL;
+
+		conn = rlb_tree_select(t, best, _pool);
+		if (conn)
+			return conn;
+
+		/* stays blocked until the next refill */
+		best->pass = t->pass;
+	} while (1);
+}
+
+static void
+rlb_tree_charge(td_rlb_tree_t *t, td_rlb_pool_t *p, td_rlb_conn_t *conn)
+{
+	struct ratelimit_tree_conn *tc = conn->data;
+	unsigned long need = conn->need;
+	td_rlb_pool_t *q;
+
+	list_del_init(&tc->entry);
+
+	p->vclock = MAX(p->vclock, p->vown);
+	p->vown  += need * RLB_POOL_VSCALE;
+	p->own_active = !list_empty(&p->wait);
+
+	for (q = p; q; q = q->parent) {
+		if (rlb_pool_limited(q))
+			q->b.cred -= need;
+
+		q->granted += need;
+		q->n_wait--;
+
+		if (q->parent) {
+			q->parent->vclock = MAX(q->parent->vclock, q->vtime);
+			q->vtime += need * RLB_POOL_VSCALE / q->weight;
+		}
+	}
+}
+
+static void
+rlb_tree_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_tree_t *t = data;
+	td_rlb_conn_t *conn;
+	td_rlb_pool_t *p;
+
+	rlb_tree_refill(t);
+
+	if (!rlb_tree_queue(rlb, t))
+		return;
+
+	t->pass++;
+
+	while ((conn = rlb_tree_select(t, &t->root, &p))) {
+		rlb_tree_charge(t, p, conn);
+		rlb_conn_respond(rlb, conn, conn->need);
+	}
+}
+
+static long long
+rlb_pool_usec(td_rlb_pool_t *p)
+{
+	long long us;
+
+	us  = -p->b.cred;
+	us *= 1000000;
+	us += p->b.rate - 1;
+	us /= p->b.rate;
+
+	return MAX(us, 1);
+}
+
+static void
+rlb_tree_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_tree_t *t = data;
+	struct timeval *tv = &t->timeo;
+	td_rlb_pool_t *p;
+	long long us;
+
+	if (list_empty(&rlb->wait)) {
+		*_tv = NULL;
+		return;
+	}
+
+	/* until the first of those holding anyone up refills */
+
+	us = LLONG_MAX;
+
+	rlb_tree_for_each_pool(p, t)
+		if (p->n_wait && !rlb_pool_open(p))
+			us = MIN(us, rlb_pool_usec(p));
+
+	if (us == LLONG_MAX) {
+		*_tv = NULL;
+		return;
+	}
+
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+
+	*_tv = tv;
+}
+
+static void
+rlb_tree_reset(td_rlb_t *rlb, void *data)
+{
+	td_rlb_tree_t *t = data;
+	uint64_t now = td_rlb_now_ns();
+	td_rlb_pool_t *p;
+
+	rlb_tree_for_each_pool(p, t) {
+		p->b.cred = p->b.cap;
+		p->b.ts   = now;
+	}
+}
+
+static void
+rlb_tree_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_tree_t *t = data;
+	td_rlb_pool_t *p, *next;
+
+	if (!t)
+		return;
+
+	list_for_each_entry_safe(p, next, &t->pools, entry) {
+		if (p == &t->root)
+			continue;
+
+		rlb_listener_close(rlb, &p->lsn);
+		free(p->name);
+		free(p);
+	}
+
+	free(t);
+}
+
+static void
+rlb_pool_init(td_rlb_tree_t *t, td_rlb_pool_t *p, td_rlb_pool_t *parent)
+{
+	INIT_LIST_HEAD(&p->children);
+	INIT_LIST_HEAD(&p->sibling);
+	INIT_LIST_HEAD(&p->wait);
+	INIT_LIST_HEAD(&p->lsn.entry);
+	p->lsn.efd.fd = -1;
+	p->weight     = 1;
+
+	p->parent = parent;
+	if (parent) {
+		p->depth = parent->depth + 1;
+		list_add_tail(&p->sibling, &parent->children);
+	}
+
+	list_add_tail(&p->entry, &t->pools);
+}
+
+/* <name>[,parent=<name>][,rate=..][,cap=..][,weight=..][,socket=..] */
+static int
+rlb_tree_parse_pool(td_rlb_t *rlb, td_rlb_tree_t *t, char *arg)
+{
+	enum { PARENT, RATE, CAP, WEIGHT, SOCKET };
+	char *const tokens[] = {
+		[PARENT] = "parent",
+		[RATE]   = "rate",
+		[CAP]    = "cap",
+		[WEIGHT] = "weight",
+		[SOCKET] = "socket",
+		NULL
+	};
+	td_rlb_pool_t *p, *parent;
+	char *name, *value, *sock;
+	long rate, cap, weight;
+	int err;
+
+	name = strsep(&arg, ",");
+	if (!name || !*name) {
+		ERR("pool name required");
+		return -EINVAL;
+	}
+
+	if (rlb_tree_find(t, name)) {
+		ERR("pool %s already defined", name);
+		return -EINVAL;
+	}
+
+	parent = &t->root;
+	sock   = name;
+	rate   = 0;
+	cap    = 0;
+	weight = 1;
+
+	while (arg && *arg) {
+		switch (getsubopt(&arg, tokens, &value)) {
+		case PARENT:
+			parent = value ? rlb_tree_find(t, value) : NULL;
+			if (!parent) {
+				ERR("pool %s: parent must be defined first",
+				    name);
+				return -EINVAL;
+			}
+			break;
+
+		case RATE:
+			rate = value ? rlb_strtol(value) : -EINVAL;
+			if (rate < 0) {
+				ERR("pool %s: invalid rate", name);
+				return -EINVAL;
+			}
+			break;
+
+		case CAP:
+			cap = value ? rlb_strtol(value) : -EINVAL;
+			if (cap < 0) {
+				ERR("pool %s: invalid cap", name);
+				return -EINVAL;
+			}
+			break;
 
-		lo  = m->total;
-		lo *= m->limit_lo;
-		lo /= 100;
+		case WEIGHT:
+			weight = value ? strtol(value, NULL, 0) : 0;
+			if (weight < 1 || weight > RLB_POOL_WEIGHT_MAX) {
+				ERR("pool %s: weight must be 1..%d",
+				    name, RLB_POOL_WEIGHT_MAX);
+				return -EINVAL;
+			}
+			break;
 
-		if (cred >= lo)
-			return 0;
+		case SOCKET:
+			if (!value || !*value) {
+				ERR("pool %s: invalid socket", name);
+				return -EINVAL;
+			}
+			sock = value;
+			break;
 
-	} else
-		if (cred <= 0) {
-			m->valve.ops->reset(rlb, m->valve.data);
-			return 1;
+		default:
+			ERR("pool %s: unknown option %s", name, value);
+			return -EINVAL;
 		}
+	}
 
-	return m->congested;
-}
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -ENOMEM;
 
-static void
-rlb_meminfo_dispatch_low(td_rlb_t *rlb, td_rlb_meminfo_t *m,
-			 long long *_cred)
-{
-	td_rlb_conn_t *conn, *next;
-	long long cred = *_cred, grant;
+	p->name = strdup(name);
+	if (!p->name) {
+		free(p);
+		return -ENOMEM;
+	}
 
-	rlb_for_each_waiting_safe(conn, next, rlb) {
+	rlb_pool_init(t, p, parent);
 
-		if (cred <= 0)
-			break;
+	p->weight = weight;
+	p->b.rate = rate;
+	p->b.cap  = cap;
 
-		grant = MIN(cred, conn->need);
+	err = rlb_listener_open(rlb, &p->lsn, sock, p);
+	if (err)
+		return err;
 
-		rlb_conn_respond(rlb, conn, grant);
+	return 0;
+}
 
-		cred -= grant;
+static int
+rlb_tree_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_tree_t *t;
+	int err;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		err = -ENOMEM;
+		goto fail;
 	}
 
-	*_cred = cred;
-}
+	INIT_LIST_HEAD(&t->pools);
+	rlb_pool_init(t, &t->root, NULL);
 
-static void
-rlb_meminfo_dispatch(td_rlb_t *rlb, void *data)
-{
-	td_rlb_meminfo_t *m = data;
-	long long us, hi, cred, dirty, pend;
+	do {
+		const struct option longopts[] = {
+			{ "rate",        1, NULL, 'r' },
+			{ "cap",         1, NULL, 'c' },
+			{ "pool",        1, NULL, 'p' },
+			{ NULL,          0, NULL,  0  }
+		};
+		long val;
+		int c;
 
-	/* we run only once per m->period */
+		c = getopt_long(argc, argv, "r:c:p:", longopts, NULL);
+		if (c < 0)
+			break;
 
-	us = rlb_usec_since(rlb, &m->ts);
-	if (us / 1000 > m->period) {
-		rlb_meminfo_scan(m);
-		m->ts = rlb->now;
-	}
+		switch (c) {
+		case 'r':
+			val = rlb_strtol(optarg);
+			if (val < 0) {
+				ERR("invalid --rate");
+				goto usage;
+			}
+			t->root.b.rate = val;
+			break;
 
-	/* uncongested credit:
-	   memory below hi watermark minus pending I/O */
+		case 'c':
+			val = rlb_strtol(optarg);
+			if (val < 0) {
+				ERR("invalid --cap");
+				goto usage;
+			}
+			t->root.b.cap = val;
+			break;
 
-	hi  = m->total;
-	hi *= m->limit_hi;
-	hi /= 100;
+		case 'p':
+			err = rlb_tree_parse_pool(rlb, t, optarg);
+			if (err) {
+				if (err == -EINVAL)
+					goto usage;
+				goto fail;
+			}
+			break;
 
-	dirty = m->dirty + m->writeback;
+		case '?':
+			goto usage;
 
-	cred  = hi - dirty;
-	cred *= 1000;
+		default:
+			BUG();
+		}
+	} while (1);
 
-	pend  = rlb_pending(rlb);
-	cred -= pend;
+	rlb_tree_reset(rlb, t);
 
-	m->congested = rlb_meminfo_test_high(rlb, m, cred);
+	*data = t;
 
-	DBG(3, "dirty=%lld (%lld) pend=%llu cred=%lld %s",
-	    dirty, dirty * 100 / m->total, pend, cred,
-	    m->congested ? "congested" : "");
+	return 0;
 
-	if (!m->congested) {
-		rlb_meminfo_dispatch_low(rlb, m, &cred);
+fail:
+	rlb_tree_destroy(rlb, t);
+	return err;
 
-		m->congested = rlb_meminfo_test_high(rlb, m, cred);
-	}
+usage:
+	err = -EINVAL;
+	goto fail;
+}
 
-	if (m->congested)
-		m->valve.ops->dispatch(rlb, m->valve.data);
+static void
+rlb_tree_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=tree --"
+		" [{-r|--rate}=<rate [KMG]>] [{-c|--cap}=<size [KMG]>]"
+		" [{-p|--pool}=<name>[,parent=<name>][,weight=<n>]"
+		"[,rate=<rate [KMG]>][,cap=<size [KMG]>][,socket=<name>]]...");
 }
 
-static struct ratelimit_ops rlb_meminfo_ops = {
-	.usage    = rlb_meminfo_usage,
-	.create   = rlb_meminfo_create,
-	.destroy  = rlb_meminfo_destroy,
-	.info     = rlb_meminfo_info,
+static void
+rlb_tree_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_tree_t *t = data;
+	td_rlb_pool_t *p;
+
+	rlb_tree_refill(t);
+
+	rlb_tree_for_each_pool(p, t) {
+		const char *name = p->name ? p->name : rlb->name;
+
+		if (rlb_pool_limited(p))
+			INFO("TREE: %*s%s: weight %u rate: %lld B/s"
+			     " cap: %lld B cred: %lld B, %llu B granted",
+			     2 * p->depth, "", name, p->weight,
+			     (long long)p->b.rate, (long long)p->b.cap,
+			     (long long)p->b.cred, p->granted);
+		else
+			INFO("TREE: %*s%s: weight %u unlimited,"
+			     " %llu B granted",
+			     2 * p->depth, "", name, p->weight, p->granted);
+	}
+}
 
-	.settimeo = rlb_meminfo_settimeo,
-	.timeout  = rlb_meminfo_timeout,
-	.dispatch = rlb_meminfo_dispatch,
+static struct ratelimit_ops rlb_tree_ops = {
+	.usage    = rlb_tree_usage,
+	.create   = rlb_tree_create,
+	.destroy  = rlb_tree_destroy,
+	.info     = rlb_tree_info,
+
+	.settimeo = rlb_tree_settimeo,
+	.timeout  = rlb_tree_dispatch,
+	.dispatch = rlb_tree_dispatch,
+	.reset    = rlb_tree_reset,
 };
 
 /*
@@ -1319,48 +3063,33 @@ rlb_info(td_rlb_t *rlb)
 	rlb_conn_infos(rlb);
 }
 
-static sigset_t rlb_sigunblock;
+static sigset_t rlb_sigmask;
 static sigset_t rlb_sigpending;
 
-static void
-rlb_sigmark(int signo)
-{
-	INFO("Caught SIG%d", signo);
-	sigaddset(&rlb_sigpending, signo);
-}
-
+/* signals are blocked, and read from rlb->sfd instead */
 static int
 rlb_siginit(void)
 {
 	struct sigaction sa_ignore  = { .sa_handler = SIG_IGN };
-	struct sigaction sa_pending = { .sa_handler = rlb_sigmark };
-	sigset_t sigmask;
-	int err = 0;
-
-	if (!err)
-		err = sigaction(SIGPIPE, &sa_ignore, NULL);
-	if (!err)
-		err = sigaction(SIGINT,  &sa_pending, NULL);
-	if (!err)
-		err = sigaction(SIGTERM, &sa_pending, NULL);
-	if (!err)
-		err = sigaction(SIGUSR1, &sa_pending, NULL);
+	int err;
+
+	err = sigaction(SIGPIPE, &sa_ignore, NULL);
 	if (err) {
 		err = -errno;
 		goto fail;
 	}
 
-	err = sigemptyset(&sigmask);
+	err = sigemptyset(&rlb_sigmask);
 	if (err == -1) { 
 		err = -errno;
 		goto fail;
 	}
 
-	sigaddset(&sigmask, SIGINT);
-	sigaddset(&sigmask, SIGTERM);
-	sigaddset(&sigmask, SIGUSR1);
+	sigaddset(&rlb_sigmask, SIGINT);
+	sigaddset(&rlb_sigmask, SIGTERM);
+	sigaddset(&rlb_sigmask, SIGUSR1);
 
-	err = sigprocmask(SIG_BLOCK, &sigmask, &rlb_sigunblock);
+	err = sigprocmask(SIG_BLOCK, &rlb_sigmask, NULL);
 	if (err) {
 		err = -errno;
 		goto fail;
@@ -1370,11 +3099,28 @@ fail:
 	return err;
 }
 
+static int
+rlb_sigread(td_rlb_t *rlb)
+{
+	struct signalfd_siginfo si;
+	int n = 0;
+
+	while (read(rlb->sfd.fd, &si, sizeof(si)) == sizeof(si)) {
+		INFO("Caught SIG%d", si.ssi_signo);
+		sigaddset(&rlb_sigpending, si.ssi_signo);
+		n++;
+	}
+
+	return n;
+}
+
 static int
 rlb_main_signaled(td_rlb_t *rlb)
 {
-	if (sigismember(&rlb_sigpending, SIGUSR1))
+	if (sigismember(&rlb_sigpending, SIGUSR1)) {
+		sigdelset(&rlb_sigpending, SIGUSR1);
 		rlb_info(rlb);
+	}
 
 	if (sigismember(&rlb_sigpending, SIGINT) ||
 	    sigismember(&rlb_sigpending, SIGTERM))
@@ -1383,6 +3129,60 @@ rlb_main_signaled(td_rlb_t *rlb)
 	return 0;
 }
 
+/* the valve's timeout, relative. NULL disarms. */
+static void
+rlb_timer_set(td_rlb_t *rlb, const struct timeval *tv)
+{
+	struct itimerspec its;
+	int err;
+
+	memset(&its, 0, sizeof(its));
+
+	if (tv) {
+		TIMEVAL_TO_TIMESPEC(tv, &its.it_value);
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+
+	err = timerfd_settime(rlb->tfd.fd, 0, &its, NULL);
+	if (err)
+		PERROR("timerfd_settime");
+}
+
+static int
+rlb_timer_read(td_rlb_t *rlb)
+{
+	uint64_t exp;
+	ssize_t n;
+
+	n = read(rlb->tfd.fd, &exp, sizeof(exp));
+
+	return n == sizeof(exp) && exp;
+}
+
+static void
+rlb_stdin_open(td_rlb_t *rlb)
+{
+	int err;
+
+	rlb->ifd.fd = STDIN_FILENO;
+
+	/* not pollable if redirected from a regular file */
+	err = epoll_ctl(rlb->epfd, EPOLL_CTL_ADD, rlb->ifd.fd,
+			&(struct epoll_event) { .events = EPOLLIN,
+						.data.ptr = &rlb->ifd });
+	if (err)
+		rlb->ifd.fd = -1;
+}
+
+static void
+rlb_stdin_close(td_rlb_t *rlb)
+{
+	if (rlb->ifd.fd >= 0) {
+		rlb_epoll_del(rlb, &rlb->ifd);
+		rlb->ifd.fd = -1;
+	}
+}
 
 static struct ratelimit_ops *
 rlb_find_valve(const char *name)
@@ -1400,12 +3200,24 @@ rlb_find_valve(const char *name)
 	case 't':
 		if (!strcmp(name, "token"))
 			ops = &rlb_token_ops;
+		else if (!strcmp(name, "tree"))
+			ops = &rlb_tree_ops;
 		break;
 
 	case 'm':
 		if (!strcmp(name, "meminfo"))
 			ops = &rlb_meminfo_ops;
 		break;
+
+	case 'd':
+		if (!strcmp(name, "dual"))
+			ops = &rlb_dual_ops;
+		break;
+
+	case 'l':
+		if (!strcmp(name, "latency"))
+			ops = &rlb_latency_ops;
+		break;
 	}
 
 	return ops;
@@ -1414,81 +3226,75 @@ rlb_find_valve(const char *name)
 static int
 rlb_main_iterate(td_rlb_t *rlb)
 {
-	td_rlb_conn_t *conn, *next;
+	struct epoll_event ev[RLB_EVENTS_MAX];
 	struct timeval *tv;
-	struct timespec _ts, *ts = &_ts;
-	int nfds, err;
-	fd_set rfds;
-
-	FD_ZERO(&rfds);
-	nfds = 0;
-
-	if (stdin) {
-		FD_SET(STDIN_FILENO, &rfds);
-		nfds = MAX(nfds, STDIN_FILENO);
-	}
+	int i, n, err, timeout, dispatch, signaled;
 
-	if (rlb->sock >= 0) {
-		FD_SET(rlb->sock, &rfds);
-		nfds = MAX(nfds, rlb->sock);
-	}
-
-	rlb_for_each_conn(conn, rlb) {
-		FD_SET(conn->sock, &rfds);
-		nfds = MAX(nfds, conn->sock);
-	}
+	rlb_shm_update(rlb);
 
 	rlb->valve.ops->settimeo(rlb, &tv, rlb->valve.data);
-	if (tv) {
-		TIMEVAL_TO_TIMESPEC(tv, ts);
-	} else
-		ts = NULL;
+	rlb_timer_set(rlb, tv);
 
-	rlb->ts = rlb->now;
-
-	nfds = pselect(nfds + 1, &rfds, NULL, NULL, ts, &rlb_sigunblock);
-	if (nfds < 0) {
+	n = epoll_wait(rlb->epfd, ev, ARRAY_SIZE(ev), -1);
+	if (n < 0) {
 		err = -errno;
 		if (err != -EINTR)
-			PERROR("select");
+			PERROR("epoll_wait");
 		goto fail;
 	}
 
 	gettimeofday(&rlb->now, NULL);
 
-	if (!nfds) {
-		BUG_ON(!ts);
-		rlb->valve.ops->timeout(rlb, rlb->valve.data);
-	}
+	timeout = dispatch = signaled = 0;
 
-	if (nfds) {
-		rlb_for_each_conn_safe(conn, next, rlb)
-			if (FD_ISSET(conn->sock, &rfds)) {
-				rlb_conn_receive(rlb, conn);
-				if (!--nfds)
-					break;
-			}
+	for (i = 0; i < n; i++) {
+		struct rlb_fd *efd = ev[i].data.ptr;
+		td_rlb_conn_t *conn;
 
-		rlb->valve.ops->dispatch(rlb, rlb->valve.data);
-	}
+		switch (efd->type) {
+		case RLB_FD_CONN:
+			conn = container_of(efd, td_rlb_conn_t, efd);
+			/* closed earlier on */
+			if (efd->fd < 0)
+				break;
+			rlb_conn_receive(rlb, conn);
+			dispatch = 1;
+			break;
+
+		case RLB_FD_LISTEN:
+			rlb_accept_conn(rlb,
+					container_of(efd, td_rlb_listener_t,
+						     efd));
+			break;
+
+		case RLB_FD_TIMER:
+			timeout |= rlb_timer_read(rlb);
+			break;
+
+		case RLB_FD_SIGNAL:
+			signaled |= rlb_sigread(rlb);
+			break;
 
-	if (unlikely(nfds)) {
-		if (FD_ISSET(STDIN_FILENO, &rfds)) {
-			getc(stdin);
+		case RLB_FD_STDIN:
+			if (getc(stdin) == EOF)
+				rlb_stdin_close(rlb);
 			rlb_info(rlb);
-			nfds--;
-		}
-	}
+			break;
 
-	if (unlikely(nfds)) {
-		if (FD_ISSET(rlb->sock, &rfds)) {
-			rlb_accept_conn(rlb);
-			nfds--;
+		default:
+			BUG();
 		}
 	}
 
-	BUG_ON(nfds);
-	err = 0;
+	if (timeout)
+		rlb->valve.ops->timeout(rlb, rlb->valve.data);
+
+	if (dispatch)
+		rlb->valve.ops->dispatch(rlb, rlb->valve.data);
+
+	rlb_conn_reap(rlb);
+
+	err = signaled ? -EINTR : 0;
 fail:
 	return err;
 }
@@ -1511,7 +3317,7 @@ rlb_main_run(td_rlb_t *rlb)
 			}
 		}
 
-	} while (rlb->sock >= 0 || !list_empty(&rlb->open));
+	} while (rlb->lsn.efd.fd >= 0 || !list_empty(&rlb->open));
 
 	return err;
 }
@@ -1519,12 +3325,33 @@ rlb_main_run(td_rlb_t *rlb)
 static void
 rlb_shutdown(td_rlb_t *rlb)
 {
+	td_rlb_listener_t *lsn, *next_lsn;
 	td_rlb_conn_t *conn, *next;
 
 	rlb_for_each_conn_safe(conn, next, rlb)
 		rlb_conn_close(rlb, conn);
 
-	rlb_sock_close(rlb);
+	rlb_conn_reap(rlb);
+
+	list_for_each_entry_safe(lsn, next_lsn, &rlb->listeners, entry)
+		rlb_listener_close(rlb, lsn);
+
+	rlb_stdin_close(rlb);
+
+	if (rlb->tfd.fd >= 0) {
+		close(rlb->tfd.fd);
+		rlb->tfd.fd = -1;
+	}
+
+	if (rlb->sfd.fd >= 0) {
+		close(rlb->sfd.fd);
+		rlb->sfd.fd = -1;
+	}
+
+	if (rlb->epfd >= 0) {
+		close(rlb->epfd);
+		rlb->epfd = -1;
+	}
 }
 
 static void
@@ -1536,7 +3363,7 @@ rlb_usage(td_rlb_t *rlb, const char *prog, FILE *stream)
 		rlb->valve.ops->usage(rlb, stream, rlb->valve.data);
 	else
 		fprintf(stream,
-			" {-t|--type}={token|meminfo}"
+			" {-t|--type}={token|meminfo|dual|latency|tree}"
 			" [-h|--help] [-D|--debug=<n>]");
 
 	fprintf(stream, "\n");
@@ -1558,18 +3385,52 @@ rlb_destroy(td_rlb_t *rlb)
 	}
 }
 
+/* one descriptor per connection, plus a few */
+static void
+rlb_setrlimit(void)
+{
+	const rlim_t want = RLB_CONN_MAX + 64;
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return;
+
+	if (rl.rlim_cur >= want)
+		return;
+
+	if (rl.rlim_max < want) {
+		struct rlimit _rl = { want, want };
+
+		if (!setrlimit(RLIMIT_NOFILE, &_rl))
+			return;
+	}
+
+	rl.rlim_cur = MIN(want, rl.rlim_max);
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		PERROR("setrlimit");
+	else if (rl.rlim_cur < want)
+		INFO("Open files limited to %lu", (unsigned long)rl.rlim_cur);
+}
+
 static int
 rlb_create(td_rlb_t *rlb, const char *name)
 {
-	int i, err;
+	int err;
 
 	memset(rlb, 0, sizeof(*rlb));
 	INIT_LIST_HEAD(&rlb->open);
 	INIT_LIST_HEAD(&rlb->wait);
-	rlb->sock = -1;
-
-	for (i = RLB_CONN_MAX - 1; i >= 0; i--)
-		rlb_conn_free(rlb, &rlb->connv[i]);
+	INIT_LIST_HEAD(&rlb->dead);
+	INIT_LIST_HEAD(&rlb->listeners);
+	INIT_LIST_HEAD(&rlb->lsn.entry);
+	rlb->lsn.efd.fd = -1;
+	rlb->epfd       = -1;
+	rlb->sfd.type   = RLB_FD_SIGNAL;
+	rlb->sfd.fd     = -1;
+	rlb->tfd.type   = RLB_FD_TIMER;
+	rlb->tfd.fd     = -1;
+	rlb->ifd.type   = RLB_FD_STDIN;
+	rlb->ifd.fd     = -1;
 
 	rlb->name = strdup(name);
 	if (!rlb->name) {
@@ -1577,7 +3438,39 @@ rlb_create(td_rlb_t *rlb, const char *name)
 		goto fail;
 	}
 
-	err = rlb_sock_open(rlb);
+	rlb_setrlimit();
+
+	rlb->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (rlb->epfd < 0) {
+		PERROR("epoll_create1");
+		err = -errno;
+		goto fail;
+	}
+
+	rlb->sfd.fd = signalfd(-1, &rlb_sigmask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (rlb->sfd.fd < 0) {
+		PERROR("signalfd");
+		err = -errno;
+		goto fail;
+	}
+
+	err = rlb_epoll_add(rlb, &rlb->sfd);
+	if (err)
+		goto fail;
+
+	rlb->tfd.fd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK|TFD_CLOEXEC);
+	if (rlb->tfd.fd < 0) {
+		PERROR("timerfd_create");
+		err = -errno;
+		goto fail;
+	}
+
+	err = rlb_epoll_add(rlb, &rlb->tfd);
+	if (err)
+		goto fail;
+
+	err = rlb_listener_open(rlb, &rlb->lsn, name, NULL);
 	if (err)
 		goto fail;
 
@@ -1705,6 +3598,8 @@ main(int argc, char **argv)
 		goto fail;
 	}
 
+	rlb_shm_publish(rlb);
+
 	if (!debug) {
 		err = daemon(0, 0);
 		if (err)
@@ -1714,7 +3609,10 @@ main(int argc, char **argv)
 		rlb_openlog(prog, LOG_DAEMON);
 	}
 
-	INFO("TD ratelimit bridge: %s, pid %d", rlb->path, getpid());
+	if (stdin)
+		rlb_stdin_open(rlb);
+
+	INFO("TD ratelimit bridge: %s, pid %d", rlb->lsn.path, getpid());
 
 	rlb_info(rlb);
 
@@ -141,6 +141,29 @@ struct vhd_batmap {
 	char                      *map;
 };
 
+/*
+ * BAT journal: a sidecar file next to the image holding one sector per
+ * BAT update, kept by tapdisk. Sector 0 is a header naming the image
+ * and the current generation; records for that generation follow in
+ * order. The BAT in the image is only brought up to date at
+ * checkpoints, after which the generation is bumped, invalidating all
+ * records. vhd_open folds a leftover journal into writable images, and
+ * vhd_read_bat applies it to read-only ones.
+ */
+#define VHD_BATLOG_SUFFIX          ".batlog"
+#define VHD_BATLOG_COOKIE          "tdbatlog"
+#define VHD_BATLOG_RECORDS         2048
+
+struct vhd_batlog_sector {
+	char                       cookie[8];
+	uuid_t                     uuid;
+	uint64_t                   gen;
+	uint64_t                   seq;         /* 0 for the header */
+	uint32_t                   blk;
+	uint32_t                   offset;
+	uint32_t                   checksum;
+} __attribute__((packed));
+
 struct crypto_blkcipher;
 
 struct vhd_context {
@@ -360,6 +383,9 @@ int vhd_read_footer_strict(vhd_context_t *, vhd_footer_t *);
 int vhd_read_header(vhd_context_t *, vhd_header_t *);
 int vhd_read_header_at(vhd_context_t *, vhd_header_t *, off64_t);
 int vhd_read_bat(vhd_context_t *, vhd_bat_t *);
+int vhd_batlog_apply(vhd_context_t *, vhd_bat_t *);
+uint32_t vhd_batlog_checksum(struct vhd_batlog_sector *);
+int vhd_read_batmap_header(vhd_context_t *, vhd_batmap_t *);
 int vhd_read_batmap(vhd_context_t *, vhd_batmap_t *);
 int vhd_read_bitmap(vhd_context_t *, uint32_t block, char **bufp);
 int vhd_read_at(vhd_context_t *ctx, uint64_t block, uint32_t from, size_t size, char *buf);
@@ -111,7 +111,8 @@ int tap_ctl_allocate(int *minor, char **devname);
 int tap_ctl_free(const int minor);
 
 int tap_ctl_create(const char *params, char **devname, int flags, 
-		   int prt_minor, char *secondary, int timeout, const char *logpath);
+		   int prt_minor, char *secondary, int timeout, int mirror_lag,
+		   const char *logpath);
 int tap_ctl_destroy(const int id, const int minor, int force,
 		    struct timeval *timeout);
 
@@ -123,7 +124,8 @@ int tap_ctl_detach(const int id, const int minor);
 
 int tap_ctl_open(const int id, const int minor, const char *params, int flags,
 		 const int prt_minor, const char *secondary, int timeout,
-		 const char *logpath, uint8_t key_size, uint8_t *encryption_key);
+		 int mirror_lag, const char *logpath, uint8_t key_size,
+		 uint8_t *encryption_key);
 int tap_ctl_close(const int id, const int minor, const int force,
 		  struct timeval *timeout);
 
@@ -136,7 +138,7 @@ int tap_ctl_pause(const int id, const int minor, struct timeval *timeout);
  * Unpauses the VBD
  */
 int tap_ctl_unpause(const int id, const int minor, const char *params,
-		int flags, char *secondary, const char *logpath);
+		int flags, char *secondary, int mirror_lag, const char *logpath);
 
 ssize_t tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size);
 int tap_ctl_stats_fwrite(pid_t pid, int minor, FILE *out);
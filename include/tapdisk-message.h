@@ -56,6 +56,11 @@
 #define TAPDISK_MESSAGE_FLAG_STANDBY     0x100
 #define TAPDISK_MESSAGE_FLAG_NO_O_DIRECT 0x200
 #define TAPDISK_MESSAGE_FLAG_OPEN_ENCRYPTED 0x400
+#define TAPDISK_MESSAGE_FLAG_ELIDE_ZEROS 0x800
+#define TAPDISK_MESSAGE_FLAG_BAT_LOG     0x1000
+#define TAPDISK_MESSAGE_FLAG_COR         0x2000
+#define TAPDISK_MESSAGE_FLAG_WRITEBACK   0x4000
+#define TAPDISK_MESSAGE_FLAG_MIRROR_ASYNC 0x8000
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint32_t                         tapdisk_message_flag_t;
@@ -76,6 +81,7 @@ struct tapdisk_message_params {
 	uint32_t                         prt_devnum;
 	uint16_t                         req_timeout;
 	char                             secondary[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+	uint16_t                         mirror_lag;    /* MiB, 0: default */
 };
 
 struct tapdisk_message_image {
@@ -42,7 +42,8 @@ int main(void)
 		cmocka_run_group_tests_name("Stats tests", tapdisk_stats_tests, NULL, NULL)+
 		cmocka_run_group_tests_name("nbd_server_tests", tapdisk_nbdserver_tests, NULL, NULL)+
 		cmocka_run_group_tests_name("VBD tests", tapdisk_vbd_tests, NULL, NULL)+
-		cmocka_run_group_tests_name("Scheduler tests", tapdisk_sched_tests, NULL, NULL);
+		cmocka_run_group_tests_name("Scheduler tests", tapdisk_sched_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("td-rated tests", td_rated_tests, NULL, NULL);
 
 	return result;
 }
@@ -50,17 +50,41 @@ void test_vbd_linked_list(void **state);
 void test_vbd_complete_td_request(void **state);
 void test_vbd_issue_request(void **stat);
 void test_vbd_complete_block_status_request(void **stat);
+void test_vbd_block_status_out_of_order(void **stat);
+void test_vbd_block_status_merge_contiguous(void **stat);
 
 static const struct CMUnitTest tapdisk_vbd_tests[] = {
 	cmocka_unit_test(test_vbd_linked_list),
 	cmocka_unit_test(test_vbd_issue_request),
-	cmocka_unit_test(test_vbd_complete_block_status_request)
+	cmocka_unit_test(test_vbd_complete_block_status_request),
+	cmocka_unit_test(test_vbd_block_status_out_of_order),
+	cmocka_unit_test(test_vbd_block_status_merge_contiguous)
 };
 
 void test_nbdserver_new_protocol_handshake(void **state);
 void test_nbdserver_new_protocol_handshake_send_fails(void **state);
+void test_nbdserver_negotiate_go_piecemeal(void **state);
+void test_nbdserver_negotiate_set_meta_context(void **state);
+void test_nbdserver_block_status_out_of_order(void **state);
+void test_nbdserver_block_status_gap(void **state);
+void test_nbdserver_block_status_req_one(void **state);
+void test_nbdserver_block_status_unknown(void **state);
+void test_nbdserver_block_status_max_extents(void **state);
+void test_nbdserver_pool_size_classes(void **state);
+void test_nbdserver_partial_send(void **state);
+void test_nbdserver_zerocopy_disconnect(void **state);
 static const struct CMUnitTest tapdisk_nbdserver_tests[] = {
-	cmocka_unit_test(test_nbdserver_new_protocol_handshake)
+	cmocka_unit_test(test_nbdserver_new_protocol_handshake),
+	cmocka_unit_test(test_nbdserver_negotiate_go_piecemeal),
+	cmocka_unit_test(test_nbdserver_negotiate_set_meta_context),
+	cmocka_unit_test(test_nbdserver_block_status_out_of_order),
+	cmocka_unit_test(test_nbdserver_block_status_gap),
+	cmocka_unit_test(test_nbdserver_block_status_req_one),
+	cmocka_unit_test(test_nbdserver_block_status_unknown),
+	cmocka_unit_test(test_nbdserver_block_status_max_extents),
+	cmocka_unit_test(test_nbdserver_pool_size_classes),
+	cmocka_unit_test(test_nbdserver_partial_send),
+	cmocka_unit_test(test_nbdserver_zerocopy_disconnect)
 };
 
 void test_scheduler_set_max_timeout(void **state);
@@ -177,4 +201,24 @@ static const struct CMUnitTest tapdisk_sched_tests[] = {
   cmocka_unit_test(test_scheduler_run_deleted_duplicate_event),
 };
 
+void test_td_rated_bucket_refill(void **state);
+void test_td_rated_bucket_refill_fraction(void **state);
+void test_td_rated_bucket_take(void **state);
+void test_td_rated_partial_grant(void **state);
+void test_td_rated_shm_token(void **state);
+void test_td_rated_epoll_loop(void **state);
+void test_td_rated_tree_weights(void **state);
+void test_td_rated_tree_nested(void **state);
+
+static const struct CMUnitTest td_rated_tests[] = {
+	cmocka_unit_test(test_td_rated_bucket_refill),
+	cmocka_unit_test(test_td_rated_bucket_refill_fraction),
+	cmocka_unit_test(test_td_rated_bucket_take),
+	cmocka_unit_test(test_td_rated_partial_grant),
+	cmocka_unit_test(test_td_rated_shm_token),
+	cmocka_unit_test(test_td_rated_epoll_loop),
+	cmocka_unit_test(test_td_rated_tree_weights),
+	cmocka_unit_test(test_td_rated_tree_nested)
+};
+
 #endif /* __TEST_SUITES_H__ */
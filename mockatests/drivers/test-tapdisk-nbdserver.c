@@ -33,37 +33,611 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
 
 #include "test-suites.h"
 #include "tapdisk.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-vbd.h"
 #include "tapdisk-protocol-new.h"
 
+/*
+ * A client negotiating over one end of a socket pair, the test playing
+ * the NBD client on the other.
+ */
+static td_nbdserver_client_t *
+setup_negotiation(td_nbdserver_t *server, int *fds)
+{
+	td_nbdserver_client_t *client;
+
+	memset(server, 0, sizeof(*server));
+	INIT_LIST_HEAD(&server->clients);
+	server->info.size = 2048;
+	server->info.sector_size = 512;
+
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+	client = tapdisk_nbdserver_alloc_client(server);
+	assert_non_null(client);
+
+	assert_int_equal(tapdisk_nbdserver_new_protocol_handshake(client, fds[0]), 0);
+
+	return client;
+}
+
+static void
+teardown_negotiation(td_nbdserver_client_t *client, int *fds)
+{
+	tapdisk_nbdserver_free_client(client);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/* Read exactly len bytes the server sent, which must be there already. */
+static void
+read_sent(int fd, void *buf, size_t len)
+{
+	assert_int_equal(recv(fd, buf, len, MSG_DONTWAIT), len);
+}
+
+static void
+assert_nothing_sent(int fd)
+{
+	char c;
+
+	assert_int_equal(recv(fd, &c, 1, MSG_DONTWAIT), -1);
+	assert_true(errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void
+read_option_reply(int fd, uint32_t option, uint32_t reply, uint32_t len)
+{
+	struct nbd_fixed_new_option_reply hdr;
+
+	read_sent(fd, &hdr, sizeof(hdr));
+	assert_int_equal(be64toh(hdr.magic), NBD_REP_MAGIC);
+	assert_int_equal(be32toh(hdr.option), option);
+	assert_int_equal(be32toh(hdr.reply), reply);
+	assert_int_equal(be32toh(hdr.replylen), len);
+}
+
+static void
+send_option_hdr(int fd, uint32_t option, uint32_t len)
+{
+	struct nbd_new_option opt;
+
+	opt.version = htobe64(NBD_OPT_MAGIC);
+	opt.option = htobe32(option);
+	opt.optlen = htobe32(len);
+	assert_int_equal(write(fd, &opt, sizeof(opt)), sizeof(opt));
+}
+
 void
 test_nbdserver_new_protocol_handshake(void **state)
 {
-	td_nbdserver_client_t client;
+	td_nbdserver_client_t *client;
 	td_nbdserver_t server;
-	int new_fd =123 ;
+	int fds[2];
 
 	uint16_t gflags = (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
-	struct nbd_new_handshake handshake;
+	struct nbd_new_handshake handshake, sent;
 	bzero(&handshake, sizeof(handshake));
 	handshake.nbdmagic = htobe64 (NBD_MAGIC);
 	handshake.version = htobe64 (NBD_OPT_MAGIC);
 	handshake.gflags = htobe16 (gflags);
 
-	/* Check input to send */
-	expect_memory(__wrap_send, buf, &handshake, sizeof(handshake));
-	expect_value(__wrap_send, fd, new_fd);
-	expect_value(__wrap_send, size, sizeof(handshake));
-	expect_value(__wrap_send, flags, 0);
-	will_return(__wrap_send, sizeof(handshake));
+	client = setup_negotiation(&server, fds);
+
+	/* queued, not sent */
+	assert_int_equal(client->tx_bytes, sizeof(handshake));
+	assert_nothing_sent(fds[1]);
+
+	tapdisk_nbdserver_clientcb(0, SCHEDULER_POLL_READ_FD, client);
+
+	assert_int_equal(client->tx_bytes, 0);
+	read_sent(fds[1], &sent, sizeof(sent));
+	assert_memory_equal(&sent, &handshake, sizeof(handshake));
+	assert_nothing_sent(fds[1]);
+
+	teardown_negotiation(client, fds);
+}
+
+void
+test_nbdserver_negotiate_go_piecemeal(void **state)
+{
+	struct nbd_fixed_new_option_reply_info_export export;
+	struct nbd_fixed_new_option_reply_info_block_size block_info;
+	struct nbd_new_handshake handshake;
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	char data[4 + 3 + 2];
+	uint32_t cflags, u32;
+	uint16_t u16;
+	int fds[2];
+
+	client = setup_negotiation(&server, fds);
+	tapdisk_nbdserver_clientcb(0, SCHEDULER_POLL_READ_FD, client);
+	read_sent(fds[1], &handshake, sizeof(handshake));
+
+	/* the client flags, a byte short: wait for the rest */
+	cflags = htobe32(NBD_FLAG_NO_ZEROES);
+	assert_int_equal(write(fds[1], &cflags, 3), 3);
+	tapdisk_nbdserver_clientcb(0, SCHEDULER_POLL_READ_FD, client);
+	assert_false(client->no_zeroes);
+	assert_int_equal(write(fds[1], (char *)&cflags + 3, 1), 1);
+	tapdisk_nbdserver_clientcb(0, SCHEDULER_POLL_READ_FD, client);
+	assert_true(client->no_zeroes);
+
+	/* NBD_OPT_GO, its data in two pieces */
+	u32 = htobe32(3);
+	memcpy(data, &u32, 4);
+	memcpy(data + 4, "foo", 3);
+	u16 = htobe16(0);
+	memcpy(data + 7, &u16, 2);
+
+	send_option_hdr(fds[1], NBD_OPT_GO, sizeof(data));
+	assert_int_equal(write(fds[1], data, 5), 5);
+	tapdisk_nbdserver_clientcb(0, SCHEDULER_POLL_READ_FD, client);
+	assert_nothing_sent(fds[1]);
+
+	assert_int_equal(write(fds[1], data + 5, sizeof(data) - 5),
+			 sizeof(data) - 5);
+	tapdisk_nbdserver_clientcb(0, SCHEDULER_POLL_READ_FD, client);
+
+	read_option_reply(fds[1], NBD_OPT_GO, NBD_REP_INFO, sizeof(export));
+	read_sent(fds[1], &export, sizeof(export));
+	assert_int_equal(be16toh(export.info), NBD_INFO_EXPORT);
+	assert_int_equal(be64toh(export.exportsize), 2048 * 512);
+
+	read_option_reply(fds[1], NBD_OPT_GO, NBD_REP_INFO, sizeof(block_info));
+	read_sent(fds[1], &block_info, sizeof(block_info));
+	assert_int_equal(be16toh(block_info.info), NBD_INFO_BLOCK_SIZE);
+
+	read_option_reply(fds[1], NBD_OPT_GO, NBD_REP_ACK, 0);
+	assert_nothing_sent(fds[1]);
+
+	/* all replies sent, their requests back */
+	assert_int_equal(tapdisk_nbdserver_reqs_pending(client), 0);
+
+	teardown_negotiation(client, fds);
+}
+
+void
+test_nbdserver_negotiate_set_meta_context(void **state)
+{
+	struct nbd_fixed_new_option_reply_meta_context context;
+	struct nbd_new_handshake handshake;
+	td_nbdserver_client_t *client;
+	td_nbdserver_t server;
+	char data[4 + 0 + 4 + 4 + 15];
+	char name[15];
+	uint32_t cflags, u32;
+	int fds[2];
+
+	client = setup_negotiation(&server, fds);
+
+	cflags = htobe32(0);
+	assert_int_equal(write(fds[1], &cflags, sizeof(cflags)), sizeof(cflags));
+
+	/* a query running past the end of the option is invalid */
+	u32 = htobe32(0);
+	memcpy(data, &u32, 4);
+	u32 = htobe32(1);
+	memcpy(data + 4, &u32, 4);
+	u32 = htobe32(16);
+	memcpy(data + 8, &u32, 4);
+	memcpy(data + 12, "base:allocation", 15);
+	send_option_hdr(fds[1], NBD_OPT_SET_META_CONTEXT, sizeof(data));
+	assert_int_equal(write(fds[1], data, sizeof(data)), sizeof(data));
+
+	u32 = htobe32(15);
+	memcpy(data + 8, &u32, 4);
+	send_option_hdr(fds[1], NBD_OPT_SET_META_CONTEXT, sizeof(data));
+	assert_int_equal(write(fds[1], data, sizeof(data)), sizeof(data));
+
+	tapdisk_nbdserver_clientcb(0, SCHEDULER_POLL_READ_FD, client);
+
+	read_sent(fds[1], &handshake, sizeof(handshake));
+	read_option_reply(fds[1], NBD_OPT_SET_META_CONTEXT,
+			  NBD_REP_ERR_INVALID, 0);
+	read_option_reply(fds[1], NBD_OPT_SET_META_CONTEXT,
+			  NBD_REP_META_CONTEXT, sizeof(context) + 15);
+	read_sent(fds[1], &context, sizeof(context));
+	assert_int_equal(be32toh(context.context_id), base_allocation_id);
+	read_sent(fds[1], name, sizeof(name));
+	assert_memory_equal(name, "base:allocation", 15);
+	read_option_reply(fds[1], NBD_OPT_SET_META_CONTEXT, NBD_REP_ACK, 0);
+	assert_nothing_sent(fds[1]);
+
+	teardown_negotiation(client, fds);
+}
+
+static void
+push_extent(tapdisk_extents_t *extents, td_sector_t sec, int secs, int flag)
+{
+	td_request_t treq;
+
+	bzero(&treq, sizeof(treq));
+	treq.sec = sec;
+	treq.secs = secs;
+	treq.status = flag;
+	assert_int_equal(add_extent(extents, &treq), 0);
+}
+
+static void
+assert_descriptor(struct nbd_block_descriptor *block, int secs, int flag)
+{
+	assert_int_equal(be32toh(block->length), secs << SECTOR_SHIFT);
+	assert_int_equal(be32toh(block->status_flags), flag);
+}
+
+void
+test_nbdserver_block_status_out_of_order(void **state)
+{
+	tapdisk_extents_t *extents = calloc(1, sizeof(*extents));
+	struct nbd_block_descriptor *blocks;
+	size_t count;
+
+	/* completion order, not disk order */
+	push_extent(extents, 16, 8, TD_BLOCK_STATE_HOLE);
+	push_extent(extents, 8, 8, TD_BLOCK_STATE_HOLE);
+	push_extent(extents, 0, 8, TD_BLOCK_STATE_NONE);
+	push_extent(extents, 24, 8, TD_BLOCK_STATE_NONE);
+
+	blocks = convert_extents_to_block_descriptors(extents, 0, 0, &count);
+	assert_non_null(blocks);
+	assert_int_equal(count, 3);
+	assert_descriptor(&blocks[0], 8, TD_BLOCK_STATE_NONE);
+	assert_descriptor(&blocks[1], 16, TD_BLOCK_STATE_HOLE);
+	assert_descriptor(&blocks[2], 8, TD_BLOCK_STATE_NONE);
+
+	free(blocks);
+	free_extents(extents);
+}
+
+void
+test_nbdserver_block_status_gap(void **state)
+{
+	tapdisk_extents_t *extents = calloc(1, sizeof(*extents));
+	struct nbd_block_descriptor *blocks;
+	size_t count;
+
+	/* the reply stops where the extents stop being contiguous */
+	push_extent(extents, 24, 8, TD_BLOCK_STATE_HOLE);
+	push_extent(extents, 64, 8, TD_BLOCK_STATE_NONE);
+	push_extent(extents, 16, 8, TD_BLOCK_STATE_NONE);
+
+	blocks = convert_extents_to_block_descriptors(extents, 16, 0, &count);
+	assert_non_null(blocks);
+	assert_int_equal(count, 2);
+	assert_descriptor(&blocks[0], 8, TD_BLOCK_STATE_NONE);
+	assert_descriptor(&blocks[1], 8, TD_BLOCK_STATE_HOLE);
+	free(blocks);
+
+	/* nor does it start past a gap */
+	blocks = convert_extents_to_block_descriptors(extents, 8, 0, &count);
+	assert_non_null(blocks);
+	assert_int_equal(count, 0);
+
+	free(blocks);
+	free_extents(extents);
+}
+
+void
+test_nbdserver_block_status_req_one(void **state)
+{
+	tapdisk_extents_t *extents = calloc(1, sizeof(*extents));
+	struct nbd_block_descriptor *blocks;
+	size_t count;
+
+	push_extent(extents, 8, 8, TD_BLOCK_STATE_NONE);
+	push_extent(extents, 0, 8, TD_BLOCK_STATE_NONE);
+	push_extent(extents, 16, 8, TD_BLOCK_STATE_HOLE);
+
+	/* one descriptor, still covering both extents of equal status */
+	blocks = convert_extents_to_block_descriptors(extents, 0,
+						      NBD_CMD_FLAG_REQ_ONE,
+						      &count);
+	assert_non_null(blocks);
+	assert_int_equal(count, 1);
+	assert_descriptor(&blocks[0], 16, TD_BLOCK_STATE_NONE);
+
+	free(blocks);
+	free_extents(extents);
+}
+
+void
+test_nbdserver_block_status_unknown(void **state)
+{
+	tapdisk_extents_t *extents = calloc(1, sizeof(*extents));
+	struct nbd_block_descriptor *blocks;
+	size_t count;
+
+	push_extent(extents, 8, 8, TD_BLOCK_STATE_UNKNOWN);
+	push_extent(extents, 0, 8, TD_BLOCK_STATE_HOLE);
+	push_extent(extents, 16, 8, TD_BLOCK_STATE_HOLE);
+
+	/* stops short of what was not looked up */
+	blocks = convert_extents_to_block_descriptors(extents, 0, 0, &count);
+	assert_non_null(blocks);
+	assert_int_equal(count, 1);
+	assert_descriptor(&blocks[0], 8, TD_BLOCK_STATE_HOLE);
+	free(blocks);
+	free_extents(extents);
+
+	/* but answers something, calling it data, if that is all there is */
+	extents = calloc(1, sizeof(*extents));
+	push_extent(extents, 16, 8, TD_BLOCK_STATE_HOLE);
+	push_extent(extents, 8, 8, TD_BLOCK_STATE_UNKNOWN);
+
+	blocks = convert_extents_to_block_descriptors(extents, 8, 0, &count);
+	assert_non_null(blocks);
+	assert_int_equal(count, 1);
+	assert_descriptor(&blocks[0], 8, TD_BLOCK_STATE_NONE);
+
+	free(blocks);
+	free_extents(extents);
+}
+
+void
+test_nbdserver_block_status_max_extents(void **state)
+{
+	tapdisk_extents_t *extents = calloc(1, sizeof(*extents));
+	struct nbd_block_descriptor *blocks;
+	size_t count;
+	int i, n = 16384 + 100;
+
+	/* alternating, so that none merge */
+	for (i = n - 1; i >= 0; i--)
+		push_extent(extents, i, 1,
+			    i & 1 ? TD_BLOCK_STATE_HOLE : TD_BLOCK_STATE_NONE);
+
+	blocks = convert_extents_to_block_descriptors(extents, 0, 0, &count);
+	assert_non_null(blocks);
+	assert_int_equal(count, 16384);
+	assert_descriptor(&blocks[0], 1, TD_BLOCK_STATE_NONE);
+	assert_descriptor(&blocks[16383], 1, TD_BLOCK_STATE_HOLE);
+
+	free(blocks);
+	free_extents(extents);
+}
+
+static void
+free_pool(td_nbdserver_t *server)
+{
+	void *buf;
+	int i;
+
+	for (i = 0; i < TAPDISK_NBDSERVER_POOL_CLASSES; i++)
+		while ((buf = server->pool[i])) {
+			server->pool[i] = *(void **)buf;
+			free(buf);
+		}
+	server->pool_bytes = 0;
+}
+
+void
+test_nbdserver_pool_size_classes(void **state)
+{
+	td_nbdserver_t server;
+	void *buf, *small, *bufs[17];
+	int i;
+
+	memset(&server, 0, sizeof(server));
+
+	/* rounded up to the 8K class, and handed out again from there */
+	buf = tapdisk_nbdserver_get_buf(&server, 5000);
+	assert_non_null(buf);
+	tapdisk_nbdserver_put_buf(&server, buf, 5000);
+	assert_int_equal(server.pool_bytes, 8192);
+
+	small = tapdisk_nbdserver_get_buf(&server, 4096);
+	assert_ptr_not_equal(small, buf);
+	assert_int_equal(server.pool_bytes, 8192);
+
+	assert_ptr_equal(tapdisk_nbdserver_get_buf(&server, 8192), buf);
+	assert_int_equal(server.pool_bytes, 0);
+
+	tapdisk_nbdserver_put_buf(&server, small, 4096);
+	tapdisk_nbdserver_put_buf(&server, buf, 8192);
+	assert_int_equal(server.pool_bytes, 4096 + 8192);
+	assert_ptr_equal(tapdisk_nbdserver_get_buf(&server, 1), small);
+	tapdisk_nbdserver_put_buf(&server, small, 1);
+
+	/* beyond the largest class: never pooled */
+	buf = tapdisk_nbdserver_get_buf(&server, (2 << 20) + 512);
+	assert_non_null(buf);
+	tapdisk_nbdserver_put_buf(&server, buf, (2 << 20) + 512);
+	assert_int_equal(server.pool_bytes, 4096 + 8192);
+
+	/* the pool holds at most 32MB, the rest is freed */
+	for (i = 0; i < 17; i++)
+		bufs[i] = tapdisk_nbdserver_get_buf(&server, 2 << 20);
+	for (i = 0; i < 17; i++)
+		tapdisk_nbdserver_put_buf(&server, bufs[i], 2 << 20);
+	assert_true(server.pool_bytes <= 32 << 20);
+	assert_true(server.pool_bytes > (32 << 20) - (2 << 20));
+
+	free_pool(&server);
+}
+
+/*
+ * A reply with a pooled payload of len bytes, the header filled with
+ * tag and the payload with tag + 1.
+ */
+static td_nbdserver_req_t *
+prep_reply(td_nbdserver_client_t *client, size_t len, char tag)
+{
+	td_nbdserver_req_t *req;
+	struct td_iovec *iov;
+
+	req = tapdisk_nbdserver_alloc_request(client);
+	assert_non_null(req);
+
+	iov = req->vreq.iov;
+	memset(req, 0, sizeof(*req));
+	req->vreq.iov = iov;
+
+	memset(req->tx_hdr, tag, 16);
+	req->tx_hdr_len = 16;
+
+	if (len) {
+		req->iov.base = tapdisk_nbdserver_get_buf(client->server, len);
+		assert_non_null(req->iov.base);
+		req->iov.secs = len >> SECTOR_SHIFT;
+		client->buf_bytes += len;
+		memset(req->iov.base, tag + 1, len);
+		req->tx_data = req->iov.base;
+		req->tx_data_len = len;
+	}
+
+	return req;
+}
+
+static td_nbdserver_client_t *
+setup_replies(td_nbdserver_t *server, int *fds)
+{
+	td_nbdserver_client_t *client;
+
+	memset(server, 0, sizeof(*server));
+	INIT_LIST_HEAD(&server->clients);
+
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	assert_int_equal(fcntl(fds[1], F_SETFL, O_NONBLOCK), 0);
+
+	client = tapdisk_nbdserver_alloc_client(server);
+	assert_non_null(client);
+	client->client_fd = fds[0];
+
+	return client;
+}
+
+static void
+assert_bytes(const char *buf, char c, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		assert_int_equal(buf[i], c);
+}
+
+void
+test_nbdserver_partial_send(void **state)
+{
+	td_nbdserver_t server;
+	td_nbdserver_client_t *client;
+	td_nbdserver_req_t *big, *small;
+	size_t len = 64 * 1024, total = 16 + len + 16, got = 0;
+	int fds[2], sndbuf = 4096, loops = 0;
+	char *stream;
+	void *payload;
+	ssize_t n;
+
+	client = setup_replies(&server, fds);
+	assert_int_equal(setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF,
+				    &sndbuf, sizeof(sndbuf)), 0);
+
+	/* the socket takes part of it, the rest waits for POLLOUT */
+	big = prep_reply(client, len, 'a');
+	payload = big->iov.base;
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_WRITE_FD);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	tapdisk_nbdserver_queue_reply(client, big);
+
+	assert_int_equal(client->tx_event_id, 0);
+	assert_true(client->tx_bytes > 0);
+	assert_true(client->tx_bytes < 16 + len);
+	assert_int_equal(client->n_reqs_free, client->n_reqs - 1);
+
+	/* queued behind the first, nothing reordered */
+	small = prep_reply(client, 0, 'c');
+	tapdisk_nbdserver_queue_reply(client, small);
+	assert_int_equal(client->n_reqs_free, client->n_reqs - 2);
+
+	stream = malloc(total);
+	assert_non_null(stream);
+
+	while (got < total) {
+		assert_true(++loops < 10000);
+
+		n = read(fds[1], stream + got, total - got);
+		if (n < 0 && errno == EAGAIN)
+			n = 0;
+		assert_true(n >= 0);
+		got += n;
+
+		if (!list_empty(&client->tx_queue))
+			assert_int_equal(
+				tapdisk_nbdserver_send_replies(client), 0);
+	}
+
+	assert_true(list_empty(&client->tx_queue));
+	assert_int_equal(client->tx_event_id, -1);
+	assert_int_equal(client->tx_bytes, 0);
+	assert_int_equal(client->buf_bytes, 0);
+	assert_int_equal(client->n_reqs_free, client->n_reqs);
+
+	assert_bytes(stream, 'a', 16);
+	assert_bytes(stream + 16, 'b', len);
+	assert_bytes(stream + 16 + len, 'c', 16);
+
+	/* the payload went back to its size class */
+	assert_ptr_equal(server.pool[4], payload);
+	assert_int_equal(server.pool_bytes, len);
+
+	free(stream);
+	tapdisk_nbdserver_free_client(client);
+	assert_true(list_empty(&server.clients));
+	free_pool(&server);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void
+test_nbdserver_zerocopy_disconnect(void **state)
+{
+	td_nbdserver_t server;
+	td_nbdserver_client_t *client;
+	td_nbdserver_req_t *req;
+	size_t len = 128 * 1024;
+	int fds[2];
+
+	client = setup_replies(&server, fds);
+
+	/*
+	 * AF_UNIX ignores MSG_ZEROCOPY: the send succeeds, and without
+	 * completions on the error queue the reply stays on zc_wait,
+	 * as if the kernel were still sending from its buffer.
+	 */
+	client->zc = true;
+	client->zc_fd = epoll_create1(EPOLL_CLOEXEC);
+	assert_true(client->zc_fd >= 0);
+
+	req = prep_reply(client, len, 'a');
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_READ_FD);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	tapdisk_nbdserver_queue_reply(client, req);
+
+	assert_true(list_empty(&client->tx_queue));
+	assert_false(list_empty(&client->zc_wait));
+	assert_true(req->zc);
+	assert_int_equal(client->zc_next, 1);
+	assert_int_equal(client->n_reqs_free, client->n_reqs - 1);
+	assert_int_equal(client->buf_bytes, len);
 
-	client.server = &server;
+	/* the buffer is freed, not pooled for the next request to reuse */
+	tapdisk_nbdserver_free_client(client);
+	assert_true(list_empty(&server.clients));
+	assert_int_equal(server.pool_bytes, 0);
+	assert_null(server.pool[5]);
 
-	expect_value(__wrap_tapdisk_server_register_event, cb, tapdisk_nbdserver_handshake_cb);
-	expect_value(__wrap_tapdisk_server_register_event, mode, SCHEDULER_POLL_READ_FD);
-	int err = tapdisk_nbdserver_new_protocol_handshake(&client, new_fd);
-	assert_int_equal(err, 0);
+	close(fds[0]);
+	close(fds[1]);
 }
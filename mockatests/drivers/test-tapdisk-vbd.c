@@ -155,3 +155,110 @@ test_vbd_complete_block_status_request(void **stat)
 	tapdisk_image_close(image);
 	free_extents(extents);
 }
+
+/*
+ * A block status request covering @secs sectors, which the pieces
+ * completed below never finish.
+ */
+static void
+setup_block_status(td_vbd_t *vbd, td_vbd_request_t *vreq, td_image_t **image,
+		   int secs)
+{
+	bzero(vbd, sizeof(*vbd));
+	INIT_LIST_HEAD(&vbd->images);
+	INIT_LIST_HEAD(&vbd->pending_requests);
+	*image = tapdisk_image_allocate("blah", DISK_TYPE_VHD, TD_OPEN_RDONLY | TD_OPEN_SHAREABLE);
+	list_add_tail(&(*image)->next, &vbd->images);
+
+	bzero(vreq, sizeof(*vreq));
+	INIT_LIST_HEAD(&vreq->next);
+	vreq->vbd = vbd;
+	vreq->op = TD_OP_BLOCK_STATUS;
+	vreq->submitting = 1;
+	vreq->secs_pending = secs;
+	vreq->data = calloc(1, sizeof(tapdisk_extents_t));
+	assert_non_null(vreq->data);
+}
+
+static void
+complete_block_status(td_vbd_request_t *vreq, td_image_t *image,
+		      td_sector_t sec, int secs, int status)
+{
+	td_request_t treq;
+
+	bzero(&treq, sizeof(treq));
+	treq.sec    = sec;
+	treq.secs   = secs;
+	treq.status = status;
+	treq.image  = image;
+	treq.vreq   = vreq;
+	treq.op     = TD_OP_BLOCK_STATUS;
+	treq.cb     = tapdisk_vbd_complete_block_status_request;
+
+	tapdisk_vbd_complete_block_status_request(treq, 0);
+}
+
+void
+test_vbd_block_status_out_of_order(void **stat)
+{
+	td_vbd_t vbd;
+	td_vbd_request_t vreq;
+	td_image_t *image;
+	tapdisk_extents_t *extents;
+
+	setup_block_status(&vbd, &vreq, &image, 24);
+	extents = vreq.data;
+
+	complete_block_status(&vreq, image, 8, 8, TD_BLOCK_STATE_HOLE);
+	/* ahead of the tail: a separate extent, left for the server to sort */
+	complete_block_status(&vreq, image, 0, 8, TD_BLOCK_STATE_HOLE);
+	/* behind it again, but no longer contiguous with the tail */
+	complete_block_status(&vreq, image, 16, 8, TD_BLOCK_STATE_HOLE);
+
+	assert_int_equal(extents->count, 3);
+	assert_int_equal(extents->head->start, 8);
+	assert_int_equal(extents->head->next->start, 0);
+	assert_int_equal(extents->tail->start, 16);
+	assert_int_equal(extents->tail->length, 8);
+	assert_int_equal(vreq.secs_pending, 0);
+
+	tapdisk_image_close(image);
+	free_extents(extents);
+}
+
+void
+test_vbd_block_status_merge_contiguous(void **stat)
+{
+	td_vbd_t vbd;
+	td_vbd_request_t vreq;
+	td_image_t *image;
+	tapdisk_extents_t *extents;
+	tapdisk_extent_t *ext;
+
+	setup_block_status(&vbd, &vreq, &image, 40);
+	extents = vreq.data;
+
+	complete_block_status(&vreq, image, 0, 8, TD_BLOCK_STATE_HOLE);
+	complete_block_status(&vreq, image, 8, 8, TD_BLOCK_STATE_HOLE);
+	/* contiguous, another status */
+	complete_block_status(&vreq, image, 16, 8, TD_BLOCK_STATE_NONE);
+	/* same status, but past a gap */
+	complete_block_status(&vreq, image, 32, 8, TD_BLOCK_STATE_NONE);
+
+	assert_int_equal(extents->count, 3);
+	ext = extents->head;
+	assert_int_equal(ext->start, 0);
+	assert_int_equal(ext->length, 16);
+	assert_int_equal(ext->flag, TD_BLOCK_STATE_HOLE);
+	ext = ext->next;
+	assert_int_equal(ext->start, 16);
+	assert_int_equal(ext->length, 8);
+	assert_int_equal(ext->flag, TD_BLOCK_STATE_NONE);
+	ext = ext->next;
+	assert_int_equal(ext->start, 32);
+	assert_int_equal(ext->length, 8);
+	assert_null(ext->next);
+
+	tapdisk_image_close(image);
+	free_extents(extents);
+}
@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2024, Cloud Software Group, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+/* the bridge is a program of its own: test it from the inside */
+#define main td_rated_main
+#include "td-rated.c"
+#undef main
+
+#define RLB_TEST_NEVER  (UINT64_MAX / 2)
+
+static void
+quiet_vlog(int prio, const char *fmt, va_list ap)
+{
+}
+
+static char rlb_test_dir[] = "/tmp/td-rated-test.XXXXXX";
+
+static char *
+rlb_test_path(const char *name)
+{
+	char *path = mprintf("%s/%s", rlb_test_dir, name);
+
+	assert_non_null(path);
+	return path;
+}
+
+static void
+setup_dir(void)
+{
+	rlb_vlog = quiet_vlog;
+
+	assert_non_null(mkdtemp(rlb_test_dir));
+}
+
+/* a bridge in the test directory, with @type valve given @args */
+static void
+setup_bridge(td_rlb_t *rlb, const char *type, char **args, int n_args)
+{
+	char *argv[8] = { (char *)type }, *path;
+	int i;
+
+	path = rlb_test_path("bridge");
+	assert_int_equal(rlb_create(rlb, path), 0);
+	free(path);
+
+	for (i = 0; i < n_args; i++)
+		argv[i + 1] = args[i];
+
+	optind = 0;
+	assert_int_equal(rlb_create_valve(rlb, &rlb->valve, type,
+					  n_args + 1, argv), 0);
+	rlb_shm_publish(rlb);
+}
+
+static void
+teardown_bridge(td_rlb_t *rlb)
+{
+	rlb_destroy(rlb);
+	assert_int_equal(rmdir(rlb_test_dir), 0);
+	strcpy(rlb_test_dir + strlen(rlb_test_dir) - 6, "XXXXXX");
+}
+
+/* a connection in need of @need bytes, the valve on fds[1] */
+static td_rlb_conn_t *
+add_waiter(td_rlb_t *rlb, td_rlb_pool_t *pool, unsigned long need, int *fds)
+{
+	td_rlb_conn_t *conn;
+
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+	conn = rlb_conn_alloc(rlb);
+	assert_non_null(conn);
+
+	INIT_LIST_HEAD(&conn->wait);
+	conn->efd.type = RLB_FD_CONN;
+	conn->efd.fd   = fds[0];
+	conn->id       = (int)++rlb->serial;
+	conn->pool     = pool;
+	list_add_tail(&conn->open, &rlb->open);
+
+	if (need) {
+		conn->need = need;
+		conn->ios[RLB_OP_WRITE]   = 1;
+		conn->bytes[RLB_OP_WRITE] = need;
+		list_add_tail(&conn->wait, &rlb->wait);
+		rlb->n_wait++;
+	}
+
+	return conn;
+}
+
+static void
+valve_send(int fd, unsigned long need, unsigned long done)
+{
+	struct td_valve_req req = { need, done };
+
+	assert_int_equal(write(fd, &req, sizeof(req)), sizeof(req));
+}
+
+static unsigned long
+valve_recv(int fd)
+{
+	unsigned long gntd;
+
+	assert_int_equal(read(fd, &gntd, sizeof(gntd)), sizeof(gntd));
+	return gntd;
+}
+
+void
+test_td_rated_bucket_refill(void **state)
+{
+	const uint64_t t0 = 1000000000ULL;
+	struct td_rlb_bucket b = {
+		.rate = 1000000, .cap = 65536, .cred = -1000, .ts = t0
+	};
+
+	/* 500us at 1MB/s */
+	assert_int_equal(td_rlb_bucket_level(&b, t0 + 500000), -500);
+	td_rlb_bucket_refill(&b, t0 + 500000);
+	assert_int_equal(b.cred, -500);
+	assert_int_equal(b.ts, t0 + 500000);
+
+	/* the clock doesn't run backwards, nor does credit */
+	td_rlb_bucket_refill(&b, t0);
+	assert_int_equal(b.cred, -500);
+	assert_int_equal(b.ts, t0 + 500000);
+
+	/* up to cap, and no further */
+	assert_int_equal(td_rlb_bucket_level(&b, t0 + 10000000000ULL), 65536);
+	td_rlb_bucket_refill(&b, t0 + 10000000000ULL);
+	assert_int_equal(b.cred, 65536);
+	assert_int_equal(b.ts, t0 + 10000000000ULL);
+
+	/* unlimited */
+	b.rate = 0;
+	b.cred = -1;
+	td_rlb_bucket_refill(&b, t0 + 20000000000ULL);
+	assert_int_equal(b.cred, -1);
+}
+
+void
+test_td_rated_bucket_refill_fraction(void **state)
+{
+	const uint64_t t0 = 1000000000ULL;
+	struct td_rlb_bucket b = {
+		.rate = 3, .cap = 100, .cred = 0, .ts = t0
+	};
+
+	/* less than a byte's worth: nothing, and the clock stays put */
+	td_rlb_bucket_refill(&b, t0 + 300000000ULL);
+	assert_int_equal(b.cred, 0);
+	assert_int_equal(b.ts, t0);
+
+	/*
+	 * 1.5 bytes' worth: the clock only advances by the byte paid
+	 * out, the rest still counts towards the next one.
+	 */
+	td_rlb_bucket_refill(&b, t0 + 500000000ULL);
+	assert_int_equal(b.cred, 1);
+	assert_int_equal(b.ts, t0 + 333333000ULL);
+
+	td_rlb_bucket_refill(&b, t0 + 700000000ULL);
+	assert_int_equal(b.cred, 2);
+}
+
+void
+test_td_rated_bucket_take(void **state)
+{
+	struct td_rlb_bucket b = { .rate = 1000, .cap = 8192, .cred = 4096 };
+
+	assert_int_equal(td_rlb_bucket_take(&b, 4096), 0);
+	assert_int_equal(b.cred, 0);
+
+	/* valves never go into debt, only td-rated grants on credit */
+	assert_int_equal(td_rlb_bucket_take(&b, 1), -EAGAIN);
+	assert_int_equal(b.cred, 0);
+
+	td_rlb_bucket_give(&b, 512);
+	assert_int_equal(b.cred, 512);
+	assert_int_equal(td_rlb_bucket_take(&b, 512), 0);
+}
+
+void
+test_td_rated_partial_grant(void **state)
+{
+	td_rlb_t rlb;
+	td_rlb_conn_t *conn;
+	int fds[2];
+
+	memset(&rlb, 0, sizeof(rlb));
+	INIT_LIST_HEAD(&rlb.open);
+	INIT_LIST_HEAD(&rlb.wait);
+	INIT_LIST_HEAD(&rlb.dead);
+	INIT_LIST_HEAD(&rlb.listeners);
+	rlb.epfd = -1;
+	rlb_vlog = quiet_vlog;
+
+	conn = add_waiter(&rlb, NULL, 0, fds);
+
+	valve_send(fds[1], 8192, 0);
+	valve_send(fds[1], 4096 | TD_VALVE_REQ_READ, 0);
+	rlb_conn_receive(&rlb, conn);
+
+	assert_int_equal(conn->need, 12288);
+	assert_int_equal(conn->ios[RLB_OP_WRITE], 1);
+	assert_int_equal(conn->ios[RLB_OP_READ], 1);
+	assert_int_equal(rlb.n_wait, 1);
+	assert_int_equal(rlb_dual_amount(conn, RLB_OP_WRITE, 1), 8192);
+	assert_int_equal(rlb_dual_amount(conn, RLB_OP_READ, 1), 4096);
+
+	/* half of it: still waiting, each op charged its share of the rest */
+	rlb_conn_respond(&rlb, conn, 6144);
+	assert_int_equal(valve_recv(fds[1]), 6144);
+	assert_int_equal(conn->need, 6144);
+	assert_int_equal(conn->gntd, 6144);
+	assert_int_equal(rlb.gntd, 6144);
+	assert_false(list_empty(&conn->wait));
+	assert_int_equal(rlb_dual_amount(conn, RLB_OP_WRITE, 1), 4096);
+	assert_int_equal(rlb_dual_amount(conn, RLB_OP_READ, 1), 2048);
+	assert_int_equal(rlb_dual_amount(conn, RLB_OP_WRITE, 0), 1);
+
+	/* I/O done with part of the grant */
+	valve_send(fds[1], 0, 4096);
+	rlb_conn_receive(&rlb, conn);
+	assert_int_equal(conn->gntd, 2048);
+	assert_int_equal(rlb.gntd, 2048);
+
+	rlb_conn_respond(&rlb, conn, 6144);
+	assert_int_equal(valve_recv(fds[1]), 6144);
+	assert_int_equal(conn->need, 0);
+	assert_int_equal(conn->gntd, 8192);
+	assert_true(list_empty(&conn->wait));
+	assert_int_equal(rlb.n_wait, 0);
+	assert_int_equal(conn->bytes[RLB_OP_WRITE], 0);
+
+	/* more done than granted is a protocol error */
+	valve_send(fds[1], 0, 8193);
+	rlb_conn_receive(&rlb, conn);
+	assert_int_equal(conn->efd.fd, -1);
+	assert_int_equal(rlb.gntd, 0);
+	assert_false(list_empty(&rlb.dead));
+
+	rlb_conn_reap(&rlb);
+	assert_int_equal(rlb.n_conns, 0);
+	close(fds[1]);
+}
+
+void
+test_td_rated_shm_token(void **state)
+{
+	char *args[] = { "--rate=1000000", "--cap=65536" };
+	struct td_rlb_shm *shm;
+	td_rlb_t rlb;
+	char *path;
+	int fd;
+
+	setup_dir();
+	setup_bridge(&rlb, "token", args, 2);
+
+	/* the token bucket is shared, valves debit it directly */
+	assert_non_null(rlb.shm);
+	assert_int_equal(rlb.shm->enabled, 1);
+	assert_int_equal(rlb.shm->limits, TD_RLB_LIMIT_WRITE);
+
+	path = rlb_test_path("bridge" TD_RLB_SHM_SUFFIX);
+	fd = open(path, O_RDWR);
+	assert_true(fd >= 0);
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	assert_true(shm != MAP_FAILED);
+	close(fd);
+
+	assert_int_equal(shm->magic, TD_RLB_SHM_MAGIC);
+	assert_int_equal(shm->version, TD_RLB_SHM_VERSION);
+	assert_int_equal(shm->bucket.rate, 1000000);
+	assert_int_equal(shm->bucket.cred, 65536);
+
+	assert_int_equal(td_rlb_bucket_take(&shm->bucket, 65536), 0);
+	assert_int_equal(td_rlb_bucket_take(&shm->bucket, 4096), -EAGAIN);
+	assert_int_equal(rlb.shm->bucket.cred, 0);
+
+	/* gone with the bridge, and valves told to stop using it */
+	teardown_bridge(&rlb);
+	assert_int_equal(shm->enabled, 0);
+	assert_int_equal(access(path, F_OK), -1);
+
+	munmap(shm, sizeof(*shm));
+	free(path);
+}
+
+void
+test_td_rated_epoll_loop(void **state)
+{
+	char *args[] = { "--rate=1000000", "--cap=1000000" };
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct timeval *tv;
+	td_rlb_conn_t *conn;
+	td_rlb_t rlb;
+	int s;
+
+	setup_dir();
+	setup_bridge(&rlb, "token", args, 2);
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert_true(s >= 0);
+	strcpy(addr.sun_path, rlb.lsn.path);
+	assert_int_equal(connect(s, (struct sockaddr *)&addr, sizeof(addr)), 0);
+
+	/* accept */
+	assert_int_equal(rlb_main_iterate(&rlb), 0);
+	assert_int_equal(rlb.n_conns, 1);
+	conn = rlb_conn_entry(rlb.open.next);
+
+	/* request, granted on credit */
+	valve_send(s, 2000000, 0);
+	assert_int_equal(rlb_main_iterate(&rlb), 0);
+	assert_int_equal(valve_recv(s), 2000000);
+	assert_int_equal(rlb.gntd, 2000000);
+
+	/* in debt: waits for the bucket to refill */
+	valve_send(s, 4096, 2000000);
+	assert_int_equal(rlb_main_iterate(&rlb), 0);
+	assert_int_equal(rlb.gntd, 0);
+	assert_int_equal(rlb.n_wait, 1);
+	assert_int_equal(conn->need, 4096);
+
+	rlb.valve.ops->settimeo(&rlb, &tv, rlb.valve.data);
+	assert_non_null(tv);
+	assert_true(rlb_tv_usec(tv) > 900000);
+	assert_true(rlb_tv_usec(tv) <= 1000000);
+
+	rlb_shm_update(&rlb);
+	assert_int_equal(rlb.shm->waiters, 1);
+
+	/* hang up: closed and freed after the batch */
+	close(s);
+	assert_int_equal(rlb_main_iterate(&rlb), 0);
+	assert_int_equal(rlb.n_conns, 0);
+	assert_int_equal(rlb.n_wait, 0);
+	assert_true(list_empty(&rlb.open));
+	assert_true(list_empty(&rlb.dead));
+
+	teardown_bridge(&rlb);
+}
+
+/*
+ * A tree valve with a pool for each spec, sockets in the test
+ * directory, and buckets frozen: no refill while the test runs.
+ */
+static td_rlb_tree_t *
+setup_tree(td_rlb_t *rlb, char **specs, int n_specs)
+{
+	char *args[8];
+	td_rlb_tree_t *t;
+	td_rlb_pool_t *p;
+	int i;
+
+	setup_dir();
+
+	for (i = 0; i < n_specs; i++) {
+		args[i] = mprintf("--pool=%s,socket=%s/%.*s", specs[i],
+				  rlb_test_dir, (int)strcspn(specs[i], ","),
+				  specs[i]);
+		assert_non_null(args[i]);
+	}
+
+	setup_bridge(rlb, "tree", args, n_specs);
+
+	for (i = 0; i < n_specs; i++)
+		free(args[i]);
+
+	t = rlb->valve.data;
+	rlb_tree_for_each_pool(p, t)
+		p->b.ts = RLB_TEST_NEVER;
+
+	return t;
+}
+
+static void
+close_waiters(int fds[][2], int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		close(fds[i][1]);
+}
+
+void
+test_td_rated_tree_weights(void **state)
+{
+	char *specs[] = { "a,weight=3", "b" };
+	td_rlb_tree_t *t;
+	td_rlb_pool_t *a, *b;
+	int fds[16][2], i;
+	td_rlb_t rlb;
+
+	t = setup_tree(&rlb, specs, 2);
+	a = rlb_tree_find(t, "a");
+	b = rlb_tree_find(t, "b");
+	assert_int_equal(a->weight, 3);
+
+	/* shm is for token valves only */
+	assert_int_equal(rlb.shm->enabled, 0);
+
+	/* the root lets 8 requests through */
+	t->root.b.rate = 1;
+	t->root.b.cred = 8 * 4096 - 1;
+
+	for (i = 0; i < 8; i++) {
+		add_waiter(&rlb, a, 4096, fds[2 * i]);
+		add_waiter(&rlb, b, 4096, fds[2 * i + 1]);
+	}
+
+	rlb_tree_dispatch(&rlb, t);
+
+	assert_int_equal(t->root.granted, 8 * 4096);
+	assert_int_equal(a->granted, 6 * 4096);
+	assert_int_equal(b->granted, 2 * 4096);
+	assert_int_equal(rlb.n_wait, 8);
+	assert_true(t->root.b.cred < 0);
+	assert_int_equal(valve_recv(fds[0][1]), 4096);
+
+	teardown_bridge(&rlb);
+	close_waiters(fds, 16);
+}
+
+void
+test_td_rated_tree_nested(void **state)
+{
+	char *specs[] = { "sr,rate=1,cap=8191",
+			  "t1,parent=sr", "t2,parent=sr", "sr2" };
+	td_rlb_pool_t *sr, *t1, *t2, *sr2;
+	struct timeval *tv;
+	td_rlb_tree_t *t;
+	int fds[9][2], i;
+	td_rlb_t rlb;
+
+	t = setup_tree(&rlb, specs, 4);
+	sr  = rlb_tree_find(t, "sr");
+	t1  = rlb_tree_find(t, "t1");
+	t2  = rlb_tree_find(t, "t2");
+	sr2 = rlb_tree_find(t, "sr2");
+	assert_ptr_equal(t1->parent, sr);
+	assert_int_equal(t2->depth, 2);
+
+	for (i = 0; i < 3; i++) {
+		add_waiter(&rlb, t1, 4096, fds[3 * i]);
+		add_waiter(&rlb, t2, 4096, fds[3 * i + 1]);
+		add_waiter(&rlb, sr2, 4096, fds[3 * i + 2]);
+	}
+
+	rlb_tree_dispatch(&rlb, t);
+
+	/* sr's budget, shared by its tenants, doesn't hold up sr2 */
+	assert_int_equal(sr->granted, 2 * 4096);
+	assert_int_equal(t1->granted, 4096);
+	assert_int_equal(t2->granted, 4096);
+	assert_int_equal(sr2->granted, 3 * 4096);
+	assert_int_equal(sr->b.cred, 8191 - 2 * 4096);
+	assert_int_equal(rlb.n_wait, 4);
+
+	/* until sr refills by a byte */
+	rlb_tree_settimeo(&rlb, &tv, t);
+	assert_non_null(tv);
+	assert_int_equal(rlb_tv_usec(tv), 1000000);
+
+	/* unblocked */
+	sr->b.cred = 2 * 4096;
+	rlb_tree_dispatch(&rlb, t);
+	assert_int_equal(sr->granted, 5 * 4096);
+	assert_int_equal(t1->granted, 3 * 4096);
+	assert_int_equal(rlb.n_wait, 1);
+
+	teardown_bridge(&rlb);
+	close_waiters(fds, 9);
+}
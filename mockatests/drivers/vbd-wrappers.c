@@ -48,16 +48,6 @@ __wrap_td_queue_block_status(td_image_t *image, td_request_t *treq)
 	check_expected(treq);
 }
 
-int
-__wrap_send(int fd, void* buf, size_t size, int flags)
-{
-	check_expected(buf);
-	check_expected(fd);
-	check_expected(size);
-	check_expected(flags);
-	return (int)mock();
-}
-
 event_id_t
 __wrap_tapdisk_server_register_event(char mode, int fd,
                               struct timeval timeout, event_cb_t cb, void *data)
@@ -46,6 +46,7 @@
 #include <iconv.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
@@ -1255,6 +1256,11 @@ vhd_read_bat(vhd_context_t *ctx, vhd_bat_t *bat)
 
 	vhd_bat_in(bat);
 
+	/* a crashed tapdisk may not have checkpointed its journal */
+	err = vhd_batlog_apply(ctx, bat);
+	if (err < 0)
+		goto fail;
+
 	return 0;
 
 fail:
@@ -1264,7 +1270,152 @@ fail:
 	return err;
 }
 
+uint32_t
+vhd_batlog_checksum(struct vhd_batlog_sector *rec)
+{
+	uint32_t i, sum = 0, saved;
+	unsigned char *p = (unsigned char *)rec;
+
+	saved = rec->checksum;
+	rec->checksum = 0;
+	for (i = 0; i < sizeof(*rec); i++)
+		sum += p[i];
+	rec->checksum = saved;
+
+	return ~sum;
+}
+
 static int
+vhd_batlog_valid(vhd_context_t *ctx, struct vhd_batlog_sector *rec,
+		 uint64_t gen, uint64_t seq)
+{
+	if (memcmp(rec->cookie, VHD_BATLOG_COOKIE, sizeof(rec->cookie)))
+		return 0;
+	if (uuid_compare(rec->uuid, ctx->footer.uuid))
+		return 0;
+	if (be32toh(rec->checksum) != vhd_batlog_checksum(rec))
+		return 0;
+	if (seq && be64toh(rec->gen) != gen)
+		return 0;
+	return be64toh(rec->seq) == seq;
+}
+
+/*
+ * Applies the records of a BAT journal left next to the image to @bat.
+ * Returns the number of records applied, or -errno.
+ */
+int
+vhd_batlog_apply(vhd_context_t *ctx, vhd_bat_t *bat)
+{
+	struct vhd_batlog_sector rec;
+	char *path;
+	uint64_t gen;
+	uint32_t seq, blk;
+	int fd, err;
+
+	if (asprintf(&path, "%s%s", ctx->file, VHD_BATLOG_SUFFIX) < 0)
+		return -ENOMEM;
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	free(path);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -errno;
+
+	err = 0;
+
+	if (pread(fd, &rec, sizeof(rec), 0) != sizeof(rec) ||
+	    !vhd_batlog_valid(ctx, &rec, 0, 0))
+		goto out;
+
+	gen = be64toh(rec.gen);
+
+	for (seq = 1; seq <= VHD_BATLOG_RECORDS; seq++) {
+		if (pread(fd, &rec, sizeof(rec),
+			  (off64_t)seq * VHD_SECTOR_SIZE) != sizeof(rec))
+			break;
+		if (!vhd_batlog_valid(ctx, &rec, gen, seq))
+			break;
+
+		blk = be32toh(rec.blk);
+		if (blk >= bat->entries) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		bat->bat[blk] = be32toh(rec.offset);
+	}
+
+	err = seq - 1;
+	if (err)
+		VHDLOG("%s: applied %d bat log records\n", ctx->file, err);
+
+out:
+	close(fd);
+	return err;
+}
+
+/*
+ * Writes what a leftover BAT journal records into the image, and
+ * removes it, so writers never act on a stale BAT. A tapdisk
+ * journaling into the log holds a lock on it: that one is left alone.
+ */
+static int
+vhd_batlog_recover(vhd_context_t *ctx)
+{
+	vhd_bat_t bat;
+	char *path;
+	int fd, err;
+
+	if (!vhd_type_dynamic(ctx) || ctx->is_block)
+		return 0;
+
+	if (asprintf(&path, "%s%s", ctx->file, VHD_BATLOG_SUFFIX) < 0)
+		return -ENOMEM;
+
+	fd = open(path, O_RDWR | O_LARGEFILE);
+	if (fd == -1) {
+		err = errno == ENOENT ? 0 : -errno;
+		goto out;
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		err = errno == EWOULDBLOCK ? 0 : -errno;
+		if (!err)
+			VHDLOG("%s: bat log in use, not recovering\n",
+			       ctx->file);
+		goto out;
+	}
+
+	/* applies the journal */
+	err = vhd_read_bat(ctx, &bat);
+	if (err)
+		goto out;
+
+	ctx->bat = bat;
+	err = vhd_write_bat(ctx, &bat);
+	memset(&ctx->bat, 0, sizeof(ctx->bat));
+	free(bat.bat);
+	if (err)
+		goto out;
+
+	if (fdatasync(ctx->fd)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (unlink(path))
+		err = -errno;
+
+out:
+	if (err)
+		VHDLOG("%s: bat log recovery failed: %d\n", ctx->file, err);
+	if (fd != -1)
+		close(fd);
+	free(path);
+	return err;
+}
+
+int
 vhd_read_batmap_header(vhd_context_t *ctx, vhd_batmap_t *batmap)
 {
 	int err;
@@ -2772,7 +2923,7 @@ vhd_open(vhd_context_t *ctx, const char *file, int flags)
 		if (err)
 			goto fail;
 
-		return 0;
+		goto out;
 	}
 
 	err = vhd_read_footer(ctx, &ctx->footer,
@@ -2814,6 +2965,13 @@ vhd_open(vhd_context_t *ctx, const char *file, int flags)
 		goto fail;
 	}
 
+out:
+	if (flags & VHD_OPEN_RDWR) {
+		err = vhd_batlog_recover(ctx);
+		if (err)
+			goto fail;
+	}
+
 	return 0;
 
 fail: